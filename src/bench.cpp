@@ -0,0 +1,124 @@
+#include "cpu.h"
+#include "bcpu.h"
+#include "threaded_cpu.h"
+#include "jit_cpu.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+// Simulation speed of StaticCPU against DynamicCPU on the same program.
+// usage: bench [program file] [runs] [threads]. The program is read from stdin if no file is given.
+// With threads > 1, StaticCPU is also run with parallel evaluation (see StaticCPU::set_threads()).
+// The functional models (BCPU, ThreadedCPU, and JitCPU where supported) are compared too, in MIPS.
+
+template <class Sim>
+double run(const std::string &program, std::size_t threads, clock_t &clk, clock_t &skipped, uint64_t &instrs,
+  insomnia::mem_val_t &ret) {
+  auto cpu = std::make_unique<Sim>();
+  if(threads > 1 && !cpu->set_threads(threads))
+    std::cerr << "parallel evaluation does not pay off here. Serial instead." << std::endl;
+  std::istringstream is(program);
+  cpu->preload_program(is);
+  auto beg = std::chrono::steady_clock::now();
+  while(cpu->tick()) {}
+  auto end = std::chrono::steady_clock::now();
+  clk = cpu->cycles();
+  skipped = cpu->skipped_cycles();
+  instrs = cpu->instructions();
+  ret = cpu->get_ret();
+  return std::chrono::duration<double>(end - beg).count();
+}
+
+// best of runs, in seconds.
+template <class Sim>
+double report(const char *name, const std::string &program, int runs, std::size_t threads,
+  clock_t &clk, insomnia::mem_val_t &ret) {
+  double best = 0;
+  uint64_t instrs = 0;
+  clock_t skipped = 0;
+  for(int i = 0; i < runs; ++i) {
+    double sec = run<Sim>(program, threads, clk, skipped, instrs, ret);
+    if(i == 0 || sec < best) best = sec;
+  }
+  std::cout << name << ": " << clk << " cycles, " << instrs << " instrs, ret " << ret << ", "
+    << best << " s, " << instrs / best / 1000 << " KIPS, " << clk / best / 1000 << " kcycles/s, "
+    << 100.0 * skipped / clk << "% cycles skipped" << std::endl;
+  return best;
+}
+
+// functional model: best of runs, in seconds. regs: the register file at the end.
+template <class Sim>
+double report_functional(const char *name, const std::string &program, int runs, uint64_t &instrs,
+  std::array<insomnia::mem_val_t, insomnia::RFSize> &regs) {
+  double best = 0;
+  for(int i = 0; i < runs; ++i) {
+    auto cpu = std::make_unique<Sim>();
+    std::istringstream is(program);
+    cpu->preload_program(is);
+    auto beg = std::chrono::steady_clock::now();
+    while(cpu->tick()) {}
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end - beg).count();
+    if(i == 0 || sec < best) best = sec;
+    instrs = cpu->instructions();
+    for(std::size_t r = 0; r < insomnia::RFSize; ++r) regs[r] = cpu->get_reg(r);
+  }
+  std::cout << name << ": " << instrs << " instrs, ret " << (regs[10] & 0xff) << ", " << best << " s, "
+    << instrs / best / 1e6 << " MIPS" << std::endl;
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  std::stringstream program;
+  if(argc > 1) {
+    std::ifstream file(argv[1]);
+    if(!file) {
+      std::cerr << "cannot open " << argv[1] << std::endl;
+      return 1;
+    }
+    program << file.rdbuf();
+  } else program << std::cin.rdbuf();
+  int runs = argc > 2 ? std::stoi(argv[2]) : 3;
+  std::size_t threads = argc > 3 ? std::stoul(argv[3]) : 1;
+
+  clock_t dyn_clk = 0, sta_clk = 0;
+  insomnia::mem_val_t dyn_ret = 0, sta_ret = 0;
+  double dyn = report<insomnia::DynamicCPU>("dynamic", program.str(), runs, 1, dyn_clk, dyn_ret);
+  double sta = report<insomnia::StaticCPU>("static ", program.str(), runs, 1, sta_clk, sta_ret);
+  if(dyn_clk != sta_clk || dyn_ret != sta_ret) {
+    std::cerr << "static and dynamic CPU disagree" << std::endl;
+    return 1;
+  }
+  std::cout << "speedup: " << dyn / sta << std::endl;
+  if(threads > 1) {
+    clock_t par_clk = 0;
+    insomnia::mem_val_t par_ret = 0;
+    double par = report<insomnia::StaticCPU>("parallel", program.str(), runs, threads, par_clk, par_ret);
+    if(par_clk != sta_clk || par_ret != sta_ret) {
+      std::cerr << "parallel and serial evaluation disagree" << std::endl;
+      return 1;
+    }
+    std::cout << "parallel speedup: " << sta / par << std::endl;
+  }
+
+  uint64_t base_instrs = 0, thr_instrs = 0;
+  std::array<insomnia::mem_val_t, insomnia::RFSize> base_regs{}, thr_regs{};
+  double base = report_functional<insomnia::BCPU>("bcpu    ", program.str(), runs, base_instrs, base_regs);
+  double thr = report_functional<insomnia::ThreadedCPU>("threaded", program.str(), runs, thr_instrs, thr_regs);
+  if(base_instrs != thr_instrs || base_regs != thr_regs) {
+    std::cerr << "BCPU and ThreadedCPU disagree" << std::endl;
+    return 1;
+  }
+  std::cout << "threaded speedup: " << base / thr << std::endl;
+#ifdef ISM_JIT_SUPPORTED
+  uint64_t jit_instrs = 0;
+  std::array<insomnia::mem_val_t, insomnia::RFSize> jit_regs{};
+  double jit = report_functional<insomnia::JitCPU>("jit     ", program.str(), runs, jit_instrs, jit_regs);
+  if(base_instrs != jit_instrs || base_regs != jit_regs) {
+    std::cerr << "BCPU and JitCPU disagree" << std::endl;
+    return 1;
+  }
+  std::cout << "jit speedup: " << base / jit << std::endl;
+#endif
+  return 0;
+}
@@ -2,6 +2,7 @@
 #define ISM_ALU_H
 
 #include "common.h"
+#include "checkpoint.h"
 #include "utility.h"
 #include "wire_harness.h"
 
@@ -11,7 +12,7 @@ namespace insomnia {
 
 // (High functional) Common Arithmetic and Logic Unit.
 // Can do all kinds of calculation in 1 clock cycle.
-class CommonALU : public CPUModule {
+class CommonALU final : public CPUModule {
   struct Registers {
     bool is_busy = false;
     rob_index_t rob_index;
@@ -23,6 +24,7 @@ class CommonALU : public CPUModule {
     mem_ptr_t instr_addr;
     bool is_branch;
     mem_ptr_t pred_pc;
+    bool operator==(const Registers &) const = default;
   };
 public:
   CommonALU(
@@ -35,168 +37,166 @@ public:
   _flush_input(std::move(flush_input)),
   _cdb_output(std::move(cdb_output)),
   _rs_output(std::move(rs_output)),
-  _cur_regs(), _nxt_regs() {}
+  _regs() {}
 
   void sync() override {
-    _cur_regs = _nxt_regs;
+    _regs.commit();
   }
 
-  bool update() override {
-    // debug("ALU");
-    _nxt_regs = _cur_regs;
+  wire_mask_t update() override {
+    _regs.restore();
 
     WH_ALU_CDB cdb_output{};
     WH_ALU_RS rs_output{};
 
     if(_flush_input->is_flush) {
-      _nxt_regs.is_busy = false;
-      _nxt_regs.instr_type = InstrType::INVALID;
+      _regs.nxt().is_busy = false;
+      _regs.nxt().instr_type = InstrType::INVALID;
     }
 
-    if(!_nxt_regs.is_busy) {
+    if(!_regs.nxt().is_busy) {
       if(_rs_input->is_valid) {
-        _nxt_regs.is_busy = true;
-        _nxt_regs.rob_index = _rs_input->rob_index;
-        _nxt_regs.instr_type = _rs_input->instr_type;
-        _nxt_regs.src1_value = _rs_input->src1_value;
-        _nxt_regs.src2_value = _rs_input->src2_value;
-        _nxt_regs.imm = _rs_input->imm;
-        _nxt_regs.dst_reg = _rs_input->dst_reg;
-        _nxt_regs.instr_addr = _rs_input->instr_addr;
-        _nxt_regs.is_branch = _rs_input->is_branch;
-        _nxt_regs.pred_pc = _rs_input->pred_pc;
+        _regs.nxt().is_busy = true;
+        _regs.nxt().rob_index = _rs_input->rob_index;
+        _regs.nxt().instr_type = _rs_input->instr_type;
+        _regs.nxt().src1_value = _rs_input->src1_value;
+        _regs.nxt().src2_value = _rs_input->src2_value;
+        _regs.nxt().imm = _rs_input->imm;
+        _regs.nxt().dst_reg = _rs_input->dst_reg;
+        _regs.nxt().instr_addr = _rs_input->instr_addr;
+        _regs.nxt().is_branch = _rs_input->is_branch;
+        _regs.nxt().pred_pc = _rs_input->pred_pc;
       }
     }
-    if(_nxt_regs.is_busy) {
-      debug("ALU: Calculate addr " + std::to_string(_nxt_regs.instr_addr) +
-        ", rob index " + std::to_string(_nxt_regs.rob_index));
+    if(_regs.nxt().is_busy) {
+      ISM_LOG(ALU, Trace, "calculate addr {}, rob index {}", _regs.nxt().instr_addr, _regs.nxt().rob_index);
       mem_val_t result = 0;
       mem_ptr_t real_branch_pc = 0;
       bool is_branch = false;
       bool is_load_store = false;
-      uint32_t shamt = static_cast<uint32_t>(_nxt_regs.imm) & 0x1f;
+      uint32_t shamt = static_cast<uint32_t>(_regs.nxt().imm) & 0x1f;
 
-      switch(_nxt_regs.instr_type) {
+      switch(_regs.nxt().instr_type) {
       case InstrType::ADD:
-        result = _nxt_regs.src1_value + _nxt_regs.src2_value;
+        result = _regs.nxt().src1_value + _regs.nxt().src2_value;
         break;
       case InstrType::ADDI:
-        result = _nxt_regs.src1_value + _nxt_regs.imm;
+        result = _regs.nxt().src1_value + _regs.nxt().imm;
         break;
       case InstrType::SUB:
-        result = _nxt_regs.src1_value - _nxt_regs.src2_value;
+        result = _regs.nxt().src1_value - _regs.nxt().src2_value;
         break;
       case InstrType::SLT:
-        result = (static_cast<int32_t>(_nxt_regs.src1_value) < static_cast<int32_t>(_nxt_regs.src2_value)) ? 1 : 0;
+        result = (static_cast<int32_t>(_regs.nxt().src1_value) < static_cast<int32_t>(_regs.nxt().src2_value)) ? 1 : 0;
         break;
       case InstrType::SLTU:
-        result = (_nxt_regs.src1_value < _nxt_regs.src2_value) ? 1 : 0;
+        result = (_regs.nxt().src1_value < _regs.nxt().src2_value) ? 1 : 0;
         break;
       case InstrType::XOR:
-        result = _nxt_regs.src1_value ^ _nxt_regs.src2_value;
+        result = _regs.nxt().src1_value ^ _regs.nxt().src2_value;
         break;
       case InstrType::XORI:
-        result = _nxt_regs.src1_value ^ _nxt_regs.imm;
+        result = _regs.nxt().src1_value ^ _regs.nxt().imm;
         break;
       case InstrType::OR:
-        result = _nxt_regs.src1_value | _nxt_regs.src2_value;
+        result = _regs.nxt().src1_value | _regs.nxt().src2_value;
         break;
       case InstrType::ORI:
-        result = _nxt_regs.src1_value | _nxt_regs.imm;
+        result = _regs.nxt().src1_value | _regs.nxt().imm;
         break;
       case InstrType::AND:
-        result = _nxt_regs.src1_value & _nxt_regs.src2_value;
+        result = _regs.nxt().src1_value & _regs.nxt().src2_value;
         break;
       case InstrType::ANDI:
-        result = _nxt_regs.src1_value & _nxt_regs.imm;
+        result = _regs.nxt().src1_value & _regs.nxt().imm;
         break;
       case InstrType::SLL:
-        result = _nxt_regs.src1_value << (_nxt_regs.src2_value & 0x1f); // shamt from rs2 (lower 5 bits)
+        result = _regs.nxt().src1_value << (_regs.nxt().src2_value & 0x1f); // shamt from rs2 (lower 5 bits)
         break;
       case InstrType::SLLI:
-        result = _nxt_regs.src1_value << shamt;
+        result = _regs.nxt().src1_value << shamt;
         break;
       case InstrType::SLTI:
-        result = (static_cast<int32_t>(_nxt_regs.src1_value) < static_cast<int32_t>(_nxt_regs.imm)) ? 1 : 0;
+        result = (static_cast<int32_t>(_regs.nxt().src1_value) < static_cast<int32_t>(_regs.nxt().imm)) ? 1 : 0;
         break;
       case InstrType::SLTIU:
-        result = (static_cast<uint32_t>(_nxt_regs.src1_value) < static_cast<uint32_t>(_nxt_regs.imm)) ? 1 : 0;
+        result = (static_cast<uint32_t>(_regs.nxt().src1_value) < static_cast<uint32_t>(_regs.nxt().imm)) ? 1 : 0;
         break;
       case InstrType::SRL:
-        result = _nxt_regs.src1_value >> (_nxt_regs.src2_value & 0x1f);
+        result = _regs.nxt().src1_value >> (_regs.nxt().src2_value & 0x1f);
         break;
       case InstrType::SRLI:
-        result = _nxt_regs.src1_value >> shamt;
+        result = _regs.nxt().src1_value >> shamt;
         break;
       case InstrType::SRA:
-        result = static_cast<int32_t>(_nxt_regs.src1_value) >> (_nxt_regs.src2_value & 0x1f);
+        result = static_cast<int32_t>(_regs.nxt().src1_value) >> (_regs.nxt().src2_value & 0x1f);
         break;
       case InstrType::SRAI:
-        result = static_cast<int32_t>(_nxt_regs.src1_value) >> shamt;
+        result = static_cast<int32_t>(_regs.nxt().src1_value) >> shamt;
         break;
       case InstrType::LUI:
-        result = static_cast<uint32_t>(_nxt_regs.imm) << 12;
+        result = static_cast<uint32_t>(_regs.nxt().imm) << 12;
         break;
       case InstrType::AUIPC:
-        result = _nxt_regs.instr_addr + (static_cast<uint32_t>(_nxt_regs.imm) << 12);
+        result = _regs.nxt().instr_addr + (static_cast<uint32_t>(_regs.nxt().imm) << 12);
         break;
       case InstrType::BEQ:
         is_branch = true;
-        if(_nxt_regs.src1_value == _nxt_regs.src2_value) {
-          real_branch_pc = _nxt_regs.instr_addr + _nxt_regs.imm;
+        if(_regs.nxt().src1_value == _regs.nxt().src2_value) {
+          real_branch_pc = _regs.nxt().instr_addr + _regs.nxt().imm;
         } else {
-          real_branch_pc = _nxt_regs.instr_addr + 4;
+          real_branch_pc = _regs.nxt().instr_addr + 4;
         }
         break;
       case InstrType::BNE:
         is_branch = true;
-        if(_nxt_regs.src1_value != _nxt_regs.src2_value) {
-          real_branch_pc = _nxt_regs.instr_addr + _nxt_regs.imm;
+        if(_regs.nxt().src1_value != _regs.nxt().src2_value) {
+          real_branch_pc = _regs.nxt().instr_addr + _regs.nxt().imm;
         } else {
-          real_branch_pc = _nxt_regs.instr_addr + 4;
+          real_branch_pc = _regs.nxt().instr_addr + 4;
         }
         break;
       case InstrType::BLT:
         is_branch = true;
-        if(static_cast<int32_t>(_nxt_regs.src1_value) < static_cast<int32_t>(_nxt_regs.src2_value)) {
-          real_branch_pc = _nxt_regs.instr_addr + _nxt_regs.imm;
+        if(static_cast<int32_t>(_regs.nxt().src1_value) < static_cast<int32_t>(_regs.nxt().src2_value)) {
+          real_branch_pc = _regs.nxt().instr_addr + _regs.nxt().imm;
         } else {
-          real_branch_pc = _nxt_regs.instr_addr + 4;
+          real_branch_pc = _regs.nxt().instr_addr + 4;
         }
         break;
       case InstrType::BGE:
         is_branch = true;
-        if(static_cast<int32_t>(_nxt_regs.src1_value) >= static_cast<int32_t>(_nxt_regs.src2_value)) {
-          real_branch_pc = _nxt_regs.instr_addr + _nxt_regs.imm;
+        if(static_cast<int32_t>(_regs.nxt().src1_value) >= static_cast<int32_t>(_regs.nxt().src2_value)) {
+          real_branch_pc = _regs.nxt().instr_addr + _regs.nxt().imm;
         } else {
-          real_branch_pc = _nxt_regs.instr_addr + 4;
+          real_branch_pc = _regs.nxt().instr_addr + 4;
         }
         break;
       case InstrType::BLTU:
         is_branch = true;
-        if(_nxt_regs.src1_value < _nxt_regs.src2_value) {
-          real_branch_pc = _nxt_regs.instr_addr + _nxt_regs.imm;
+        if(_regs.nxt().src1_value < _regs.nxt().src2_value) {
+          real_branch_pc = _regs.nxt().instr_addr + _regs.nxt().imm;
         } else {
-          real_branch_pc = _nxt_regs.instr_addr + 4;
+          real_branch_pc = _regs.nxt().instr_addr + 4;
         }
         break;
       case InstrType::BGEU:
         is_branch = true;
-        if(_nxt_regs.src1_value >= _nxt_regs.src2_value) {
-          real_branch_pc = _nxt_regs.instr_addr + _nxt_regs.imm;
+        if(_regs.nxt().src1_value >= _regs.nxt().src2_value) {
+          real_branch_pc = _regs.nxt().instr_addr + _regs.nxt().imm;
         } else {
-          real_branch_pc = _nxt_regs.instr_addr + 4;
+          real_branch_pc = _regs.nxt().instr_addr + 4;
         }
         break;
       case InstrType::JAL:
         is_branch = true;
-        real_branch_pc = _nxt_regs.instr_addr + _nxt_regs.imm;
-        result = _nxt_regs.instr_addr + 4;
+        real_branch_pc = _regs.nxt().instr_addr + _regs.nxt().imm;
+        result = _regs.nxt().instr_addr + 4;
         break;
       case InstrType::JALR:
         is_branch = true;
-        real_branch_pc = (_nxt_regs.src1_value + _nxt_regs.imm) & ~1;
-        result = _nxt_regs.instr_addr + 4;
+        real_branch_pc = (_regs.nxt().src1_value + _regs.nxt().imm) & ~1;
+        result = _regs.nxt().instr_addr + 4;
         break;
       case InstrType::LB:
       case InstrType::LH:
@@ -207,7 +207,7 @@ public:
       case InstrType::SH:
       case InstrType::SW:
         // calculate address.
-        result = _nxt_regs.src1_value + _nxt_regs.imm;
+        result = _regs.nxt().src1_value + _regs.nxt().imm;
         is_load_store = true;
         break;
       case InstrType::INVALID:
@@ -218,40 +218,45 @@ public:
 
       cdb_output.entry = CDBEntry{
         .is_valid = true,
-        .rob_index = _nxt_regs.rob_index,
+        .rob_index = _regs.nxt().rob_index,
         .real_pc = is_branch ? real_branch_pc : 0,
         .value = result,
         .is_load_store = is_load_store
       };
 
-      _nxt_regs.is_busy = false;
-      _nxt_regs.instr_type = InstrType::INVALID;
+      _regs.nxt().is_busy = false;
+      _regs.nxt().instr_type = InstrType::INVALID;
     }
 
-    rs_output.can_accept_instr = !_nxt_regs.is_busy;
+    rs_output.can_accept_instr = !_regs.nxt().is_busy;
 
-    bool update_signal = false;
+    wire_mask_t update_signal = 0;
 
-    if(*_cdb_output != cdb_output) {
-      *_cdb_output = cdb_output;
-      update_signal = true;
-    }
+    if(_cdb_output->drive(cdb_output)) update_signal |= 1 << 0;
 
-    if(*_rs_output != rs_output) {
-      *_rs_output = rs_output;
-      update_signal = true;
-    }
+    if(_rs_output->drive(rs_output)) update_signal |= 1 << 1;
 
     return update_signal;
   }
 
+  bool stable() const override { return _regs.stable(); }
+  void save(CheckpointWriter &out) const override { out.pod(_regs.cur()); }
+  void load(CheckpointReader &in) override { _regs.reset(in.pod<Registers>()); }
+  ModulePorts ports() const override {
+    return {
+      .name = "ALU",
+      .inputs = {_rs_input.get(), _flush_input.get()},
+      .outputs = {_cdb_output.get(), _rs_output.get()}
+    };
+  }
+
 private:
   const std::shared_ptr<const WH_RS_ALU> _rs_input;
   const std::shared_ptr<WH_ALU_CDB> _cdb_output;
   const std::shared_ptr<WH_ALU_RS> _rs_output;
   const std::shared_ptr<const WH_FLUSH_PIPELINE> _flush_input;
 
-  Registers _cur_regs, _nxt_regs;
+  RegisterBuffer<Registers> _regs;
 };
 }
 
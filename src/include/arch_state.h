@@ -0,0 +1,20 @@
+#ifndef ISM_ARCH_STATE_H
+#define ISM_ARCH_STATE_H
+
+#include <array>
+
+#include "common.h"
+#include "paged_memory.h"
+
+namespace insomnia {
+
+// What a program can observe between two instructions: handed between the functional models and the CPU.
+struct ArchState {
+  mem_ptr_t pc = 0; // of the next instruction
+  std::array<mem_val_t, RFSize> regs{};
+  PagedMemory mem;
+};
+
+}
+
+#endif // ISM_ARCH_STATE_H
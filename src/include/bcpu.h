@@ -1,136 +1,148 @@
 #pragma once
 
 #include <iostream>
+#include <vector>
 
 #include "common.h"
 #include "utility.h"
 #include "instruction.h"
+#include "decode_cache.h"
+#include "paged_memory.h"
+#include "arch_state.h"
+#include "warming.h"
+#include "trace.h"
 
 namespace insomnia {
 
 class BCPU {
 
-  std::array<uint8_t, RAMSize> _mem{};
+  PagedMemory _mem;
   std::array<mem_val_t, RFSize> _regs{};
   clock_t _clk = 0;
+  uint64_t _instret = 0;
   mem_ptr_t _pc = 0;
+  DecodeCache _decoded; // decoded once per pc, not every time it runs
+  Warming *_warming = nullptr;
+  std::vector<TraceRecord> *_trace = nullptr;
 
   mem_val_t read_mem(mem_ptr_t addr, mptr_diff_t data_len) {
-    mem_val_t val = 0;
-    for(size_t i = 0; i < data_len; ++i)
-      val |= static_cast<mem_val_t>(_mem[addr + i]) << (i * 8);
-    // debug("MIU: Read " + std::to_string(val) + " with data len " + std::to_string(data_len) +
-    //   " from addr " + std::to_string(addr));
-    return val;
+    return _mem.read(addr, data_len);
   }
   void write_mem(mem_ptr_t addr, mptr_diff_t data_len, mem_val_t val) {
-    // debug("MIU: Write " + std::to_string(val) + " with data len " + std::to_string(data_len) +
-    //   " to addr " + std::to_string(addr));
-    for(size_t i = 0; i < data_len; ++i)
-      _mem[addr + i] = static_cast<uint8_t>((val >> (i * 8)) & 0xff);
+    _decoded.invalidate(addr, data_len);
+    _mem.write(addr, data_len, val);
   }
 
 public:
-  void preload_program() {
-    mem_ptr_t cur_ptr = 0, diff_ptr = 0;
-    raw_instr_t raw_instr = 0;
-    int hex_cnt = 0;
-    for(char ch = std::cin.get(); ch != EOF && ch != '&'; ch = std::cin.get()) {
-      if(is_delim(ch)) continue;
-      if(ch == '@') {
-        cur_ptr = 0;
-        for(int i = 0; i < 8; ++i) {
-          ch = std::cin.get();
-          cur_ptr = (cur_ptr << 4) | hex2dec(ch);
-        }
-        diff_ptr = 0;
-        continue;
-      }
-      raw_instr = (raw_instr << 4) | hex2dec(ch);
-      if(++hex_cnt == 8) {
-        raw_instr = ToSmallEndian32_8(raw_instr);
-        write_mem(cur_ptr + diff_ptr, 4, raw_instr);
-        hex_cnt = 0;
-        raw_instr = 0;
-        diff_ptr += 4;
-      }
-    }
+  // via std::cin by default. Pre-assumed the input style.
+  void preload_program(std::istream &is = std::cin) {
+    load_hex_program(is, [this](raw_instr_t raw_instr, mem_ptr_t addr) { write_mem(addr, 4, raw_instr); });
   }
 
   mem_val_t get_ret() const {
     return _regs[10] & 0xff;
   }
+  mem_val_t get_reg(int i) const { return _regs[i]; }
 
   std::pair<uint32_t, uint32_t> pred_stat() const { return {-1, -1}; }
 
   clock_t cycles() const { return _clk; }
+  mem_ptr_t pc() const { return _pc; }
+  uint64_t instructions() const { return _instret; }
+
+  ArchState arch_state() const {
+    ArchState state;
+    state.pc = _pc;
+    state.regs = _regs;
+    state.mem = _mem;
+    return state;
+  }
+  // go on from state. Instruction count is kept.
+  void load_arch_state(const ArchState &state) {
+    _pc = state.pc;
+    _regs = state.regs;
+    _mem = state.mem;
+    _decoded = DecodeCache();
+  }
+
+  // train warming with every instruction executed from now on. nullptr: stop.
+  void set_warming(Warming *warming) { _warming = warming; }
+  // append a record of every instruction executed from now on, the halt included. nullptr: stop.
+  void set_trace(std::vector<TraceRecord> *trace) { _trace = trace; }
 
   bool tick() {
-    static int cnt = 0; ++cnt;
-    raw_instr_t raw_instr = read_mem(_pc, 4);
-    if(raw_instr == 0x0ff00513) return false;
-    std::cout << _pc << std::endl;
-    Instruction instr{raw_instr};
-    auto rd = instr.rd();
-    auto rs1 = instr.rs1();
-    auto rs2 = instr.rs2();
-    auto imm = instr.imm();
-    switch(instr.type()) {
+    const DecodedInstr instr = _decoded.get(_pc, [this](mem_ptr_t pc) { return read_mem(pc, 4); });
+    ISM_LOG(BCPU, Trace, "pc {}", _pc);
+    auto rd = instr.rd;
+    auto rs1 = instr.rs1;
+    auto rs2 = instr.rs2;
+    auto imm = instr.imm;
+    mem_ptr_t next_pc = _pc + 4;
+    mem_ptr_t addr = 0;
+    switch(static_cast<InstrType>(instr.op)) {
     case InstrType::LUI:
-      _regs[rd] = imm << 12;
+      _regs[rd] = imm;
       break;
     case InstrType::AUIPC:
-      _regs[rd] = _pc + (imm << 12);
+      _regs[rd] = _pc + imm;
       break;
     case InstrType::JAL:
       _regs[rd] = _pc + 4;
-      _pc = _pc + imm;
+      next_pc = _pc + imm;
       break;
     case InstrType::JALR:
+      next_pc = (_regs[rs1] + imm) & (~0x1);
       _regs[rd] = _pc + 4;
-      _pc = (_regs[rs1] + imm) & (~0x1);
       break;
     case InstrType::BEQ:
-      if(_regs[rs1] == _regs[rs2]) _pc += imm; else _pc += 4;
+      if(_regs[rs1] == _regs[rs2]) next_pc = _pc + imm;
       break;
     case InstrType::BNE:
-      if(_regs[rs1] != _regs[rs2]) _pc += imm; else _pc += 4;
+      if(_regs[rs1] != _regs[rs2]) next_pc = _pc + imm;
       break;
     case InstrType::BLT:
-      if(static_cast<int32_t>(_regs[rs1]) < static_cast<int32_t>(_regs[rs2])) _pc += imm; else _pc += 4;
+      if(static_cast<int32_t>(_regs[rs1]) < static_cast<int32_t>(_regs[rs2])) next_pc = _pc + imm;
       break;
     case InstrType::BGE:
-      if(static_cast<int32_t>(_regs[rs1]) >= static_cast<int32_t>(_regs[rs2])) _pc += imm; else _pc += 4;
+      if(static_cast<int32_t>(_regs[rs1]) >= static_cast<int32_t>(_regs[rs2])) next_pc = _pc + imm;
       break;
     case InstrType::BLTU:
-      if(_regs[rs1] < _regs[rs2]) _pc += imm; else _pc += 4;
+      if(_regs[rs1] < _regs[rs2]) next_pc = _pc + imm;
       break;
     case InstrType::BGEU:
-      if(_regs[rs1] >= _regs[rs2]) _pc += imm; else _pc += 4;
+      if(_regs[rs1] >= _regs[rs2]) next_pc = _pc + imm;
       break;
     case InstrType::LB:
-      _regs[rd] = sign_extend<mem_val_t, 8>(read_mem(_regs[rs1] + imm, 1));
+      addr = _regs[rs1] + imm;
+      _regs[rd] = sign_extend<mem_val_t, 8>(read_mem(addr, 1));
       break;
     case InstrType::LH:
-      _regs[rd] = sign_extend<mem_val_t, 16>(read_mem(_regs[rs1] + imm, 2));
+      addr = _regs[rs1] + imm;
+      _regs[rd] = sign_extend<mem_val_t, 16>(read_mem(addr, 2));
       break;
     case InstrType::LW:
-      _regs[rd] = read_mem(_regs[rs1] + imm, 4);
+      addr = _regs[rs1] + imm;
+      _regs[rd] = read_mem(addr, 4);
       break;
     case InstrType::LBU:
-      _regs[rd] = read_mem(_regs[rs1] + imm, 1);
+      addr = _regs[rs1] + imm;
+      _regs[rd] = read_mem(addr, 1);
       break;
     case InstrType::LHU:
-      _regs[rd] = read_mem(_regs[rs1] + imm, 2);
+      addr = _regs[rs1] + imm;
+      _regs[rd] = read_mem(addr, 2);
       break;
     case InstrType::SB:
-      write_mem(_regs[rs1] + imm, 1, _regs[rs2]);
+      addr = _regs[rs1] + imm;
+      write_mem(addr, 1, _regs[rs2]);
       break;
     case InstrType::SH:
-      write_mem(_regs[rs1] + imm, 2, _regs[rs2]);
+      addr = _regs[rs1] + imm;
+      write_mem(addr, 2, _regs[rs2]);
       break;
     case InstrType::SW:
-      write_mem(_regs[rs1] + imm, 4, _regs[rs2]);
+      addr = _regs[rs1] + imm;
+      write_mem(addr, 4, _regs[rs2]);
       break;
     case InstrType::ADDI:
       _regs[rd] = _regs[rs1] + imm;
@@ -166,10 +178,10 @@ public:
       _regs[rd] = _regs[rs1] - _regs[rs2];
       break;
     case InstrType::SLL:
-      _regs[rd] = _regs[rs1] << _regs[rs2];
+      _regs[rd] = _regs[rs1] << (_regs[rs2] & 0x1f);
       break;
     case InstrType::SLT:
-      _regs[rd] = (_regs[rs1] < _regs[rs2]) ? 1 : 0;
+      _regs[rd] = (static_cast<int32_t>(_regs[rs1]) < static_cast<int32_t>(_regs[rs2])) ? 1 : 0;
       break;
     case InstrType::SLTU:
       _regs[rd] = (_regs[rs1] < _regs[rs2]) ? 1 : 0;
@@ -178,10 +190,10 @@ public:
       _regs[rd] = _regs[rs1] ^ _regs[rs2];
       break;
     case InstrType::SRL:
-      _regs[rd] = _regs[rs1] >> _regs[rs2];
+      _regs[rd] = _regs[rs1] >> (_regs[rs2] & 0x1f);
       break;
     case InstrType::SRA:
-      _regs[rd] = static_cast<mem_val_t>(static_cast<int32_t>(_regs[rs1]) >> _regs[rs2]);
+      _regs[rd] = static_cast<mem_val_t>(static_cast<int32_t>(_regs[rs1]) >> (_regs[rs2] & 0x1f));
       break;
     case InstrType::OR:
       _regs[rd] = _regs[rs1] | _regs[rs2];
@@ -191,10 +203,15 @@ public:
       break;
     case InstrType::INVALID:
       throw std::runtime_error("Invalid operation");
+    default: // DecodedInstr::Halt
+      if(_trace) _trace->push_back({_pc, next_pc, 0, instr});
+      return false;
     }
     _regs[0] = 0;
-    // for(int i = 0; i < 16; ++i) std::cout << i << ": " << _regs[i] << ' '; std::cout << std::endl;
-    if(!instr.is_br() && !instr.is_jal() && !instr.is_jalr()) _pc += 4;
+    if(_warming) _warming->retire(_pc, instr, next_pc);
+    if(_trace) _trace->push_back({_pc, next_pc, addr, instr});
+    _pc = next_pc;
+    ++_instret;
     return true;
   }
 };
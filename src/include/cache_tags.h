@@ -0,0 +1,94 @@
+#ifndef ISM_CACHE_TAGS_H
+#define ISM_CACHE_TAGS_H
+
+#include <array>
+#include <bit>
+#include <cstddef>
+
+#include "common.h"
+
+namespace insomnia {
+
+// Tags of a set-associative cache of Size bytes in lines of LineSize, Ways lines a set.
+// The least recently used line of a set is replaced (an invalid one first).
+// Data, if any, is kept by the user at the same (set, way).
+template <std::size_t Size, std::size_t Ways, std::size_t LineSize>
+class CacheTags {
+public:
+  static constexpr std::size_t Sets = Size / Ways / LineSize;
+  static_assert(Sets * Ways * LineSize == Size && std::has_single_bit(Sets), "sets must be a power of two");
+  static_assert(std::has_single_bit(LineSize), "lines must be a power of two");
+
+  struct Slot {
+    std::size_t set, way;
+  };
+
+  static mem_ptr_t line_of(mem_ptr_t addr) { return addr & ~static_cast<mem_ptr_t>(LineSize - 1); }
+  static std::size_t set_of(mem_ptr_t addr) { return addr / LineSize % Sets; }
+
+  // the line holding addr, made the most recently used. false if it is not there.
+  bool lookup(mem_ptr_t addr, Slot &slot) {
+    if(!find(addr, slot)) return false;
+    _ways[slot.set][slot.way].last_use = ++_uses;
+    return true;
+  }
+  // the same, leaving the order of use as it is.
+  bool find(mem_ptr_t addr, Slot &slot) const {
+    std::size_t set = set_of(addr);
+    for(std::size_t way = 0; way < Ways; ++way)
+      if(_ways[set][way].valid && _ways[set][way].tag == tag_of(addr)) {
+        slot = {set, way};
+        return true;
+      }
+    return false;
+  }
+  bool contains(mem_ptr_t addr) const {
+    Slot slot;
+    return find(addr, slot);
+  }
+  // the line held at slot, if valid.
+  mem_ptr_t line_at(Slot slot) const {
+    return static_cast<mem_ptr_t>((_ways[slot.set][slot.way].tag * Sets + slot.set) * LineSize);
+  }
+
+  // makes room for the line holding addr and returns where. evicted: the line it replaces, if valid.
+  Slot allocate(mem_ptr_t addr, bool &evicted, mem_ptr_t &evicted_line) {
+    std::size_t set = set_of(addr), victim = 0;
+    auto &ways = _ways[set];
+    for(std::size_t way = 1; way < Ways; ++way)
+      if(age(ways[way]) < age(ways[victim])) victim = way;
+    evicted = ways[victim].valid;
+    evicted_line = line_at({set, victim});
+    ways[victim] = {.valid = true, .tag = tag_of(addr), .last_use = ++_uses};
+    return {set, victim};
+  }
+  Slot allocate(mem_ptr_t addr) {
+    bool evicted;
+    mem_ptr_t evicted_line;
+    return allocate(addr, evicted, evicted_line);
+  }
+
+  // drops the line holding addr, if there. Returns whether it was.
+  bool invalidate(mem_ptr_t addr) {
+    Slot slot;
+    if(!find(addr, slot)) return false;
+    _ways[slot.set][slot.way].valid = false;
+    return true;
+  }
+
+private:
+  struct Way {
+    bool valid = false;
+    mem_ptr_t tag = 0;
+    uint64_t last_use = 0;
+  };
+  std::array<std::array<Way, Ways>, Sets> _ways{};
+  uint64_t _uses = 0;
+
+  static mem_ptr_t tag_of(mem_ptr_t addr) { return addr / LineSize / Sets; }
+  static uint64_t age(const Way &way) { return way.valid ? way.last_use : 0; }
+};
+
+}
+
+#endif // ISM_CACHE_TAGS_H
@@ -3,11 +3,12 @@
 
 #include "wire_harness.h"
 #include "common.h"
+#include "checkpoint.h"
 #include <array>
 
 namespace insomnia {
 
-class CommonDataBus : public CPUModule {
+class CommonDataBus final : public CPUModule {
 public:
   CommonDataBus(
     std::shared_ptr<const WH_LSB_CDB> lsb_input,
@@ -17,30 +18,35 @@ public:
   _lsb_input(std::move(lsb_input)), _alu_input(std::move(alu_input)),
   _output(std::move(output)) {}
   void sync() override {}
-  bool update() override {
-    // debug("CDB");,
+  wire_mask_t update() override {
     WH_CDB_OUT output{};
     if(_lsb_input->entry.is_valid) {
       output.lsb_entry = _lsb_input->entry;
-      debug("LSB Broadcast: " + std::to_string(output.lsb_entry.rob_index) + ", " +
-        std::to_string(output.lsb_entry.value) + ", " +
-        std::to_string(output.lsb_entry.real_pc));
+      ISM_LOG(CDB, Trace, "LSB broadcast: {}, {}, {}",
+        output.lsb_entry.rob_index, output.lsb_entry.value, output.lsb_entry.real_pc);
     }
     if(_alu_input->entry.is_valid) {
       output.alu_entry = _alu_input->entry;
-      debug("ALU Broadcast: " + std::to_string(output.alu_entry.rob_index) + ", " +
-        std::to_string(output.alu_entry.value) + ", " +
-        std::to_string(output.alu_entry.real_pc));
+      ISM_LOG(CDB, Trace, "ALU broadcast: {}, {}, {}",
+        output.alu_entry.rob_index, output.alu_entry.value, output.alu_entry.real_pc);
     }
 
-    bool update_signal = false;
-    if(*_output != output) {
-      *_output = output;
-      update_signal = true;
-    }
+    wire_mask_t update_signal = 0;
+    if(_output->drive(output)) update_signal |= 1 << 0;
     return update_signal;
   }
 
+  bool stable() const override { return true; } // no state
+  void save(CheckpointWriter &) const override {}
+  void load(CheckpointReader &) override {}
+  ModulePorts ports() const override {
+    return {
+      .name = "CDB",
+      .inputs = {_lsb_input.get(), _alu_input.get()},
+      .outputs = {_output.get()}
+    };
+  }
+
 private:
   const std::shared_ptr<const WH_LSB_CDB> _lsb_input;
   const std::shared_ptr<const WH_ALU_CDB> _alu_input;
@@ -0,0 +1,135 @@
+#ifndef ISM_CHECKPOINT_H
+#define ISM_CHECKPOINT_H
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "common.h"
+#include "paged_memory.h"
+
+namespace insomnia {
+
+// Checkpoint file layout:
+//   "ISMCKPT" '\0', u32 version, the configuration (IFUSize, ROBSize, LSBSize, RSSize and the
+//   caches' ICacheSize, ICacheWays, ICacheLineSize, FetchBlockSize, DCacheSize, DCacheWays, DCacheLineSize,
+//   L2CacheSize, L2CacheWays, L2CacheLineSize and DRAMBanks as u64),
+//   then sections as the CPU writes them (see StaticCPU::save_checkpoint()), each one opened by its name.
+// Values are written as their bytes, in host byte order: a checkpoint is only read by the build that wrote it
+// (or one with the same configuration). Memory is written as its non-zero pages.
+inline constexpr char CheckpointMagic[8] = {'I', 'S', 'M', 'C', 'K', 'P', 'T', '\0'};
+inline constexpr uint32_t CheckpointVersion = 7;
+
+class CheckpointWriter {
+public:
+  explicit CheckpointWriter(std::ostream &os) : _os(os) {
+    bytes(CheckpointMagic, sizeof(CheckpointMagic));
+    pod(CheckpointVersion);
+    for(uint64_t size: config()) pod(size);
+  }
+
+  void section(const std::string &name) {
+    pod(static_cast<uint32_t>(name.size()));
+    bytes(name.data(), name.size());
+  }
+  template <class T>
+  void pod(const T &val) {
+    static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable values are written as bytes");
+    bytes(&val, sizeof(T));
+  }
+  // (key, value) pairs of an associative container, ordered by key so that equal maps give equal files.
+  template <class Map>
+  void map(const Map &map) {
+    std::vector<std::pair<typename Map::key_type, typename Map::mapped_type>> pairs(map.begin(), map.end());
+    std::sort(pairs.begin(), pairs.end());
+    pod(static_cast<uint64_t>(pairs.size()));
+    for(auto &[key, val]: pairs) pod(key), pod(val);
+  }
+  // as (u32 index, page) for every page with a non-zero byte, by address.
+  void memory(const PagedMemory &mem) {
+    std::vector<std::pair<uint32_t, const PagedMemory::Page *>> pages;
+    mem.for_each_page([&](uint32_t index, const PagedMemory::Page &page) {
+      if(std::any_of(page.begin(), page.end(), [](uint8_t byte) { return byte != 0; }))
+        pages.emplace_back(index, &page);
+    });
+    pod(static_cast<uint32_t>(pages.size()));
+    for(auto [index, page]: pages) {
+      pod(index);
+      bytes(page->data(), page->size());
+    }
+  }
+
+private:
+  friend class CheckpointReader;
+  std::ostream &_os;
+
+  static std::array<uint64_t, 15> config() {
+    return {IFUSize, ROBSize, LSBSize, RSSize, ICacheSize, ICacheWays, ICacheLineSize, FetchBlockSize,
+      DCacheSize, DCacheWays, DCacheLineSize, L2CacheSize, L2CacheWays, L2CacheLineSize, DRAMBanks};
+  }
+
+  void bytes(const void *data, std::size_t len) {
+    if(!_os.write(static_cast<const char *>(data), len)) throw std::runtime_error("Checkpoint: write failed");
+  }
+};
+
+class CheckpointReader {
+public:
+  explicit CheckpointReader(std::istream &is) : _is(is) {
+    char magic[sizeof(CheckpointMagic)];
+    bytes(magic, sizeof(magic));
+    if(std::memcmp(magic, CheckpointMagic, sizeof(magic)) != 0) throw std::runtime_error("Checkpoint: not a checkpoint");
+    if(pod<uint32_t>() != CheckpointVersion) throw std::runtime_error("Checkpoint: unsupported version");
+    for(uint64_t size: CheckpointWriter::config())
+      if(pod<uint64_t>() != size) throw std::runtime_error("Checkpoint: written with another configuration");
+  }
+
+  void section(const std::string &name) {
+    std::string found(pod<uint32_t>(), '\0');
+    bytes(found.data(), found.size());
+    if(found != name) throw std::runtime_error("Checkpoint: expected section " + name + ", found " + found);
+  }
+  template <class T>
+  void pod(T &val) {
+    static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable values are read as bytes");
+    bytes(&val, sizeof(T));
+  }
+  template <class T>
+  T pod() {
+    T val;
+    pod(val);
+    return val;
+  }
+  template <class Map>
+  void map(Map &map) {
+    map.clear();
+    for(auto cnt = pod<uint64_t>(); cnt; --cnt) {
+      auto key = pod<typename Map::key_type>();
+      map[key] = pod<typename Map::mapped_type>();
+    }
+  }
+  void memory(PagedMemory &mem) {
+    mem.clear();
+    for(auto cnt = pod<uint32_t>(); cnt; --cnt) {
+      auto index = pod<uint32_t>();
+      if(index >= PagedMemory::Pages) throw std::runtime_error("Checkpoint: page out of memory");
+      bytes(mem.page(index).data(), PagedMemory::PageSize);
+    }
+  }
+
+private:
+  std::istream &_is;
+
+  void bytes(void *data, std::size_t len) {
+    if(!_is.read(static_cast<char *>(data), len)) throw std::runtime_error("Checkpoint: truncated");
+  }
+};
+
+}
+
+#endif // ISM_CHECKPOINT_H
@@ -0,0 +1,214 @@
+#ifndef ISM_CO_MODULE_H
+#define ISM_CO_MODULE_H
+
+#include <array>
+#include <coroutine>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "timing_wheel.h"
+
+namespace insomnia {
+
+// Base for modules written as processes (C++20 coroutines) instead of State enums and switches.
+// Processes run at clock edges only, in sync(). They suspend with
+//   co_await cycles(n);               // until n edges later
+//   co_await until(pred, harness...); // until the first edge at which pred() holds
+// and until(...).timeout(n) gives up after n edges (co_await then yields false).
+// until(...).restart_point() marks a wait in which the process is as it was when it started. Checkpoints
+// are only taken while every process waits at one (restartable()), and recreate the processes from scratch.
+// until() evaluates pred again only after one of the harnesses has changed (see WireHarness::generation),
+// so pred must depend on nothing else. At an edge, only the processes whose wait is over are resumed.
+//
+// Code between two co_awaits sees the inputs of the cycle that just ended, and sets up what
+// update() drives in the next one. update() is left with the outputs, plus whatever must react
+// within the cycle (a flush).
+//
+// Processes are registered with spawn<&Module::body>() and created at the first edge, when the
+// module has its final address (frames point to it; a CoModule must not move after that).
+// They behave as if started at edge 0: the first wait ends at edge 1 at the earliest.
+class CoModule : public CPUModule {
+  static constexpr clock_t Never = std::numeric_limits<clock_t>::max();
+  static constexpr std::size_t MaxWatched = 4;
+
+protected:
+  class Wait;
+
+  class Process {
+  public:
+    struct promise_type {
+      Wait *wait = nullptr; // what the process is suspended on. nullptr once it has returned.
+      clock_t edge = 0;     // the edge it is running at
+      Process get_return_object() { return Process(std::coroutine_handle<promise_type>::from_promise(*this)); }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+      void return_void() { wait = nullptr; }
+      void unhandled_exception() { throw; }
+    };
+
+    Process(Process &&other) noexcept : _handle(std::exchange(other._handle, {})) {}
+    Process &operator=(Process &&other) noexcept {
+      std::swap(_handle, other._handle);
+      return *this;
+    }
+    ~Process() { if(_handle) _handle.destroy(); }
+
+  private:
+    friend class CoModule;
+    std::coroutine_handle<promise_type> _handle;
+    explicit Process(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+    Wait *wait() const { return _handle.promise().wait; }
+    void resume(clock_t edge) {
+      _handle.promise().edge = edge;
+      _handle.resume();
+    }
+  };
+
+  class Wait {
+  public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<Process::promise_type> handle) {
+      if(_cycles != Never) {
+        _deadline = handle.promise().edge + _cycles;
+        if(_deadline > _wheel->now()) _wheel->schedule(_deadline); // otherwise due at once (at the first edge)
+      }
+      handle.promise().wait = this;
+    }
+    // true if pred() ended the wait, false if the cycles did.
+    bool await_resume() const noexcept { return _fired; }
+
+
+  protected:
+    friend class CoModule;
+    TimingWheel *_wheel;
+    clock_t _cycles = Never;   // from the edge it starts at
+    clock_t _deadline = Never; // the edge it ends at
+    bool (*_pred)(const Wait *) = nullptr;
+    std::array<const uint32_t *, MaxWatched> _watched{};
+    std::size_t _watched_cnt = 0;
+    // pred() and the generations it was evaluated at. Not checked yet at the edge it starts at.
+    mutable std::array<uint32_t, MaxWatched> _seen{};
+    mutable bool _checked = false, _holds = false, _fired = false;
+    bool _restart_point = false;
+
+    explicit Wait(TimingWheel *wheel) : _wheel(wheel) {}
+
+    bool due(clock_t now) const {
+      if(_pred) {
+        bool changed = !_checked;
+        for(std::size_t k = 0; k < _watched_cnt; ++k)
+          if(*_watched[k] != _seen[k]) {
+            _seen[k] = *_watched[k];
+            changed = true;
+          }
+        if(changed) {
+          _holds = _pred(this);
+          _checked = true;
+        }
+        if(_holds) return _fired = true;
+      }
+      return now >= _deadline;
+    }
+  };
+
+  template <class Pred>
+  class Until : public Wait {
+  public:
+    template <class ...WH>
+    Until(TimingWheel *wheel, Pred pred, const WH &...watched) : Wait(wheel), _p(std::move(pred)) {
+      static_assert(sizeof...(WH) <= MaxWatched, "too many harnesses to watch");
+      this->_pred = [](const Wait *wait) { return static_cast<const Until *>(wait)->_p(); };
+      ((this->_watched[this->_watched_cnt++] = &watched.generation), ...);
+    }
+    // the process waits here with nothing of its own in flight: it may as well be started again.
+    Until restart_point() && {
+      this->_restart_point = true;
+      return std::move(*this);
+    }
+    // stop waiting after n edges at most.
+    Until timeout(clock_t n) && {
+      this->_cycles = n;
+      return std::move(*this);
+    }
+  private:
+    Pred _p;
+  };
+
+  explicit CoModule(std::shared_ptr<TimingWheel> wheel) : _wheel(std::move(wheel)) {}
+
+  // Body is a member coroutine of the module: Process Module::body().
+  // At an edge, processes are resumed in the order they are spawned.
+  template <auto Body>
+  void spawn() {
+    _bodies.push_back([](CoModule *self) { return (static_cast<typename member_of<decltype(Body)>::type *>(self)->*Body)(); });
+  }
+
+  Wait cycles(clock_t n) {
+    Wait wait(_wheel.get());
+    wait._cycles = n;
+    return wait;
+  }
+  template <class Pred, class ...WH>
+  Until<Pred> until(Pred pred, const WH &...watched) { return Until<Pred>(_wheel.get(), std::move(pred), watched...); }
+
+  const std::shared_ptr<TimingWheel> _wheel;
+
+public:
+  // the clock edge.
+  void sync() override {
+    if(_processes.size() < _bodies.size()) start();
+    clock_t now = _wheel->now();
+    for(auto &process: _processes)
+      if(auto wait = process.wait(); wait && wait->due(now))
+        process.resume(now);
+  }
+
+  // every process is at a restart point (or not started yet).
+  bool restartable() const {
+    for(auto &process: _processes)
+      if(auto wait = process.wait(); !wait || !wait->_restart_point) return false;
+    return true;
+  }
+
+  // nothing to do at this edge.
+  bool stable() const override {
+    if(_processes.size() < _bodies.size()) return false;
+    clock_t now = _wheel->now();
+    for(auto &process: _processes)
+      if(auto wait = process.wait(); wait && wait->due(now)) return false;
+    return true;
+  }
+
+protected:
+  // what save() writes of the processes: nothing but the check that they can be restarted.
+  void save_processes() const {
+    if(!restartable()) throw std::runtime_error("CoModule: checkpoint while a process is not at a restart point");
+  }
+  // processes restarted from scratch, up to their first wait.
+  void load_processes() {
+    _processes.clear();
+    start();
+  }
+
+private:
+  template <class> struct member_of;
+  template <class Module, class R> struct member_of<R (Module::*)()> { using type = Module; };
+
+  std::vector<Process (*)(CoModule *)> _bodies;
+  std::vector<Process> _processes;
+
+  void start() {
+    for(auto body: _bodies) {
+      _processes.push_back(body(this));
+      _processes.back().resume(0); // up to its first wait
+    }
+  }
+};
+
+}
+
+#endif // ISM_CO_MODULE_H
@@ -4,13 +4,13 @@
 #include <cstdint>
 #include <memory> // for std::shared_ptr
 #include <array>
+#include <vector>
 
+#include "log.h"
+#include "register_buffer.h"
 
-namespace insomnia {
-inline void debug(const std::string &str) {
-  // std::cerr << str << std::endl;
-}
 
+namespace insomnia {
 /********************* global parameters ************************/
 
 using mem_val_t   = uint32_t; // RV32I 4 bytes
@@ -20,13 +20,44 @@ using clock_t     = uint32_t;
 using rob_index_t = uint32_t;
 using rf_index_t  = uint8_t;  // 0~31
 
-constexpr std::size_t RAMSize = 1 << 20; // 1KB
+constexpr std::size_t RAMSize = 1 << 20; // flat memory of JitCPU and ThreadedCPU, which fault outside it. The others page theirs.
 constexpr std::size_t IFUSize = 8;
 constexpr std::size_t ROBSize = 16;
 constexpr std::size_t LSBSize = 16;
 constexpr std::size_t RSSize  = 16;
 // constexpr std::size_t CDBCap  = 16;
 constexpr std::size_t RFSize  = 32;
+// L1 instruction cache: bytes, ways, bytes per line, cycles from a fetch request to its reply on a hit.
+constexpr std::size_t ICacheSize       = 4096;
+constexpr std::size_t ICacheWays       = 2;
+constexpr std::size_t ICacheLineSize   = 32;
+constexpr std::size_t ICacheHitLatency = 1;
+// Fetch block: the aligned bytes one fetch hands the IFU. Up to FetchBlockSize / 4 instructions are queued a cycle.
+constexpr std::size_t FetchBlockSize   = 16;
+// L1 data cache, write-back and write-allocate: the same, plus the misses it keeps track of at once
+// (miss status holding registers) and the loads/stores each of them can hold until its line comes.
+constexpr std::size_t DCacheSize       = 4096;
+constexpr std::size_t DCacheWays       = 2;
+constexpr std::size_t DCacheLineSize   = 32;
+constexpr std::size_t DCacheHitLatency = 2;
+constexpr std::size_t DCacheMSHRs      = 4;
+constexpr std::size_t DCacheTargets    = 4;
+// Behind them (see memory_hierarchy.h). Unified L2 cache, write-back and write-allocate: bytes, ways, bytes per line,
+// cycles from a request to its reply on a hit, misses outstanding at once.
+constexpr std::size_t L2CacheSize       = 65536;
+constexpr std::size_t L2CacheWays       = 8;
+constexpr std::size_t L2CacheLineSize   = 64;
+constexpr std::size_t L2CacheHitLatency = 10;
+constexpr std::size_t L2CacheMSHRs      = 8;
+// DRAM: banks, bytes per row of a bank, bytes a cycle on the data bus, cycles to open a row (activate),
+// to access the open one (column access) and to close it (precharge), requests its controller holds.
+constexpr std::size_t DRAMBanks     = 8;
+constexpr std::size_t DRAMRowSize   = 2048;
+constexpr std::size_t DRAMBusWidth  = 8;
+constexpr std::size_t DRAMtRCD      = 30;
+constexpr std::size_t DRAMtCAS      = 30;
+constexpr std::size_t DRAMtRP       = 30;
+constexpr std::size_t DRAMQueueSize = 16;
 
 /********************* module base ********************************/
 
@@ -43,6 +74,24 @@ constexpr std::size_t RFSize  = 32;
 // The CPU will do something like this every clock cycle:
 // while(!stabilized) { stabilized = true; for(module: modules) stabilized &= !module->update(); }
 // for(module: modules) module->sync();
+// (In fact the CPU only re-runs the modules listening on a changed harness. See scheduler.h.)
+
+// Set of output WireHarnesses of one module. Bit i stands for ModulePorts::outputs[i].
+using wire_mask_t = uint32_t;
+
+// WireHarnesses a module is connected to, identified by address.
+struct ModulePorts {
+  const char *name;                  // for diagnostics
+  std::vector<const void *> inputs;  // read by update()
+  std::vector<const void *> outputs; // written by update(), in the bit order of its return value
+  // inputs that only reach the registers (the next register state), never this cycle's outputs.
+  // They do not take part in combinational paths.
+  std::vector<const void *> registered;
+};
+
+class CheckpointWriter;
+class CheckpointReader;
+
 class CPUModule {
 public:
   CPUModule() = default;
@@ -54,8 +103,19 @@ public:
   virtual void sync() = 0;
 
   // combinational logic update. Called once by related module everytime it changed its output wire signals.
-  // returns whether this update changes some output WireHarnesses.
-  virtual bool update() = 0;
+  // returns the set of output WireHarnesses this update changes.
+  virtual wire_mask_t update() = 0;
+
+  // the harnesses passed in by the constructor. Used by the CPU to know who listens to what.
+  virtual ModulePorts ports() const = 0;
+  // whether the coming sync() leaves the module state as it was at the start of this cycle.
+  // Used to skip cycles in which nothing can change (see TimingWheel).
+  virtual bool stable() const = 0;
+
+  // the state sync() carries into the next cycle, for checkpoints (see checkpoint.h).
+  // Between two cycles only. load() is given what save() wrote, in a module constructed the same way.
+  virtual void save(CheckpointWriter &out) const = 0;
+  virtual void load(CheckpointReader &in) = 0;
 };
 
 }
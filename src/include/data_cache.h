@@ -0,0 +1,377 @@
+#ifndef ISM_DATA_CACHE_H
+#define ISM_DATA_CACHE_H
+
+#include <bit>
+#include <vector>
+
+#include "cache_tags.h"
+#include "co_module.h"
+#include "checkpoint.h"
+#include "paged_memory.h"
+#include "ring_buffer.h"
+#include "wire_harness.h"
+
+namespace insomnia {
+
+struct DataCacheStat {
+  uint64_t hits = 0;
+  uint64_t misses = 0;      // that took an MSHR
+  uint64_t merges = 0;      // misses on a line already missed: waited in its MSHR
+  uint64_t retries = 0;     // requests not taken: MSHRs or room for replies used up
+  uint64_t writebacks = 0;  // dirty lines written to memory
+  uint64_t mshr_cycles = 0; // MSHRs in use, summed over the cycles
+  std::size_t mshr_peak = 0;
+
+  double hit_rate() const {
+    uint64_t accesses = hits + misses + merges;
+    return accesses ? 1.0 * hits / accesses : 0;
+  }
+};
+
+// L1 data cache between the LSB and the MIU: Size bytes in lines of LineSize, Ways-way set associative,
+// least recently used line replaced, write-back and write-allocate.
+// One load or store is taken a cycle and answered HitLatency cycles later on a hit. A miss waits in a
+// miss status holding register (MSHR) for its line; MSHRs misses later merge into, up to Targets each,
+// so that several misses are outstanding while hits go on. The MIU fills them one at a time, oldest
+// first, after the write-back of any dirty line replaced. Their loads and stores are done as the line
+// comes in, in order, and answered one a cycle behind what is already waiting.
+// A store is answered as it is taken (even into an MSHR): it is committed, and a flush keeps it.
+// A request that finds no MSHR, or no room for its reply, is told to retry.
+// Stores are told to the I-cache, which drops the lines they write. Its fills are held off at the MIU
+// while this cache has a newer copy of the line, which it then writes back.
+template <std::size_t Size, std::size_t Ways, std::size_t LineSize, clock_t HitLatency,
+  std::size_t MSHRs, std::size_t Targets>
+class DataCache final : public CoModule {
+  using Tags = CacheTags<Size, Ways, LineSize>;
+  using Line = std::array<uint8_t, LineSize>;
+  static_assert(LineSize == std::tuple_size_v<decltype(WH_MIU_DC::line)>, "lines are filled as WH_MIU_DC::line");
+  static_assert(HitLatency >= 1);
+
+  struct Target {
+    bool is_store = false;
+    uint32_t index = 0; // LSB entry
+    mem_ptr_t addr = 0;
+    mptr_diff_t data_len = 0;
+    mem_val_t value = 0;
+  };
+  struct MSHR {
+    mem_ptr_t line = 0;
+    bool is_sent = false; // the fill is asked for
+    std::array<Target, Targets> targets{};
+    std::size_t target_cnt = 0;
+  };
+  struct Reply {
+    clock_t at = 0; // the cycle it is driven in
+    WH_MIU_LSB reply;
+  };
+  struct Writeback {
+    bool is_valid = false;
+    mem_ptr_t line = 0;
+    Line data{};
+  };
+
+public:
+  // replies that can wait: one a cycle for every request that can be in flight.
+  static constexpr std::size_t ReplyCap = std::bit_ceil(MSHRs * Targets + HitLatency);
+
+  DataCache(
+    std::shared_ptr<TimingWheel> wheel,
+    std::shared_ptr<const WH_LSB_MIU> lsb_input,
+    std::shared_ptr<const WH_MIU_DC> miu_input,
+    std::shared_ptr<const WH_IC_MIU> ic_input,
+    std::shared_ptr<const WH_FLUSH_PIPELINE> flush_input,
+    std::shared_ptr<WH_MIU_LSB> lsb_output,
+    std::shared_ptr<WH_DC_MIU> miu_output,
+    std::shared_ptr<WH_DC_IC> ic_output
+    ) :
+  CoModule(std::move(wheel)),
+  _lsb_input(std::move(lsb_input)), _miu_input(std::move(miu_input)), _ic_input(std::move(ic_input)),
+  _flush_input(std::move(flush_input)),
+  _lsb_output(std::move(lsb_output)), _miu_output(std::move(miu_output)), _ic_output(std::move(ic_output)) {
+    spawn<&DataCache::serve>();
+  }
+
+  wire_mask_t update() override {
+    wire_mask_t update_signal = 0;
+    // a flush drops loads, not the stores.
+    WH_MIU_LSB lsb_reply = _lsb_reply;
+    if(_flush_input->is_flush) {
+      if(lsb_reply.is_load_reply) lsb_reply.is_load_reply = false, lsb_reply.index = 0, lsb_reply.value = 0;
+      if(lsb_reply.is_retry && !lsb_reply.retry_store) lsb_reply.is_retry = false, lsb_reply.retry_index = 0;
+    }
+    WH_DC_MIU miu_request = _miu_request;
+    miu_request.hold_ic = _ic_input->is_valid && newer(_ic_input->addr);
+    if(_lsb_output->drive(lsb_reply)) update_signal |= 1 << 0;
+    if(_miu_output->drive(miu_request)) update_signal |= 1 << 1;
+    if(_ic_output->drive(_ic_news)) update_signal |= 1 << 2;
+    return update_signal;
+  }
+
+  const DataCacheStat &stat() const { return _stat; }
+
+  // committed stores waiting in MSHRs for their lines.
+  bool stores_pending() const {
+    for(const auto &mshr: _mshrs)
+      for(std::size_t k = 0; k < mshr.target_cnt; ++k)
+        if(mshr.targets[k].is_store) return true;
+    return false;
+  }
+  // writes the dirty lines into mem, the memory image of the MIU, when handing the state over.
+  // Not during a cycle, and not with stores pending.
+  void write_back(PagedMemory &mem) const {
+    for(std::size_t set = 0; set < Tags::Sets; ++set)
+      for(std::size_t way = 0; way < Ways; ++way)
+        if(_dirty[set][way]) {
+          mem_ptr_t line = _tags.line_at({set, way});
+          mem.write_block(line, _data[set][way].data(), LineSize);
+        }
+    if(_writeback.is_valid)
+      mem.write_block(_writeback.line, _writeback.data.data(), LineSize);
+  }
+
+  void save(CheckpointWriter &out) const override {
+    save_processes();
+    out.pod(_tags);
+    out.pod(_data);
+    out.pod(_dirty);
+    out.pod(_stat);
+    out.pod(_ic_news);
+  }
+  void load(CheckpointReader &in) override {
+    in.pod(_tags);
+    in.pod(_data);
+    in.pod(_dirty);
+    in.pod(_stat);
+    in.pod(_ic_news);
+    _mshrs.clear();
+    _replies.clear();
+    _writeback = {};
+    _lsb_reply = {};
+    _miu_request = {};
+    load_processes();
+  }
+
+  ModulePorts ports() const override {
+    return {
+      .name = "DC",
+      .inputs = {_ic_input.get(), _flush_input.get()}, // requests and fills are taken at the clock edge
+      .outputs = {_lsb_output.get(), _miu_output.get(), _ic_output.get()}
+    };
+  }
+
+private:
+  const std::shared_ptr<const WH_LSB_MIU> _lsb_input;
+  const std::shared_ptr<const WH_MIU_DC> _miu_input;
+  const std::shared_ptr<const WH_IC_MIU> _ic_input;
+  const std::shared_ptr<const WH_FLUSH_PIPELINE> _flush_input;
+  const std::shared_ptr<WH_MIU_LSB> _lsb_output;
+  const std::shared_ptr<WH_DC_MIU> _miu_output;
+  const std::shared_ptr<WH_DC_IC> _ic_output;
+  Tags _tags;
+  std::array<std::array<Line, Ways>, Tags::Sets> _data{};
+  std::array<std::array<bool, Ways>, Tags::Sets> _dirty{};
+  ring_buffer<MSHR, MSHRs> _mshrs; // the front one is filled first
+  ring_buffer<Reply, ReplyCap> _replies;
+  std::size_t _load_targets = 0;   // in _mshrs: each of them has a reply to come
+  Writeback _writeback;            // a dirty line on its way to memory
+  DataCacheStat _stat;
+  // driven by update(), but for what a flush drops.
+  WH_MIU_LSB _lsb_reply{};
+  WH_DC_MIU _miu_request{};
+  WH_DC_IC _ic_news{};
+
+  bool requested() const {
+    return !_flush_input->is_flush && (_lsb_input->is_load_request || _lsb_input->is_store_request);
+  }
+  // the I-cache asks for a line of which this cache has the only up-to-date copy.
+  bool snooped() const { return _ic_input->is_valid && dirty(_ic_input->addr); }
+  bool idle() const {
+    return _mshrs.empty() && _replies.empty() && !_writeback.is_valid &&
+      _lsb_reply == WH_MIU_LSB{} && _miu_request == WH_DC_MIU{};
+  }
+
+  Process serve() {
+    for(;;) {
+      if(idle() && !requested() && !snooped())
+        co_await until([this] { return requested() || snooped(); }, *_flush_input, *_lsb_input, *_ic_input)
+          .restart_point();
+      edge();
+      co_await cycles(1);
+    }
+  }
+
+  // everything taken at one clock edge.
+  void edge() {
+    const clock_t now = _wheel->now();
+    _stat.mshr_cycles += _mshrs.size();
+    _lsb_reply = {};
+    if(_flush_input->is_flush) drop_loads();
+    if(_miu_input->is_fill) fill(now);
+    if(_miu_input->is_written) _writeback = {}, _miu_request = {};
+    if(requested()) take(now);
+    if(!_writeback.is_valid && _miu_request == WH_DC_MIU{} && snooped()) {
+      typename Tags::Slot slot;
+      for(mem_ptr_t line = Tags::line_of(_ic_input->addr); line < _ic_input->addr + ICacheLineSize; line += LineSize)
+        if(_tags.find(line, slot) && _dirty[slot.set][slot.way]) {
+          ISM_LOG(DC, Debug, "write back line {} for the I-cache", line);
+          write_back(line, slot);
+          break;
+        }
+    }
+    if(_miu_request == WH_DC_MIU{}) {
+      if(_writeback.is_valid) {
+        _miu_request = {.is_writeback = true, .addr = _writeback.line, .line = _writeback.data};
+      } else if(!_mshrs.empty() && !_mshrs.front().is_sent) {
+        _mshrs.front().is_sent = true;
+        _miu_request = {.is_fill = true, .addr = _mshrs.front().line};
+      }
+    }
+    if(!_replies.empty() && _replies.front().at <= now + 1) {
+      auto &reply = _replies.front().reply;
+      _lsb_reply.is_load_reply = reply.is_load_reply;
+      _lsb_reply.is_store_reply = reply.is_store_reply;
+      _lsb_reply.index = reply.index;
+      _lsb_reply.value = reply.value;
+      _replies.pop();
+    }
+    _stat.mshr_peak = std::max(_stat.mshr_peak, _mshrs.size());
+  }
+
+  // a flush: what is waiting for loads goes. The lines still come, and the stores are kept.
+  void drop_loads() {
+    for(std::size_t k = _replies.size(); k--; ) {
+      Reply reply = _replies.front();
+      _replies.pop();
+      if(!reply.reply.is_load_reply) _replies.push(reply);
+    }
+    for(auto it = _mshrs.begin(); it != _mshrs.end(); ++it) {
+      auto &mshr = _mshrs.at(it.index());
+      std::size_t kept = 0;
+      for(std::size_t k = 0; k < mshr.target_cnt; ++k)
+        if(mshr.targets[k].is_store) mshr.targets[kept++] = mshr.targets[k];
+      mshr.target_cnt = kept;
+    }
+    _load_targets = 0;
+  }
+
+  // the line of the front MSHR comes in, in place of the least recently used one.
+  void fill(clock_t now) {
+    auto &mshr = _mshrs.front();
+    bool evicted;
+    mem_ptr_t victim;
+    auto slot = _tags.allocate(mshr.line, evicted, victim);
+    if(evicted && _dirty[slot.set][slot.way]) write_back(victim, slot);
+    ISM_LOG(DC, Debug, "fill line {}, {} loads/stores waiting", mshr.line, mshr.target_cnt);
+    _data[slot.set][slot.way] = _miu_input->line;
+    _dirty[slot.set][slot.way] = false;
+    for(std::size_t k = 0; k < mshr.target_cnt; ++k) {
+      const auto &target = mshr.targets[k];
+      if(target.is_store) {
+        write(slot, target.addr, target.data_len, target.value);
+      } else {
+        reply({.is_load_reply = true, .index = target.index, .value = read(slot, target.addr, target.data_len)}, now);
+        --_load_targets;
+      }
+    }
+    _mshrs.pop();
+    _miu_request = {};
+  }
+
+  void take(clock_t now) {
+    const auto &req = *_lsb_input;
+    if(req.is_store_request && req.addr % LineSize + req.data_len > LineSize)
+      throw std::runtime_error("DC: store across lines");
+    mem_ptr_t line = Tags::line_of(req.addr);
+    typename Tags::Slot slot;
+    MSHR *mshr = nullptr;
+    bool hit = false;
+    // room for its reply, after those of the loads in the MSHRs.
+    bool taken = _replies.size() + _load_targets < ReplyCap;
+    if(taken) {
+      for(auto it = _mshrs.begin(); it != _mshrs.end(); ++it)
+        if(it->line == line) mshr = &_mshrs.at(it.index());
+      hit = !mshr && _tags.lookup(req.addr, slot);
+      taken = hit || (mshr ? mshr->target_cnt < Targets : !_mshrs.full());
+    }
+    if(!taken) {
+      ISM_LOG(DC, Debug, "retry {} at {}", req.is_store_request ? "store" : "load", req.addr);
+      ++_stat.retries;
+      _lsb_reply.is_retry = true;
+      _lsb_reply.retry_store = req.is_store_request;
+      _lsb_reply.retry_index = req.index;
+      return;
+    }
+    if(hit) {
+      ++_stat.hits;
+      if(req.is_store_request) write(slot, req.addr, req.data_len, req.value);
+      else reply({.is_load_reply = true, .index = req.index, .value = read(slot, req.addr, req.data_len)}, now);
+    } else {
+      if(mshr) {
+        ++_stat.merges;
+      } else {
+        ++_stat.misses;
+        _mshrs.push(MSHR{.line = line});
+        mshr = &_mshrs.back();
+      }
+      ISM_LOG(DC, Debug, "miss on {} at {}", req.is_store_request ? "store" : "load", req.addr);
+      mshr->targets[mshr->target_cnt++] = {
+        .is_store = req.is_store_request, .index = req.index, .addr = req.addr, .data_len = req.data_len,
+        .value = req.value
+      };
+      if(!req.is_store_request) ++_load_targets;
+    }
+    if(req.is_store_request) {
+      reply({.is_store_reply = true, .index = req.index}, now);
+      ++_ic_news.store_cnt;
+      _ic_news.store_addr = req.addr;
+      _ic_news.store_len = req.data_len;
+    }
+  }
+
+  // answered HitLatency cycles after the edge now, or after the replies already waiting.
+  void reply(const WH_MIU_LSB &reply, clock_t now) { _replies.push(Reply{now + HitLatency, reply}); }
+
+  void write_back(mem_ptr_t line, typename Tags::Slot slot) {
+    ++_stat.writebacks;
+    _writeback = {.is_valid = true, .line = line, .data = _data[slot.set][slot.way]};
+    _dirty[slot.set][slot.way] = false;
+  }
+
+  // whether memory is behind this cache on some byte of the I-cache line at addr.
+  bool dirty(mem_ptr_t addr) const {
+    for(mem_ptr_t line = Tags::line_of(addr); line < addr + ICacheLineSize; line += LineSize)
+      if(typename Tags::Slot slot; _tags.find(line, slot) && _dirty[slot.set][slot.way]) return true;
+    return false;
+  }
+  // or it will be, once the MSHRs or the write-back are done with.
+  bool newer(mem_ptr_t addr) const {
+    if(dirty(addr)) return true;
+    for(mem_ptr_t line = Tags::line_of(addr); line < addr + ICacheLineSize; line += LineSize) {
+      if(_writeback.is_valid && _writeback.line == line) return true;
+      for(const auto &mshr: _mshrs)
+        if(mshr.line == line) return true;
+    }
+    return false;
+  }
+
+  mem_val_t read(typename Tags::Slot slot, mem_ptr_t addr, mptr_diff_t data_len) const {
+    const auto &data = _data[slot.set][slot.way];
+    mem_val_t val = 0;
+    // a load across lines only comes down a mispredicted path in compiled code: bytes past the line read 0.
+    for(std::size_t i = 0; i < data_len && addr % LineSize + i < LineSize; ++i)
+      val |= static_cast<mem_val_t>(data[addr % LineSize + i]) << (i * 8);
+    ISM_LOG(DC, Trace, "read {} with data len {} from addr {}", val, data_len, addr);
+    return val;
+  }
+  void write(typename Tags::Slot slot, mem_ptr_t addr, mptr_diff_t data_len, mem_val_t val) {
+    ISM_LOG(DC, Trace, "write {} with data len {} to addr {}", val, data_len, addr);
+    auto &data = _data[slot.set][slot.way];
+    for(std::size_t i = 0; i < data_len; ++i)
+      data[addr % LineSize + i] = static_cast<uint8_t>((val >> (i * 8)) & 0xff);
+    _dirty[slot.set][slot.way] = true;
+  }
+};
+
+}
+
+#endif // ISM_DATA_CACHE_H
@@ -0,0 +1,101 @@
+#ifndef ISM_DECODE_CACHE_H
+#define ISM_DECODE_CACHE_H
+
+#include <array>
+
+#include "common.h"
+#include "instruction.h"
+#include "paged_memory.h"
+
+namespace insomnia {
+
+// Instruction in the form the functional model executes it: operands, immediate (already shifted
+// for LUI/AUIPC, shift amounts masked) and the handler to run.
+struct DecodedInstr {
+  // handler index: an InstrType, or one of these.
+  static constexpr uint8_t Halt = 0xfe;      // li a0, 255: end of program
+  static constexpr uint8_t Undecoded = 0xff;
+
+  uint8_t op = Undecoded;
+  uint8_t rd = 0, rs1 = 0, rs2 = 0;
+  int32_t imm = 0;
+
+  DecodedInstr() = default;
+  explicit DecodedInstr(raw_instr_t raw_instr) {
+    if(raw_instr == 0x0ff00513) {
+      op = Halt;
+      return;
+    }
+    Instruction instr{raw_instr};
+    op = static_cast<uint8_t>(instr.type());
+    rd = instr.rd();
+    rs1 = instr.rs1();
+    rs2 = instr.rs2();
+    imm = instr.imm();
+    switch(instr.type()) {
+    case InstrType::LUI: case InstrType::AUIPC:
+      imm = static_cast<int32_t>(static_cast<uint32_t>(imm) << 12);
+      break;
+    case InstrType::SLLI: case InstrType::SRLI: case InstrType::SRAI:
+      imm &= 0x1f;
+      break;
+    default:
+      break;
+    }
+  }
+};
+
+// Decoded instructions by pc, filled the first time each pc is executed, in pages of the 32-bit space
+// allocated as code is first run in them.
+// Stores must be reported through invalidate(): a store into a page holding decoded instructions
+// drops the decoded words it overwrites, so self-modifying code is decoded again.
+class DecodeCache {
+  static constexpr std::size_t PageBits = PageTable<DecodedInstr>::PageBits;
+  static constexpr std::size_t PageWords = std::size_t{1} << (PageBits - 2);
+  using Page = std::array<DecodedInstr, PageWords>;
+
+public:
+  DecodeCache() = default;
+  DecodeCache(const DecodeCache &other) : _pages(other._pages) {}
+  DecodeCache &operator=(const DecodeCache &other) {
+    _pages = other._pages;
+    _last = nullptr, _last_index = NoPage;
+    return *this;
+  }
+
+  // fetch(pc) reads the raw instruction, on a miss only.
+  template <class Fetch>
+  const DecodedInstr &get(mem_ptr_t pc, Fetch &&fetch) {
+    if(pc & 0b11) [[unlikely]] { // no slot of its own: not cached
+      _unaligned = DecodedInstr(fetch(pc));
+      return _unaligned;
+    }
+    if(pc >> PageBits != _last_index) [[unlikely]] {
+      _last_index = pc >> PageBits;
+      _last = &_pages.touch(_last_index);
+    }
+    auto &entry = (*_last)[(pc >> 2) & (PageWords - 1)];
+    if(entry.op == DecodedInstr::Undecoded) [[unlikely]] entry = DecodedInstr(fetch(pc));
+    return entry;
+  }
+
+  // len bytes at addr are written.
+  void invalidate(mem_ptr_t addr, mptr_diff_t len) {
+    mem_ptr_t last = addr + len - 1;
+    for(mem_ptr_t word = addr >> 2; word <= last >> 2; ++word)
+      if(Page *page = _pages.find(word >> (PageBits - 2)))
+        (*page)[word & (PageWords - 1)].op = DecodedInstr::Undecoded;
+  }
+
+private:
+  static constexpr uint32_t NoPage = ~uint32_t{0};
+
+  PageTable<Page> _pages;
+  Page *_last = nullptr; // the page of _last_index, where the pc mostly stays
+  uint32_t _last_index = NoPage;
+  DecodedInstr _unaligned;
+};
+
+}
+
+#endif // ISM_DECODE_CACHE_H
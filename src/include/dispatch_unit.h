@@ -3,10 +3,11 @@
 
 #include "instruction.h"
 #include "wire_harness.h"
+#include "checkpoint.h"
 
 namespace insomnia {
 
-class DispatchUnit : public CPUModule {
+class DispatchUnit final : public CPUModule {
   class MappingTableEntry {
   public:
     bool is_ready = true;
@@ -47,6 +48,7 @@ class DispatchUnit : public CPUModule {
     bool rob_request_sent = false;
     bool rob_entry_allocated_ack = false;
     rob_index_t alloc_rob_index = 0;
+    bool operator==(const Registers &) const = default;
   };
 
   // shall be another unit, so not in the register.
@@ -78,81 +80,33 @@ public:
   _lsb_output(std::move(lsb_output)),
   _rf_output(std::move(rf_output)),
   _rob_output(std::move(rob_output)),
-  _cur_regs(), _nxt_regs() {}
+  _regs() {}
 
   void sync() override {
-    _cur_regs = _nxt_regs;
-
-    // overwrite mapping table once a new reliance emerges.
-
-    // never occupy x0, since broadcast to x0 is not designed to be valid.
-    if(_cur_regs.rob_entry_allocated_ack && _cur_regs.dst_reg != 0) {
-      _mapping_table[_cur_regs.dst_reg].is_ready = false;
-      _mapping_table[_cur_regs.dst_reg].rob_index = _cur_regs.alloc_rob_index;
-    }
-
-    // free mapping table slot only when the latest occupancy is freed.
-
-    if(_cdb_input->lsb_entry.is_valid) {
-      for(std::size_t i = 1; i < RFSize; ++i) {
-        if(!_mapping_table[i].is_ready && _mapping_table[i].rob_index == _cdb_input->lsb_entry.rob_index) {
-          _mapping_table[i].is_ready = true;
-        }
-      }
-    }
-
-    if(_cdb_input->alu_entry.is_valid && !_cdb_input->alu_entry.is_load_store) {
-      for(std::size_t i = 1; i < RFSize; ++i) {
-        if(!_mapping_table[i].is_ready && _mapping_table[i].rob_index == _cdb_input->alu_entry.rob_index) {
-          _mapping_table[i].is_ready = true;
-        }
-      }
-    }
-
-    if(_rob_input->is_commit) {
-      for(std::size_t i = 1; i < RFSize; ++i) {
-        if(!_mapping_table[i].is_ready && _mapping_table[i].rob_index == _rob_input->commit_index) {
-          _mapping_table[i].is_ready = true;
-        }
-      }
-    }
-
+    wake_operands(_regs.nxt());
+    _regs.commit();
+    update_mapping_table(_mapping_table, _regs.cur());
+  }
 
-    // temporary fix
-    // This does not match the division of sync/update
-    // But we already integrated mapping table, so that's fine.
-    // can be put into update, but laz.
-    if(_cur_regs.state == State::WAIT_OPERANDS) {
-      if(_cdb_input->lsb_entry.is_valid) {
-        if(!_cur_regs.src1_ready && _cur_regs.src1_index == _cdb_input->lsb_entry.rob_index) {
-          _cur_regs.src1_ready = true;
-          _cur_regs.src1_value = _cdb_input->lsb_entry.value;
-        }
-        if(!_cur_regs.src2_ready && _cur_regs.src2_index == _cdb_input->lsb_entry.rob_index) {
-          _cur_regs.src2_ready = true;
-          _cur_regs.src2_value = _cdb_input->lsb_entry.value;
-        }
-      }
-      if(_cdb_input->alu_entry.is_valid && !_cdb_input->alu_entry.is_load_store) {
-        if(!_cur_regs.src1_ready && _cur_regs.src1_index == _cdb_input->alu_entry.rob_index) {
-          _cur_regs.src1_ready = true;
-          _cur_regs.src1_value = _cdb_input->alu_entry.value;
-        }
-        if(!_cur_regs.src2_ready && _cur_regs.src2_index == _cdb_input->alu_entry.rob_index) {
-          _cur_regs.src2_ready = true;
-          _cur_regs.src2_value = _cdb_input->alu_entry.value;
-        }
-      }
-      if(_cur_regs.src1_ready && _cur_regs.src2_ready) {
-        _cur_regs.state = State::OPERANDS_READY;
-      }
-    }
+  bool stable() const override {
+    Registers next = _regs.nxt();
+    wake_operands(next);
+    auto table = _mapping_table;
+    update_mapping_table(table, next);
+    return next == _regs.cur() && table == _mapping_table;
+  }
 
+  void save(CheckpointWriter &out) const override {
+    out.pod(_regs.cur());
+    out.pod(_mapping_table);
+  }
+  void load(CheckpointReader &in) override {
+    _regs.reset(in.pod<Registers>());
+    _mapping_table = in.pod<decltype(_mapping_table)>();
   }
 
-  bool update() override {
-    // debug("DU");
-    _nxt_regs = _cur_regs;
+  wire_mask_t update() override {
+    _regs.restore();
 
     WH_DU_IFU ifu_output{};
     WH_DU_RS rs_output{};
@@ -160,59 +114,41 @@ public:
     WH_DU_RF rf_output{};
     WH_DU_ROB rob_output{};
 
-    bool update_signal = false;
+    wire_mask_t update_signal = 0;
 
-    _nxt_regs.rob_request_sent = false;
-    _nxt_regs.rob_entry_allocated_ack = false;
+    _regs.nxt().rob_request_sent = false;
+    _regs.nxt().rob_entry_allocated_ack = false;
 
     if(_flush_input->is_flush) {
-      _nxt_regs.state = State::IDLE;
-      _nxt_regs.instr_valid = false;
-      _nxt_regs.rob_request_sent = false;
-      _nxt_regs.rob_entry_allocated_ack = false;
-
-      // Reset mapping table on flush
-      for(std::size_t i = 0; i < RFSize; ++i){
-        _mapping_table[i].is_ready = true;
-      }
+      _regs.nxt().state = State::IDLE;
+      _regs.nxt().instr_valid = false;
+      _regs.nxt().rob_request_sent = false;
+      _regs.nxt().rob_entry_allocated_ack = false;
+
+      // mapping table is reset in sync().
 
       ifu_output.can_accept_req = true;
 
-      if(*_ifu_output != ifu_output) {
-        *_ifu_output = ifu_output;
-        update_signal = true;
-      }
-      if(*_rs_output != rs_output) {
-        *_rs_output = rs_output;
-        update_signal = true;
-      }
-      if(*_lsb_output != lsb_output) {
-        *_lsb_output = lsb_output;
-        update_signal = true;
-      }
-      if(*_rf_output != rf_output) {
-        *_rf_output = rf_output;
-        update_signal = true;
-      }
-      if(*_rob_output != rob_output) {
-        *_rob_output = rob_output;
-        update_signal = true;
-      }
+      if(_ifu_output->drive(ifu_output)) update_signal |= 1 << 0;
+      if(_rs_output->drive(rs_output)) update_signal |= 1 << 1;
+      if(_lsb_output->drive(lsb_output)) update_signal |= 1 << 2;
+      if(_rf_output->drive(rf_output)) update_signal |= 1 << 3;
+      if(_rob_output->drive(rob_output)) update_signal |= 1 << 4;
       return update_signal;
     }
 
-    switch(_nxt_regs.state) {
+    switch(_regs.nxt().state) {
     case State::IDLE: {
       ifu_output.can_accept_req = true;
       if(_ifu_input->is_valid) {
         // ifu_output.can_accept_req = false; // handle it first
-        _nxt_regs.instr_valid = true;
-        _nxt_regs.instr = Instruction(_ifu_input->raw_instr);
-        _nxt_regs.instr_addr = _ifu_input->instr_addr;
-        _nxt_regs.next_pc = _ifu_input->pred_pc;
+        _regs.nxt().instr_valid = true;
+        _regs.nxt().instr = Instruction(_ifu_input->raw_instr);
+        _regs.nxt().instr_addr = _ifu_input->instr_addr;
+        _regs.nxt().next_pc = _ifu_input->pred_pc;
 
-        _nxt_regs.dst_reg = _nxt_regs.instr.rd();
-        _nxt_regs.state = State::FETCHED_DECODED;
+        _regs.nxt().dst_reg = _regs.nxt().instr.rd();
+        _regs.nxt().state = State::FETCHED_DECODED;
       }
     } break;
 
@@ -220,70 +156,70 @@ public:
     case State::WAIT_ROB_ALLOC: {
       rob_output = WH_DU_ROB{
         .is_valid = true,
-        .raw_instr = _nxt_regs.instr.raw_instr(),
-        .is_br = _nxt_regs.instr.is_br(),
-        .is_jalr = _nxt_regs.instr.is_jalr(),
-        .instr_addr = _nxt_regs.instr_addr,
-        .pred_pc = _nxt_regs.next_pc,
-        .is_load = _nxt_regs.instr.is_load(),
-        .is_store = _nxt_regs.instr.is_store(),
-        .data_len = _nxt_regs.instr.mem_data_len(),
-        .write_rf = _nxt_regs.instr.write_rf(),
-        .dst_reg = _nxt_regs.instr.rd(),
-        .instr = _nxt_regs.instr
+        .raw_instr = _regs.nxt().instr.raw_instr(),
+        .is_br = _regs.nxt().instr.is_br(),
+        .is_jalr = _regs.nxt().instr.is_jalr(),
+        .instr_addr = _regs.nxt().instr_addr,
+        .pred_pc = _regs.nxt().next_pc,
+        .is_load = _regs.nxt().instr.is_load(),
+        .is_store = _regs.nxt().instr.is_store(),
+        .data_len = _regs.nxt().instr.mem_data_len(),
+        .write_rf = _regs.nxt().instr.write_rf(),
+        .dst_reg = _regs.nxt().instr.rd(),
+        .instr = _regs.nxt().instr
       };
-      _nxt_regs.rob_request_sent = true;
+      _regs.nxt().rob_request_sent = true;
       if(_rob_input->is_alloc_valid) {
-        _nxt_regs.alloc_rob_index = _rob_input->rob_index;
-        _nxt_regs.rob_entry_allocated_ack = _nxt_regs.instr.write_rf();
+        _regs.nxt().alloc_rob_index = _rob_input->rob_index;
+        _regs.nxt().rob_entry_allocated_ack = _regs.nxt().instr.write_rf();
 
         // fetch rf data using the old mapping table
-        rf_index_t rs1_idx = _nxt_regs.instr.rs1();
-        if(!_nxt_regs.instr.has_src1() || rs1_idx == 0) {
-          _nxt_regs.src1_ready = true;
-          _nxt_regs.src1_value = 0;
-          _nxt_regs.src1_index = 0;
+        rf_index_t rs1_idx = _regs.nxt().instr.rs1();
+        if(!_regs.nxt().instr.has_src1() || rs1_idx == 0) {
+          _regs.nxt().src1_ready = true;
+          _regs.nxt().src1_value = 0;
+          _regs.nxt().src1_index = 0;
         } else if(_rob_input->has_src1) {
           // more updated than mapping table
-          _nxt_regs.src1_ready = true;
-          _nxt_regs.src1_index = 0;
-          _nxt_regs.src1_value = _rob_input->src1;
+          _regs.nxt().src1_ready = true;
+          _regs.nxt().src1_index = 0;
+          _regs.nxt().src1_value = _rob_input->src1;
         } else if(_mapping_table[rs1_idx].is_ready) {
           rf_output.is_valid = true;
           rf_output.reqRi = true;
           rf_output.Ri = rs1_idx;
-          _nxt_regs.src1_ready = false;
-          _nxt_regs.src1_index = 0;
+          _regs.nxt().src1_ready = false;
+          _regs.nxt().src1_index = ROBSize; // no ROB entry: a broadcast for entry 0 is not it
         } else {
-          _nxt_regs.src1_ready = false;
-          _nxt_regs.src1_index = _mapping_table[rs1_idx].rob_index;
-          _nxt_regs.src1_value = 0;
+          _regs.nxt().src1_ready = false;
+          _regs.nxt().src1_index = _mapping_table[rs1_idx].rob_index;
+          _regs.nxt().src1_value = 0;
         }
 
-        rf_index_t rs2_idx = _nxt_regs.instr.rs2();
-        if(!_nxt_regs.instr.has_src2() || rs2_idx == 0) {
-          _nxt_regs.src2_ready = true;
-          _nxt_regs.src2_value = 0;
-          _nxt_regs.src2_index = 0;
+        rf_index_t rs2_idx = _regs.nxt().instr.rs2();
+        if(!_regs.nxt().instr.has_src2() || rs2_idx == 0) {
+          _regs.nxt().src2_ready = true;
+          _regs.nxt().src2_value = 0;
+          _regs.nxt().src2_index = 0;
         } else if(_rob_input->has_src2) {
           // more updated than mapping table
-          _nxt_regs.src2_ready = true;
-          _nxt_regs.src2_index = 0;
-          _nxt_regs.src2_value = _rob_input->src2;
+          _regs.nxt().src2_ready = true;
+          _regs.nxt().src2_index = 0;
+          _regs.nxt().src2_value = _rob_input->src2;
         } else if(_mapping_table[rs2_idx].is_ready) {
           rf_output.is_valid = true;
           rf_output.reqRj = true;
           rf_output.Rj = rs2_idx;
-          _nxt_regs.src2_ready = false;
-          _nxt_regs.src2_index = 0;
+          _regs.nxt().src2_ready = false;
+          _regs.nxt().src2_index = ROBSize; // the same
         } else {
-          _nxt_regs.src2_ready = false;
-          _nxt_regs.src2_index = _mapping_table[rs2_idx].rob_index;
-          _nxt_regs.src2_value = 0;
+          _regs.nxt().src2_ready = false;
+          _regs.nxt().src2_index = _mapping_table[rs2_idx].rob_index;
+          _regs.nxt().src2_value = 0;
         }
-        _nxt_regs.state = State::WAIT_OPERANDS;
+        _regs.nxt().state = State::WAIT_OPERANDS;
       } else {
-        _nxt_regs.state = State::WAIT_ROB_ALLOC;
+        _regs.nxt().state = State::WAIT_ROB_ALLOC;
         rob_output.is_valid = true; // ?
       }
     } break;
@@ -291,127 +227,198 @@ public:
     case State::WAIT_OPERANDS: {
       if(_rf_input->is_valid) {
         if(_rf_input->repRi) {
-          _nxt_regs.src1_value = _rf_input->Vi;
-          _nxt_regs.src1_ready = true;
+          _regs.nxt().src1_value = _rf_input->Vi;
+          _regs.nxt().src1_ready = true;
         }
         if(_rf_input->repRj) {
-          _nxt_regs.src2_value = _rf_input->Vj;
-          _nxt_regs.src2_ready = true;
+          _regs.nxt().src2_value = _rf_input->Vj;
+          _regs.nxt().src2_ready = true;
         }
       }
 
       if(_cdb_input->lsb_entry.is_valid){
-        if(!_nxt_regs.src1_ready && _nxt_regs.src1_index == _cdb_input->lsb_entry.rob_index){
-          _nxt_regs.src1_value = _cdb_input->lsb_entry.value;
-          _nxt_regs.src1_ready = true;
+        if(!_regs.nxt().src1_ready && _regs.nxt().src1_index == _cdb_input->lsb_entry.rob_index){
+          _regs.nxt().src1_value = _cdb_input->lsb_entry.value;
+          _regs.nxt().src1_ready = true;
         }
-        if(!_nxt_regs.src2_ready && _nxt_regs.src2_index == _cdb_input->lsb_entry.rob_index){
-          _nxt_regs.src2_value = _cdb_input->lsb_entry.value;
-          _nxt_regs.src2_ready = true;
+        if(!_regs.nxt().src2_ready && _regs.nxt().src2_index == _cdb_input->lsb_entry.rob_index){
+          _regs.nxt().src2_value = _cdb_input->lsb_entry.value;
+          _regs.nxt().src2_ready = true;
         }
       }
       if(_cdb_input->alu_entry.is_valid){
-        if(!_nxt_regs.src1_ready && _nxt_regs.src1_index == _cdb_input->alu_entry.rob_index){
-          _nxt_regs.src1_value = _cdb_input->alu_entry.value;
-          _nxt_regs.src1_ready = true;
+        if(!_regs.nxt().src1_ready && _regs.nxt().src1_index == _cdb_input->alu_entry.rob_index){
+          _regs.nxt().src1_value = _cdb_input->alu_entry.value;
+          _regs.nxt().src1_ready = true;
         }
-        if(!_nxt_regs.src2_ready && _nxt_regs.src2_index == _cdb_input->alu_entry.rob_index){
-          _nxt_regs.src2_value = _cdb_input->alu_entry.value;
-          _nxt_regs.src2_ready = true;
+        if(!_regs.nxt().src2_ready && _regs.nxt().src2_index == _cdb_input->alu_entry.rob_index){
+          _regs.nxt().src2_value = _cdb_input->alu_entry.value;
+          _regs.nxt().src2_ready = true;
         }
       }
 
-      if(_nxt_regs.src1_ready && _nxt_regs.src2_ready) {
-        _nxt_regs.state = State::OPERANDS_READY;
+      if(_regs.nxt().src1_ready && _regs.nxt().src2_ready) {
+        _regs.nxt().state = State::OPERANDS_READY;
       }
     } break;
 
     case State::OPERANDS_READY: {
-      bool is_branch_instr = _nxt_regs.instr.is_br() || _nxt_regs.instr.is_jal() || _nxt_regs.instr.is_jalr();
+      bool is_branch_instr = _regs.nxt().instr.is_br() || _regs.nxt().instr.is_jal() || _regs.nxt().instr.is_jalr();
 
       if(_rs_input->can_accept_instr) {
         rs_output = WH_DU_RS{
           .is_valid = true,
-          .rob_index = _nxt_regs.alloc_rob_index,
-          .instr_type = _nxt_regs.instr.type(),
-          .src1_ready = _nxt_regs.src1_ready,
-          .src1_value = _nxt_regs.src1_value,
-          .src1_index = _nxt_regs.src1_index,
-          .src2_ready = _nxt_regs.src2_ready,
-          .src2_value = _nxt_regs.src2_value,
-          .src2_index = _nxt_regs.src2_index,
-          .imm = _nxt_regs.instr.imm(),
-          .dst_reg = _nxt_regs.dst_reg,
-          .instr_addr = _nxt_regs.instr_addr,
+          .rob_index = _regs.nxt().alloc_rob_index,
+          .instr_type = _regs.nxt().instr.type(),
+          .src1_ready = _regs.nxt().src1_ready,
+          .src1_value = _regs.nxt().src1_value,
+          .src1_index = _regs.nxt().src1_index,
+          .src2_ready = _regs.nxt().src2_ready,
+          .src2_value = _regs.nxt().src2_value,
+          .src2_index = _regs.nxt().src2_index,
+          .imm = _regs.nxt().instr.imm(),
+          .dst_reg = _regs.nxt().dst_reg,
+          .instr_addr = _regs.nxt().instr_addr,
           .is_branch = is_branch_instr,
-          .pred_pc = _nxt_regs.instr_addr + 4
+          .pred_pc = _regs.nxt().instr_addr + 4
         };
-        if(_nxt_regs.instr.is_load()) {
+        if(_regs.nxt().instr.is_load()) {
           lsb_output = WH_DU_LSB{
             .is_valid = true,
-            .data_len = _nxt_regs.instr.mem_data_len(),
+            .data_len = _regs.nxt().instr.mem_data_len(),
             .is_load = true,
-            .rob_index = _nxt_regs.alloc_rob_index,
+            .rob_index = _regs.nxt().alloc_rob_index,
           };
-        } else if(_nxt_regs.instr.is_store()) {
+        } else if(_regs.nxt().instr.is_store()) {
           lsb_output = WH_DU_LSB{
             .is_valid = true,
-            .data_len = _nxt_regs.instr.mem_data_len(),
+            .data_len = _regs.nxt().instr.mem_data_len(),
             .is_store = true,
-            .data_ready = _nxt_regs.src2_ready,
-            .data_index = _nxt_regs.src2_index,
-            .data_value = _nxt_regs.src2_value,
-            .rob_index = _nxt_regs.alloc_rob_index,
+            .data_ready = _regs.nxt().src2_ready,
+            .data_index = _regs.nxt().src2_index,
+            .data_value = _regs.nxt().src2_value,
+            .rob_index = _regs.nxt().alloc_rob_index,
           };
         }
-        _nxt_regs.state = State::DISPATCHING;
+        _regs.nxt().state = State::DISPATCHING;
       } else {
-        _nxt_regs.state = State::STALLED;
+        _regs.nxt().state = State::STALLED;
       }
     }
     break;
 
     case State::DISPATCHING: {
-      _nxt_regs.state = State::IDLE;
-      _nxt_regs.instr_valid = false;
+      _regs.nxt().state = State::IDLE;
+      _regs.nxt().instr_valid = false;
       ifu_output.can_accept_req = false; // nah, no.
     } break;
 
     case State::STALLED: {
       if(_rs_input->can_accept_instr) {
-        _nxt_regs.state = State::OPERANDS_READY;
+        _regs.nxt().state = State::OPERANDS_READY;
       }
     } break;
     }
 
-    if(*_ifu_output != ifu_output) {
-      *_ifu_output = ifu_output;
-      update_signal = true;
+    if(_ifu_output->drive(ifu_output)) update_signal |= 1 << 0;
+
+    if(_rs_output->drive(rs_output)) update_signal |= 1 << 1;
+
+    if(_lsb_output->drive(lsb_output)) update_signal |= 1 << 2;
+
+    if(_rf_output->drive(rf_output)) update_signal |= 1 << 3;
+
+    if(_rob_output->drive(rob_output)) update_signal |= 1 << 4;
+
+    return update_signal;
+  }
+  ModulePorts ports() const override {
+    return {
+      .name = "DU",
+      .inputs = {_ifu_input.get(), _rf_input.get(), _rob_input.get(), _cdb_input.get(), _flush_input.get(), _rs_input.get()},
+      .outputs = {_ifu_output.get(), _rs_output.get(), _lsb_output.get(), _rf_output.get(), _rob_output.get()},
+      .registered = {_ifu_input.get(), _rf_input.get(), _cdb_input.get()}
+    };
+  }
+private:
+  // operands broadcast this cycle, caught into the registers about to be latched.
+  void wake_operands(Registers &regs) const {
+    // temporary fix
+    // This does not match the division of sync/update
+    // But we already integrated mapping table, so that's fine.
+    // can be put into update, but laz.
+    if(regs.state == State::WAIT_OPERANDS) {
+      if(_cdb_input->lsb_entry.is_valid) {
+        if(!regs.src1_ready && regs.src1_index == _cdb_input->lsb_entry.rob_index) {
+          regs.src1_ready = true;
+          regs.src1_value = _cdb_input->lsb_entry.value;
+        }
+        if(!regs.src2_ready && regs.src2_index == _cdb_input->lsb_entry.rob_index) {
+          regs.src2_ready = true;
+          regs.src2_value = _cdb_input->lsb_entry.value;
+        }
+      }
+      if(_cdb_input->alu_entry.is_valid && !_cdb_input->alu_entry.is_load_store) {
+        if(!regs.src1_ready && regs.src1_index == _cdb_input->alu_entry.rob_index) {
+          regs.src1_ready = true;
+          regs.src1_value = _cdb_input->alu_entry.value;
+        }
+        if(!regs.src2_ready && regs.src2_index == _cdb_input->alu_entry.rob_index) {
+          regs.src2_ready = true;
+          regs.src2_value = _cdb_input->alu_entry.value;
+        }
+      }
+      if(regs.src1_ready && regs.src2_ready) {
+        regs.state = State::OPERANDS_READY;
+      }
     }
+  }
 
-    if(*_rs_output != rs_output) {
-      *_rs_output = rs_output;
-      update_signal = true;
+  // the mapping table as changed at this edge. regs is the newly latched state.
+  void update_mapping_table(std::array<MappingTableEntry, RFSize> &table, const Registers &regs) const {
+    // Reset mapping table on flush.
+    // Not done in update(): update() may run on a stale flush signal before ROB is evaluated.
+    if(_flush_input->is_flush) {
+      for(std::size_t i = 0; i < RFSize; ++i) {
+        table[i].is_ready = true;
+      }
     }
 
-    if(*_lsb_output != lsb_output) {
-      *_lsb_output = lsb_output;
-      update_signal = true;
+    // overwrite mapping table once a new reliance emerges.
+
+    // never occupy x0, since broadcast to x0 is not designed to be valid.
+    if(regs.rob_entry_allocated_ack && regs.dst_reg != 0) {
+      table[regs.dst_reg].is_ready = false;
+      table[regs.dst_reg].rob_index = regs.alloc_rob_index;
     }
 
-    if(*_rf_output != rf_output) {
-      *_rf_output = rf_output;
-      update_signal = true;
+    // free mapping table slot only when the latest occupancy is freed.
+
+    if(_cdb_input->lsb_entry.is_valid) {
+      for(std::size_t i = 1; i < RFSize; ++i) {
+        if(!table[i].is_ready && table[i].rob_index == _cdb_input->lsb_entry.rob_index) {
+          table[i].is_ready = true;
+        }
+      }
     }
 
-    if(*_rob_output != rob_output) {
-      *_rob_output = rob_output;
-      update_signal = true;
+    if(_cdb_input->alu_entry.is_valid && !_cdb_input->alu_entry.is_load_store) {
+      for(std::size_t i = 1; i < RFSize; ++i) {
+        if(!table[i].is_ready && table[i].rob_index == _cdb_input->alu_entry.rob_index) {
+          table[i].is_ready = true;
+        }
+      }
     }
 
-    return update_signal;
+    if(_rob_input->is_commit) {
+      for(std::size_t i = 1; i < RFSize; ++i) {
+        if(!table[i].is_ready && table[i].rob_index == _rob_input->commit_index) {
+          table[i].is_ready = true;
+        }
+      }
+    }
   }
-private:
+
   const std::shared_ptr<const WH_IFU_DU> _ifu_input;
   const std::shared_ptr<const WH_RF_DU> _rf_input;
   const std::shared_ptr<const WH_ROB_DU> _rob_input;
@@ -425,7 +432,7 @@ private:
   const std::shared_ptr<WH_DU_RF> _rf_output;
   const std::shared_ptr<WH_DU_ROB> _rob_output;
 
-  Registers _cur_regs, _nxt_regs;
+  RegisterBuffer<Registers> _regs;
 };
 
 }
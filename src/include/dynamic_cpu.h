@@ -0,0 +1,405 @@
+#ifndef ISM_DYNAMIC_CPU_H
+#define ISM_DYNAMIC_CPU_H
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+#include "alu.h"
+#include "cdb.h"
+#include "miu.h"
+#include "instruction_cache.h"
+#include "data_cache.h"
+#include "utility.h"
+// #include "decoder.h"
+#include "predictor.h"
+#include "scheduler.h"
+#include "timing_wheel.h"
+#include "arch_state.h"
+#include "warming.h"
+#include "checkpoint.h"
+#include "wire_harness.h"
+#include "dispatch_unit.h"
+#include "register_file.h"
+#include "reorder_buffer.h"
+#include "load_store_buffer.h"
+#include "reservation_station.h"
+#include "instruction_fetch_unit.h"
+
+namespace insomnia {
+
+// Modules and wire harnesses wired up at run time, through shared_ptr and virtual calls.
+// Slower than StaticCPU, but the wiring is easy to change and inspect. Kept for debugging.
+class DynamicCPU {
+  // module type alias
+  using MIU  = MemoryInterfaceUnit<MemoryBackend>;
+  using IC   = InstructionCache<ICacheSize, ICacheWays, ICacheLineSize, ICacheHitLatency>;
+  using DC   = DataCache<DCacheSize, DCacheWays, DCacheLineSize, DCacheHitLatency, DCacheMSHRs, DCacheTargets>;
+  // using DEC  = Decoder;
+  using IFU  = InstructionFetchUnit<IFUSize>;
+  using DU   = DispatchUnit;
+  using ROB  = ReorderBuffer<ROBSize>;
+  using ALU  = CommonALU;
+  using LSB  = LoadStoreBuffer<LSBSize>;
+  using RS   = ReservationStation<RSSize>;
+  using PRED = Predictor;
+  using RF   = RegisterFile;
+  using CDB  = CommonDataBus;
+private:
+  clock_t _clk;  // state machine update clock
+  clock_t _skipped = 0; // cycles fast-forwarded
+  std::shared_ptr<TimingWheel> _wheel; // wakeups requested by modules
+  std::array<std::shared_ptr<CPUModule>, 12> _modules; // CPU modules array, for traverse
+  EventScheduler _scheduler; // decides which modules to update
+  std::unique_ptr<WorkerPool> _pool; // for parallel evaluation, if set_threads() found it worthwhile
+
+  std::shared_ptr<MIU>  _miu;       // Memory Interface Unit (in contact with RAM)
+  std::shared_ptr<IC>   _ic;        // L1 Instruction Cache
+  std::shared_ptr<DC>   _dc;        // L1 Data Cache
+  // std::shared_ptr<DEC>  _dec;       // Instruction Decoder
+  std::shared_ptr<IFU>  _ifu;       // Instruction Fetch Unit
+  std::shared_ptr<DU>   _du;        // Dispatch Unit (with Instruction Fetch Unit and Decoder integrated)
+  std::shared_ptr<ROB>  _rob;       // ReOrder Buffer
+  std::shared_ptr<ALU>  _alu;       // (High functional) Common ALU. Can do all kinds of calculation in 1 clock cycle.
+  std::shared_ptr<LSB>  _lsb;       // Load Store Buffer
+  std::shared_ptr<RS>   _rs;        // Reservation Station
+  std::shared_ptr<PRED> _pred;      // Branch Predictor
+  std::shared_ptr<RF>   _rf;        // General Register File
+  std::shared_ptr<CDB>  _cdb;       // Common Data Bus
+
+  // every harness, in creation order (that of Wiring), with how to checkpoint it.
+  struct HarnessRef {
+    void *harness;
+    void (*save)(CheckpointWriter &, const void *);
+    void (*load)(CheckpointReader &, void *);
+  };
+  std::vector<HarnessRef> _harnesses;
+
+  template <class WH>
+  std::shared_ptr<WH> harness() {
+    auto wh = std::make_shared<WH>();
+    _harnesses.push_back({wh.get(),
+      [](CheckpointWriter &out, const void *wh) { out.pod(*static_cast<const WH *>(wh)); },
+      [](CheckpointReader &in, void *wh) { *static_cast<WH *>(wh) = in.pod<WH>(); }});
+    return wh;
+  }
+
+  // modules in checkpoint order, the same as StaticCPU's.
+  std::array<CPUModule *, 12> checkpoint_order() const {
+    return {_miu.get(), _ic.get(), _dc.get(), _ifu.get(), _du.get(), _rob.get(), _alu.get(), _lsb.get(), _rs.get(), _pred.get(), _rf.get(), _cdb.get()};
+  }
+
+public:
+  DynamicCPU() : _clk(0), _wheel(std::make_shared<TimingWheel>()) {
+
+    auto wh_ic_ifu    = harness<WH_MIU_IFU>();
+    auto wh_ifu_ic    = harness<WH_IFU_MIU>();
+    auto wh_ic_miu    = harness<WH_IC_MIU>();
+    auto wh_miu_ic    = harness<WH_MIU_IC>();
+    auto wh_dc_ic     = harness<WH_DC_IC>();
+    auto wh_dc_miu    = harness<WH_DC_MIU>();
+    auto wh_miu_dc    = harness<WH_MIU_DC>();
+    auto wh_dc_lsb    = harness<WH_MIU_LSB>();
+    auto wh_lsb_dc    = harness<WH_LSB_MIU>();
+    auto wh_ifu_du    = harness<WH_IFU_DU>();
+    auto wh_ifu_pred  = harness<WH_IFU_PRED>();
+    auto wh_du_ifu    = harness<WH_DU_IFU>();
+    auto wh_pred_ifu  = harness<WH_PRED_IFU>();
+    auto wh_rob_pred  = harness<WH_ROB_PRED>();
+    auto wh_rob_du    = harness<WH_ROB_DU>();
+    auto wh_rob_rf    = harness<WH_ROB_RF>();
+    auto wh_rob_lsb   = harness<WH_ROB_LSB>();
+    auto wh_lsb_rob   = harness<WH_LSB_ROB>();
+    auto wh_du_rob    = harness<WH_DU_ROB>();
+    auto wh_cdb_out   = harness<WH_CDB_OUT>();
+    auto wh_lsb_cdb   = harness<WH_LSB_CDB>();
+    auto wh_alu_cdb   = harness<WH_ALU_CDB>();
+    auto wh_flush     = harness<WH_FLUSH_PIPELINE>();
+    auto wh_rf_du     = harness<WH_RF_DU>();
+    auto wh_du_rf     = harness<WH_DU_RF>();
+    auto wh_du_lsb    = harness<WH_DU_LSB>();
+    auto wh_du_rs     = harness<WH_DU_RS>();
+    auto wh_rs_alu    = harness<WH_RS_ALU>();
+    auto wh_alu_rs    = harness<WH_ALU_RS>();
+    auto wh_rs_du     = harness<WH_RS_DU>();
+
+
+    _miu = std::make_shared<MIU>(
+      _wheel,
+      wh_dc_miu,
+      wh_ic_miu,
+      wh_flush,
+      wh_miu_ic,
+      wh_miu_dc
+    );
+
+    _ic = std::make_shared<IC>(
+      _wheel,
+      wh_ifu_ic,
+      wh_miu_ic,
+      wh_dc_ic,
+      wh_flush,
+      wh_ic_ifu,
+      wh_ic_miu
+    );
+
+    _dc = std::make_shared<DC>(
+      _wheel,
+      wh_lsb_dc,
+      wh_miu_dc,
+      wh_ic_miu,
+      wh_flush,
+      wh_dc_lsb,
+      wh_dc_miu,
+      wh_dc_ic
+    );
+
+    _cdb = std::make_shared<CDB>(
+      wh_lsb_cdb,
+      wh_alu_cdb,
+      wh_cdb_out
+    );
+
+    _pred = std::make_shared<PRED>(
+      wh_ifu_pred,
+      wh_rob_pred,
+      wh_pred_ifu
+    );
+
+    _rf = std::make_shared<RF>(
+      _wheel,
+      wh_du_rf,
+      wh_rob_rf,
+      wh_rf_du
+    );
+
+    _rob = std::make_shared<ROB>(
+      wh_du_rob,
+      wh_cdb_out,
+      wh_lsb_rob,
+      wh_rob_lsb,
+      wh_rob_du,
+      wh_rob_pred,
+      wh_rob_rf,
+      wh_flush
+    );
+
+    _ifu = std::make_shared<IFU>(
+      0, // start from instr addr 0x0
+      wh_ic_ifu,
+      wh_pred_ifu,
+      wh_flush,
+      wh_du_ifu,
+      wh_ifu_ic,
+      wh_ifu_pred,
+      wh_ifu_du
+    );
+
+    _du = std::make_shared<DU>(
+      wh_ifu_du,
+      wh_rf_du,
+      wh_rob_du,
+      wh_cdb_out,
+      wh_flush,
+      wh_rs_du,
+      wh_du_ifu,
+      wh_du_rs,
+      wh_du_lsb,
+      wh_du_rf,
+      wh_du_rob
+    );
+
+    _alu = std::make_shared<ALU>(
+      wh_rs_alu,
+      wh_flush,
+      wh_alu_cdb,
+      wh_alu_rs
+    );
+
+    _lsb = std::make_shared<LSB>(
+      wh_dc_lsb,
+      wh_du_lsb,
+      wh_rob_lsb,
+      wh_flush,
+      wh_cdb_out,
+      wh_lsb_rob,
+      wh_lsb_dc,
+      wh_lsb_cdb
+    );
+
+    _rs = std::make_shared<RS>(
+      wh_du_rs,
+      wh_cdb_out,
+      wh_flush,
+      wh_alu_rs,
+      wh_rs_alu,
+      wh_rs_du
+    );
+
+    _modules = {
+      _miu,
+      _ic,
+      _dc,
+      _cdb,
+      _pred,
+      _rf,
+      _rob,
+      _ifu,
+      _du,
+      _alu,
+      _lsb,
+      _rs
+    };
+    // std::shuffle(_modules.begin(), _modules.end(), std::mt19937_64(std::random_device{}()));
+    _scheduler.build(_modules); // also decides the evaluation order
+  }
+
+  // via std::cin by default. Pre-assumed the input style.
+  void preload_program(std::istream &is = std::cin) {
+    load_hex_program(is, [this](mem_val_t raw_instr, mem_ptr_t addr) { _miu->preload_program(raw_instr, addr); });
+  }
+  // Start from state instead of a preloaded program. Before the first tick only.
+  void load_arch_state(const ArchState &state) {
+    if(_clk) throw std::runtime_error("DynamicCPU: state loaded into a running CPU");
+    _miu->load_memory(state.mem);
+    for(std::size_t i = 0; i < RFSize; ++i) _rf->set_reg(i, state.regs[i]);
+    _ifu->reset(state.pc);
+    _rob->reset(state.pc);
+  }
+  // Committed state: valid once tick() has returned false.
+  ArchState arch_state() const {
+    ArchState state;
+    state.pc = _rob->next_pc();
+    for(std::size_t i = 0; i < RFSize; ++i) state.regs[i] = _rf->get_reg(i);
+    state.mem = _miu->memory();
+    _dc->write_back(state.mem);
+    return state;
+  }
+  // start with trained predictor tables. Before the first tick only.
+  void load_warming(const Warming &warming) { _pred->load_tables(warming.predictor); }
+  void save_warming(Warming &warming) const { warming.predictor = _pred->tables(); }
+  // tick() returns false once cnt more instructions are committed and their stores are in memory.
+  void stop_after(uint64_t cnt) { _rob->stop_after(cnt); }
+  // whether the program has ended (rather than stopped by stop_after()).
+  bool halted() const { return _rob->to_terminate(); }
+
+  // whether a checkpoint can be taken now: no memory access or register read in flight
+  // (see CoModule::restart_point()). Between two ticks. Comes true within a few cycles.
+  bool checkpointable() const {
+    return _miu->restartable() && _ic->restartable() && _dc->restartable() && _rf->restartable();
+  }
+  // The complete state, so that a CPU that load_checkpoint()s it goes on exactly as this one would.
+  // Between two ticks, once checkpointable(). See checkpoint.h for the format.
+  void save_checkpoint(std::ostream &os) const {
+    CheckpointWriter out(os);
+    out.section("CPU");
+    out.pod(_clk);
+    out.pod(_skipped);
+    out.pod(*_wheel);
+    _scheduler.save(out);
+    out.section("Wiring");
+    for(auto &ref: _harnesses) ref.save(out, ref.harness);
+    for(auto module: checkpoint_order()) {
+      out.section(module->ports().name);
+      module->save(out);
+    }
+  }
+  // Instead of a preloaded program. Before the first tick only.
+  void load_checkpoint(std::istream &is) {
+    if(_clk) throw std::runtime_error("DynamicCPU: checkpoint loaded into a running CPU");
+    CheckpointReader in(is);
+    in.section("CPU");
+    _clk = in.pod<clock_t>();
+    _skipped = in.pod<clock_t>();
+    *_wheel = in.pod<TimingWheel>();
+    _scheduler.load(in);
+    in.section("Wiring");
+    for(auto &ref: _harnesses) ref.load(in, ref.harness);
+    for(auto module: checkpoint_order()) {
+      in.section(module->ports().name);
+      module->load(in);
+    }
+  }
+
+  // Evaluate independent modules on this many threads (including the calling one).
+  // Stays serial where that cannot pay off: too few cores, or no two modules to evaluate at once
+  // (see EventScheduler::worth_parallel). Returns whether it is parallel now. Results are the same either way.
+  bool set_threads(std::size_t threads) {
+    _pool.reset();
+    if(_scheduler.worth_parallel(threads))
+      _pool = std::make_unique<WorkerPool>(threads);
+    return _pool != nullptr;
+  }
+
+  bool tick() {
+    ++_clk;
+    _wheel->advance(_clk);
+
+    ISM_LOG(CPU, Trace, "clk {}", _clk);
+    if(_pool && !log_active()) _scheduler.evaluate(*_pool);
+    else _scheduler.evaluate();
+    if(_rob->to_terminate()) return false;
+    if(_rob->stopped() && !_lsb->stores_pending() && !_dc->stores_pending()) return false;
+    /*
+    if(!_rob->_regs.cur().queue.empty() &&
+      (_rob->_regs.nxt().queue.empty() || _rob->_regs.cur().queue.front().instr_addr != _rob->_regs.nxt().queue.front().instr_addr)) {
+      static int cnt = 0; ++cnt; // debug
+      std::cout << _rob->_regs.cur().queue.front().instr_addr << std::endl;
+      auto &entry = _rob->_regs.cur().queue.front();
+      for(int i = 0; i < 16; ++i) {
+        auto o = _rf->get_reg(i);
+        if(_rob->_rf_output->is_valid && _rob->_rf_output->dst_reg == i) o = _rob->_rf_output->value;
+        if(i == 0) o = 0;
+        std::cout << i << ": " << o << ' ';
+      }
+      std::cout << std::endl;
+    }
+    */
+    // If nothing changed in this cycle and nothing changes at this edge, the cycles up to
+    // the next wakeup are all the same as this one. Skip them.
+    bool quiescent = _scheduler.quiet() &&
+      std::all_of(_modules.begin(), _modules.end(), [](auto &module) { return module->stable(); });
+    // std::shuffle(_modules.begin(), _modules.end(), std::mt19937_64(std::random_device{}()));
+    for(auto &module: _modules)
+      module->sync();
+    if(quiescent)
+      if(auto wakeup = _wheel->next_event()) {
+        _skipped += *wakeup - 1 - _clk;
+        _clk = *wakeup - 1;
+      }
+    return true;
+  }
+
+  std::pair<uint32_t, uint32_t> pred_stat() const { return _pred->pred_stat(); }
+
+  // {I-cache hits, misses}
+  std::pair<uint64_t, uint64_t> icache_stat() const { return _ic->stat(); }
+  const DataCacheStat &dcache_stat() const { return _dc->stat(); }
+  // of the L2 cache and DRAM behind the L1s
+  MemoryStat memory_stat() const { return _miu->stat(); }
+
+  // {module evaluations done, module evaluations saved compared to updating everything}
+  std::pair<uint64_t, uint64_t> eval_stat() const {
+    return {_scheduler.evaluations(), _scheduler.saved_evaluations()};
+  }
+
+  // {convergence sweeps in total, most sweeps in one cycle}
+  std::pair<uint64_t, std::size_t> pass_stat() const {
+    return {_scheduler.passes(), _scheduler.max_passes()};
+  }
+
+  mem_val_t get_ret() const {
+    return _rf->get_reg(10) & 0xff;
+  }
+
+  clock_t cycles() const { return _clk; }
+
+  // cycles fast-forwarded instead of simulated. Included in cycles().
+  clock_t skipped_cycles() const { return _skipped; }
+
+  uint64_t instructions() const { return _rob->instret(); }
+};
+
+}
+
+#endif // ISM_DYNAMIC_CPU_H
\ No newline at end of file
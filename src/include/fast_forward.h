@@ -0,0 +1,67 @@
+#ifndef ISM_FAST_FORWARD_H
+#define ISM_FAST_FORWARD_H
+
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+
+#include "bcpu.h"
+#include "arch_state.h"
+
+namespace insomnia {
+
+// Runs a program in three phases: BCPU (functional) up to a point, then the cycle-accurate CPU
+// from the architectural state BCPU reached, then optionally BCPU again up to the end.
+// The CPU phase measures the region in cycles without simulating the prologue.
+struct FastForward {
+  uint64_t skip = std::numeric_limits<uint64_t>::max(); // instructions run by BCPU first
+  std::optional<mem_ptr_t> until; // or until this pc is reached, whichever comes first
+  std::optional<uint64_t> detail; // instructions run by the CPU, then BCPU again. Empty: to the end.
+};
+
+struct FastForwardResult {
+  mem_val_t ret = 0;
+  uint64_t skipped = 0;      // instructions run by BCPU before the CPU
+  uint64_t detailed = 0;     // instructions run by the CPU
+  uint64_t rest = 0;         // instructions run by BCPU after the CPU
+  clock_t cycles = 0;        // of the CPU
+  std::pair<uint32_t, uint32_t> pred_stat{};
+};
+
+template <class Detailed>
+FastForwardResult run_fast_forward(std::istream &program, const FastForward &options) {
+  FastForwardResult res;
+  auto functional = std::make_unique<BCPU>();
+  functional->preload_program(program);
+  bool running = true;
+  while(functional->instructions() < options.skip && (!options.until || functional->pc() != *options.until))
+    if(!(running = functional->tick())) break;
+  res.skipped = functional->instructions();
+  if(!running) {
+    res.ret = functional->get_ret();
+    return res;
+  }
+
+  auto detailed = std::make_unique<Detailed>();
+  detailed->load_arch_state(functional->arch_state());
+  if(options.detail) detailed->stop_after(*options.detail);
+  while(detailed->tick()) {}
+  res.detailed = detailed->instructions();
+  res.cycles = detailed->cycles();
+  res.pred_stat = detailed->pred_stat();
+  if(detailed->halted()) {
+    res.ret = detailed->get_ret();
+    return res;
+  }
+
+  functional->load_arch_state(detailed->arch_state());
+  while(functional->tick()) {}
+  res.rest = functional->instructions() - res.skipped;
+  res.ret = functional->get_ret();
+  return res;
+}
+
+}
+
+#endif // ISM_FAST_FORWARD_H
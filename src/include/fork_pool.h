@@ -0,0 +1,130 @@
+#ifndef ISM_FORK_POOL_H
+#define ISM_FORK_POOL_H
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ISM_FORK_SUPPORTED
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace insomnia {
+
+// Runs jobs in forked children, at most `limit` at a time. A child works on a copy-on-write snapshot
+// of the whole process as it is at spawn(), so a job can start from any state the parent has built,
+// and the parent goes on at once. The job's Result comes back through a pipe.
+// Only built on POSIX systems (ISM_FORK_SUPPORTED is defined then).
+template <class Result>
+class ForkPool {
+  static_assert(std::is_trivially_copyable_v<Result>, "results are sent back as bytes");
+  static_assert(sizeof(Result) <= PIPE_BUF, "a child must be able to write its result without a reader");
+
+public:
+  explicit ForkPool(std::size_t limit) : _limit(limit ? limit : 1) {}
+  ForkPool(const ForkPool &) = delete;
+  ForkPool &operator=(const ForkPool &) = delete;
+  ~ForkPool() {
+    for(auto [pid, child]: _running) {
+      ::kill(pid, SIGKILL);
+      ::waitpid(pid, nullptr, 0);
+      ::close(child.fd);
+    }
+  }
+
+  // job() -> Result runs in a child. Waits for a child to finish first if limit are running.
+  // id: to tell the results apart.
+  template <class Job>
+  void spawn(std::size_t id, Job &&job) {
+    while(_running.size() >= _limit) reap();
+    int fds[2];
+    if(::pipe(fds) != 0) throw std::runtime_error("ForkPool: pipe failed");
+    pid_t pid = ::fork();
+    if(pid < 0) {
+      ::close(fds[0]);
+      ::close(fds[1]);
+      throw std::runtime_error("ForkPool: fork failed");
+    }
+    if(pid == 0) { // the child never returns to the caller, nor runs the parent's destructors
+      ::close(fds[0]);
+      int status = 1;
+      try {
+        Result res = job();
+        if(write_all(fds[1], &res, sizeof(res))) status = 0;
+      } catch(...) {}
+      ::_exit(status);
+    }
+    ::close(fds[1]);
+    _running.emplace(pid, Child{id, fds[0]});
+  }
+
+  // waits for every child. Results in the order the children finished.
+  std::vector<std::pair<std::size_t, Result>> finish() {
+    while(!_running.empty()) reap();
+    return std::move(_results);
+  }
+
+private:
+  struct Child {
+    std::size_t id;
+    int fd; // read end of its pipe
+  };
+  const std::size_t _limit;
+  std::unordered_map<pid_t, Child> _running;
+  std::vector<std::pair<std::size_t, Result>> _results;
+
+  static bool write_all(int fd, const void *data, std::size_t len) {
+    auto ptr = static_cast<const char *>(data);
+    while(len) {
+      ssize_t cnt = ::write(fd, ptr, len);
+      if(cnt < 0 && errno == EINTR) continue;
+      if(cnt <= 0) return false;
+      ptr += cnt, len -= cnt;
+    }
+    return true;
+  }
+  static bool read_all(int fd, void *data, std::size_t len) {
+    auto ptr = static_cast<char *>(data);
+    while(len) {
+      ssize_t cnt = ::read(fd, ptr, len);
+      if(cnt < 0 && errno == EINTR) continue;
+      if(cnt <= 0) return false;
+      ptr += cnt, len -= cnt;
+    }
+    return true;
+  }
+
+  // one child has finished: collect its result.
+  void reap() {
+    int status;
+    pid_t pid;
+    while((pid = ::waitpid(-1, &status, 0)) < 0 && errno == EINTR) {}
+    auto it = _running.find(pid);
+    if(it == _running.end()) {
+      if(pid < 0) throw std::runtime_error("ForkPool: waitpid failed");
+      return; // not one of ours
+    }
+    Child child = it->second;
+    _running.erase(it);
+    Result res;
+    bool ok = read_all(child.fd, &res, sizeof(res));
+    ::close(child.fd);
+    if(!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      throw std::runtime_error("ForkPool: a child failed");
+    _results.emplace_back(child.id, res);
+  }
+};
+
+}
+
+#endif
+
+#endif // ISM_FORK_POOL_H
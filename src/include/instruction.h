@@ -114,6 +114,7 @@ public:
   void resolve(raw_instr_t raw_instr) {
     _raw_instr = raw_instr;
     _type = InstrType::INVALID;
+    _imm = 0;
     _rs2_shamt = slice_bytes<uint8_t, 24, 20>(raw_instr);
     _rs1       = slice_bytes<uint8_t, 19, 15>(raw_instr);
     _rd        = slice_bytes<uint8_t, 11,  7>(raw_instr);
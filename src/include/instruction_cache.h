@@ -0,0 +1,165 @@
+#ifndef ISM_INSTRUCTION_CACHE_H
+#define ISM_INSTRUCTION_CACHE_H
+
+#include "cache_tags.h"
+#include "co_module.h"
+#include "checkpoint.h"
+#include "wire_harness.h"
+
+namespace insomnia {
+
+// L1 instruction cache between the IFU and the MIU: Size bytes in lines of LineSize, Ways-way set
+// associative, least recently used line replaced. Fetches are answered HitLatency cycles after the
+// request on a hit, without the MIU; a miss fills the whole line from the MIU first.
+// A fetch is answered with the rest of the fetch block the pc is in (see FetchBlockSize).
+// A new fetch is taken at the edge that ends the reply, so hits can stream one block a cycle.
+// Stores drop the lines they touch as the D-cache takes them (self-modifying code); a line being
+// filled meanwhile may be older than they are, so it answers the fetch but is not kept.
+template <std::size_t Size, std::size_t Ways, std::size_t LineSize, clock_t HitLatency>
+class InstructionCache final : public CoModule {
+  using Tags = CacheTags<Size, Ways, LineSize>;
+  static_assert(LineSize >= 4, "lines must hold whole instructions");
+  static_assert(FetchBlockSize >= 4 && FetchBlockSize % 4 == 0 && LineSize % FetchBlockSize == 0,
+    "fetch blocks must hold whole instructions and lie in one line");
+  static_assert(LineSize == std::tuple_size_v<decltype(WH_MIU_IC::line)>, "lines are filled as WH_MIU_IC::line");
+  static_assert(HitLatency >= 1);
+
+public:
+  InstructionCache(
+    std::shared_ptr<TimingWheel> wheel,
+    std::shared_ptr<const WH_IFU_MIU> ifu_input,
+    std::shared_ptr<const WH_MIU_IC> miu_input,
+    std::shared_ptr<const WH_DC_IC> dc_input,
+    std::shared_ptr<const WH_FLUSH_PIPELINE> flush_input,
+    std::shared_ptr<WH_MIU_IFU> ifu_output,
+    std::shared_ptr<WH_IC_MIU> miu_output
+    ) :
+  CoModule(std::move(wheel)),
+  _ifu_input(std::move(ifu_input)), _miu_input(std::move(miu_input)), _dc_input(std::move(dc_input)),
+  _flush_input(std::move(flush_input)),
+  _ifu_output(std::move(ifu_output)), _miu_output(std::move(miu_output)) {
+    spawn<&InstructionCache::snoop>(); // first: a fetch sees the lines dropped at the same edge
+    spawn<&InstructionCache::serve>();
+  }
+
+  wire_mask_t update() override {
+    wire_mask_t update_signal = 0;
+    if(_ifu_output->drive(_flush_input->is_flush ? WH_MIU_IFU{} : _ifu_reply)) update_signal |= 1 << 0;
+    if(_miu_output->drive(_flush_input->is_flush ? WH_IC_MIU{} : _miu_request)) update_signal |= 1 << 1;
+    return update_signal;
+  }
+
+  // {hits, misses}
+  std::pair<uint64_t, uint64_t> stat() const { return {_hits, _misses}; }
+
+  void save(CheckpointWriter &out) const override {
+    save_processes();
+    out.pod(_tags);
+    out.pod(_data);
+    out.pod(_hits);
+    out.pod(_misses);
+    out.pod(_store_cnt);
+  }
+  void load(CheckpointReader &in) override {
+    in.pod(_tags);
+    in.pod(_data);
+    in.pod(_hits);
+    in.pod(_misses);
+    in.pod(_store_cnt);
+    _ifu_reply = {};
+    _miu_request = {};
+    load_processes();
+  }
+
+  ModulePorts ports() const override {
+    return {
+      .name = "IC",
+      .inputs = {_flush_input.get()}, // requests and fills are taken at the clock edge
+      .outputs = {_ifu_output.get(), _miu_output.get()}
+    };
+  }
+
+private:
+  const std::shared_ptr<const WH_IFU_MIU> _ifu_input;
+  const std::shared_ptr<const WH_MIU_IC> _miu_input;
+  const std::shared_ptr<const WH_DC_IC> _dc_input;
+  const std::shared_ptr<const WH_FLUSH_PIPELINE> _flush_input;
+  const std::shared_ptr<WH_MIU_IFU> _ifu_output;
+  const std::shared_ptr<WH_IC_MIU> _miu_output;
+  Tags _tags;
+  std::array<std::array<std::array<uint8_t, LineSize>, Ways>, Tags::Sets> _data{};
+  uint64_t _hits = 0, _misses = 0;
+  uint32_t _store_cnt = 0; // the last store dropped
+  bool _filling = false;    // waiting for _fill_line
+  bool _fill_stale = false; // a store has written it meanwhile
+  mem_ptr_t _fill_line = 0;
+  // driven by update() unless flushing.
+  WH_MIU_IFU _ifu_reply{};
+  WH_IC_MIU _miu_request{};
+
+  bool requested() const { return !_flush_input->is_flush && _ifu_input->is_valid; }
+  auto flushed() {
+    return until([this] { return _flush_input->is_flush; }, *_flush_input);
+  }
+
+  Process snoop() {
+    for(;;) {
+      co_await until([this] { return _dc_input->store_cnt != _store_cnt; }, *_dc_input).restart_point();
+      _store_cnt = _dc_input->store_cnt;
+      mem_ptr_t addr = _dc_input->store_addr;
+      for(mem_ptr_t line = Tags::line_of(addr); line < addr + _dc_input->store_len; line += LineSize) {
+        if(_tags.invalidate(line)) ISM_LOG(IC, Debug, "store at {} drops line {}", addr, line);
+        if(_filling && line == _fill_line) _fill_stale = true;
+      }
+    }
+  }
+
+  Process serve() {
+    for(;;) {
+      _ifu_reply = {};
+      if(!requested())
+        co_await until([this] { return requested(); }, *_flush_input, *_ifu_input).restart_point();
+      mem_ptr_t pc = _ifu_input->pc;
+      typename Tags::Slot slot;
+      const std::array<uint8_t, LineSize> *line;
+      if(_tags.lookup(pc, slot)) {
+        ++_hits;
+        if(HitLatency > 1 && co_await flushed().timeout(HitLatency - 1)) continue;
+        line = &_data[slot.set][slot.way];
+      } else {
+        ++_misses;
+        mem_ptr_t base = Tags::line_of(pc);
+        ISM_LOG(IC, Debug, "miss at {}, fill line {}", pc, base);
+        _miu_request = {.is_valid = true, .addr = base};
+        _filling = true;
+        _fill_stale = false;
+        _fill_line = base;
+        co_await until([this] { return _flush_input->is_flush || _miu_input->is_fill; }, *_flush_input, *_miu_input);
+        // dropped by the MIU as well on a flush
+        _miu_request = {};
+        _filling = false;
+        if(_flush_input->is_flush) continue;
+        line = &_miu_input->line;
+        if(!_fill_stale) {
+          slot = _tags.allocate(base);
+          _data[slot.set][slot.way] = _miu_input->line;
+        }
+      }
+      // instructions are word aligned: they never cross a block, nor a line
+      mem_ptr_t word = pc & ~mem_ptr_t{3};
+      _ifu_reply = {
+        .is_valid = true,
+        .instr_cnt = static_cast<uint8_t>((FetchBlockSize - word % FetchBlockSize) / 4),
+        .instr_addr = pc
+      };
+      for(std::size_t k = 0; k < _ifu_reply.instr_cnt; ++k)
+        for(std::size_t i = 0; i < 4; ++i)
+          _ifu_reply.raw_instrs[k] |= static_cast<raw_instr_t>((*line)[word % LineSize + k * 4 + i]) << (i * 8);
+      co_await cycles(1);
+    }
+  }
+};
+
+}
+
+#endif // ISM_INSTRUCTION_CACHE_H
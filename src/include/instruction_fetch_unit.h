@@ -4,14 +4,15 @@
 #include <cassert>
 
 #include "common.h"
+#include "checkpoint.h"
 #include "instruction.h" // pre-decoding
 #include "wire_harness.h"
-#include "circular_queue.h"
+#include "ring_buffer.h"
 
 namespace insomnia {
 
 template <std::size_t BufSize>
-class InstructionFetchUnit : public CPUModule {
+class InstructionFetchUnit final : public CPUModule {
   enum class State {
     IDLE,
     HANDLE_BR_JMP,
@@ -21,12 +22,27 @@ class InstructionFetchUnit : public CPUModule {
     mem_ptr_t instr_addr;
     bool next_pc_ready = false;
     mem_ptr_t next_pc; // act like prediction pc
+    bool operator==(const Entry &) const = default;
+  };
+  // the last fetch block, as far as it is not queued yet.
+  struct Block {
+    std::array<raw_instr_t, FetchBlockSize / 4> raw_instrs{};
+    mem_ptr_t addr = 0; // of raw_instrs[pos]
+    uint8_t pos = 0, cnt = 0;
+    bool operator==(const Block &) const = default;
   };
   struct Registers {
-    circular_queue<Entry, BufSize> queue; // raw instructions
+    ring_buffer<Entry, BufSize> queue; // raw instructions
     mem_ptr_t pc; // managed here
+    Block block;
     // clock_t clk_delay;
     Registers(mem_ptr_t _pc) : pc(_pc) {}
+    void restore_from(const Registers &other) {
+      queue.restore_from(other.queue);
+      pc = other.pc;
+      block = other.block;
+    }
+    bool operator==(const Registers &) const = default;
   };
 
 public:
@@ -45,16 +61,15 @@ public:
   _miu_output(std::move(miu_output)), _pred_output(std::move(pred_output)),
   _du_output(std::move(du_output)),
   _cur_stat(State::IDLE), _nxt_stat(State::IDLE),
-  _cur_regs(pc), _nxt_regs(pc) {}
+  _regs(pc) {}
 
   void sync() override {
     _cur_stat = _nxt_stat;
-    _cur_regs = _nxt_regs;
+    _regs.commit();
   }
-  bool update() override {
-    // debug("IFU");
+  wire_mask_t update() override {
     _nxt_stat = _cur_stat;
-    _nxt_regs = _cur_regs;
+    _regs.restore();
 
     WH_IFU_MIU miu_output{};
     WH_IFU_PRED pred_output{};
@@ -62,41 +77,53 @@ public:
 
     // always be cautious for prediction failure.
     if(_flush_input->is_flush) {
-      _nxt_regs.pc = _flush_input->pc;
-      _nxt_regs.queue.clear();
+      _regs.nxt().pc = _flush_input->pc;
+      _regs.nxt().queue.clear();
+      _regs.nxt().block = {};
       // Then fetch new instr
       miu_output.is_valid = true;
-      miu_output.pc = _nxt_regs.pc;
+      miu_output.pc = _regs.nxt().pc;
       _nxt_stat = State::IDLE;
     } else {
+      const auto &queue = _regs.nxt().queue; // for reading
 
-      assert(_nxt_regs.queue.size() < 2 || _nxt_regs.queue.front().instr_addr != _nxt_regs.queue.back().instr_addr);
+      assert(queue.size() < 2 || queue.front().instr_addr != queue.back().instr_addr);
 
-      // send...
-      // pc not valid when handling br/jmp
-      if(_nxt_stat == State::IDLE && !_nxt_regs.queue.full() && (
-        _nxt_regs.queue.empty() || _nxt_regs.queue.front().instr_addr != _nxt_regs.pc)) {
-        miu_output.is_valid = true;
-        miu_output.pc = _nxt_regs.pc;
-        }
+      auto &block = _regs.nxt().block;
+      // fetch block reply has came. Only asked for once the last one is used up.
+      if(_miu_input->is_valid) {
+        block.raw_instrs = _miu_input->raw_instrs;
+        block.addr = _miu_input->instr_addr;
+        block.pos = 0;
+        block.cnt = _miu_input->instr_cnt;
+      }
+      if(_nxt_stat == State::HANDLE_BR_JMP && _pred_input->is_valid) {
+        _regs.nxt().pc = _pred_input->pred_pc;
+        _regs.nxt().queue.back().next_pc = _regs.nxt().pc;
+        _regs.nxt().queue.back().next_pc_ready = true;
+        _nxt_stat = State::IDLE;
+      }
 
-      if(_miu_input->is_valid && !_nxt_regs.queue.full()) {
-        // fetch instr reply has came.
-        raw_instr_t raw_instr = _miu_input->raw_instr;
-        mem_ptr_t instr_addr = _miu_input->instr_addr;
+      // pre-decode and queue the block while the pc goes through it: up to a jump, a br/jalr the predictor
+      // is asked about, a full queue, or the instruction at the front once more (a loop in the block).
+      while(_nxt_stat == State::IDLE && in_block() && !queue.full() &&
+        (queue.empty() || queue.front().instr_addr != _regs.nxt().pc)) {
+        raw_instr_t raw_instr = block.raw_instrs[block.pos++];
+        mem_ptr_t instr_addr = block.addr;
+        block.addr += 4;
 
         Entry entry{
           .raw_instr = raw_instr,
           .instr_addr = instr_addr,
           .next_pc_ready = false
         };
-        _nxt_regs.queue.push(entry);
+        _regs.nxt().queue.push(entry);
 
         Instruction instr{raw_instr};
         if(instr.is_jal()) {
-          _nxt_regs.pc = instr_addr + instr.imm();
-          _nxt_regs.queue.back().next_pc = _nxt_regs.pc;
-          _nxt_regs.queue.back().next_pc_ready = true;
+          _regs.nxt().pc = instr_addr + instr.imm();
+          _regs.nxt().queue.back().next_pc = _regs.nxt().pc;
+          _regs.nxt().queue.back().next_pc_ready = true;
           _nxt_stat = State::IDLE;
         } else if(instr.is_jalr() || instr.is_br()) {
           pred_output.is_valid = true;
@@ -105,45 +132,61 @@ public:
           pred_output.is_jalr = instr.is_jalr();
           _nxt_stat = State::HANDLE_BR_JMP;
         } else {
-          _nxt_regs.pc = instr_addr + 4;
-          _nxt_regs.queue.back().next_pc = _nxt_regs.pc;
-          _nxt_regs.queue.back().next_pc_ready = true;
+          _regs.nxt().pc = instr_addr + 4;
+          _regs.nxt().queue.back().next_pc = _regs.nxt().pc;
+          _regs.nxt().queue.back().next_pc_ready = true;
           _nxt_stat = State::IDLE;
         }
       }
-      if(_nxt_stat == State::HANDLE_BR_JMP && _pred_input->is_valid) {
-        _nxt_regs.pc = _pred_input->pred_pc;
-        _nxt_regs.queue.back().next_pc = _nxt_regs.pc;
-        _nxt_regs.queue.back().next_pc_ready = true;
-        _nxt_stat = State::IDLE;
-      }
 
-      if(_du_input->can_accept_req && !_nxt_regs.queue.empty() && _nxt_regs.queue.front().next_pc_ready) {
-        auto &entry = _nxt_regs.queue.front();
+      if(_du_input->can_accept_req && !queue.empty() && queue.front().next_pc_ready) {
+        const auto &entry = queue.front();
         du_output.is_valid = true;
         du_output.raw_instr = entry.raw_instr;
         du_output.instr_addr = entry.instr_addr;
         du_output.pred_pc = entry.next_pc;
-        _nxt_regs.queue.pop();
+        _regs.nxt().queue.pop();
       }
-    }
 
-    bool update_signal = false;
-    if(*_miu_output != miu_output) {
-      *_miu_output = miu_output;
-      update_signal = true;
-    }
-    if(*_pred_output != pred_output) {
-      *_pred_output = pred_output;
-      update_signal = true;
-    }
-    if(*_du_output != du_output) {
-      *_du_output = du_output;
-      update_signal = true;
+      // send, for the state this cycle leaves: the fetch after a reply goes out in the reply cycle.
+      // pc not valid when handling br/jmp
+      if(_nxt_stat == State::IDLE && !in_block() && !queue.full() && (
+        queue.empty() || queue.front().instr_addr != _regs.nxt().pc)) {
+        miu_output.is_valid = true;
+        miu_output.pc = _regs.nxt().pc;
+      }
     }
+
+    wire_mask_t update_signal = 0;
+    if(_miu_output->drive(miu_output)) update_signal |= 1 << 0;
+    if(_pred_output->drive(pred_output)) update_signal |= 1 << 1;
+    if(_du_output->drive(du_output)) update_signal |= 1 << 2;
     return update_signal;
   }
 
+  bool stable() const override { return _regs.stable() && _nxt_stat == _cur_stat; }
+  void save(CheckpointWriter &out) const override {
+    out.pod(_regs.cur());
+    out.pod(_cur_stat);
+  }
+  void load(CheckpointReader &in) override {
+    Registers regs = _regs.cur();
+    in.pod(regs);
+    _regs.reset(regs);
+    _cur_stat = _nxt_stat = in.pod<State>();
+  }
+
+  // fetch from pc instead. Before the first cycle only.
+  void reset(mem_ptr_t pc) { _regs.reset(Registers(pc)); }
+
+  ModulePorts ports() const override {
+    return {
+      .name = "IFU",
+      .inputs = {_miu_input.get(), _pred_input.get(), _flush_input.get(), _du_input.get()},
+      .outputs = {_miu_output.get(), _pred_output.get(), _du_output.get()}
+    };
+  }
+
 private:
   const std::shared_ptr<const WH_MIU_IFU> _miu_input;
   const std::shared_ptr<const WH_PRED_IFU> _pred_input;
@@ -153,7 +196,12 @@ private:
   const std::shared_ptr<WH_IFU_PRED> _pred_output;
   const std::shared_ptr<WH_IFU_DU> _du_output;
   State _cur_stat, _nxt_stat;
-  Registers _cur_regs, _nxt_regs;
+  RegisterBuffer<Registers> _regs;
+
+  bool in_block() const {
+    const auto &block = _regs.nxt().block;
+    return block.pos < block.cnt && block.addr == _regs.nxt().pc;
+  }
 };
 
 }
@@ -0,0 +1,413 @@
+#ifndef ISM_JIT_CPU_H
+#define ISM_JIT_CPU_H
+
+#if defined(__x86_64__) && defined(__linux__)
+#define ISM_JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "utility.h"
+#include "instruction.h"
+#include "decode_cache.h"
+
+namespace insomnia {
+
+// Functional model like BCPU that translates basic blocks into x86-64 code, for fast-forwarding.
+// Only built on x86-64 Linux (ISM_JIT_SUPPORTED is defined then).
+//
+// Translated code keeps
+//   r15: the guest registers (Context::regs), r14: guest memory, r13: which words are translated,
+//   r12: the code of the block at each pc / 4 (nullptr if none). eax, ecx, edx are scratch.
+// Guest registers live in memory. Guest memory is the RAMSize bytes from address 0: a load, store
+// or jump outside it faults, and tick() throws.
+// A block leaves through an exit site,
+//   mov eax, next pc; lea rdx, [site]; jmp exit
+// which returns to tick(). tick() translates the next block and turns the site into
+// "jmp next block", so that the next time the blocks are chained without leaving the code.
+// jalr looks its target up in the r12 table and only returns to tick() if it is not translated.
+// A store into translated code leaves the block right after it, and all code is dropped.
+// The code cache is never writable and executable at once: it is made read/write to translate or link,
+// and read/execute again before tick() enters it.
+class JitCPU {
+  static constexpr std::size_t CodeCacheSize = 16 << 20;
+  static constexpr std::size_t MaxBlockLen = 64;
+  static constexpr std::ptrdiff_t MaxBlockCode = MaxBlockLen * 128 + 128; // bytes, upper bound
+
+  // why the code returned. tick() gets (Exit << 32) | pc.
+  enum Exit : uint64_t { Next, Halt, Written, Invalid, Fault };
+
+  struct Context {
+    uint64_t link = 0;    // exit site taken, to be linked. [r15 - 16]
+    uint64_t instret = 0; // [r15 - 8]
+    std::array<mem_val_t, RFSize> regs{};
+  };
+  static_assert(offsetof(Context, regs) - offsetof(Context, link) == 16 &&
+    offsetof(Context, regs) - offsetof(Context, instret) == 8);
+
+  using Entry = uint64_t (*)(mem_val_t *regs, uint8_t *mem, const uint8_t *code_words,
+    uint8_t *const *block_at, const uint8_t *code);
+
+  std::array<uint8_t, RAMSize> _mem{};
+  Context _ctx;
+  clock_t _clk = 0;
+  mem_ptr_t _pc = 0;
+
+  std::vector<uint8_t *> _block_at = std::vector<uint8_t *>(RAMSize / 4);  // by pc / 4
+  std::vector<uint8_t> _code_words = std::vector<uint8_t>(RAMSize / 4); // translated, by address / 4
+
+  uint8_t *_code = nullptr; // the code cache, mmap'd
+  uint8_t *_code_ptr = nullptr;
+  uint8_t *_blocks_begin = nullptr; // after the entry and the exit stub
+  uint8_t *_exit = nullptr;
+  Entry _enter = nullptr;
+  bool _writable = true; // the code cache is read/write now, not read/execute
+
+  mem_val_t read_mem(mem_ptr_t addr, mptr_diff_t data_len) {
+    mem_val_t val = 0;
+    for(size_t i = 0; i < data_len; ++i)
+      val |= static_cast<mem_val_t>(_mem[addr + i]) << (i * 8);
+    return val;
+  }
+  void write_mem(mem_ptr_t addr, mptr_diff_t data_len, mem_val_t val) {
+    if(addr >= RAMSize || RAMSize - addr < data_len) throw std::runtime_error("JitCPU: program out of memory");
+    for(size_t i = 0; i < data_len; ++i)
+      _mem[addr + i] = static_cast<uint8_t>((val >> (i * 8)) & 0xff);
+  }
+
+  /********************* emitter ************************/
+
+  void emit(std::initializer_list<uint8_t> bytes) {
+    for(auto byte: bytes) *_code_ptr++ = byte;
+  }
+  void emit32(uint32_t val) {
+    std::memcpy(_code_ptr, &val, 4);
+    _code_ptr += 4;
+  }
+  void emit64(uint64_t val) {
+    std::memcpy(_code_ptr, &val, 8);
+    _code_ptr += 8;
+  }
+  static uint8_t disp(uint8_t reg) { return static_cast<uint8_t>(reg * 4); }
+
+  void load_eax(uint8_t reg) { emit({0x41, 0x8b, 0x47, disp(reg)}); } // mov eax, [r15 + reg]
+  void load_ecx(uint8_t reg) { emit({0x41, 0x8b, 0x4f, disp(reg)}); } // mov ecx, [r15 + reg]
+  void store_eax(uint8_t reg) { emit({0x41, 0x89, 0x47, disp(reg)}); } // mov [r15 + reg], eax
+  void store_imm(uint8_t reg, uint32_t val) { emit({0x41, 0xc7, 0x47, disp(reg)}); emit32(val); }
+  // opcode: 03 add, 2b sub, 33 xor, 0b or, 23 and, 3b cmp. op eax, [r15 + reg]
+  void op_reg(uint8_t opcode, uint8_t reg) { emit({0x41, opcode, 0x47, disp(reg)}); }
+  // opcode: 05 add, 35 xor, 0d or, 25 and, 3d cmp. op eax, imm32
+  void op_imm(uint8_t opcode, int32_t imm) { emit({opcode}); emit32(imm); }
+  // cc: 9c l, 92 b. setcc al; movzx eax, al
+  void set_eax(uint8_t cc) { emit({0x0f, cc, 0xc0, 0x0f, 0xb6, 0xc0}); }
+  void jmp(const uint8_t *target) {
+    emit({0xe9});
+    emit32(static_cast<uint32_t>(target - (_code_ptr + 4)));
+  }
+  // eax = guest address rs1 + imm of a len-byte access by the instruction at pc.
+  // Out of memory: leave with Fault, not counting it and the undone ones after it.
+  void address(uint8_t rs1, int32_t imm, uint8_t len, mem_ptr_t pc, std::size_t undone) {
+    load_eax(rs1);
+    if(imm) op_imm(0x05, imm);
+    op_imm(0x3d, static_cast<int32_t>(RAMSize - len));
+    emit({0x76, static_cast<uint8_t>(8 + ExitWithLen)}); // jbe on
+    emit({0x49, 0x81, 0x6f, 0xf8}); // sub qword [r15 - 8], undone
+    emit32(static_cast<uint32_t>(undone));
+    exit_with(Fault, pc);
+  }
+
+  static constexpr std::size_t ExitSiteLen = 17;
+  void exit_site(mem_ptr_t next) {
+    uint8_t *site = _code_ptr;
+    emit({0xb8}); // mov eax, next. Becomes jmp rel32 when linked.
+    emit32(next);
+    emit({0x48, 0x8d, 0x15}); // lea rdx, [rip + site]
+    emit32(static_cast<uint32_t>(site - (_code_ptr + 4)));
+    jmp(_exit);
+  }
+  static constexpr std::size_t ExitWithLen = 17;
+  void exit_with(Exit exit, mem_ptr_t pc) {
+    emit({0x48, 0xb8}); // movabs rax, exit << 32 | pc
+    emit64(exit << 32 | pc);
+    emit({0x31, 0xd2}); // xor edx, edx: nothing to link
+    jmp(_exit);
+  }
+
+  void emit_runtime() {
+    _code_ptr = _code;
+    _enter = reinterpret_cast<Entry>(_code_ptr);
+    emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}); // push rbx, rbp, r12 ~ r15
+    emit({0x49, 0x89, 0xff}); // mov r15, rdi
+    emit({0x49, 0x89, 0xf6}); // mov r14, rsi
+    emit({0x49, 0x89, 0xd5}); // mov r13, rdx
+    emit({0x49, 0x89, 0xcc}); // mov r12, rcx
+    emit({0x41, 0xff, 0xe0}); // jmp r8
+    _exit = _code_ptr;
+    emit({0x49, 0x89, 0x57, 0xf0}); // mov [r15 - 16], rdx
+    emit({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3}); // pop ...; ret
+    _blocks_begin = _code_ptr;
+  }
+
+  /********************* translation ************************/
+
+  uint8_t *translate(mem_ptr_t pc) {
+    std::vector<DecodedInstr> instrs;
+    std::size_t cnt = 0; // executed instructions, without halt / invalid
+    for(mem_ptr_t addr = pc; instrs.size() < MaxBlockLen && addr < RAMSize; addr += 4) {
+      _code_words[addr >> 2] = 1;
+      auto &instr = instrs.emplace_back(read_mem(addr, 4));
+      auto type = static_cast<InstrType>(instr.op);
+      if(instr.op == DecodedInstr::Halt || type == InstrType::INVALID) break;
+      ++cnt;
+      if(type == InstrType::JAL || type == InstrType::JALR || (InstrType::BEQ <= type && type <= InstrType::BGEU)) break;
+    }
+    ISM_LOG(BCPU, Debug, "translating {} instructions at {}", instrs.size(), pc);
+
+    uint8_t *code = _code_ptr;
+    if(cnt) { // add qword [r15 - 8], cnt
+      emit({0x49, 0x81, 0x47, 0xf8});
+      emit32(cnt);
+    }
+    std::size_t done = 0;
+    bool left = false;
+    for(auto &instr: instrs) {
+      auto rd = instr.rd, rs1 = instr.rs1, rs2 = instr.rs2;
+      auto imm = instr.imm;
+      if(instr.op == DecodedInstr::Halt) {
+        exit_with(Halt, pc);
+        left = true;
+        break;
+      }
+      ++done;
+      switch(static_cast<InstrType>(instr.op)) {
+      case InstrType::LUI:
+        if(rd) store_imm(rd, imm);
+        break;
+      case InstrType::AUIPC:
+        if(rd) store_imm(rd, pc + imm);
+        break;
+      case InstrType::JAL:
+        if(rd) store_imm(rd, pc + 4);
+        exit_site(pc + imm);
+        left = true;
+        break;
+      case InstrType::JALR:
+        load_eax(rs1);
+        if(imm) op_imm(0x05, imm);
+        op_imm(0x25, ~1);
+        if(rd) store_imm(rd, pc + 4);
+        emit({0xa8, 0x02, 0x75, 0x17});       // test al, 2; jnz miss
+        op_imm(0x3d, static_cast<int32_t>(RAMSize - 4)); // cmp eax, RAMSize - 4
+        emit({0x77, 0x10});                   // ja miss
+        emit({0x89, 0xc2, 0xc1, 0xea, 0x02}); // mov edx, eax; shr edx, 2
+        emit({0x49, 0x8b, 0x14, 0xd4});       // mov rdx, [r12 + rdx * 8]
+        emit({0x48, 0x85, 0xd2, 0x74, 0x02}); // test rdx, rdx; jz miss
+        emit({0xff, 0xe2});                   // jmp rdx
+        emit({0x31, 0xd2});                   // miss: xor edx, edx
+        jmp(_exit);
+        left = true;
+        break;
+      case InstrType::BEQ: case InstrType::BNE: case InstrType::BLT:
+      case InstrType::BGE: case InstrType::BLTU: case InstrType::BGEU: {
+        static constexpr uint8_t jcc[] = {0x74, 0x75, 0x7c, 0x7d, 0x72, 0x73}; // je jne jl jge jb jae
+        load_eax(rs1);
+        op_reg(0x3b, rs2);
+        emit({jcc[instr.op - static_cast<uint8_t>(InstrType::BEQ)], ExitSiteLen});
+        exit_site(pc + 4);
+        exit_site(pc + imm);
+        left = true;
+      } break;
+      case InstrType::LB: case InstrType::LH: case InstrType::LW:
+      case InstrType::LBU: case InstrType::LHU: {
+        if(!rd) break;
+        auto type = static_cast<InstrType>(instr.op);
+        address(rs1, imm, type == InstrType::LW ? 4 : type == InstrType::LH || type == InstrType::LHU ? 2 : 1,
+          pc, cnt - done + 1);
+        switch(type) {
+        case InstrType::LB:  emit({0x41, 0x0f, 0xbe, 0x04, 0x06}); break; // movsx eax, byte [r14 + rax]
+        case InstrType::LH:  emit({0x41, 0x0f, 0xbf, 0x04, 0x06}); break; // movsx eax, word [r14 + rax]
+        case InstrType::LBU: emit({0x41, 0x0f, 0xb6, 0x04, 0x06}); break; // movzx eax, byte [r14 + rax]
+        case InstrType::LHU: emit({0x41, 0x0f, 0xb7, 0x04, 0x06}); break; // movzx eax, word [r14 + rax]
+        default:             emit({0x41, 0x8b, 0x04, 0x06}); break;       // mov eax, [r14 + rax]
+        }
+        store_eax(rd);
+      } break;
+      case InstrType::SB: case InstrType::SH: case InstrType::SW: {
+        auto type = static_cast<InstrType>(instr.op);
+        uint8_t len = type == InstrType::SW ? 4 : type == InstrType::SH ? 2 : 1;
+        address(rs1, imm, len, pc, cnt - done + 1);
+        load_ecx(rs2);
+        switch(type) {
+        case InstrType::SB: emit({0x41, 0x88, 0x0c, 0x06}); break;       // mov [r14 + rax], cl
+        case InstrType::SH: emit({0x66, 0x41, 0x89, 0x0c, 0x06}); break; // mov [r14 + rax], cx
+        default:            emit({0x41, 0x89, 0x0c, 0x06}); break;       // mov [r14 + rax], ecx
+        }
+        // translated code written: leave.
+        emit({0x8d, 0x50, static_cast<uint8_t>(len - 1), 0xc1, 0xea, 0x02}); // lea edx, [rax + len - 1]; shr edx, 2
+        emit({0x41, 0x8a, 0x4c, 0x15, 0x00});                               // mov cl, [r13 + rdx]
+        emit({0x89, 0xc2, 0xc1, 0xea, 0x02});                               // mov edx, eax; shr edx, 2
+        emit({0x41, 0x0a, 0x4c, 0x15, 0x00});                               // or cl, [r13 + rdx]
+        std::size_t rest = cnt - done;
+        emit({0x74, static_cast<uint8_t>((rest ? 8 : 0) + ExitWithLen)});  // jz on
+        if(rest) { // sub qword [r15 - 8], rest
+          emit({0x49, 0x81, 0x6f, 0xf8});
+          emit32(rest);
+        }
+        exit_with(Written, pc + 4);
+      } break;
+      case InstrType::ADDI: case InstrType::XORI: case InstrType::ORI: case InstrType::ANDI:
+      case InstrType::SLTI: case InstrType::SLTIU: {
+        if(!rd) break;
+        load_eax(rs1);
+        switch(static_cast<InstrType>(instr.op)) {
+        case InstrType::ADDI:  op_imm(0x05, imm); break;
+        case InstrType::XORI:  op_imm(0x35, imm); break;
+        case InstrType::ORI:   op_imm(0x0d, imm); break;
+        case InstrType::ANDI:  op_imm(0x25, imm); break;
+        case InstrType::SLTI:  op_imm(0x3d, imm); set_eax(0x9c); break;
+        default:               op_imm(0x3d, imm); set_eax(0x92); break;
+        }
+        store_eax(rd);
+      } break;
+      case InstrType::SLLI: case InstrType::SRLI: case InstrType::SRAI: {
+        if(!rd) break;
+        static constexpr uint8_t modrm[] = {0xe0, 0xe8, 0xf8}; // shl shr sar
+        load_eax(rs1);
+        emit({0xc1, modrm[instr.op - static_cast<uint8_t>(InstrType::SLLI)], static_cast<uint8_t>(imm)});
+        store_eax(rd);
+      } break;
+      case InstrType::SLL: case InstrType::SRL: case InstrType::SRA: {
+        if(!rd) break;
+        load_eax(rs1);
+        load_ecx(rs2); // x86 masks the count to 5 bits, as RV32I does
+        auto type = static_cast<InstrType>(instr.op);
+        emit({0xd3, static_cast<uint8_t>(type == InstrType::SLL ? 0xe0 : type == InstrType::SRL ? 0xe8 : 0xf8)});
+        store_eax(rd);
+      } break;
+      case InstrType::ADD: case InstrType::SUB: case InstrType::XOR: case InstrType::OR:
+      case InstrType::AND: case InstrType::SLT: case InstrType::SLTU: {
+        if(!rd) break;
+        load_eax(rs1);
+        switch(static_cast<InstrType>(instr.op)) {
+        case InstrType::ADD: op_reg(0x03, rs2); break;
+        case InstrType::SUB: op_reg(0x2b, rs2); break;
+        case InstrType::XOR: op_reg(0x33, rs2); break;
+        case InstrType::OR:  op_reg(0x0b, rs2); break;
+        case InstrType::AND: op_reg(0x23, rs2); break;
+        case InstrType::SLT: op_reg(0x3b, rs2); set_eax(0x9c); break;
+        default:             op_reg(0x3b, rs2); set_eax(0x92); break;
+        }
+        store_eax(rd);
+      } break;
+      case InstrType::INVALID:
+        exit_with(Invalid, pc);
+        left = true;
+        break;
+      }
+      if(left) break;
+      pc += 4;
+    }
+    if(!left) exit_site(pc); // the block is full
+    return code;
+  }
+
+  // drops all translated code.
+  void flush() {
+    ISM_LOG(BCPU, Debug, "dropping {} bytes of code", _code_ptr - _blocks_begin);
+    _code_ptr = _blocks_begin;
+    std::fill(_block_at.begin(), _block_at.end(), nullptr);
+    std::fill(_code_words.begin(), _code_words.end(), 0);
+    _ctx.link = 0;
+  }
+
+  void protect(bool writable) {
+    if(_writable == writable) return;
+    if(mprotect(_code, CodeCacheSize, PROT_READ | (writable ? PROT_WRITE : PROT_EXEC)) != 0)
+      throw std::runtime_error("JitCPU: cannot protect the code cache");
+    _writable = writable;
+  }
+
+  uint8_t *block_at(mem_ptr_t pc) {
+    if(pc >= RAMSize || pc & 0b11) throw std::runtime_error("JitCPU: pc out of memory or unaligned");
+    auto &code = _block_at[pc >> 2];
+    if(!code) {
+      protect(true);
+      if(_code + CodeCacheSize - _code_ptr < MaxBlockCode) flush();
+      code = translate(pc);
+    }
+    return code;
+  }
+
+  // exit site -> jmp target
+  void link(uint8_t *site, const uint8_t *target) {
+    protect(true);
+    auto rel = static_cast<uint32_t>(target - (site + 5));
+    std::memcpy(site + 1, &rel, 4);
+    site[0] = 0xe9;
+  }
+
+public:
+  JitCPU() {
+    void *code = mmap(nullptr, CodeCacheSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) throw std::runtime_error("JitCPU: cannot map the code cache");
+    _code = static_cast<uint8_t *>(code);
+    emit_runtime();
+  }
+  JitCPU(const JitCPU &) = delete;
+  JitCPU &operator=(const JitCPU &) = delete;
+  ~JitCPU() { munmap(_code, CodeCacheSize); }
+
+  // via std::cin by default. Pre-assumed the input style.
+  void preload_program(std::istream &is = std::cin) {
+    load_hex_program(is, [this](raw_instr_t raw_instr, mem_ptr_t addr) { write_mem(addr, 4, raw_instr); });
+  }
+
+  mem_val_t get_ret() const {
+    return _ctx.regs[10] & 0xff;
+  }
+  mem_val_t get_reg(int i) const { return _ctx.regs[i]; }
+
+  std::pair<uint32_t, uint32_t> pred_stat() const { return {-1, -1}; }
+
+  clock_t cycles() const { return _clk; }
+  uint64_t instructions() const { return _ctx.instret; }
+
+  bool tick() {
+    uint8_t *code = block_at(_pc);
+    if(_ctx.link) {
+      link(reinterpret_cast<uint8_t *>(_ctx.link), code);
+      _ctx.link = 0;
+    }
+    protect(false);
+    uint64_t res = _enter(_ctx.regs.data(), _mem.data(), _code_words.data(), _block_at.data(), code);
+    _pc = static_cast<mem_ptr_t>(res);
+    switch(static_cast<Exit>(res >> 32)) {
+    case Next:
+      return true;
+    case Written:
+      flush();
+      return true;
+    case Halt:
+      return false;
+    case Fault:
+      throw std::runtime_error("JitCPU: memory access out of range at pc " + std::to_string(_pc));
+    case Invalid:
+      break;
+    }
+    throw std::runtime_error("Invalid operation");
+  }
+};
+
+}
+
+#endif // defined(__x86_64__) && defined(__linux__)
+
+#endif // ISM_JIT_CPU_H
@@ -5,13 +5,14 @@
 #include <unordered_map>
 
 #include "common.h"
-#include "circular_queue.h"
+#include "checkpoint.h"
+#include "ring_buffer.h"
 #include "wire_harness.h"
 
 namespace insomnia {
 
 template <std::size_t BufSize>
-class LoadStoreBuffer : public CPUModule {
+class LoadStoreBuffer final : public CPUModule {
   struct Entry {
     bool is_valid = false;
     bool is_load = false;
@@ -26,19 +27,17 @@ class LoadStoreBuffer : public CPUModule {
     rob_index_t data_index;
     mem_val_t data_value;
 
-    bool miu_request_sent = false;
+    bool miu_request_sent = false; // a load waiting for the D-cache
     bool is_executed = false;
     bool is_committed = false;
     bool is_finished = false;
+    bool operator==(const Entry &) const = default;
   };
 
   struct Registers {
-    circular_queue<Entry, BufSize> entries;
+    ring_buffer<Entry, BufSize> entries;
 
-    bool load_sent = false;
-    bool store_sent = false;
-
-    std::size_t load_index;
+    bool store_sent = false; // the front store, until the D-cache has it
     std::size_t store_index;
 
     bool accept_data = false;
@@ -49,6 +48,20 @@ class LoadStoreBuffer : public CPUModule {
 
     mem_val_t data_ack;
     mem_ptr_t addr_ack;
+
+    // keep in line with the fields above.
+    void restore_from(const Registers &other) {
+      entries.restore_from(other.entries);
+      store_sent = other.store_sent;
+      store_index = other.store_index;
+      accept_data = other.accept_data;
+      accept_addr = other.accept_addr;
+      data_index = other.data_index;
+      addr_index = other.addr_index;
+      data_ack = other.data_ack;
+      addr_ack = other.addr_ack;
+    }
+    bool operator==(const Registers &) const = default;
   };
 
 public:
@@ -66,57 +79,48 @@ public:
     _rob_input(std::move(rob_input)), _flush_input(std::move(flush_input)),
     _data_input(std::move(data_input)), _rob_output(std::move(rob_output)),
     _miu_output(std::move(miu_output)), _data_output(std::move(data_output)),
-    _cur_regs(), _nxt_regs() {}
+    _regs() {}
 
   void sync() override {
-    _cur_regs = _nxt_regs;
+    _regs.commit();
   }
 
-  bool update() override {
-    // debug("LSB");
-    _nxt_regs = _cur_regs;
+  wire_mask_t update() override {
+    _regs.restore();
 
     WH_LSB_ROB rob_output{};
     WH_LSB_MIU miu_output{};
     WH_LSB_CDB data_output{};
-    _nxt_regs.load_sent = false;
-    _nxt_regs.store_sent = false;
+    const auto &entries = _regs.nxt().entries; // for reading
+    rob_output.is_full = _regs.cur().entries.full();
 
-    // flush
+    // flush. Committed stores stay, and so does the one the D-cache is taking.
     if(_flush_input->is_flush) {
-      while(!_nxt_regs.entries.empty() && !_nxt_regs.entries.back().is_committed) {
-        _nxt_regs.entries.pop_back();
+      while(!entries.empty() && !entries.back().is_committed) {
+        _regs.nxt().entries.pop_back();
       }
+      store_reply();
+      while(!entries.empty() && entries.front().is_finished) _regs.nxt().entries.pop();
 
-      _nxt_regs.load_sent = false;
-      _nxt_regs.store_sent = false;
-      _nxt_regs.accept_addr = false;
-      _nxt_regs.accept_data = false;
+      _regs.nxt().accept_addr = false;
+      _regs.nxt().accept_data = false;
 
-      bool update_signal = false;
+      wire_mask_t update_signal = 0;
 
-      if(*_rob_output != rob_output) {
-        *_rob_output = rob_output;
-        update_signal = true;
-      }
+      if(_rob_output->drive(rob_output)) update_signal |= 1 << 0;
 
-      if(*_miu_output != miu_output) {
-        *_miu_output = miu_output;
-        update_signal = true;
-      }
+      if(_miu_output->drive(miu_output)) update_signal |= 1 << 1;
 
-      if(*_data_output != data_output) {
-        *_data_output = data_output;
-        update_signal = true;
-      }
+      if(_data_output->drive(data_output)) update_signal |= 1 << 2;
 
       return update_signal;
     }
 
-    // add entry
-    if(_du_input->is_valid && !_nxt_regs.entries.full()) {
-      debug("LSB: " + std::to_string(_du_input->rob_index));
-      _nxt_regs.entries.push(Entry{
+    // add entry. The ROB has made sure there is room; a full buffer here means
+    // the request is stale and the DU is yet to be evaluated this cycle.
+    if(_du_input->is_valid && !entries.full()) {
+      ISM_LOG(LSB, Trace, "new entry for rob idx {}", _du_input->rob_index);
+      _regs.nxt().entries.push(Entry{
         .is_valid = true,
         .is_load = _du_input->is_load,
         .is_store = _du_input->is_store,
@@ -133,12 +137,11 @@ public:
 
     // data load reply
     if(_miu_input->is_load_reply) {
-      auto &entry = _nxt_regs.entries.at(_cur_regs.load_index);
-      // might be forwarded in waiting load reply
+      auto &entry = _regs.nxt().entries.at(_miu_input->index);
+      entry.miu_request_sent = false;
       if(!entry.data_ready) {
-        debug("LSB: loaded " + std::to_string(_miu_input->value) +
-          " at " + std::to_string(entry.addr_value) + " for rob idx "
-          + std::to_string(entry.rob_index));
+        ISM_LOG(LSB, Debug, "loaded {} at {} for rob idx {}",
+          _miu_input->value, entry.addr_value, entry.rob_index);
         entry.data_value = _miu_input->value;
         entry.data_ready = true;
         entry.is_executed = true;
@@ -147,65 +150,66 @@ public:
           .rob_index = entry.rob_index,
           .value = entry.data_value,
         };
-        _nxt_regs.load_sent = false;
       }
     }
+    // not taken: sent again below.
+    if(_miu_input->is_retry && !_miu_input->retry_store)
+      _regs.nxt().entries.at(_miu_input->retry_index).miu_request_sent = false;
 
-    if(_cur_regs.accept_addr) {
-      auto &entry = _nxt_regs.entries.at(_cur_regs.addr_index);
+    if(_regs.cur().accept_addr) {
+      auto &entry = _regs.nxt().entries.at(_regs.cur().addr_index);
       entry.addr_ready = true;
-      entry.addr_value = _cur_regs.addr_ack;
+      entry.addr_value = _regs.cur().addr_ack;
     }
 
-    if(_cur_regs.accept_data) {
-      auto &entry = _nxt_regs.entries.at(_cur_regs.data_index);
+    if(_regs.cur().accept_data) {
+      auto &entry = _regs.nxt().entries.at(_regs.cur().data_index);
       entry.data_ready = true;
-      entry.data_value = _cur_regs.data_ack;
+      entry.data_value = _regs.cur().data_ack;
     }
 
-    _nxt_regs.accept_addr = false;
-    _nxt_regs.accept_data = false;
+    _regs.nxt().accept_addr = false;
+    _regs.nxt().accept_data = false;
 
     // cdb data broadcast (store_data_value/addr_value)
     if(_data_input->lsb_entry.is_valid) {
-      for(std::size_t i = 0; i < _nxt_regs.entries.size(); ++i) {
-        auto index = (_nxt_regs.entries.front_index() + i) % BufSize;
-        auto &entry = _nxt_regs.entries.at(index);
+      for(auto it = entries.begin(); it != entries.end(); ++it) {
+        const auto &entry = *it;
         assert(entry.is_valid);
         // store data value (signal: data_index)
         if(entry.is_store && !entry.data_ready && entry.data_index == _data_input->lsb_entry.rob_index) {
-          _nxt_regs.accept_data = true;
-          _nxt_regs.data_ack = _data_input->lsb_entry.value;
-          _nxt_regs.data_index = index;
+          _regs.nxt().accept_data = true;
+          _regs.nxt().data_ack = _data_input->lsb_entry.value;
+          _regs.nxt().data_index = it.index();
         }
       }
     }
     if(_data_input->alu_entry.is_valid) {
-      for(std::size_t i = 0; i < _nxt_regs.entries.size(); ++i) {
-        auto index = (_nxt_regs.entries.front_index() + i) % BufSize;
-        auto &entry = _nxt_regs.entries.at(index);
+      for(auto it = entries.begin(); it != entries.end(); ++it) {
+        const auto &entry = *it;
         assert(entry.is_valid);
         // store data value (signal: data_index)
         if(entry.is_store && !entry.data_ready && entry.data_index == _data_input->alu_entry.rob_index) {
-          _nxt_regs.accept_data = true;
-          _nxt_regs.data_ack = _data_input->alu_entry.value;
-          _nxt_regs.data_index = index;
+          _regs.nxt().accept_data = true;
+          _regs.nxt().data_ack = _data_input->alu_entry.value;
+          _regs.nxt().data_index = it.index();
         }
         // l/s addr value (signal: rob_index, from_alu)
         // from_alu is used in filtering the signal called by itself.
         if(!entry.addr_ready && entry.rob_index == _data_input->alu_entry.rob_index) {
-          _nxt_regs.accept_addr = true;
-          _nxt_regs.addr_ack = _data_input->alu_entry.value;
-          _nxt_regs.addr_index = index;
+          _regs.nxt().accept_addr = true;
+          _regs.nxt().addr_ack = _data_input->alu_entry.value;
+          _regs.nxt().addr_index = it.index();
         }
       }
     }
 
-    // rob commission
+    // rob commission. Committed stores waiting for the D-cache have given their rob index back:
+    // it may be in use again.
     if(_rob_input->is_valid) {
-      for(std::size_t i = 0; i < _nxt_regs.entries.size(); ++i) {
-        auto &entry = _nxt_regs.entries.at((_nxt_regs.entries.front_index() + i) % BufSize);
-        if(entry.rob_index == _rob_input->rob_index) {
+      for(auto it = entries.begin(); it != entries.end(); ++it) {
+        if(!it->is_committed && it->rob_index == _rob_input->rob_index) {
+          auto &entry = _regs.nxt().entries.at(it.index());
           entry.is_committed = true;
           if(entry.is_load) {
             entry.is_finished = true;
@@ -215,106 +219,116 @@ public:
       }
     }
 
-    // data forward & execute load
-    for(std::size_t i = 0; i < _nxt_regs.entries.size(); ++i) {
-      auto &entry = _nxt_regs.entries.at((_nxt_regs.entries.front_index() + i) % BufSize);
-      assert(entry.is_valid);
-      // data output invalidness: broadcast one data per cycle.
-      if(entry.is_load && !entry.data_ready && !data_output.entry.is_valid) {
-        bool has_reliance = false;
-        for(std::size_t j = i; j > 0; --j) {
-          auto& older_entry = _nxt_regs.entries.at((_nxt_regs.entries.front_index() + j - 1) % BufSize);
-          if(older_entry.is_valid && older_entry.is_store && older_entry.addr_value == entry.addr_value) {
-            has_reliance = true;
-            if(older_entry.data_ready && older_entry.data_len == entry.data_len) {
-              entry.data_value = older_entry.data_value;
-              entry.data_ready = true;
-              entry.is_executed = true;
-              data_output.entry = CDBEntry{
-                .is_valid = true,
-                .rob_index = entry.rob_index,
-                .value = entry.data_value,
-              };
-            }
-            // only forward the latest one
-            break;
-          }
-        }
-
-        if(entry.addr_ready && !has_reliance && !_cur_regs.load_sent) {
-          // load now.
-          miu_output = WH_LSB_MIU{
-            .is_load_request = true,
-            .addr = entry.addr_value,
-            .data_len = entry.data_len
-          };
-          _nxt_regs.load_sent = true;
-          _nxt_regs.load_index = (_nxt_regs.entries.front_index() + i) % BufSize;
-        }
-        // only one at a time
-        break;
-      }
-    }
-
     // inform ROB
-    for(std::size_t i = 0; i < _nxt_regs.entries.size(); ++i) {
-      auto &entry = _nxt_regs.entries.at((_nxt_regs.entries.front_index() + i) % BufSize);
-      if(entry.is_store && !entry.is_executed && entry.addr_ready && entry.data_ready) {
-        entry.is_executed = true;
-        rob_output.is_valid = true;
+    for(auto it = entries.begin(); it != entries.end(); ++it) {
+      if(const auto &entry = *it;
+        entry.is_store && !entry.is_executed && entry.addr_ready && entry.data_ready) {
+        _regs.nxt().entries.at(it.index()).is_executed = true;
+        rob_output.is_store_ready = true;
         rob_output.rob_index = entry.rob_index;
         break; // only notify one
       }
     }
 
     // execute committed store
-    if(!_nxt_regs.entries.empty()) {
-      auto &entry = _nxt_regs.entries.front();
-      if(entry.is_store && entry.is_executed && entry.is_committed) {
-        if(!_cur_regs.store_sent) {
+    store_reply();
+    if(!entries.empty()) {
+      const auto &entry = entries.front();
+      if(entry.is_store && entry.is_executed && entry.is_committed && !entry.is_finished) {
+        if(!_regs.nxt().store_sent) {
           miu_output = WH_LSB_MIU{
             .is_store_request = true,
             .addr = entry.addr_value,
             .value = entry.data_value,
-            .data_len = entry.data_len
+            .data_len = entry.data_len,
+            .index = static_cast<uint32_t>(entries.front_index())
           };
-          // inform MIU
-          _nxt_regs.store_sent = true;
-          _nxt_regs.store_index = _nxt_regs.entries.front_index();
+          // inform D-cache
+          _regs.nxt().store_sent = true;
+          _regs.nxt().store_index = entries.front_index();
         }
       }
     }
 
-    if(_miu_input->is_store_reply) {
-      auto &entry = _nxt_regs.entries.at(_nxt_regs.store_index);
-      entry.is_finished = true;
-      _nxt_regs.store_sent = false;
+    // data forward & execute load: the oldest one not sent, if a store is not being sent.
+    // Loads go on while older ones wait for the D-cache.
+    for(auto it = entries.begin(); it != entries.end(); ++it) {
+      assert(it->is_valid);
+      if(!it->is_load || it->data_ready || it->miu_request_sent) continue;
+      auto &entry = _regs.nxt().entries.at(it.index());
+      bool has_reliance = false;
+      for(auto older = it; older != entries.begin(); ) {
+        const auto &older_entry = *--older;
+        // a store of unknown address may write anything: wait for it too.
+        if(older_entry.is_valid && older_entry.is_store && (!older_entry.addr_ready ||
+          (older_entry.addr_value < entry.addr_value + entry.data_len &&
+           entry.addr_value < older_entry.addr_value + older_entry.data_len))) {
+          has_reliance = true;
+          // data output invalidness: broadcast one data per cycle.
+          if(entry.addr_ready && older_entry.addr_ready && older_entry.addr_value == entry.addr_value &&
+            older_entry.data_ready && older_entry.data_len == entry.data_len && !data_output.entry.is_valid) {
+            entry.data_value = older_entry.data_value;
+            entry.data_ready = true;
+            entry.is_executed = true;
+            data_output.entry = CDBEntry{
+              .is_valid = true,
+              .rob_index = entry.rob_index,
+              .value = entry.data_value,
+            };
+          }
+          // only forward the latest one
+          break;
+        }
+      }
+
+      if(entry.addr_ready && !has_reliance && !miu_output.is_store_request) {
+        // load now.
+        miu_output = WH_LSB_MIU{
+          .is_load_request = true,
+          .addr = entry.addr_value,
+          .data_len = entry.data_len,
+          .index = static_cast<uint32_t>(it.index())
+        };
+        entry.miu_request_sent = true;
+      }
+      // only one at a time
+      break;
     }
 
-    while(_nxt_regs.entries.size() > 0) {
-      auto &entry = _nxt_regs.entries.front();
-      if(entry.is_finished) {
-        _nxt_regs.entries.pop();
+    while(entries.size() > 0) {
+      if(entries.front().is_finished) {
+        _regs.nxt().entries.pop();
       } else break;
     }
 
-    bool update_signal = false;
+    wire_mask_t update_signal = 0;
 
-    if(*_rob_output != rob_output) {
-      *_rob_output = rob_output;
-      update_signal = true;
-    }
-    if(*_miu_output != miu_output) {
-      *_miu_output = miu_output;
-      update_signal = true;
-    }
-    if(*_data_output != data_output) {
-      *_data_output = data_output;
-      update_signal = true;
-    }
+    if(_rob_output->drive(rob_output)) update_signal |= 1 << 0;
+    if(_miu_output->drive(miu_output)) update_signal |= 1 << 1;
+    if(_data_output->drive(data_output)) update_signal |= 1 << 2;
     return update_signal;
   }
 
+  bool stable() const override { return _regs.stable(); }
+  void save(CheckpointWriter &out) const override { out.pod(_regs.cur()); }
+  void load(CheckpointReader &in) override { _regs.reset(in.pod<Registers>()); }
+
+  // whether committed stores are still on their way to memory.
+  bool stores_pending() const {
+    for(const auto &entry: _regs.cur().entries)
+      if(entry.is_store && entry.is_committed) return true;
+    return false;
+  }
+
+  ModulePorts ports() const override {
+    return {
+      .name = "LSB",
+      .inputs = {_miu_input.get(), _du_input.get(), _rob_input.get(), _flush_input.get(), _data_input.get()},
+      .outputs = {_rob_output.get(), _miu_output.get(), _data_output.get()},
+      .registered = {_data_input.get()}
+    };
+  }
+
 private:
   const std::shared_ptr<const WH_MIU_LSB> _miu_input;
   const std::shared_ptr<const WH_DU_LSB> _du_input;
@@ -326,7 +340,16 @@ private:
   const std::shared_ptr<WH_LSB_MIU> _miu_output;
   const std::shared_ptr<WH_LSB_CDB> _data_output;
 
-  Registers _cur_regs, _nxt_regs;
+  RegisterBuffer<Registers> _regs;
+
+  // the D-cache has taken the front store, or tells it to send it again.
+  void store_reply() {
+    if(_miu_input->is_store_reply) {
+      _regs.nxt().entries.at(_regs.nxt().store_index).is_finished = true;
+      _regs.nxt().store_sent = false;
+    }
+    if(_miu_input->is_retry && _miu_input->retry_store) _regs.nxt().store_sent = false;
+  }
 };
 
 }
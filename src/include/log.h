@@ -0,0 +1,206 @@
+#ifndef ISM_LOG_H
+#define ISM_LOG_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include "spsc_ring.h"
+
+// Leveled, per-module logging.
+//   ISM_LOG(LSB, Debug, "loaded {} at {}", value, addr);
+// Levels below ISM_LOG_LEVEL are compiled out. The others are checked against the runtime level
+// of the module (Off unless set, see configure_log()). Either way the arguments are not evaluated
+// unless the record is taken.
+// A taken record is stored in binary form (format string pointer and up to MaxArgs integers or
+// string literals) in a lock-free ring, and formatted by a background thread.
+// Records come from the simulation thread only.
+
+// 0 Trace, 1 Debug, 2 Info, 3 Warn, 4 Error, 5 Off. Set by the CMake cache variable of the same name.
+#ifndef ISM_LOG_LEVEL
+#define ISM_LOG_LEVEL 5
+#endif
+
+#define ISM_LOG(module, level, ...) \
+  do { \
+    if constexpr(::insomnia::LogLevel::level >= ::insomnia::CompiledLogLevel) \
+      if(::insomnia::log_enabled(::insomnia::LogModule::module, ::insomnia::LogLevel::level)) \
+        ::insomnia::Logger::instance().write(::insomnia::LogModule::module, ::insomnia::LogLevel::level, __VA_ARGS__); \
+  } while(false)
+
+namespace insomnia {
+
+enum class LogLevel : uint8_t { Trace, Debug, Info, Warn, Error, Off };
+enum class LogModule : uint8_t { CPU, SCHED, MIU, IFU, DU, ROB, RS, ALU, LSB, CDB, PRED, RF, IC, DC, BCPU, Count };
+
+constexpr LogLevel CompiledLogLevel = static_cast<LogLevel>(ISM_LOG_LEVEL);
+
+inline constexpr const char *LogLevelNames[] = {"trace", "debug", "info", "warn", "error", "off"};
+inline constexpr const char *LogModuleNames[] = {
+  "CPU", "SCHED", "MIU", "IFU", "DU", "ROB", "RS", "ALU", "LSB", "CDB", "PRED", "RF", "IC", "DC", "BCPU"
+};
+static_assert(std::size(LogModuleNames) == static_cast<std::size_t>(LogModule::Count));
+
+inline std::array<LogLevel, static_cast<std::size_t>(LogModule::Count)> log_levels = [] {
+  std::array<LogLevel, static_cast<std::size_t>(LogModule::Count)> levels;
+  levels.fill(LogLevel::Off);
+  return levels;
+}();
+
+inline bool log_enabled(LogModule module, LogLevel level) {
+  return level >= log_levels[static_cast<std::size_t>(module)];
+}
+
+// whether any record can be taken at all.
+inline bool log_active() {
+  return CompiledLogLevel != LogLevel::Off &&
+    std::any_of(log_levels.begin(), log_levels.end(), [](LogLevel level) { return level != LogLevel::Off; });
+}
+
+inline void set_log_level(LogModule module, LogLevel level) {
+  log_levels[static_cast<std::size_t>(module)] = level;
+}
+
+// spec: comma-separated "MODULE=level" items, MODULE may be "all". e.g. "all=info,LSB=trace".
+// Unknown names are ignored. nullptr is allowed (nothing enabled).
+inline void configure_log(const char *spec) {
+  for(; spec && *spec; ) {
+    const char *end = std::strchr(spec, ',');
+    if(!end) end = spec + std::strlen(spec);
+    const char *eq = static_cast<const char *>(std::memchr(spec, '=', end - spec));
+    if(eq) {
+      auto is = [](const char *beg, const char *end, const char *name) {
+        return std::strlen(name) == static_cast<std::size_t>(end - beg) && std::strncmp(beg, name, end - beg) == 0;
+      };
+      for(std::size_t l = 0; l < std::size(LogLevelNames); ++l) {
+        if(!is(eq + 1, end, LogLevelNames[l])) continue;
+        for(std::size_t m = 0; m < std::size(LogModuleNames); ++m)
+          if(is(spec, eq, "all") || is(spec, eq, LogModuleNames[m]))
+            log_levels[m] = static_cast<LogLevel>(l);
+      }
+    }
+    spec = *end ? end + 1 : end;
+  }
+}
+
+class Logger {
+public:
+  static constexpr std::size_t MaxArgs = 6;
+
+  static Logger &instance() {
+    static Logger logger;
+    return logger;
+  }
+
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  ~Logger() {
+    _stop.store(true, std::memory_order_release);
+    _flusher.join();
+  }
+
+  // "{}" in fmt is replaced by the next argument. fmt must be a string literal, and so must
+  // string arguments: only the pointers are kept.
+  template <class ...Args>
+  void write(LogModule module, LogLevel level, const char *fmt, Args ...args) {
+    static_assert(sizeof...(Args) <= MaxArgs, "too many log arguments");
+    static_assert(((std::is_integral_v<Args> || std::is_enum_v<Args> || std::is_same_v<Args, const char *>) && ...),
+      "log arguments must be integers, enums or string literals");
+    Record record{.fmt = fmt, .module = module, .level = level, .argc = sizeof...(Args)};
+    std::size_t i = 0;
+    (record.put(i++, args), ...);
+    while(!_ring.try_push(record)) std::this_thread::yield(); // full: wait for the flusher
+    ++_produced;
+  }
+
+  // returns once everything written so far is out.
+  void flush() {
+    while(_flushed.load(std::memory_order_acquire) < _produced) std::this_thread::yield();
+  }
+
+  // where records go. Call before anything is logged.
+  void redirect(std::ostream &out) { _out = &out; }
+
+private:
+  struct Record {
+    const char *fmt = nullptr;
+    LogModule module;
+    LogLevel level;
+    uint8_t argc = 0;
+    uint8_t str_mask = 0;    // args that are const char *
+    uint8_t signed_mask = 0; // args to be printed as signed
+    uint64_t args[MaxArgs];
+
+    template <class T>
+    void put(std::size_t i, T val) {
+      if constexpr(std::is_same_v<T, const char *>) {
+        str_mask |= 1 << i;
+        args[i] = reinterpret_cast<uintptr_t>(val);
+      } else if constexpr(std::is_enum_v<T>) {
+        put(i, static_cast<std::underlying_type_t<T>>(val));
+      } else {
+        if constexpr(std::is_signed_v<T>) signed_mask |= 1 << i;
+        args[i] = static_cast<uint64_t>(val);
+      }
+    }
+  };
+
+  spsc_ring<Record, 1 << 14> _ring;
+  uint64_t _produced = 0;               // simulation thread only
+  std::atomic<uint64_t> _flushed{0};    // records written out by the flusher
+  std::atomic<bool> _stop{false};
+  std::ostream *_out = &std::cerr;
+  std::thread _flusher;
+
+  Logger() : _flusher([this] { run(); }) {}
+
+  void run() {
+    uint64_t consumed = 0;
+    Record record;
+    std::string batch;
+    for(;;) {
+      bool stop = _stop.load(std::memory_order_acquire); // read first: nothing is pushed after it is set
+      batch.clear();
+      for(std::size_t n = 0; n < 4096 && _ring.try_pop(record); ++n) {
+        format(record, batch);
+        ++consumed;
+      }
+      if(!batch.empty()) {
+        _out->write(batch.data(), static_cast<std::streamsize>(batch.size()));
+        _out->flush();
+        _flushed.store(consumed, std::memory_order_release);
+      } else if(stop) return;
+      else std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  static void format(const Record &record, std::string &out) {
+    out += LogModuleNames[static_cast<std::size_t>(record.module)];
+    out += ' ';
+    out += LogLevelNames[static_cast<std::size_t>(record.level)];
+    out += ": ";
+    std::size_t i = 0;
+    for(const char *p = record.fmt; *p; ++p) {
+      if(p[0] == '{' && p[1] == '}' && i < record.argc) {
+        if(record.str_mask & (1 << i)) out += reinterpret_cast<const char *>(record.args[i]);
+        else if(record.signed_mask & (1 << i)) out += std::to_string(static_cast<int64_t>(record.args[i]));
+        else out += std::to_string(record.args[i]);
+        ++i;
+        ++p;
+      } else out += *p;
+    }
+    out += '\n';
+  }
+};
+
+}
+
+#endif // ISM_LOG_H
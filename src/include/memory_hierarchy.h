@@ -0,0 +1,413 @@
+#ifndef ISM_MEMORY_HIERARCHY_H
+#define ISM_MEMORY_HIERARCHY_H
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <stdexcept>
+
+#include "cache_tags.h"
+#include "checkpoint.h"
+#include "common.h"
+#include "ring_buffer.h"
+
+namespace insomnia {
+
+// Timing of the memory behind the L1 caches. The MIU keeps the data and asks a backend when each L1 line
+// request is answered. A backend has
+//   bool access(id, addr, len, is_write, now); // takes a request of len bytes at addr at the edge now.
+//                                              // false: not now, ask again.
+//   void cancel(id, now);                      // its answer is not wanted any more (a flushed fetch).
+//   void edge(now, done);                      // moves on at the edge now: done(id) for every request
+//                                              // answered in the cycle after.
+//   clock_t next_event(now);                   // the next edge at which edge() has something to do.
+//   bool idle();                               // nothing in flight.
+//   MemoryStat stat();
+//   save(out) / load(in);                      // while idle.
+// A request is looked at by edge() at the edge it is taken, and ids are the requester's: one request
+// of each id at a time.
+
+inline constexpr clock_t MemoryNever = std::numeric_limits<clock_t>::max();
+
+// what a level of the memory hierarchy did: how long its requests took and how many bytes it moved.
+struct MemLevelStat {
+  uint64_t reads = 0, writes = 0;
+  uint64_t bytes = 0;   // moved for them
+  uint64_t latency = 0; // cycles from taking each to answering it, summed
+
+  double avg_latency() const { return reads + writes ? 1.0 * latency / (reads + writes) : 0; }
+  // bytes a cycle, over a run of cycles.
+  double bandwidth(uint64_t cycles) const { return cycles ? 1.0 * bytes / cycles : 0; }
+};
+
+struct L2CacheStat : MemLevelStat {
+  uint64_t hits = 0;
+  uint64_t misses = 0;     // that took an MSHR
+  uint64_t merges = 0;     // misses on a line already missed
+  uint64_t writebacks = 0; // dirty lines written to DRAM
+
+  double hit_rate() const {
+    uint64_t accesses = hits + misses + merges;
+    return accesses ? 1.0 * hits / accesses : 0;
+  }
+};
+
+struct DRAMStat : MemLevelStat {
+  uint64_t row_hits = 0;      // to the open row
+  uint64_t row_misses = 0;    // to a bank with no row open: activate first
+  uint64_t row_conflicts = 0; // to a bank with another row open: precharge and activate first
+  uint64_t bus_cycles = 0;    // the data bus was busy
+
+  double row_hit_rate() const {
+    uint64_t accesses = row_hits + row_misses + row_conflicts;
+    return accesses ? 1.0 * row_hits / accesses : 0;
+  }
+};
+
+// of each level. A level the backend does not have stays at zero.
+struct MemoryStat {
+  L2CacheStat l2;
+  DRAMStat dram;
+};
+
+// Memory answering every request Latency cycles after it is taken, one at a time: the MIU of old.
+// The next request is taken the cycle after the answer, or after the one a cancel() frees it in.
+template <clock_t Latency>
+class FlatMemory {
+  static_assert(Latency >= 1);
+
+public:
+  bool access(uint32_t id, mem_ptr_t, std::size_t len, bool is_write, clock_t now) {
+    if(_busy || now < _free) return false;
+    _busy = true;
+    _id = id;
+    _at = now + Latency;
+    ++(is_write ? _stat.writes : _stat.reads);
+    _stat.bytes += len;
+    _stat.latency += Latency;
+    return true;
+  }
+  void cancel(uint32_t id, clock_t now) {
+    if(_busy && _id == id) _busy = false, _free = now + 1;
+  }
+  template <class F>
+  void edge(clock_t now, F &&done) {
+    if(_busy && _at <= now + 1) {
+      _busy = false;
+      _free = _at + 1;
+      done(_id);
+    }
+  }
+  clock_t next_event(clock_t) const { return _busy ? _at - 1 : MemoryNever; }
+  bool idle() const { return !_busy; }
+  MemoryStat stat() const { return {.dram = _stat}; }
+
+  void save(CheckpointWriter &out) const {
+    out.pod(_free);
+    out.pod(_stat);
+  }
+  void load(CheckpointReader &in) {
+    _busy = false;
+    in.pod(_free);
+    in.pod(_stat);
+  }
+
+private:
+  bool _busy = false;
+  uint32_t _id = 0;
+  clock_t _at = 0;   // the cycle it is answered in
+  clock_t _free = 0; // first edge at which a request can be taken
+  DRAMStat _stat;
+};
+
+// DRAM behind its controller: Banks banks of rows of RowSize bytes, with the row last used left open
+// (open-page policy). Lines of LineSize bytes are read and written whole; consecutive rows are in
+// consecutive banks.
+// Requests wait at the controller, QueueCap of them at most, and are scheduled first-ready
+// first-come-first-served (FR-FCFS): one command a cycle, for the oldest request to an open row of a bank
+// that can take one, or else for the oldest one to a bank that can. Its data is then on the bus,
+// BusWidth bytes a cycle, from
+//   tCAS cycles later on the open row, tRCD + tCAS on a bank with no row open, tRP + tRCD + tCAS on another row,
+// or once the bus is free. A bank takes its next command tCAS before its data is through, so that
+// accesses to an open row stream back to back. A request stays at the controller until its data is through.
+template <std::size_t Banks, std::size_t RowSize, std::size_t LineSize, std::size_t BusWidth,
+  clock_t tRCD, clock_t tCAS, clock_t tRP, std::size_t QueueCap>
+class DRAM {
+  static_assert(RowSize % LineSize == 0 && LineSize % BusWidth == 0, "lines fill rows and bus beats");
+  static_assert(tCAS >= 1);
+  static constexpr clock_t Burst = LineSize / BusWidth;
+
+public:
+  bool full() const { return _size == QueueCap; }
+  bool idle() const { return _size == 0; }
+
+  // a line request at the edge now. Not if full().
+  void push(mem_ptr_t line, bool is_write, clock_t now) {
+    if(full()) throw std::runtime_error("DRAM: request to a full controller");
+    _queue[_size++] = {.line = line, .is_write = is_write, .taken = now};
+  }
+
+  // the edge now: read(line) for every read whose data is through, oldest first, then a command
+  // for the request picked.
+  template <class F>
+  void edge(clock_t now, F &&read) {
+    std::array<mem_ptr_t, QueueCap> lines;
+    std::size_t read_cnt = 0, kept = 0;
+    for(std::size_t i = 0; i < _size; ++i) {
+      const auto &req = _queue[i];
+      if(req.is_issued && req.end <= now) {
+        if(!req.is_write) lines[read_cnt++] = req.line;
+      } else {
+        _queue[kept++] = req;
+      }
+    }
+    _size = kept;
+    for(std::size_t i = 0; i < read_cnt; ++i) read(lines[i]);
+
+    std::size_t pick = _size;
+    for(std::size_t i = 0; i < _size; ++i) {
+      const auto &req = _queue[i];
+      const auto &bank = _banks[bank_of(req.line)];
+      if(req.is_issued || bank.ready > now) continue;
+      if(bank.is_open && bank.row == row_of(req.line)) {
+        pick = i;
+        break;
+      }
+      if(pick == _size) pick = i;
+    }
+    if(pick != _size) issue(_queue[pick], now);
+  }
+
+  clock_t next_event(clock_t now) const {
+    clock_t next = MemoryNever;
+    for(std::size_t i = 0; i < _size; ++i) {
+      const auto &req = _queue[i];
+      next = std::min(next, req.is_issued ? req.end : std::max(_banks[bank_of(req.line)].ready, now + 1));
+    }
+    return next;
+  }
+
+  const DRAMStat &stat() const { return _stat; }
+
+  void save(CheckpointWriter &out) const {
+    out.pod(_banks);
+    out.pod(_bus_free);
+    out.pod(_stat);
+  }
+  void load(CheckpointReader &in) {
+    _size = 0;
+    in.pod(_banks);
+    in.pod(_bus_free);
+    in.pod(_stat);
+  }
+
+private:
+  struct Request {
+    mem_ptr_t line = 0;
+    bool is_write = false;
+    bool is_issued = false;
+    clock_t taken = 0;
+    clock_t end = 0; // once issued: the edge its data is through at
+  };
+  struct Bank {
+    bool is_open = false;
+    mem_ptr_t row = 0;
+    clock_t ready = 0; // first edge it takes a command at
+  };
+  std::array<Request, QueueCap> _queue{}; // oldest first
+  std::size_t _size = 0;
+  std::array<Bank, Banks> _banks{};
+  clock_t _bus_free = 0; // first cycle the bus is free in
+  DRAMStat _stat;
+
+  static std::size_t bank_of(mem_ptr_t line) { return line / RowSize % Banks; }
+  static mem_ptr_t row_of(mem_ptr_t line) { return static_cast<mem_ptr_t>(line / RowSize / Banks); }
+
+  void issue(Request &req, clock_t now) {
+    auto &bank = _banks[bank_of(req.line)];
+    mem_ptr_t row = row_of(req.line);
+    clock_t access = tCAS;
+    if(bank.is_open && bank.row == row) ++_stat.row_hits;
+    else if(bank.is_open) ++_stat.row_conflicts, access += tRP + tRCD;
+    else ++_stat.row_misses, access += tRCD;
+    clock_t start = std::max<clock_t>(now + access, _bus_free);
+    req.is_issued = true;
+    req.end = start + Burst;
+    _bus_free = req.end;
+    bank = {.is_open = true, .row = row, .ready = req.end - tCAS};
+    ISM_LOG(MIU, Trace, "DRAM {} line {}: bank {} row {}, data through at {}",
+      req.is_write ? "write" : "read", req.line, bank_of(req.line), row, req.end);
+    ++(req.is_write ? _stat.writes : _stat.reads);
+    _stat.bytes += LineSize;
+    _stat.latency += req.end - req.taken;
+    _stat.bus_cycles += Burst;
+  }
+};
+
+// Unified L2 cache in front of Memory (a DRAM): Size bytes in lines of LineSize, Ways-way set associative,
+// least recently used line replaced, write-back and write-allocate. It keeps the tags only.
+// One L1 request (a line fill or write-back) is looked up a cycle, oldest first, and answered HitLatency
+// cycles after on a hit. A miss waits for its line in one of MSHRs miss status holding registers, which
+// later misses to the line merge into, and is answered the cycle after the line comes in. Lines are read
+// from DRAM oldest miss first, as the controller has room; the dirty ones they replace are written back.
+// MSHRs is also the number of L1 requests it holds at once.
+template <std::size_t Size, std::size_t Ways, std::size_t LineSize, clock_t HitLatency, std::size_t MSHRs,
+  class Memory>
+class L2Cache {
+  using Tags = CacheTags<Size, Ways, LineSize>;
+  static_assert(HitLatency >= 1);
+  static_assert(MSHRs <= 32, "MSHR targets are a mask of requests");
+
+public:
+  bool access(uint32_t id, mem_ptr_t addr, std::size_t len, bool is_write, clock_t now) {
+    if(Tags::line_of(addr) != Tags::line_of(addr + len - 1))
+      throw std::runtime_error("L2: request across lines");
+    auto it = std::find_if(_requests.begin(), _requests.end(), [](const Request &req) { return !req.is_valid; });
+    if(it == _requests.end()) return false;
+    *it = {.is_valid = true, .is_write = is_write, .id = id, .addr = addr, .len = len, .taken = now};
+    _lookups.push(static_cast<std::size_t>(it - _requests.begin()));
+    return true;
+  }
+  void cancel(uint32_t id, clock_t) {
+    for(auto &req: _requests)
+      if(req.is_valid && req.id == id) req.is_wanted = false;
+  }
+
+  template <class F>
+  void edge(clock_t now, F &&done) {
+    _memory.edge(now, [&](mem_ptr_t line) { fill(line, now); });
+    if(!_lookups.empty() && lookup(_lookups.front(), now)) _lookups.pop();
+    // lines to read: a fill makes room at the controller for the line it writes back.
+    for(;;) {
+      MSHR *oldest = nullptr;
+      for(auto &mshr: _mshrs)
+        if(mshr.is_valid && !mshr.is_sent && (!oldest || mshr.seq < oldest->seq)) oldest = &mshr;
+      if(!oldest || _memory.full()) break;
+      oldest->is_sent = true;
+      _memory.push(oldest->line, false, now);
+    }
+    for(auto &req: _requests)
+      if(req.is_valid && req.is_answered && req.answer_at <= now + 1) {
+        req.is_valid = false;
+        if(req.is_wanted) done(req.id);
+      }
+  }
+
+  clock_t next_event(clock_t now) const {
+    clock_t next = _lookups.empty() ? _memory.next_event(now) : now + 1;
+    for(const auto &req: _requests)
+      if(req.is_valid && req.is_answered) next = std::min(next, req.answer_at - 1);
+    return next;
+  }
+  bool idle() const {
+    return _memory.idle() &&
+      std::none_of(_requests.begin(), _requests.end(), [](const Request &req) { return req.is_valid; });
+  }
+  MemoryStat stat() const { return {.l2 = _stat, .dram = _memory.stat()}; }
+
+  void save(CheckpointWriter &out) const {
+    out.pod(_tags);
+    out.pod(_dirty);
+    out.pod(_stat);
+    _memory.save(out);
+  }
+  void load(CheckpointReader &in) {
+    in.pod(_tags);
+    in.pod(_dirty);
+    in.pod(_stat);
+    _memory.load(in);
+    _requests = {};
+    _lookups.clear();
+    _mshrs = {};
+  }
+
+private:
+  struct Request {
+    bool is_valid = false;
+    bool is_write = false;
+    bool is_wanted = true;
+    bool is_answered = false;
+    uint32_t id = 0;
+    mem_ptr_t addr = 0;
+    std::size_t len = 0;
+    clock_t taken = 0;
+    clock_t answer_at = 0; // the cycle it is answered in
+  };
+  struct MSHR {
+    bool is_valid = false;
+    bool is_sent = false;  // the line is asked for
+    bool is_dirty = false; // a write waits in it
+    mem_ptr_t line = 0;
+    uint32_t targets = 0;  // requests waiting, by their slot
+    uint64_t seq = 0;      // order of the misses
+  };
+  Memory _memory;
+  Tags _tags;
+  std::array<std::array<bool, Ways>, Tags::Sets> _dirty{};
+  std::array<Request, MSHRs> _requests{};
+  ring_buffer<std::size_t, MSHRs> _lookups; // requests (slots) to look up, oldest first
+  std::array<MSHR, MSHRs> _mshrs{};
+  uint64_t _misses = 0;
+  L2CacheStat _stat;
+
+  // false if it has to wait for an MSHR.
+  bool lookup(std::size_t slot, clock_t now) {
+    auto &req = _requests[slot];
+    mem_ptr_t line = Tags::line_of(req.addr);
+    for(auto &mshr: _mshrs)
+      if(mshr.is_valid && mshr.line == line) {
+        ++_stat.merges;
+        mshr.targets |= uint32_t{1} << slot;
+        mshr.is_dirty |= req.is_write;
+        return true;
+      }
+    if(typename Tags::Slot way; _tags.lookup(req.addr, way)) {
+      ++_stat.hits;
+      if(req.is_write) _dirty[way.set][way.way] = true;
+      answer(req, now + HitLatency);
+      return true;
+    }
+    auto mshr = std::find_if(_mshrs.begin(), _mshrs.end(), [](const MSHR &mshr) { return !mshr.is_valid; });
+    if(mshr == _mshrs.end()) return false;
+    ++_stat.misses;
+    ISM_LOG(MIU, Debug, "L2 miss at {}", req.addr);
+    *mshr = {.is_valid = true, .is_dirty = req.is_write, .line = line, .targets = uint32_t{1} << slot, .seq = ++_misses};
+    return true;
+  }
+
+  // the line of an MSHR comes in, in place of the least recently used one.
+  void fill(mem_ptr_t line, clock_t now) {
+    auto mshr = std::find_if(_mshrs.begin(), _mshrs.end(),
+      [line](const MSHR &mshr) { return mshr.is_valid && mshr.line == line; });
+    if(mshr == _mshrs.end()) throw std::runtime_error("L2: fill without a miss");
+    bool evicted;
+    mem_ptr_t victim;
+    auto way = _tags.allocate(line, evicted, victim);
+    if(evicted && _dirty[way.set][way.way]) {
+      ++_stat.writebacks;
+      _memory.push(victim, true, now);
+    }
+    _dirty[way.set][way.way] = mshr->is_dirty;
+    for(std::size_t slot = 0; slot < MSHRs; ++slot)
+      if(mshr->targets >> slot & 1) answer(_requests[slot], now + 1);
+    mshr->is_valid = false;
+  }
+
+  void answer(Request &req, clock_t at) {
+    req.is_answered = true;
+    req.answer_at = at;
+    ++(req.is_write ? _stat.writes : _stat.reads);
+    _stat.bytes += req.len;
+    _stat.latency += at - req.taken;
+  }
+};
+
+// the backend the CPUs are built with. FlatMemory<4> is the fixed-latency memory of before.
+// testcases/dcache_stress keeps the L1s busy enough for its latencies to matter (see CMakeLists.txt).
+using MemoryBackend = L2Cache<L2CacheSize, L2CacheWays, L2CacheLineSize, L2CacheHitLatency, L2CacheMSHRs,
+  DRAM<DRAMBanks, DRAMRowSize, L2CacheLineSize, DRAMBusWidth, DRAMtRCD, DRAMtCAS, DRAMtRP, DRAMQueueSize>>;
+static_assert(L2CacheLineSize >= ICacheLineSize && L2CacheLineSize >= DCacheLineSize, "L1 lines sit in one L2 line");
+
+}
+
+#endif // ISM_MEMORY_HIERARCHY_H
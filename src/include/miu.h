@@ -1,175 +1,173 @@
 #ifndef ISM_MIU_H
 #define ISM_MIU_H
 
+#include "co_module.h"
+#include "checkpoint.h"
+#include "memory_hierarchy.h"
+#include "paged_memory.h"
 #include "wire_harness.h"
 
 namespace insomnia {
 
-// Maybe someone will implement a RAM here.
-
-// memory is in small endian.
-template <std::size_t RAMCap>
-class MemoryInterfaceUnit : public CPUModule {
-  enum class State {
-    IDLE, LSB_LOAD, LSB_STORE, IFU_FETCH
-  };
-  struct Registers {
-    mem_ptr_t addr;
-    mem_val_t value;
-    mptr_diff_t data_len;
-    clock_t clk_delay;
-  };
+// The interface of the L1 caches to the memory hierarchy behind them. The data is here (see paged_memory.h);
+// Memory (see memory_hierarchy.h) tells when each line request is answered.
+template <class Memory>
+class MemoryInterfaceUnit final : public CoModule {
 public:
   MemoryInterfaceUnit(
-    std::shared_ptr<const WH_LSB_MIU> lsb_input,
-    std::shared_ptr<const WH_IFU_MIU> ifu_input,
+    std::shared_ptr<TimingWheel> wheel,
+    std::shared_ptr<const WH_DC_MIU> dc_input,
+    std::shared_ptr<const WH_IC_MIU> ic_input,
     std::shared_ptr<const WH_FLUSH_PIPELINE> flush_input,
-    std::shared_ptr<WH_MIU_IFU> ifu_output,
-    std::shared_ptr<WH_MIU_LSB> lsb_output
+    std::shared_ptr<WH_MIU_IC> ic_output,
+    std::shared_ptr<WH_MIU_DC> dc_output
     ) :
-  _lsb_input(std::move(lsb_input)), _ifu_input(std::move(ifu_input)), _flush_input(std::move(flush_input)),
-  _ifu_output(std::move(ifu_output)), _lsb_output(std::move(lsb_output)),
-  _mem(),
-  _cur_stat(State::IDLE), _nxt_stat(State::IDLE),
-  _cur_regs(), _nxt_regs() {}
-
-  void sync() override {
-    _cur_stat = _nxt_stat;
-    _cur_regs = _nxt_regs;
+  CoModule(std::move(wheel)),
+  _dc_input(std::move(dc_input)), _ic_input(std::move(ic_input)), _flush_input(std::move(flush_input)),
+  _ic_output(std::move(ic_output)), _dc_output(std::move(dc_output)) {
+    spawn<&MemoryInterfaceUnit::serve>();
   }
-  bool update() override {
-    // debug("MIU");
-    _nxt_stat = _cur_stat;
-    _nxt_regs = _cur_regs;
 
-    WH_MIU_IFU ifu_output{};
-    WH_MIU_LSB lsb_output{};
-
-    // No need to handle this?
-    if(_flush_input->is_flush) {
-      // terminate everything.
-      _nxt_stat = State::IDLE;
-      debug("Flushing...");
-
-      bool update_signal = false;
-
-      if(*_ifu_output != ifu_output) {
-        *_ifu_output = ifu_output;
-        update_signal = true;
-      }
-      if(*_lsb_output != lsb_output) {
-        *_lsb_output = lsb_output;
-        update_signal = true;
-      }
-      return update_signal;
-    }
-
-    switch(_cur_stat) {
-    case State::IDLE: {
-      try_process();
-    } break;
-    case State::LSB_LOAD: {
-      if(--_nxt_regs.clk_delay == 0) {
-        lsb_output.is_load_reply = true;
-        lsb_output.value = read_mem(_cur_regs.addr, _cur_regs.data_len);
-        debug("Load data: " + std::to_string(lsb_output.value) + " with data len " + std::to_string(_cur_regs.data_len)
-          + " at address " + std::to_string(_cur_regs.addr));
-        _nxt_stat = State::IDLE;
-        // try_process();
-      }
-    } break;
-    case State::LSB_STORE: {
-      if(--_nxt_regs.clk_delay == 0) {
-        lsb_output.is_store_reply = true;
-        write_mem(_cur_regs.addr, _cur_regs.data_len, _cur_regs.value);
-        debug("Store data: " + std::to_string(_cur_regs.value) + " with data len " + std::to_string(_cur_regs.data_len)
-         + " at address " + std::to_string(_cur_regs.addr));
-        _nxt_stat = State::IDLE;
-        // try_process();
-      }
-    } break;
-    case State::IFU_FETCH: {
-      if(--_nxt_regs.clk_delay == 0) {
-        ifu_output.is_valid = true;
-        ifu_output.raw_instr = static_cast<raw_instr_t>(
-          read_mem(_cur_regs.addr, _cur_regs.data_len));
-        ifu_output.instr_addr = _cur_regs.addr;
-        debug("Load instr: " + std::to_string(ifu_output.raw_instr) + " with data len " + std::to_string(_cur_regs.data_len)
-        + " at address " + std::to_string(_cur_regs.addr));
-        _nxt_stat = State::IDLE;
-        // try_process(); // some duplication race
-      }
-    } break;
-    }
-
-    bool update_signal = false;
-
-    if(*_ifu_output != ifu_output) {
-      *_ifu_output = ifu_output;
-      update_signal = true;
-    }
-    if(*_lsb_output != lsb_output) {
-      *_lsb_output = lsb_output;
-      update_signal = true;
-    }
+  wire_mask_t update() override {
+    wire_mask_t update_signal = 0;
+    // a flush terminates the I-cache fill. The D-cache's requests carry committed stores: they go on.
+    if(_ic_output->drive(_flush_input->is_flush ? WH_MIU_IC{} : _ic_reply)) update_signal |= 1 << 0;
+    if(_dc_output->drive(_dc_reply)) update_signal |= 1 << 1;
     return update_signal;
   }
 
+  MemoryStat stat() const { return _memory.stat(); }
+
   // the offset here does not include InstrOffset
   void preload_program(raw_instr_t raw_instr, std::size_t offset) {
     static_assert(std::is_same_v<raw_instr_t, mem_val_t>);
     write_mem(offset, 4, raw_instr);
   }
 
+  // whole memory, when handing the state over. Not during a cycle.
+  // Lines the D-cache has written since are newer (see DataCache::write_back()).
+  const PagedMemory &memory() const { return _mem; }
+  void load_memory(const PagedMemory &mem) { _mem = mem; }
+
+  void save(CheckpointWriter &out) const override {
+    save_processes();
+    out.memory(_mem);
+    _memory.save(out);
+  }
+  void load(CheckpointReader &in) override {
+    in.memory(_mem);
+    _memory.load(in);
+    _dc_waiting = _ic_waiting = _dc_replying = _ic_replying = false;
+    _ic_reply = {};
+    _dc_reply = {};
+    load_processes();
+  }
+
+  ModulePorts ports() const override {
+    return {
+      .name = "MIU",
+      .inputs = {_flush_input.get()}, // requests are taken at the clock edge, see serve()
+      .outputs = {_ic_output.get(), _dc_output.get()}
+    };
+  }
+
 private:
-  const std::shared_ptr<const WH_LSB_MIU> _lsb_input;
-  const std::shared_ptr<const WH_IFU_MIU> _ifu_input;
+  const std::shared_ptr<const WH_DC_MIU> _dc_input;
+  const std::shared_ptr<const WH_IC_MIU> _ic_input;
   const std::shared_ptr<const WH_FLUSH_PIPELINE> _flush_input;
-  const std::shared_ptr<WH_MIU_IFU> _ifu_output;
-  const std::shared_ptr<WH_MIU_LSB> _lsb_output;
-  std::array<uint8_t, RAMCap> _mem;
-  State _cur_stat, _nxt_stat;
-  Registers _cur_regs, _nxt_regs;
-
-  void try_process() {
-    if(_lsb_input->is_load_request && _lsb_input->is_store_request)
-      throw std::runtime_error("RAM update: Invalid wire harness");
-    _nxt_stat = State::IDLE;
-    if(_lsb_input->is_load_request) {
-      _nxt_regs.addr = _lsb_input->addr;
-      _nxt_regs.data_len = _lsb_input->data_len;
-      _nxt_regs.clk_delay = 3;
-      _nxt_stat = State::LSB_LOAD;
-    } else if(_lsb_input->is_store_request) {
-      _nxt_regs.addr = _lsb_input->addr;
-      _nxt_regs.data_len = _lsb_input->data_len;
-      _nxt_regs.value = _lsb_input->value;
-      _nxt_regs.clk_delay = 3;
-      _nxt_stat = State::LSB_STORE;
-    } else if(_ifu_input->is_valid) {
-      _nxt_regs.addr = _ifu_input->pc;
-      _nxt_regs.data_len = 4; // fixed
-      _nxt_regs.clk_delay = 4;
-      _nxt_stat = State::IFU_FETCH;
+  const std::shared_ptr<WH_MIU_IC> _ic_output;
+  const std::shared_ptr<WH_MIU_DC> _dc_output;
+  PagedMemory _mem;
+  // driven by update() unless flushing.
+  WH_MIU_IC _ic_reply{};
+  WH_MIU_DC _dc_reply{};
+
+  // ids of their requests in Memory.
+  enum Requester : uint32_t { DC, IC };
+  Memory _memory;
+  bool _dc_waiting = false, _ic_waiting = false;   // a request taken, not answered yet
+  bool _dc_replying = false, _ic_replying = false; // the answer is on the wires this cycle
+  bool _dc_fill = false;
+  mem_ptr_t _dc_addr = 0, _ic_addr = 0;
+
+  bool dc_requested() const { return _dc_input->is_fill || _dc_input->is_writeback; }
+  bool ic_requested() const { return !_flush_input->is_flush && _ic_input->is_valid && !_dc_input->hold_ic; }
+  // something for the next edge to take: a new request, or a flush of the I-cache's.
+  bool takes() const {
+    return (dc_requested() && !_dc_waiting && !_dc_replying) || (ic_requested() && !_ic_waiting && !_ic_replying) ||
+      (_flush_input->is_flush && _ic_waiting);
+  }
+  bool idle() const { return !_dc_waiting && !_ic_waiting && !_dc_replying && !_ic_replying && _memory.idle(); }
+
+  // One line request of each cache at a time, the D-cache's first; Memory answers them. A reply is given
+  // for one cycle, and the cache's next request is taken after it.
+  // A flush drops the I-cache's request. The D-cache's carry committed stores: they go on.
+  // An I-cache request waits while the D-cache holds it off (it has a newer copy of the line).
+  // Between requests, it only wakes up when Memory has something to do.
+  Process serve() {
+    for(;;) {
+      if(idle()) {
+        co_await until([this] { return takes(); }, *_flush_input, *_dc_input, *_ic_input).restart_point();
+      } else {
+        clock_t now = _wheel->now();
+        clock_t next = _dc_replying || _ic_replying ? now + 1 : _memory.next_event(now);
+        // no further than the timing wheel sees.
+        co_await until([this] { return takes(); }, *_flush_input, *_dc_input, *_ic_input)
+          .timeout(std::min<clock_t>(next - now, TimingWheel::Horizon - 1));
+      }
+      edge();
     }
   }
-  mem_val_t read_mem(mem_ptr_t addr, mptr_diff_t data_len) {
-    if(addr + data_len > RAMCap)
-      throw std::runtime_error("MIU: Read memory access out of RAM bound");
-    mem_val_t val = 0;
-    for(size_t i = 0; i < data_len; ++i)
-      val |= static_cast<mem_val_t>(_mem[addr + i]) << (i * 8);
-    // debug("MIU: Read " + std::to_string(val) + " with data len " + std::to_string(data_len) +
-    //   " from addr " + std::to_string(addr));
-    return val;
+
+  // everything taken at one clock edge.
+  void edge() {
+    const clock_t now = _wheel->now();
+    if(_flush_input->is_flush && _ic_waiting) _memory.cancel(IC, now), _ic_waiting = false;
+    if(dc_requested() && !_dc_waiting && !_dc_replying) {
+      mem_ptr_t addr = _dc_input->addr;
+      bool is_fill = _dc_input->is_fill;
+      if(_memory.access(DC, addr, DCacheLineSize, !is_fill, now)) {
+        if(!is_fill) {
+          _mem.write_block(addr, _dc_input->line.data(), DCacheLineSize);
+        }
+        _dc_waiting = true;
+        _dc_fill = is_fill;
+        _dc_addr = addr;
+      }
+    }
+    if(ic_requested() && !_ic_waiting && !_ic_replying && _memory.access(IC, _ic_input->addr, ICacheLineSize, false, now)) {
+      _ic_waiting = true;
+      _ic_addr = _ic_input->addr;
+    }
+    if(_dc_replying) _dc_reply = {}, _dc_replying = false;
+    if(_ic_replying) _ic_reply = {}, _ic_replying = false;
+    _memory.edge(now, [this](uint32_t id) {
+      if(id == DC) reply_dc();
+      else reply_ic();
+    });
   }
+
+  void reply_dc() {
+    _dc_waiting = false;
+    _dc_replying = true;
+    // loads down a mispredicted path may ask for anything: pages never written read as zeros.
+    if(_dc_fill) _mem.read_block(_dc_addr, _dc_reply.line.data(), DCacheLineSize);
+    _dc_reply.is_fill = _dc_fill;
+    _dc_reply.is_written = !_dc_fill;
+    ISM_LOG(MIU, Debug, "{} D-cache line at address {}", _dc_fill ? "fill" : "write back", _dc_addr);
+  }
+  void reply_ic() {
+    _ic_waiting = false;
+    _ic_replying = true;
+    _ic_reply.is_fill = true;
+    _ic_reply.addr = _ic_addr;
+    _mem.read_block(_ic_addr, _ic_reply.line.data(), ICacheLineSize);
+    ISM_LOG(MIU, Debug, "fill I-cache line at address {}", _ic_addr);
+  }
+
   void write_mem(mem_ptr_t addr, mptr_diff_t data_len, mem_val_t val) {
-    if(addr + data_len > RAMCap)
-      throw std::runtime_error("MIU: Write memory access out of RAM bound");
-    // debug("MIU: Write " + std::to_string(val) + " with data len " + std::to_string(data_len) +
-    //   " to addr " + std::to_string(addr));
-    for(size_t i = 0; i < data_len; ++i)
-      _mem[addr + i] = static_cast<uint8_t>((val >> (i * 8)) & 0xff);
+    ISM_LOG(MIU, Trace, "write {} with data len {} to addr {}", val, data_len, addr);
+    _mem.write(addr, data_len, val);
   }
 };
 
@@ -0,0 +1,196 @@
+#ifndef ISM_PAGED_MEMORY_H
+#define ISM_PAGED_MEMORY_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include "common.h"
+
+namespace insomnia {
+
+// Pages of the 32-bit address space, each one allocated the first time it is touched: a directory of
+// tables of page pointers, the tables allocated on demand too. An empty one costs its directory only.
+template <class Page>
+class PageTable {
+  static constexpr std::size_t TableBits = 10;
+  static constexpr std::size_t TableSize = std::size_t{1} << TableBits;
+  using Table = std::array<std::unique_ptr<Page>, TableSize>;
+
+public:
+  static constexpr std::size_t PageBits = 12;
+  static constexpr std::size_t Pages = std::size_t{1} << (32 - PageBits);
+
+  PageTable() = default;
+  PageTable(const PageTable &other) {
+    other.for_each([this](uint32_t index, const Page &page) { touch(index) = page; });
+  }
+  PageTable(PageTable &&other) noexcept : _dir(std::move(other._dir)), _count(std::exchange(other._count, 0)) {}
+  PageTable &operator=(const PageTable &other) {
+    if(this != &other) *this = PageTable(other);
+    return *this;
+  }
+  PageTable &operator=(PageTable &&other) noexcept {
+    _dir = std::move(other._dir);
+    _count = std::exchange(other._count, 0);
+    return *this;
+  }
+
+  // nullptr if it was never touched.
+  Page *find(uint32_t index) const {
+    auto &table = _dir[index >> TableBits];
+    return table ? (*table)[index & (TableSize - 1)].get() : nullptr;
+  }
+  // value-initialized when new.
+  Page &touch(uint32_t index) {
+    auto &table = _dir[index >> TableBits];
+    if(!table) table = std::make_unique<Table>();
+    auto &page = (*table)[index & (TableSize - 1)];
+    if(!page) page = std::make_unique<Page>(), ++_count;
+    return *page;
+  }
+
+  // f(index, page) for every page touched, by address.
+  template <class F>
+  void for_each(F &&f) const {
+    for(std::size_t dir = 0; dir < _dir.size(); ++dir) {
+      if(!_dir[dir]) continue;
+      for(std::size_t slot = 0; slot < TableSize; ++slot)
+        if(auto &page = (*_dir[dir])[slot]) f(static_cast<uint32_t>(dir << TableBits | slot), *page);
+    }
+  }
+
+  std::size_t size() const { return _count; }
+  void clear() {
+    for(auto &table: _dir) table.reset();
+    _count = 0;
+  }
+
+private:
+  std::array<std::unique_ptr<Table>, (Pages >> TableBits)> _dir;
+  std::size_t _count = 0;
+};
+
+// Guest memory, the whole 32-bit space of it, in small endian. Pages are allocated by the first write;
+// reading one never written gives zeros and allocates nothing.
+// The pages used last are remembered in a small direct-mapped cache of page pointers, so that accesses
+// staying in a few pages skip the page table. Not for use by two threads at once, even to read.
+class PagedMemory {
+public:
+  static constexpr std::size_t PageBits = PageTable<uint8_t>::PageBits;
+  static constexpr std::size_t PageSize = std::size_t{1} << PageBits;
+  static constexpr std::size_t Pages = PageTable<uint8_t>::Pages;
+  using Page = std::array<uint8_t, PageSize>;
+
+  PagedMemory() = default;
+  PagedMemory(const PagedMemory &other) : _pages(other._pages) {}
+  PagedMemory(PagedMemory &&other) noexcept : _pages(std::move(other._pages)) { other.forget(); }
+  PagedMemory &operator=(const PagedMemory &other) {
+    _pages = other._pages;
+    forget();
+    return *this;
+  }
+  PagedMemory &operator=(PagedMemory &&other) noexcept {
+    _pages = std::move(other._pages);
+    forget();
+    other.forget();
+    return *this;
+  }
+
+  // len is 1, 2 or 4. Aligned words are in one page and copied at once.
+  mem_val_t read(mem_ptr_t addr, mptr_diff_t len) const {
+    if((addr & (len - 1)) == 0) [[likely]] {
+      const Page *page = find(addr);
+      if(!page) return 0;
+      const uint8_t *data = page->data() + (addr & (PageSize - 1));
+      switch(len) {
+      case 1: return *data;
+      case 2: { uint16_t val; std::memcpy(&val, data, 2); return val; }
+      case 4: { uint32_t val; std::memcpy(&val, data, 4); return val; }
+      default: break;
+      }
+    }
+    mem_val_t val = 0;
+    for(std::size_t i = 0; i < len; ++i) {
+      const Page *page = find(addr + i);
+      if(page) val |= static_cast<mem_val_t>((*page)[(addr + i) & (PageSize - 1)]) << (i * 8);
+    }
+    return val;
+  }
+  void write(mem_ptr_t addr, mptr_diff_t len, mem_val_t val) {
+    if((addr & (len - 1)) == 0) [[likely]] {
+      uint8_t *data = touch(addr).data() + (addr & (PageSize - 1));
+      switch(len) {
+      case 1: *data = static_cast<uint8_t>(val); return;
+      case 2: { auto half = static_cast<uint16_t>(val); std::memcpy(data, &half, 2); return; }
+      case 4: std::memcpy(data, &val, 4); return;
+      default: break;
+      }
+    }
+    for(std::size_t i = 0; i < len; ++i)
+      touch(addr + i)[(addr + i) & (PageSize - 1)] = static_cast<uint8_t>(val >> (i * 8));
+  }
+
+  // len bytes from addr on, as lines are moved.
+  void read_block(mem_ptr_t addr, uint8_t *out, std::size_t len) const {
+    while(len) {
+      std::size_t offset = addr & (PageSize - 1), chunk = std::min(len, PageSize - offset);
+      if(const Page *page = find(addr)) std::memcpy(out, page->data() + offset, chunk);
+      else std::memset(out, 0, chunk);
+      addr += chunk, out += chunk, len -= chunk;
+    }
+  }
+  void write_block(mem_ptr_t addr, const uint8_t *in, std::size_t len) {
+    while(len) {
+      std::size_t offset = addr & (PageSize - 1), chunk = std::min(len, PageSize - offset);
+      std::memcpy(touch(addr).data() + offset, in, chunk);
+      addr += chunk, in += chunk, len -= chunk;
+    }
+  }
+
+  // f(index, page) for every page allocated, by address. Some may hold zeros only.
+  template <class F>
+  void for_each_page(F &&f) const { _pages.for_each(std::forward<F>(f)); }
+  // allocated if new, for filling in a whole page.
+  Page &page(uint32_t index) { return touch(static_cast<mem_ptr_t>(index) << PageBits); }
+  std::size_t pages() const { return _pages.size(); }
+  void clear() {
+    _pages.clear();
+    forget();
+  }
+
+private:
+  static_assert(std::endian::native == std::endian::little, "words are copied as host words");
+  static constexpr std::size_t CacheSize = 8;
+  static constexpr uint32_t NoPage = ~uint32_t{0};
+  struct CacheSlot {
+    uint32_t index = NoPage;
+    Page *page = nullptr; // allocated pages only
+  };
+
+  PageTable<Page> _pages;
+  mutable std::array<CacheSlot, CacheSize> _cache{};
+
+  void forget() { _cache.fill({}); }
+  Page *find(mem_ptr_t addr) const {
+    uint32_t index = addr >> PageBits;
+    auto &slot = _cache[index % CacheSize];
+    if(slot.index == index) return slot.page;
+    Page *page = _pages.find(index);
+    if(page) slot = {index, page};
+    return page;
+  }
+  Page &touch(mem_ptr_t addr) {
+    uint32_t index = addr >> PageBits;
+    auto &slot = _cache[index % CacheSize];
+    if(slot.index != index) slot = {index, &_pages.touch(index)};
+    return *slot.page;
+  }
+};
+
+}
+
+#endif // ISM_PAGED_MEMORY_H
@@ -5,27 +5,95 @@
 
 #include "wire_harness.h"
 #include "common.h"
+#include "checkpoint.h"
 
 namespace insomnia {
 
-class Predictor : public CPUModule {
+// What the predictor has learnt. Also trained outside of the pipeline by functional warming (see warming.h).
+struct PredictorTables {
+  // branch history table, for br
+  // value is ranged in [0, 3]:
+  // 00: strong Not Take, 01: weak Not Take,
+  // 10: weak Take, 11: strong Take
+  // Ugh maybe I should design a state machine here. Whatever.
+  std::unordered_map<mem_ptr_t, uint8_t> bht;
+  // return address stack, for br and jmp
+  std::unordered_map<mem_ptr_t, mem_ptr_t> ras;
+
+  // is_br: a branch, otherwise a jalr.
+  mem_ptr_t predict(mem_ptr_t instr_addr, bool is_br) const {
+    mem_ptr_t predict_pc = instr_addr + 4;
+    if(is_br) {
+      uint8_t bht_state = 0b10;
+      if(auto it = bht.find(instr_addr); it != bht.end()) {
+        bht_state = it->second;
+      }
+      // take predict
+      if(bht_state >= 0b10)
+        if(auto it = ras.find(instr_addr); it != ras.end()) {
+          predict_pc = it->second;
+        }
+    } else {
+      if(auto it = ras.find(instr_addr); it != ras.end()) {
+        predict_pc = it->second;
+      }
+    }
+    return predict_pc;
+  }
+  // is_pred_taken: whether the prediction was right.
+  void learn(mem_ptr_t instr_addr, bool is_br, bool is_pred_taken, mem_ptr_t real_pc) {
+    if(is_br) {
+      uint8_t &bht_state = bht[instr_addr];
+      if(is_pred_taken) {
+        if(bht_state < 0b11) ++bht_state;
+      } else {
+        if(bht_state > 0b00) --bht_state;
+      }
+    }
+    ras[instr_addr] = real_pc;
+  }
+};
+
+class Predictor final : public CPUModule {
   enum class State {
     IDLE,
     PREDICTING
   };
   struct Registers {
-    // branch history table, for br
-    // value is ranged in [0, 3]:
-    // 00: strong Not Take, 01: weak Not Take,
-    // 10: weak Take, 11: strong Take
-    // Ugh maybe I should design a state machine here. Whatever.
-    std::unordered_map<mem_ptr_t, uint8_t> bht;
-    // return address stack, for br and jmp
-    std::unordered_map<mem_ptr_t, mem_ptr_t> ras;
+    PredictorTables tables;
 
     mem_ptr_t pred_pc;
+
+    // statistics. Kept in registers so that re-evaluating update() does not count twice.
+    uint32_t success_pred = 0, total_pred = 0;
+
+    // the one address learnt (bht/ras written) since the last restore_from().
+    bool learnt = false;
+    mem_ptr_t learnt_addr;
+
+    // copying the tables is expensive; only bring back the learnt entries.
+    void restore_from(const Registers &other) {
+      auto restore_addr = [&](mem_ptr_t addr) {
+        auto &bht = tables.bht;
+        auto &ras = tables.ras;
+        if(auto it = other.tables.bht.find(addr); it != other.tables.bht.end()) bht[addr] = it->second;
+        else bht.erase(addr);
+        if(auto it = other.tables.ras.find(addr); it != other.tables.ras.end()) ras[addr] = it->second;
+        else ras.erase(addr);
+      };
+      if(learnt) restore_addr(learnt_addr);
+      if(other.learnt) restore_addr(other.learnt_addr);
+      learnt = false;
+      pred_pc = other.pred_pc;
+      success_pred = other.success_pred;
+      total_pred = other.total_pred;
+    }
+    // comparing the tables is expensive too. Having learnt anything counts as a change.
+    bool same_as(const Registers &other) const {
+      return !learnt && pred_pc == other.pred_pc &&
+        success_pred == other.success_pred && total_pred == other.total_pred;
+    }
   };
-  uint32_t _success_pred, _total_pred;
 public:
   Predictor(
     std::shared_ptr<const WH_IFU_PRED> ifu_input,
@@ -34,82 +102,90 @@ public:
   ) :
   _ifu_input(std::move(ifu_input)), _rob_input(std::move(rob_input)),
   _ifu_output(std::move(ifu_output)),
-  _cur_regs(), _nxt_regs(),
-  _cur_stat(State::IDLE), _nxt_stat(State::IDLE),
-  _success_pred(0), _total_pred(0) {}
+  _regs(),
+  _cur_stat(State::IDLE), _nxt_stat(State::IDLE) {}
   void sync() override {
-    _cur_regs = std::move(_nxt_regs); // to reduce C++ simulation time
+    _regs.commit();
     _cur_stat = _nxt_stat;
   }
-  bool update() override {
-    // debug("PRED");
-    _nxt_regs = _cur_regs;
+  wire_mask_t update() override {
+    _regs.restore();
     _nxt_stat = _cur_stat;
 
     WH_PRED_IFU ifu_output{};
 
     // learn first.
     if(_rob_input->is_valid) {
-      _total_pred++; _success_pred += _rob_input->is_pred_taken;
+      _regs.nxt().total_pred++; _regs.nxt().success_pred += _rob_input->is_pred_taken;
       mem_ptr_t instr_addr = _rob_input->instr_addr;
-      if(_rob_input->is_br) {
-        uint8_t &bht_state = _nxt_regs.bht[instr_addr];
-        if(_rob_input->is_pred_taken) {
-          if(bht_state < 0b11) ++bht_state;
-        } else {
-          if(bht_state > 0b00) --bht_state;
-        }
-      }
-      _nxt_regs.ras[instr_addr] = _rob_input->real_pc;
+      _regs.nxt().learnt = true;
+      _regs.nxt().learnt_addr = instr_addr;
+      _regs.nxt().tables.learn(instr_addr, _rob_input->is_br, _rob_input->is_pred_taken, _rob_input->real_pc);
     }
     // predict after learning latest result.
-    switch(_cur_stat) {
-    case State::IDLE: {
-      if(_ifu_input->is_valid) {
-        mem_ptr_t instr_addr = _ifu_input->instr_addr;
-        mem_ptr_t predict_pc = instr_addr + 4;
-
-        if(_ifu_input->is_br) {
-          uint8_t bht_state = 0b10;
-          if(auto it = _nxt_regs.bht.find(instr_addr); it != _nxt_regs.bht.end()) {
-            bht_state = it->second;
-          }
-          // take predict
-          if(bht_state >= 0b10)
-            if(auto it = _nxt_regs.ras.find(instr_addr); it != _nxt_regs.ras.end()) {
-              predict_pc = it->second;
-            }
-        } else if(_ifu_input->is_jalr) {
-          if(auto it = _nxt_regs.ras.find(instr_addr); it != _nxt_regs.ras.end()) {
-            predict_pc = it->second;
-          }
-        } else {
-          throw std::runtime_error("Prediction: invalid instruction type");
-        }
-        _nxt_regs.pred_pc = predict_pc;
-        _nxt_stat = State::PREDICTING;
-      }
-    } break;
-    case State::PREDICTING: {
+    // The IFU may ask again in the cycle it is answered: a fetch block can hold the next br/jalr.
+    if(_cur_stat == State::PREDICTING) {
       ifu_output.is_valid = true;
-      ifu_output.pred_pc = _cur_regs.pred_pc;
+      ifu_output.pred_pc = _regs.cur().pred_pc;
       _nxt_stat = State::IDLE;
-    } break;
     }
-
-    bool update_signal = false;
-    if(*_ifu_output != ifu_output) {
-      *_ifu_output = ifu_output;
-      update_signal = true;
+    if(_ifu_input->is_valid) {
+      if(!_ifu_input->is_br && !_ifu_input->is_jalr)
+        throw std::runtime_error("Prediction: invalid instruction type");
+      _regs.nxt().pred_pc = _regs.nxt().tables.predict(_ifu_input->instr_addr, _ifu_input->is_br);
+      _nxt_stat = State::PREDICTING;
     }
+
+    wire_mask_t update_signal = 0;
+    if(_ifu_output->drive(ifu_output)) update_signal |= 1 << 0;
     return update_signal;
   }
-  std::pair<uint32_t, uint32_t> pred_stat() const { return {_success_pred, _total_pred}; }
+  std::pair<uint32_t, uint32_t> pred_stat() const { return {_regs.cur().success_pred, _regs.cur().total_pred}; }
+
+  const PredictorTables &tables() const { return _regs.cur().tables; }
+  // start with what was learnt elsewhere. Before the first cycle only.
+  void load_tables(const PredictorTables &tables) {
+    Registers regs;
+    regs.tables = tables;
+    _regs.reset(regs);
+  }
+  bool stable() const override { return _regs.stable() && _nxt_stat == _cur_stat; }
+  void save(CheckpointWriter &out) const override {
+    auto &regs = _regs.cur();
+    out.map(regs.tables.bht);
+    out.map(regs.tables.ras);
+    out.pod(regs.pred_pc);
+    out.pod(regs.success_pred);
+    out.pod(regs.total_pred);
+    out.pod(regs.learnt);
+    out.pod(regs.learnt_addr);
+    out.pod(_cur_stat);
+  }
+  void load(CheckpointReader &in) override {
+    Registers regs;
+    in.map(regs.tables.bht);
+    in.map(regs.tables.ras);
+    regs.pred_pc = in.pod<mem_ptr_t>();
+    regs.success_pred = in.pod<uint32_t>();
+    regs.total_pred = in.pod<uint32_t>();
+    regs.learnt = in.pod<bool>();
+    regs.learnt_addr = in.pod<mem_ptr_t>();
+    _regs.reset(regs);
+    _cur_stat = _nxt_stat = in.pod<State>();
+  }
+  ModulePorts ports() const override {
+    return {
+      .name = "PRED",
+      .inputs = {_ifu_input.get(), _rob_input.get()},
+      .outputs = {_ifu_output.get()},
+      .registered = {_ifu_input.get(), _rob_input.get()}
+    };
+  }
 private:
   const std::shared_ptr<const WH_IFU_PRED> _ifu_input;
   const std::shared_ptr<const WH_ROB_PRED> _rob_input;
   const std::shared_ptr<WH_PRED_IFU> _ifu_output;
-  Registers _cur_regs, _nxt_regs;
+  RegisterBuffer<Registers> _regs;
   State _cur_stat, _nxt_stat;
 };
 
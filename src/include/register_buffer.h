@@ -0,0 +1,63 @@
+#ifndef ISM_REGISTER_BUFFER_H
+#define ISM_REGISTER_BUFFER_H
+
+#include <cstddef>
+
+namespace insomnia {
+
+// Current and next register state of a CPUModule, double-buffered.
+// At the clock edge the two are swapped instead of copied.
+// update() may run several times in a cycle and each run starts over from the current state:
+// if Regs provides restore_from(const Regs &), it only copies back what was written
+// (see ring_buffer::restore_from()). Otherwise the whole state is copied.
+template <class Regs>
+class RegisterBuffer {
+public:
+  template <class ...Args>
+  explicit RegisterBuffer(const Args &...args) : _bank{Regs(args...), Regs(args...)} {}
+
+  const Regs &cur() const { return _bank[_cur]; }
+  Regs &nxt() { return _bank[_cur ^ 1]; }
+  const Regs &nxt() const { return _bank[_cur ^ 1]; }
+
+  // called at the start of update(): next state := current state.
+  void restore() {
+    if constexpr(requires(Regs &regs, const Regs &other) { regs.restore_from(other); })
+      nxt().restore_from(cur());
+    else
+      nxt() = cur();
+    _restored = true;
+  }
+  // whether commit() would leave the current state as it is.
+  // Regs may provide a cheaper (conservative) same_as() instead of operator==.
+  bool stable() const {
+    if(!_restored) return true;
+    if constexpr(requires(const Regs &regs) { regs.same_as(regs); })
+      return nxt().same_as(cur());
+    else
+      return nxt() == cur();
+  }
+
+  // both states := regs, as if just constructed. Not during a cycle.
+  void reset(const Regs &regs) {
+    _bank[0] = _bank[1] = regs;
+    _restored = false;
+  }
+
+  // called at sync(): current state := next state.
+  // Without an update() since the last commit the next state is stale, and kept out.
+  void commit() {
+    if(!_restored) return;
+    _cur ^= 1;
+    _restored = false;
+  }
+
+private:
+  Regs _bank[2];
+  std::size_t _cur = 0;
+  bool _restored = false;
+};
+
+}
+
+#endif // ISM_REGISTER_BUFFER_H
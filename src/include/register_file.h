@@ -1,92 +1,86 @@
 #ifndef ISM_REGISTER_FILE_H
 #define ISM_REGISTER_FILE_H
 
+#include "co_module.h"
+#include "checkpoint.h"
 #include "wire_harness.h"
-#include "common.h"
 
 namespace insomnia {
 
-class RegisterFile : public CPUModule {
-  enum class State {
-    IDLE, READING
-  };
-  struct Registers {
-    std::array<mem_val_t, RFSize> arr;
-    bool repRi = false, repRj = false;
-    mem_val_t Vi, Vj;
-  };
+class RegisterFile final : public CoModule {
 public:
   RegisterFile(
+    std::shared_ptr<TimingWheel> wheel,
     std::shared_ptr<const WH_DU_RF> du_input,
     std::shared_ptr<const WH_ROB_RF> rob_input,
     std::shared_ptr<WH_RF_DU> du_output
     ) :
+  CoModule(std::move(wheel)),
   _du_input(std::move(du_input)), _rob_input(std::move(rob_input)),
   _du_output(std::move(du_output)),
-  _cur_regs(), _nxt_regs(),
-  _cur_stat(State::IDLE), _nxt_stat(State::IDLE) {}
-  void sync() override {
-    _cur_regs = _nxt_regs;
-    _cur_stat = _nxt_stat;
-    _cur_regs.arr[0] = 0; // fix x0 = 0
+  _arr() {
+    spawn<&RegisterFile::write_back>(); // first: a read sees the write of the same cycle
+    spawn<&RegisterFile::read>();
   }
-  bool update() override {
-    // debug("RF");
-    _nxt_regs = _cur_regs;
-    _nxt_stat = _cur_stat;
-
-    WH_RF_DU du_output{};
-
-    if(_rob_input->is_valid) {
-      _nxt_regs.arr[_rob_input->dst_reg] = _rob_input->value;
-      debug("Reg x" + std::to_string(_rob_input->dst_reg) + " is now " + std::to_string(_rob_input->value));
-    }
-
-    switch(_nxt_stat) {
-    case State::IDLE: {
-      if(_du_input->is_valid) {
-        if(_du_input->reqRi) {
-          _nxt_regs.repRi = true;
-          _nxt_regs.Vi = _nxt_regs.arr[_du_input->Ri];
-        } else _nxt_regs.repRi = false;
-        if(_du_input->reqRj) {
-          _nxt_regs.repRj = true;
-          _nxt_regs.Vj = _nxt_regs.arr[_du_input->Rj];
-        } else _nxt_regs.repRj = false;
-        _nxt_stat = State::READING;
-      }
-    } break;
-
-    case State::READING: {
-      du_output = {
-        .is_valid = true,
-        .repRi = _cur_regs.repRi,
-        .repRj = _cur_regs.repRj,
-        .Vi = _nxt_regs.Vi,
-        .Vj = _nxt_regs.Vj
-      };
-
-      _nxt_stat = State::IDLE; // only broadcast for 1 cycle
-    } break;
-    }
-
-    bool update_signal = false;
-    if(*_du_output != du_output) {
-      *_du_output = du_output;
-      update_signal = true;
-    }
+  wire_mask_t update() override {
+    wire_mask_t update_signal = 0;
+    if(_du_output->drive(_du_reply)) update_signal |= 1 << 0;
     return update_signal;
   }
   mem_ptr_t get_reg(int i) const {
     if(i == 0) return 0;
-    return _cur_regs.arr[i];
+    return _arr[i];
+  }
+  // outside of the pipeline, e.g. when loading a state.
+  void set_reg(int i, mem_val_t val) {
+    if(i != 0) _arr[i] = val;
+  }
+  void save(CheckpointWriter &out) const override {
+    save_processes();
+    out.pod(_arr);
+    out.pod(_du_reply);
+  }
+  void load(CheckpointReader &in) override {
+    _arr = in.pod<decltype(_arr)>();
+    _du_reply = in.pod<WH_RF_DU>();
+    load_processes();
+  }
+  ModulePorts ports() const override {
+    return {
+      .name = "RF",
+      .inputs = {}, // all taken at the clock edge
+      .outputs = {_du_output.get()}
+    };
   }
 private:
   const std::shared_ptr<const WH_DU_RF> _du_input;
   const std::shared_ptr<const WH_ROB_RF> _rob_input;
   const std::shared_ptr<WH_RF_DU> _du_output;
-  Registers _cur_regs, _nxt_regs;
-  State _cur_stat, _nxt_stat;
+  std::array<mem_val_t, RFSize> _arr;
+  WH_RF_DU _du_reply{}; // driven by update()
+
+  Process write_back() {
+    for(;;) {
+      co_await until([this] { return _rob_input->is_valid && _rob_input->dst_reg != 0; }, *_rob_input) // x0 stays 0
+        .restart_point();
+      _arr[_rob_input->dst_reg] = _rob_input->value;
+      ISM_LOG(RF, Debug, "x{} is now {}", _rob_input->dst_reg, _rob_input->value);
+    }
+  }
+
+  // answers a request in the next cycle, for one cycle.
+  Process read() {
+    for(;;) {
+      co_await until([this] { return _du_input->is_valid; }, *_du_input).restart_point();
+      _du_reply.is_valid = true;
+      _du_reply.repRi = _du_input->reqRi;
+      _du_reply.repRj = _du_input->reqRj;
+      if(_du_input->reqRi) _du_reply.Vi = _arr[_du_input->Ri]; // otherwise the last value stays on the wire
+      if(_du_input->reqRj) _du_reply.Vj = _arr[_du_input->Rj];
+      co_await cycles(1);
+      _du_reply.is_valid = false;
+    }
+  }
 };
 
 }
@@ -2,18 +2,21 @@
 #define ISM_REORDER_BUFFER_H
 
 #include <cassert>
+#include <limits>
+#include <utility>
 
-#include "circular_queue.h"
+#include "ring_buffer.h"
 #include "wire_harness.h"
 #include "common.h"
+#include "checkpoint.h"
 
 namespace insomnia {
 
-class CPU;
+class DynamicCPU;
 
 template <std::size_t BufSize>
-class ReorderBuffer : public CPUModule {
-  friend class CPU;
+class ReorderBuffer final : public CPUModule {
+  friend class DynamicCPU;
   enum class State {
     IDLE,
     FLUSHING
@@ -41,10 +44,20 @@ class ReorderBuffer : public CPUModule {
     mem_val_t rf_value; // execution result
 
     raw_instr_t raw_instr;
+    bool operator==(const Entry &) const = default;
   };
   struct Registers {
-    circular_queue<Entry, BufSize> queue; // entries
+    ring_buffer<Entry, BufSize> queue; // entries
     mem_ptr_t flush_pc;
+    uint64_t instret = 0; // instructions committed
+    mem_ptr_t next_pc = 0; // of the instruction after the last committed one
+    void restore_from(const Registers &other) {
+      queue.restore_from(other.queue);
+      flush_pc = other.flush_pc;
+      instret = other.instret;
+      next_pc = other.next_pc;
+    }
+    bool operator==(const Registers &) const = default;
   };
 public:
   ReorderBuffer(
@@ -62,14 +75,13 @@ public:
   _lsb_output(std::move(lsb_output)), _du_output(std::move(du_output)),
   _pred_output(std::move(pred_output)), _rf_output(std::move(rf_output)),
   _flush_output(std::move(flush_output)),
-  _cur_regs(), _nxt_regs(), _cur_stat(State::IDLE), _nxt_stat(State::IDLE) {}
+  _regs(), _cur_stat(State::IDLE), _nxt_stat(State::IDLE) {}
   void sync() override {
-    _cur_regs = _nxt_regs;
+    _regs.commit();
     _cur_stat = _nxt_stat;
   }
-  bool update() override {
-    // debug("ROB");
-    _nxt_regs = _cur_regs;
+  wire_mask_t update() override {
+    _regs.restore();
     _nxt_stat = _cur_stat;
 
     WH_ROB_LSB lsb_output{};
@@ -80,31 +92,16 @@ public:
 
     if(_cur_stat == State::FLUSHING) {
       flush_output.is_flush = true;
-      flush_output.pc = _cur_regs.flush_pc;
-      _nxt_regs.queue.clear();
+      flush_output.pc = _regs.cur().flush_pc;
+      _regs.nxt().queue.clear();
       _nxt_stat = State::IDLE;
 
-      bool update_signal = false;
-      if(*_lsb_output != lsb_output) {
-        *_lsb_output = lsb_output;
-        update_signal = true;
-      }
-      if(*_du_output != du_output) {
-        *_du_output = du_output;
-        update_signal = true;
-      }
-      if(*_pred_output != pred_output) {
-        *_pred_output = pred_output;
-        update_signal = true;
-      }
-      if(*_rf_output != rf_output) {
-        *_rf_output = rf_output;
-        update_signal = true;
-      }
-      if(*_flush_output != flush_output) {
-        *_flush_output = flush_output;
-        update_signal = true;
-      }
+      wire_mask_t update_signal = 0;
+      if(_lsb_output->drive(lsb_output)) update_signal |= 1 << 0;
+      if(_du_output->drive(du_output)) update_signal |= 1 << 1;
+      if(_pred_output->drive(pred_output)) update_signal |= 1 << 2;
+      if(_rf_output->drive(rf_output)) update_signal |= 1 << 3;
+      if(_flush_output->drive(flush_output)) update_signal |= 1 << 4;
       return update_signal;
     }
 
@@ -116,8 +113,11 @@ public:
     // The operations above can be done in one cycle, so no state machine is needed in ROB.
 
     // This instruction might be flushed, so it must be judged before instruction commit.
-    if(_du_input->is_valid && !_nxt_regs.queue.full()) {
-      _nxt_regs.queue.push(Entry{
+    // A load/store takes an LSB slot at dispatch. The DU dispatches one at a time,
+    // so the LSB has taken the last one already.
+    if(_du_input->is_valid && !_regs.nxt().queue.full() &&
+      !((_du_input->is_load || _du_input->is_store) && _lsb_input->is_full)) {
+      _regs.nxt().queue.push(Entry{
         .is_ready = false,
         .is_br = _du_input->is_br,
         .is_jalr = _du_input->is_jalr,
@@ -132,27 +132,30 @@ public:
         .dst_reg = _du_input->dst_reg,
         .raw_instr = _du_input->raw_instr
       });
-      for(std::size_t i = 0; i < _nxt_regs.queue.size(); ++i) {
-        auto &entry = _nxt_regs.queue.at((_nxt_regs.queue.front_index() + i) % BufSize);
-        if(_du_input->instr.has_src1() && entry.dst_reg == _du_input->instr.rs1() && entry.is_ready) {
-          du_output.has_src1 = true;
+      // the youngest older writer of a source, if it is done. Otherwise the DU waits for it.
+      const auto &queue = _regs.nxt().queue;
+      for(auto it = queue.begin(); it != queue.end(); ++it) {
+        const auto &entry = *it;
+        if(it.index() == queue.back_index() || !entry.write_rf) continue;
+        if(_du_input->instr.has_src1() && entry.dst_reg == _du_input->instr.rs1()) {
+          du_output.has_src1 = entry.is_ready;
           du_output.src1 = entry.rf_value;
         }
-        if(_du_input->instr.has_src2() && entry.dst_reg == _du_input->instr.rs2() && entry.is_ready) {
-          du_output.has_src2 = true;
+        if(_du_input->instr.has_src2() && entry.dst_reg == _du_input->instr.rs2()) {
+          du_output.has_src2 = entry.is_ready;
           du_output.src2 = entry.rf_value;
         }
       }
       du_output.is_alloc_valid = true;
-      du_output.rob_index = _nxt_regs.queue.back_index();
+      du_output.rob_index = _regs.nxt().queue.back_index();
     }
-    if(_lsb_input->is_valid && _nxt_regs.queue.index_valid(_lsb_input->rob_index)) {
-      auto &record = _nxt_regs.queue.at(_lsb_input->rob_index);
+    if(_lsb_input->is_store_ready && _regs.nxt().queue.index_valid(_lsb_input->rob_index)) {
+      auto &record = _regs.nxt().queue.at(_lsb_input->rob_index);
       assert(record.is_store);
       record.is_ready = true;
     }
-    if(_data_input->lsb_entry.is_valid && _nxt_regs.queue.index_valid(_data_input->lsb_entry.rob_index)) {
-      auto &record = _nxt_regs.queue.at(_data_input->lsb_entry.rob_index);
+    if(_data_input->lsb_entry.is_valid && _regs.nxt().queue.index_valid(_data_input->lsb_entry.rob_index)) {
+      auto &record = _regs.nxt().queue.at(_data_input->lsb_entry.rob_index);
       record.is_ready = true;
       if(record.is_br || record.is_jalr) {
         record.real_pc = _data_input->lsb_entry.real_pc;
@@ -161,12 +164,12 @@ public:
         record.rf_value = _data_input->lsb_entry.value;
       }
     }
-    if(_data_input->alu_entry.is_valid && _nxt_regs.queue.index_valid(_data_input->alu_entry.rob_index)) {
-      auto &record = _nxt_regs.queue.at(_data_input->alu_entry.rob_index);
+    if(_data_input->alu_entry.is_valid && _regs.nxt().queue.index_valid(_data_input->alu_entry.rob_index)) {
+      auto &record = _regs.nxt().queue.at(_data_input->alu_entry.rob_index);
       if(record.is_load || record.is_store) {
         assert(_data_input->alu_entry.is_load_store);
         // passing addr. ignore it.
-        debug("Passing L/S target addr: instr addr " + std::to_string(record.instr_addr));
+        ISM_LOG(ROB, Trace, "passing L/S target addr: instr addr {}", record.instr_addr);
       } else {
         assert(!_data_input->alu_entry.is_load_store);
         record.is_ready = true;
@@ -178,9 +181,10 @@ public:
         }
       }
     }
-    if(!_nxt_regs.queue.empty() && _nxt_regs.queue.front().is_ready) {
-      auto &record = _nxt_regs.queue.front();
-      debug("ROB commited instr " + std::to_string(record.raw_instr) + " at address " + std::to_string(record.instr_addr));
+    if(!_regs.nxt().queue.empty() && std::as_const(_regs.nxt().queue).front().is_ready &&
+      _regs.nxt().instret < _commit_limit) {
+      const auto &record = std::as_const(_regs.nxt().queue).front();
+      ISM_LOG(ROB, Debug, "commited instr {} at address {}", record.raw_instr, record.instr_addr);
       if(record.raw_instr == 0x0ff00513) {
         // terminate program. stop. The rest instructions (with this write) is ignored.
         terminate = true;
@@ -194,7 +198,7 @@ public:
         pred_output.is_pred_taken = (record.pred_pc == record.real_pc);
         if(record.pred_pc != record.real_pc) {
           // Prediction failed. Broadcast flushing signal and clear everything.
-          _nxt_regs.flush_pc = record.real_pc;
+          _regs.nxt().flush_pc = record.real_pc;
           _nxt_stat = State::FLUSHING;
         } else if(record.write_rf) {
           // Prediction succeeded & instruction is jalr/need to write RF.
@@ -206,13 +210,13 @@ public:
           rf_output.raw_instr = record.raw_instr;
 
           du_output.is_commit = true;
-          du_output.commit_index = _nxt_regs.queue.front_index();
+          du_output.commit_index = _regs.nxt().queue.front_index();
         }
       } else if(record.is_store || record.is_load) {
         // A memory interaction instruction.
         // LSB interaction
         lsb_output.is_valid = true;
-        lsb_output.rob_index = _nxt_regs.queue.front_index();
+        lsb_output.rob_index = _regs.nxt().queue.front_index();
         if(record.write_rf) {
           // Prediction succeeded & instruction is jalr/need to write RF.
           // write x[rd] = val.
@@ -222,7 +226,7 @@ public:
           rf_output.value = record.rf_value;
           rf_output.raw_instr = record.raw_instr;
           du_output.is_commit = true;
-          du_output.commit_index = _nxt_regs.queue.front_index();
+          du_output.commit_index = _regs.nxt().queue.front_index();
         }
       } else {
         // just a normal arithmetic instruction.
@@ -232,38 +236,59 @@ public:
         rf_output.value = record.rf_value;
         rf_output.raw_instr = record.raw_instr;
         du_output.is_commit = true;
-        du_output.commit_index = _nxt_regs.queue.front_index();
+        du_output.commit_index = _regs.nxt().queue.front_index();
+      }
+      if(!terminate) {
+        ++_regs.nxt().instret;
+        _regs.nxt().next_pc = record.is_br || record.is_jalr ? record.real_pc : record.pred_pc;
       }
-      debug("Pop queue");
-      _nxt_regs.queue.pop(); // also popping the one with flush pc... This design can be changed.
+      _regs.nxt().queue.pop(); // also popping the one with flush pc... This design can be changed.
     }
 
-    bool update_signal = false;
-    if(*_lsb_output != lsb_output) {
-      *_lsb_output = lsb_output;
-      update_signal = true;
-    }
-    if(*_du_output != du_output) {
-      *_du_output = du_output;
-      update_signal = true;
-    }
-    if(*_pred_output != pred_output) {
-      *_pred_output = pred_output;
-      update_signal = true;
-    }
-    if(*_rf_output != rf_output) {
-      *_rf_output = rf_output;
-      update_signal = true;
-    }
-    if(*_flush_output != flush_output) {
-      *_flush_output = flush_output;
-      update_signal = true;
-    }
+    wire_mask_t update_signal = 0;
+    if(_lsb_output->drive(lsb_output)) update_signal |= 1 << 0;
+    if(_du_output->drive(du_output)) update_signal |= 1 << 1;
+    if(_pred_output->drive(pred_output)) update_signal |= 1 << 2;
+    if(_rf_output->drive(rf_output)) update_signal |= 1 << 3;
+    if(_flush_output->drive(flush_output)) update_signal |= 1 << 4;
     return update_signal;
   }
   bool to_terminate() const {
     return terminate;
   }
+  uint64_t instret() const { return _regs.cur().instret; }
+  mem_ptr_t next_pc() const { return _regs.cur().next_pc; }
+
+  // commit at most cnt more instructions.
+  void stop_after(uint64_t cnt) { _commit_limit = _regs.cur().instret + cnt; }
+  bool stopped() const { return _regs.cur().instret >= _commit_limit; }
+
+  // the program starts at pc. Before the first cycle only.
+  void reset(mem_ptr_t pc) {
+    Registers regs;
+    regs.next_pc = pc;
+    _regs.reset(regs);
+  }
+  bool stable() const override { return _regs.stable() && _nxt_stat == _cur_stat; }
+  void save(CheckpointWriter &out) const override {
+    out.pod(_regs.cur());
+    out.pod(_cur_stat);
+    out.pod(terminate);
+    out.pod(_commit_limit);
+  }
+  void load(CheckpointReader &in) override {
+    _regs.reset(in.pod<Registers>());
+    _cur_stat = _nxt_stat = in.pod<State>();
+    terminate = in.pod<bool>();
+    _commit_limit = in.pod<uint64_t>();
+  }
+  ModulePorts ports() const override {
+    return {
+      .name = "ROB",
+      .inputs = {_du_input.get(), _data_input.get(), _lsb_input.get()},
+      .outputs = {_lsb_output.get(), _du_output.get(), _pred_output.get(), _rf_output.get(), _flush_output.get()}
+    };
+  }
 private:
   const std::shared_ptr<const WH_DU_ROB> _du_input;
   const std::shared_ptr<const WH_CDB_OUT> _data_input;
@@ -273,9 +298,10 @@ private:
   const std::shared_ptr<WH_ROB_PRED> _pred_output;
   const std::shared_ptr<WH_ROB_RF> _rf_output;
   const std::shared_ptr<WH_FLUSH_PIPELINE> _flush_output;
-  Registers _cur_regs, _nxt_regs;
+  RegisterBuffer<Registers> _regs;
   State _cur_stat, _nxt_stat;
   bool terminate = false;
+  uint64_t _commit_limit = std::numeric_limits<uint64_t>::max();
 };
 
 
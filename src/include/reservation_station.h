@@ -3,11 +3,12 @@
 
 #include "wire_harness.h"
 #include "common.h"
+#include "checkpoint.h"
 
 namespace insomnia {
 
 template <std::size_t StnSize>
-class ReservationStation : public CPUModule {
+class ReservationStation final : public CPUModule {
   struct Entry {
     bool is_valid = false;
     rob_index_t rob_index;
@@ -34,6 +35,7 @@ class ReservationStation : public CPUModule {
   struct Registers {
     std::array<Entry, StnSize> entries;
     std::size_t size = 0;
+    bool operator==(const Registers &) const = default;
   };
 public:
   ReservationStation(
@@ -50,64 +52,57 @@ public:
   _alu_input(std::move(alu_input)),
   _alu_output(std::move(alu_output)),
   _du_output(std::move(rs_output_for_du)),
-  _cur_regs(), _nxt_regs() {}
+  _regs() {}
 
   void sync() override {
-    _cur_regs = _nxt_regs;
+    _regs.commit();
   }
 
-  bool update() override {
-    // debug("RS");
-    _nxt_regs = _cur_regs;
+  wire_mask_t update() override {
+    _regs.restore();
 
     WH_RS_ALU alu_output{};
     WH_RS_DU du_output{};
 
-    bool update_signal = false;
+    wire_mask_t update_signal = 0;
 
     if(_flush_input->is_flush) {
       for(std::size_t i = 0; i < StnSize; ++i) {
-        _nxt_regs.entries[i].is_valid = false;
+        _regs.nxt().entries[i].is_valid = false;
       }
-      _nxt_regs.size = 0;
+      _regs.nxt().size = 0;
 
-      if(*_du_output != du_output) {
-        *_du_output = du_output;
-        update_signal = true;
-      }
+      if(_du_output->drive(du_output)) update_signal |= 1 << 1;
 
-      if(*_alu_output != alu_output) {
-        *_alu_output = alu_output;
-        update_signal = true;
-      }
+      if(_alu_output->drive(alu_output)) update_signal |= 1 << 0;
 
       return update_signal;
     }
 
     if(_cdb_input->lsb_entry.is_valid) {
       for(std::size_t i = 0; i < StnSize; ++i) {
-        if(_nxt_regs.entries[i].is_valid) {
-          if(!_nxt_regs.entries[i].src1_ready && _nxt_regs.entries[i].src1_index == _cdb_input->lsb_entry.rob_index) {
-            _nxt_regs.entries[i].src1_value = _cdb_input->lsb_entry.value;
-            _nxt_regs.entries[i].src1_ready = true;
+        if(_regs.nxt().entries[i].is_valid) {
+          if(!_regs.nxt().entries[i].src1_ready && _regs.nxt().entries[i].src1_index == _cdb_input->lsb_entry.rob_index) {
+            _regs.nxt().entries[i].src1_value = _cdb_input->lsb_entry.value;
+            _regs.nxt().entries[i].src1_ready = true;
           }
-          if(!_nxt_regs.entries[i].src2_ready && _nxt_regs.entries[i].src2_index == _cdb_input->lsb_entry.rob_index) {
-            _nxt_regs.entries[i].src2_value = _cdb_input->lsb_entry.value;
-            _nxt_regs.entries[i].src2_ready = true;
+          if(!_regs.nxt().entries[i].src2_ready && _regs.nxt().entries[i].src2_index == _cdb_input->lsb_entry.rob_index) {
+            _regs.nxt().entries[i].src2_value = _cdb_input->lsb_entry.value;
+            _regs.nxt().entries[i].src2_ready = true;
           }
         }
       }
     }
     if(_cdb_input->alu_entry.is_valid) {
       for(std::size_t i = 0; i < StnSize; ++i) {
-        if(_nxt_regs.entries[i].is_valid) {
-          if(!_nxt_regs.entries[i].src1_ready && _nxt_regs.entries[i].src1_index == _cdb_input->alu_entry.rob_index) {
-            _nxt_regs.entries[i].src1_value = _cdb_input->alu_entry.value;
-            _nxt_regs.entries[i].src1_ready = true;
+        if(_regs.nxt().entries[i].is_valid) {
+          if(!_regs.nxt().entries[i].src1_ready && _regs.nxt().entries[i].src1_index == _cdb_input->alu_entry.rob_index) {
+            _regs.nxt().entries[i].src1_value = _cdb_input->alu_entry.value;
+            _regs.nxt().entries[i].src1_ready = true;
           }
-          if(!_nxt_regs.entries[i].src2_ready && _nxt_regs.entries[i].src2_index == _cdb_input->alu_entry.rob_index) {
-            _nxt_regs.entries[i].src2_value = _cdb_input->alu_entry.value;
-            _nxt_regs.entries[i].src2_ready = true;
+          if(!_regs.nxt().entries[i].src2_ready && _regs.nxt().entries[i].src2_index == _cdb_input->alu_entry.rob_index) {
+            _regs.nxt().entries[i].src2_value = _cdb_input->alu_entry.value;
+            _regs.nxt().entries[i].src2_ready = true;
           }
         }
       }
@@ -118,7 +113,7 @@ public:
 
     if(_alu_input->can_accept_instr) {
       for(std::size_t i = 0; i < StnSize; ++i) {
-        Entry& entry = _nxt_regs.entries[i];
+        Entry& entry = _regs.nxt().entries[i];
         if(entry.is_valid && entry.src1_ready && entry.src2_ready) {
           if(entry.rob_index < earliest_rob_idx) {
             earliest_rob_idx = entry.rob_index;
@@ -129,7 +124,7 @@ public:
     }
 
     if(dispatch_idx != StnSize) {
-      Entry& dispatched_entry = _nxt_regs.entries[dispatch_idx];
+      Entry& dispatched_entry = _regs.nxt().entries[dispatch_idx];
 
       alu_output = WH_RS_ALU{
         .is_valid = true,
@@ -145,14 +140,14 @@ public:
       };
 
       dispatched_entry.is_valid = false;
-      --_nxt_regs.size;
+      --_regs.nxt().size;
     }
 
     // find a free slot for the incoming instruction
     std::size_t free_entry_idx = StnSize;
-    if(_nxt_regs.size < StnSize) {
+    if(_regs.nxt().size < StnSize) {
       for(std::size_t i = 0; i < StnSize; ++i) {
-        if(!_nxt_regs.entries[i].is_valid) {
+        if(!_regs.nxt().entries[i].is_valid) {
           free_entry_idx = i;
           break;
         }
@@ -160,7 +155,7 @@ public:
     }
 
     if(_du_input->is_valid && free_entry_idx != StnSize) {
-        _nxt_regs.entries[free_entry_idx] = Entry{
+        _regs.nxt().entries[free_entry_idx] = Entry{
           .is_valid = true,
           .rob_index = _du_input->rob_index,
           .instr_type = _du_input->instr_type,
@@ -176,26 +171,31 @@ public:
           .is_branch = _du_input->is_branch,
           .pred_pc = _du_input->pred_pc
         };
-        ++_nxt_regs.size;
+        ++_regs.nxt().size;
     }
 
     du_output = WH_RS_DU{
-      .can_accept_instr = (_nxt_regs.size < StnSize)
+      .can_accept_instr = (_regs.nxt().size < StnSize)
     };
 
-    if(*_du_output != du_output) {
-      *_du_output = du_output;
-      update_signal = true;
-    }
+    if(_du_output->drive(du_output)) update_signal |= 1 << 1;
 
-    if(*_alu_output != alu_output) {
-      *_alu_output = alu_output;
-      update_signal = true;
-    }
+    if(_alu_output->drive(alu_output)) update_signal |= 1 << 0;
 
     return update_signal;
   }
 
+  bool stable() const override { return _regs.stable(); }
+  void save(CheckpointWriter &out) const override { out.pod(_regs.cur()); }
+  void load(CheckpointReader &in) override { _regs.reset(in.pod<Registers>()); }
+  ModulePorts ports() const override {
+    return {
+      .name = "RS",
+      .inputs = {_du_input.get(), _cdb_input.get(), _flush_input.get(), _alu_input.get()},
+      .outputs = {_alu_output.get(), _du_output.get()}
+    };
+  }
+
 private:
   const std::shared_ptr<const WH_DU_RS> _du_input;
   const std::shared_ptr<const WH_CDB_OUT> _cdb_input;
@@ -205,7 +205,7 @@ private:
   const std::shared_ptr<WH_RS_ALU> _alu_output;
   const std::shared_ptr<WH_RS_DU> _du_output;
 
-  Registers _cur_regs, _nxt_regs;
+  RegisterBuffer<Registers> _regs;
 };
 
 }
@@ -0,0 +1,176 @@
+#ifndef ISM_RING_BUFFER_H
+#define ISM_RING_BUFFER_H
+
+#include <array>
+#include <bit>
+#include <bitset>
+#include <iterator>
+#include <stdexcept>
+
+namespace insomnia {
+
+// Accessor policies of ring_buffer.
+// checked_access throws on misuse (reading an empty buffer, pushing a full one, a dead slot...).
+// unchecked_access trusts the caller, so release builds keep no exception path in the hot loops.
+struct checked_access {
+  static void require(bool ok, const char *what) {
+    if(!ok) throw std::runtime_error(what);
+  }
+};
+struct unchecked_access {
+  static void require(bool, const char *) {}
+};
+
+// Set ISM_CHECKED_BUFFERS (CMake option of the same name) to check every access.
+#ifdef ISM_CHECKED_BUFFERS
+using default_access = checked_access;
+#else
+using default_access = unchecked_access;
+#endif
+
+// Fixed-capacity FIFO. Entries keep their slot (index) from push to pop, so an index can
+// name an entry from outside, as the ROB index does.
+// Iteration visits the live entries from oldest to newest and is read-only: write through
+// at(it.index()), so that the slot is tracked (see restore_from()).
+template <class T, std::size_t Cap, class Access = default_access>
+class ring_buffer {
+  static_assert(std::is_default_constructible_v<T> && std::has_single_bit(Cap),
+    "ring_buffer capacity must be a power of two");
+  static constexpr std::size_t Mask = Cap - 1;
+
+public:
+  class const_iterator {
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    const_iterator() = default;
+    reference operator*() const { return _buf->_data[index()]; }
+    pointer operator->() const { return &**this; }
+    const_iterator &operator++() { ++_pos; return *this; }
+    const_iterator operator++(int) { auto res = *this; ++_pos; return res; }
+    const_iterator &operator--() { --_pos; return *this; }
+    const_iterator operator--(int) { auto res = *this; --_pos; return res; }
+    bool operator==(const const_iterator &other) const { return _pos == other._pos; }
+
+    // slot of the entry in the buffer.
+    std::size_t index() const { return (_buf->_head + _pos) & Mask; }
+
+  private:
+    friend class ring_buffer;
+    const ring_buffer *_buf = nullptr;
+    std::size_t _pos = 0; // age: 0 is the front
+    const_iterator(const ring_buffer *buf, std::size_t pos) : _buf(buf), _pos(pos) {}
+  };
+
+  ring_buffer() = default;
+
+  void clear() { _head = _size = 0; }
+  void push(const T &t) {
+    Access::require(!full(), "push in full ring buffer.");
+    touch(slot(_size++)) = t;
+  }
+  template <class ...Args>
+  void emplace(Args &&...args) {
+    Access::require(!full(), "emplace in full ring buffer.");
+    new (&touch(slot(_size++))) T(std::forward<Args>(args)...);
+  }
+  void pop() {
+    Access::require(!empty(), "pop in empty ring buffer.");
+    _head = (_head + 1) & Mask;
+    --_size;
+  }
+  // be careful using this.
+  void pop_back() {
+    Access::require(!empty(), "pop_back in empty ring buffer.");
+    --_size;
+  }
+
+  T &front() { return touch(front_index()); }
+  const T &front() const { return _data[front_index()]; }
+  T &back() { return touch(back_index()); }
+  const T &back() const { return _data[back_index()]; }
+
+  [[nodiscard]] std::size_t size() const { return _size; }
+  [[nodiscard]] bool empty() const { return _size == 0; }
+  [[nodiscard]] bool full() const { return _size == Cap; }
+  [[nodiscard]] std::size_t front_index() const {
+    Access::require(!empty(), "read in empty ring buffer.");
+    return _head;
+  }
+  [[nodiscard]] std::size_t back_index() const {
+    Access::require(!empty(), "read in empty ring buffer.");
+    return slot(_size - 1);
+  }
+  // what index will it be if a new entry is pushed.
+  [[nodiscard]] std::size_t next_index() const {
+    Access::require(!full(), "query next index in full ring buffer.");
+    return slot(_size);
+  }
+
+  // whether index names a live entry. Not an accessor: always checked.
+  [[nodiscard]] bool index_valid(std::size_t index) const {
+    return index < Cap && ((index - _head) & Mask) < _size;
+  }
+  const T &at(std::size_t index) const {
+    Access::require(index_valid(index), "read in invalid place.");
+    return _data[index];
+  }
+  T &at(std::size_t index) {
+    Access::require(index_valid(index), "read in invalid place.");
+    return touch(index);
+  }
+
+  const_iterator begin() const { return {this, 0}; }
+  const_iterator end() const { return {this, _size}; }
+
+  // same entries at the same places. What is outside the buffer does not matter.
+  bool operator==(const ring_buffer &other) const {
+    if(_head != other._head || _size != other._size) return false;
+    for(std::size_t i = 0; i < _size; ++i)
+      if(!(_data[slot(i)] == other._data[slot(i)])) return false;
+    return true;
+  }
+
+  // Make this buffer equal to other, given that it was before the slots written
+  // (through push/emplace or a non-const reference) on either side since the last call.
+  // Used to restore the next register state from the current one; see RegisterBuffer.
+  // Prefer const access for reading, or the slot is copied back too.
+  void restore_from(const ring_buffer &other) {
+    for(std::size_t k = 0; k < _written_cnt; ++k) {
+      _data[_written_list[k]] = other._data[_written_list[k]];
+      _written[_written_list[k]] = false;
+    }
+    for(std::size_t k = 0; k < other._written_cnt; ++k)
+      _data[other._written_list[k]] = other._data[other._written_list[k]];
+    _written_cnt = 0;
+    _head = other._head;
+    _size = other._size;
+  }
+
+private:
+  T _data[Cap]{};
+  std::size_t _head = 0, _size = 0;
+
+  std::bitset<Cap> _written;
+  std::array<std::size_t, Cap> _written_list{};
+  std::size_t _written_cnt = 0;
+
+  // slot of the i-th oldest entry.
+  std::size_t slot(std::size_t i) const { return (_head + i) & Mask; }
+
+  T &touch(std::size_t index) {
+    if(!_written[index]) {
+      _written[index] = true;
+      _written_list[_written_cnt++] = index;
+    }
+    return _data[index];
+  }
+};
+
+}
+
+#endif // ISM_RING_BUFFER_H
@@ -0,0 +1,151 @@
+#ifndef ISM_SAMPLING_H
+#define ISM_SAMPLING_H
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "bcpu.h"
+#include "arch_state.h"
+#include "warming.h"
+#include "fork_pool.h"
+
+namespace insomnia {
+
+// SMARTS-style systematic sampling: every `interval` instructions, the cycle-accurate CPU runs
+// `warmup + measure` of them from the architectural state BCPU reached, and the CPI of the last
+// `measure` is one sample. The rest runs on BCPU, which keeps the predictor tables warm (see warming.h);
+// the detailed warmup only has to fill the pipeline. The whole-program CPI is estimated as the sample mean.
+// With jobs > 1 the windows run in forked children (see ForkPool) while BCPU goes on, through the windows too:
+// the predictor is then warmed by BCPU alone, and the estimate may differ slightly from the serial one.
+struct Sampling {
+  uint64_t interval = 100000;
+  uint64_t warmup = 2000;
+  uint64_t measure = 1000;
+  std::size_t jobs = 1; // windows run at once. Above 1 only where fork() is (ISM_FORK_SUPPORTED).
+};
+
+struct SamplingResult {
+  mem_val_t ret = 0;
+  uint64_t instructions = 0; // of the whole program
+  uint64_t samples = 0;
+  double cpi = 0;            // sample mean
+  double cpi_error = 0;      // half width of its 95% confidence interval. 0 with less than 2 samples.
+  uint64_t detailed = 0;     // instructions run by the CPU (warmup included)
+  clock_t cycles = 0;        // of the CPU
+
+  double est_cycles() const { return cpi * instructions; }
+};
+
+// One detailed window: the CPU, set up by the caller, runs up to its stop_after() limit,
+// and the instructions after the first `warmup` are measured.
+struct WindowStats {
+  bool halted = false;   // the program ended in the window: it is partial
+  mem_val_t ret = 0;     // if halted
+  uint64_t instructions = 0;
+  clock_t cycles = 0;
+  double cpi = 0;        // of the measured instructions
+};
+
+template <class Detailed>
+WindowStats run_window(Detailed &detailed, uint64_t warmup) {
+  clock_t measure_beg = 0;
+  uint64_t instr_beg = 0;
+  bool measuring = warmup == 0;
+  while(detailed.tick())
+    if(!measuring && detailed.instructions() >= warmup) {
+      measuring = true;
+      measure_beg = detailed.cycles();
+      instr_beg = detailed.instructions();
+    }
+  WindowStats stats;
+  stats.halted = detailed.halted();
+  if(stats.halted) stats.ret = detailed.get_ret();
+  stats.instructions = detailed.instructions();
+  stats.cycles = detailed.cycles();
+  if(stats.instructions > instr_beg) stats.cpi = 1.0 * (stats.cycles - measure_beg) / (stats.instructions - instr_beg);
+  return stats;
+}
+
+template <class Detailed>
+SamplingResult run_sampling(std::istream &program, const Sampling &options) {
+  if(options.interval <= options.warmup + options.measure || options.measure == 0)
+    throw std::runtime_error("Sampling interval must be longer than warmup + measure");
+  SamplingResult res;
+  Warming warming;
+  auto functional = std::make_unique<BCPU>();
+  functional->preload_program(program);
+  functional->set_warming(&warming);
+  // a fresh CPU for the next window, from the state functional has reached.
+  auto start_window = [&] {
+    auto detailed = std::make_unique<Detailed>();
+    detailed->load_arch_state(functional->arch_state());
+    detailed->load_warming(warming);
+    detailed->stop_after(options.warmup + options.measure);
+    return detailed;
+  };
+#ifdef ISM_FORK_SUPPORTED
+  std::optional<ForkPool<WindowStats>> pool;
+  if(options.jobs > 1) pool.emplace(options.jobs);
+#endif
+  std::vector<std::pair<std::size_t, WindowStats>> windows; // by sample
+  uint64_t handed_back = 0; // instructions run by the CPU only
+  const uint64_t gap = options.interval - options.warmup - options.measure;
+  for(std::size_t id = 0;; ++id) {
+    bool running = true;
+    for(uint64_t i = 0; i < gap && running; ++i) running = functional->tick();
+    if(!running) {
+      res.ret = functional->get_ret();
+      break;
+    }
+#ifdef ISM_FORK_SUPPORTED
+    if(pool) { // the window in a child; functional runs through it itself
+      pool->spawn(id, [&] { return run_window(*start_window(), options.warmup); });
+      for(uint64_t i = 0; i < options.warmup + options.measure && running; ++i) running = functional->tick();
+      if(!running) {
+        res.ret = functional->get_ret();
+        break;
+      }
+      continue;
+    }
+#endif
+    auto detailed = start_window();
+    auto stats = run_window(*detailed, options.warmup);
+    windows.emplace_back(id, stats);
+    handed_back += stats.instructions;
+    if(stats.halted) {
+      res.ret = stats.ret;
+      break;
+    }
+    detailed->save_warming(warming);
+    functional->load_arch_state(detailed->arch_state());
+  }
+#ifdef ISM_FORK_SUPPORTED
+  if(pool) windows = pool->finish();
+#endif
+  std::sort(windows.begin(), windows.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+  double sum = 0, sum_sq = 0;
+  for(auto &[id, stats]: windows) {
+    res.detailed += stats.instructions;
+    res.cycles += stats.cycles;
+    if(stats.halted) continue; // a partial sample: not counted
+    sum += stats.cpi;
+    sum_sq += stats.cpi * stats.cpi;
+    ++res.samples;
+  }
+  res.instructions = functional->instructions() + handed_back;
+  if(res.samples) res.cpi = sum / res.samples;
+  if(res.samples > 1) {
+    double var = (sum_sq - sum * sum / res.samples) / (res.samples - 1);
+    res.cpi_error = 1.96 * std::sqrt(std::max(var, 0.0) / res.samples);
+  }
+  return res;
+}
+
+}
+
+#endif // ISM_SAMPLING_H
@@ -0,0 +1,349 @@
+#ifndef ISM_SCHEDULER_H
+#define ISM_SCHEDULER_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "common.h"
+#include "checkpoint.h"
+#include "worker_pool.h"
+
+namespace insomnia {
+
+// Dirty-set scheduler for the combinational phase of a clock cycle.
+// Every module is evaluated once at the start of the cycle (its registers have just changed).
+// After that, a module is evaluated again only if some harness it listens to has changed since.
+//
+// The evaluation order is levelized from the harness graph at build time:
+// a module goes after every module driving one of its combinational inputs,
+// so in the common case one sweep reaches the fixed point.
+// Modules on a combinational loop cannot be ordered that way. They are reported on stderr and
+// ordered to break as few loop edges as possible; the sweep is then repeated until stable.
+//
+// Consecutive modules in that order that read nothing the others write form a stage.
+// Evaluating the due members of a stage at the same time gives the same result as one after
+// another, which evaluate(WorkerPool &) does.
+class EventScheduler {
+public:
+  using module_mask_t = uint32_t; // set of modules. Bit i stands for the i-th module in evaluation order.
+
+  EventScheduler() = default;
+
+  // The given order is only used to break ties.
+  template <class ModuleRange>
+  void build(const ModuleRange &modules) {
+    std::vector<CPUModule *> given;
+    for(auto &module: modules) given.push_back(&*module);
+    const std::size_t n = given.size();
+    if(n > std::numeric_limits<module_mask_t>::digits)
+      throw std::runtime_error("Scheduler: too many modules");
+
+    std::vector<ModulePorts> ports;
+    std::unordered_map<const void *, std::size_t> writer;
+    for(std::size_t i = 0; i < n; ++i) {
+      ports.push_back(given[i]->ports());
+      if(ports[i].outputs.size() > std::numeric_limits<wire_mask_t>::digits)
+        throw std::runtime_error("Scheduler: too many outputs in one module");
+      for(auto harness: ports[i].outputs)
+        if(!writer.emplace(harness, i).second)
+          throw std::runtime_error("Scheduler: harness driven by two modules");
+    }
+
+    // producer sets, over all inputs and over combinational inputs only.
+    std::vector<module_mask_t> preds(n), comb_preds(n);
+    for(std::size_t i = 0; i < n; ++i)
+      for(auto harness: ports[i].inputs) {
+        auto it = writer.find(harness);
+        if(it == writer.end()) continue; // driven from outside (never changes during a cycle)
+        preds[i] |= bit(it->second);
+        if(std::find(ports[i].registered.begin(), ports[i].registered.end(), harness) == ports[i].registered.end())
+          comb_preds[i] |= bit(it->second);
+      }
+
+    // strongly connected components of the combinational graph.
+    std::vector<module_mask_t> ancestors = comb_preds;
+    for(bool grown = true; grown; ) {
+      grown = false;
+      for(std::size_t i = 0; i < n; ++i) {
+        module_mask_t anc = ancestors[i];
+        for(module_mask_t rest = ancestors[i]; rest; rest &= rest - 1)
+          anc |= ancestors[std::countr_zero(rest)];
+        if(anc != ancestors[i]) { ancestors[i] = anc; grown = true; }
+      }
+    }
+    std::vector<module_mask_t> component(n);
+    for(std::size_t i = 0; i < n; ++i) {
+      component[i] = bit(i);
+      for(std::size_t j = 0; j < n; ++j)
+        if((ancestors[i] & bit(j)) && (ancestors[j] & bit(i))) component[i] |= bit(j);
+    }
+
+    _comb_loops.clear();
+    for(std::size_t i = 0; i < n; ++i) {
+      if(std::countr_zero(component[i]) != static_cast<int>(i)) continue; // report each component once
+      if(std::popcount(component[i]) == 1 && !(ancestors[i] & bit(i))) continue;
+      std::vector<const char *> names;
+      for(module_mask_t rest = component[i]; rest; rest &= rest - 1)
+        names.push_back(ports[std::countr_zero(rest)].name);
+      report_loop(names);
+      _comb_loops.push_back(std::move(names));
+    }
+
+    // topological order of the components. Among the ready ones, prefer the one with
+    // fewest unscheduled producers of registered inputs, so these need no re-evaluation either.
+    std::vector<std::size_t> order;
+    module_mask_t scheduled = 0;
+    while(order.size() < n) {
+      module_mask_t best = 0;
+      int best_cost = 0;
+      for(std::size_t i = 0; i < n; ++i) {
+        module_mask_t group = component[i];
+        if((scheduled & bit(i)) || std::countr_zero(group) != static_cast<int>(i)) continue;
+        module_mask_t comb = 0, all = 0;
+        for(module_mask_t rest = group; rest; rest &= rest - 1) {
+          comb |= comb_preds[std::countr_zero(rest)];
+          all |= preds[std::countr_zero(rest)];
+        }
+        if(comb & ~group & ~scheduled) continue; // not ready
+        int cost = std::popcount(all & ~group & ~scheduled);
+        if(!best || cost < best_cost) { best = group; best_cost = cost; }
+      }
+      for(auto i: order_loop(best, scheduled, comb_preds, preds)) {
+        order.push_back(i);
+        scheduled |= bit(i);
+      }
+    }
+
+    _modules.clear();
+    std::vector<std::size_t> position(n);
+    for(std::size_t k = 0; k < n; ++k) {
+      _modules.push_back(given[order[k]]);
+      position[order[k]] = k;
+    }
+    std::unordered_map<const void *, module_mask_t> comb_readers, reg_readers;
+    for(std::size_t i = 0; i < n; ++i)
+      for(auto harness: ports[i].inputs) {
+        bool registered = std::find(ports[i].registered.begin(), ports[i].registered.end(), harness)
+          != ports[i].registered.end();
+        (registered ? reg_readers : comb_readers)[harness] |= bit(position[i]);
+      }
+    _comb_listeners.assign(n, {});
+    _reg_listeners.assign(n, {});
+    for(std::size_t k = 0; k < n; ++k)
+      for(auto harness: ports[order[k]].outputs) {
+        _comb_listeners[k].push_back(comb_readers[harness]);
+        _reg_listeners[k].push_back(reg_readers[harness]);
+      }
+    _all = n == std::numeric_limits<module_mask_t>::digits ? ~module_mask_t{0} : bit(n) - 1;
+
+    _stages.clear();
+    module_mask_t stage = 0;
+    for(std::size_t k = 0; k < n; ++k) {
+      module_mask_t linked = 0; // modules k reads from or writes to
+      for(module_mask_t rest = preds[order[k]]; rest; rest &= rest - 1)
+        linked |= bit(position[std::countr_zero(rest)]);
+      for(std::size_t o = 0; o < _comb_listeners[k].size(); ++o)
+        linked |= _comb_listeners[k][o] | _reg_listeners[k][o];
+      if(linked & stage) {
+        _stages.push_back(stage);
+        stage = 0;
+      }
+      stage |= bit(k);
+    }
+    if(stage) _stages.push_back(stage);
+  }
+
+  // run update() until no harness changes any more.
+  // A module whose registered inputs changed is re-evaluated only once, after the others are stable:
+  // its outputs cannot change, only the registers it is going to latch.
+  void evaluate() {
+    const std::size_t n = _modules.size();
+    module_mask_t dirty = _all, settle = 0;
+    uint64_t evaluations = 0;
+    std::size_t last_changed_pass = 0;
+    std::size_t pass = 0;
+    while(dirty || settle) {
+      ++pass;
+      if(!dirty) std::swap(dirty, settle);
+      for(std::size_t i = 0; i < n; ++i) {
+        module_mask_t ahead = dirty & (~module_mask_t{0} << i);
+        if(!ahead) break;
+        i = std::countr_zero(ahead);
+        dirty &= ~bit(i);
+        settle &= ~bit(i);
+        ++evaluations;
+        if(wire_mask_t changed = _modules[i]->update()) {
+          last_changed_pass = pass;
+          wake(i, changed, dirty, settle);
+        }
+      }
+    }
+    account(evaluations, last_changed_pass, pass);
+  }
+
+  // evaluate(), with the due members of each stage run on the pool.
+  // Not with logging on: the log takes records from one thread only.
+  void evaluate(WorkerPool &pool) {
+    module_mask_t dirty = _all, settle = 0;
+    uint64_t evaluations = 0;
+    std::size_t last_changed_pass = 0;
+    std::size_t pass = 0;
+    std::array<std::size_t, std::numeric_limits<module_mask_t>::digits> due_modules;
+    std::array<wire_mask_t, std::numeric_limits<module_mask_t>::digits> changed;
+    while(dirty || settle) {
+      ++pass;
+      if(!dirty) std::swap(dirty, settle);
+      for(auto stage: _stages) {
+        module_mask_t due = dirty & stage;
+        if(!due) continue;
+        dirty &= ~due;
+        settle &= ~due;
+        std::size_t cnt = 0;
+        for(; due; due &= due - 1) due_modules[cnt++] = std::countr_zero(due);
+        evaluations += cnt;
+        if(cnt == 1) changed[0] = _modules[due_modules[0]]->update();
+        else pool.run(cnt, [&](std::size_t j) { changed[j] = _modules[due_modules[j]]->update(); });
+        for(std::size_t j = 0; j < cnt; ++j)
+          if(changed[j]) {
+            last_changed_pass = pass;
+            wake(due_modules[j], changed[j], dirty, settle);
+          }
+      }
+    }
+    account(evaluations, last_changed_pass, pass);
+  }
+
+  // Whether evaluate(WorkerPool &) on this many threads can beat evaluate(): there must be
+  // cores for them, and a stage with more than one module.
+  bool worth_parallel(std::size_t threads) const {
+    return threads > 1 && std::thread::hardware_concurrency() > 1 &&
+      std::any_of(_stages.begin(), _stages.end(), [](module_mask_t stage) { return std::popcount(stage) > 1; });
+  }
+
+  // The parts of evaluate(), for a CPU that runs the sweeps itself (see StaticCPU).
+  // Modules are numbered in evaluation order.
+  module_mask_t all() const { return _all; }
+  // the k-th module has changed these outputs.
+  void wake(std::size_t k, wire_mask_t changed, module_mask_t &dirty, module_mask_t &settle) const {
+    for(; changed; changed &= changed - 1) {
+      dirty |= _comb_listeners[k][std::countr_zero(changed)];
+      settle |= _reg_listeners[k][std::countr_zero(changed)];
+    }
+  }
+  // statistics of one converged cycle.
+  void account(uint64_t evaluations, std::size_t last_changed_pass, std::size_t passes) {
+    // the fixed-point loop keeps sweeping everything until a sweep changes nothing.
+    _evaluations += evaluations;
+    _saved_evaluations += _modules.size() * (last_changed_pass + 1) - evaluations;
+    _passes += passes;
+    _max_passes = std::max(_max_passes, passes);
+    _quiet = last_changed_pass == 0;
+  }
+  // whether no harness changed in the last cycle.
+  bool quiet() const { return _quiet; }
+
+  uint64_t evaluations() const { return _evaluations; }
+  uint64_t saved_evaluations() const { return _saved_evaluations; }
+  // sweeps needed to converge, in total and at worst in one cycle.
+  uint64_t passes() const { return _passes; }
+  std::size_t max_passes() const { return _max_passes; }
+  // the statistics, for checkpoints. The rest is built from the modules.
+  void save(CheckpointWriter &out) const {
+    out.pod(_evaluations);
+    out.pod(_saved_evaluations);
+    out.pod(_passes);
+    out.pod(_max_passes);
+    out.pod(_quiet);
+  }
+  void load(CheckpointReader &in) {
+    _evaluations = in.pod<uint64_t>();
+    _saved_evaluations = in.pod<uint64_t>();
+    _passes = in.pod<uint64_t>();
+    _max_passes = in.pod<std::size_t>();
+    _quiet = in.pod<bool>();
+  }
+
+  // modules in evaluation order.
+  const std::vector<CPUModule *> &order() const { return _modules; }
+  // stages, as sets of modules in evaluation order.
+  const std::vector<module_mask_t> &stages() const { return _stages; }
+  // combinational loops found in build(), by module name.
+  const std::vector<std::vector<const char *>> &comb_loops() const { return _comb_loops; }
+
+private:
+  std::vector<CPUModule *> _modules;
+  // [module][output bit]: modules reading that harness, combinationally / into registers only
+  std::vector<std::vector<module_mask_t>> _comb_listeners, _reg_listeners;
+  module_mask_t _all = 0;
+  std::vector<module_mask_t> _stages;
+  std::vector<std::vector<const char *>> _comb_loops;
+
+  uint64_t _evaluations = 0;
+  uint64_t _saved_evaluations = 0;
+  uint64_t _passes = 0;
+  std::size_t _max_passes = 0;
+  bool _quiet = false;
+
+  static constexpr module_mask_t bit(std::size_t i) { return module_mask_t{1} << i; }
+
+  // on stderr, whatever the log level. Once per process for each loop: every CPU built has the same ones.
+  static void report_loop(const std::vector<const char *> &names) {
+    std::string line = "Scheduler: combinational loop through";
+    for(auto name: names) (line += ' ') += name;
+    static std::mutex mutex;
+    static std::unordered_set<std::string> reported;
+    std::lock_guard lock(mutex);
+    if(reported.insert(line).second)
+      std::cerr << line << ". These modules are evaluated until stable, not in one sweep." << std::endl;
+  }
+
+  // evaluation order inside one component. Loops up to LoopSearchLimit modules are searched
+  // exhaustively for the order with fewest backward combinational edges, then fewest backward
+  // registered edges. Larger ones are ordered greedily.
+  static constexpr std::size_t LoopSearchLimit = 8;
+  static std::vector<std::size_t> order_loop(module_mask_t group, module_mask_t scheduled,
+    const std::vector<module_mask_t> &comb_preds, const std::vector<module_mask_t> &preds) {
+    std::vector<std::size_t> members;
+    for(module_mask_t rest = group; rest; rest &= rest - 1) members.push_back(std::countr_zero(rest));
+    if(members.size() <= LoopSearchLimit) {
+      std::vector<std::size_t> perm = members, best;
+      std::pair<int, int> best_cost;
+      do {
+        std::pair<int, int> cost{0, 0};
+        module_mask_t before = scheduled;
+        for(auto i: perm) {
+          cost.first += std::popcount(comb_preds[i] & group & ~before);
+          cost.second += std::popcount(preds[i] & group & ~before);
+          before |= bit(i);
+        }
+        if(best.empty() || cost < best_cost) { best = perm; best_cost = cost; }
+      } while(std::next_permutation(perm.begin(), perm.end()));
+      return best;
+    }
+    std::vector<std::size_t> res;
+    while(group) {
+      std::size_t pick = members.front();
+      std::pair<int, int> pick_cost{-1, -1};
+      for(module_mask_t rest = group; rest; rest &= rest - 1) {
+        std::size_t i = std::countr_zero(rest);
+        std::pair<int, int> cost{std::popcount(comb_preds[i] & ~scheduled), std::popcount(preds[i] & ~scheduled)};
+        if(pick_cost.first < 0 || cost < pick_cost) { pick = i; pick_cost = cost; }
+      }
+      res.push_back(pick);
+      scheduled |= bit(pick);
+      group &= ~bit(pick);
+    }
+    return res;
+  }
+};
+
+}
+
+#endif // ISM_SCHEDULER_H
@@ -0,0 +1,279 @@
+#ifndef ISM_SIMPOINT_H
+#define ISM_SIMPOINT_H
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "bcpu.h"
+#include "arch_state.h"
+#include "warming.h"
+#include "sampling.h"
+#include "fork_pool.h"
+
+namespace insomnia {
+
+// SimPoint: the program is cut into intervals of `interval` instructions and each is summarized by its
+// basic-block vector (how many instructions ran in each basic block). Intervals are clustered by k-means
+// and the one nearest to each centroid stands for its cluster, weighted by the cluster's size.
+// Only those run on the cycle-accurate CPU; CPI is their weighted mean.
+struct SimPoint {
+  uint64_t interval = 100000;
+  uint32_t clusters = 10;  // at most
+  uint64_t warmup = 2000;  // instructions run by the CPU before an interval, not measured
+  std::size_t jobs = 1;    // intervals run at once, as in Sampling
+};
+
+// One interval. blocks: (block id, instructions run in it), by block id.
+struct BasicBlockVector {
+  std::vector<std::pair<uint32_t, uint32_t>> blocks;
+};
+
+struct SimPointChoice {
+  uint64_t index = 0;  // of the interval
+  double weight = 0;   // fraction of the intervals it stands for
+  double cpi = 0;
+};
+
+struct SimPointResult {
+  mem_val_t ret = 0;
+  uint64_t instructions = 0;   // of the whole program
+  uint64_t intervals = 0;      // full ones. The last, partial one is not clustered.
+  std::vector<SimPointChoice> points;
+  double cpi = 0;
+  uint64_t detailed = 0;       // instructions run by the CPU (warmup included)
+  clock_t cycles = 0;          // of the CPU
+
+  double est_cycles() const { return cpi * instructions; }
+};
+
+// Basic-block vectors of a whole run. A basic block is named by its first pc: a new one starts at
+// the target of every taken branch or jump, and at every interval boundary.
+class BBVProfiler {
+public:
+  explicit BBVProfiler(uint64_t interval) : _interval(interval) {}
+
+  // runs functional to the end.
+  void profile(BCPU &functional) {
+    mem_ptr_t leader = functional.pc(), pc = leader;
+    uint32_t len = 0;
+    uint64_t left = _interval;
+    std::unordered_map<uint32_t, uint32_t> counts;
+    auto end_block = [&](mem_ptr_t next) {
+      if(len) {
+        auto [it, inserted] = _block_ids.try_emplace(leader, static_cast<uint32_t>(_block_ids.size()));
+        counts[it->second] += len;
+      }
+      leader = next;
+      len = 0;
+    };
+    while(functional.tick()) {
+      ++len;
+      mem_ptr_t next = functional.pc();
+      if(next != pc + 4) end_block(next);
+      pc = next;
+      if(--left == 0) {
+        end_block(next);
+        auto &bbv = _bbvs.emplace_back();
+        bbv.blocks.assign(counts.begin(), counts.end());
+        std::sort(bbv.blocks.begin(), bbv.blocks.end());
+        counts.clear();
+        left = _interval;
+      }
+    }
+    _ret = functional.get_ret();
+    _instructions = functional.instructions();
+  }
+
+  const std::vector<BasicBlockVector> &bbvs() const { return _bbvs; }
+  mem_val_t ret() const { return _ret; }
+  uint64_t instructions() const { return _instructions; }
+
+  // in the SimPoint frequency-vector format: one "T:id:count :id:count ..." line per interval, ids from 1.
+  void write(std::ostream &os) const {
+    for(auto &bbv: _bbvs) {
+      os << 'T';
+      for(auto [id, cnt]: bbv.blocks) os << ':' << id + 1 << ':' << cnt << ' ';
+      os << '\n';
+    }
+  }
+
+private:
+  const uint64_t _interval;
+  std::unordered_map<mem_ptr_t, uint32_t> _block_ids;
+  std::vector<BasicBlockVector> _bbvs;
+  mem_val_t _ret = 0;
+  uint64_t _instructions = 0;
+};
+
+// Picks at most k representative intervals (by index) with their weights.
+// Vectors are normalized and randomly projected to a few dimensions first, as SimPoint does;
+// k-means is run from several k-means++ seeds and the tightest clustering kept. Deterministic.
+inline std::vector<SimPointChoice> choose_simpoints(const std::vector<BasicBlockVector> &bbvs, uint32_t k) {
+  constexpr std::size_t Dims = 15;
+  constexpr int Seeds = 5, MaxIters = 100;
+  using Point = std::array<double, Dims>;
+  if(bbvs.empty() || k == 0) return {};
+  auto dist2 = [](const Point &a, const Point &b) {
+    double d = 0;
+    for(std::size_t i = 0; i < Dims; ++i) d += (a[i] - b[i]) * (a[i] - b[i]);
+    return d;
+  };
+
+  std::vector<Point> points(bbvs.size());
+  std::vector<Point> projection; // by block id: uniform in [-1, 1)
+  std::mt19937_64 rng(0x5eed);
+  std::uniform_real_distribution<double> unit(-1, 1);
+  for(std::size_t n = 0; n < bbvs.size(); ++n) {
+    double total = 0;
+    for(auto [id, cnt]: bbvs[n].blocks) total += cnt;
+    for(auto [id, cnt]: bbvs[n].blocks) {
+      while(projection.size() <= id) {
+        auto &row = projection.emplace_back();
+        for(auto &x: row) x = unit(rng);
+      }
+      for(std::size_t i = 0; i < Dims; ++i) points[n][i] += cnt / total * projection[id][i];
+    }
+  }
+
+  k = std::min<std::size_t>(k, points.size());
+  std::vector<std::size_t> best_assign;
+  std::vector<Point> best_centers;
+  double best_sse = std::numeric_limits<double>::max();
+  for(int seed = 0; seed < Seeds; ++seed) {
+    // k-means++: each next center is drawn with probability proportional to its squared distance.
+    std::vector<Point> centers{points[rng() % points.size()]};
+    std::vector<double> d2(points.size());
+    while(centers.size() < k) {
+      for(std::size_t n = 0; n < points.size(); ++n) {
+        d2[n] = std::numeric_limits<double>::max();
+        for(auto &c: centers) d2[n] = std::min(d2[n], dist2(points[n], c));
+      }
+      double sum = 0;
+      for(auto d: d2) sum += d;
+      if(sum == 0) break; // fewer distinct points than k
+      double r = std::uniform_real_distribution<double>(0, sum)(rng);
+      std::size_t n = 0;
+      for(; n + 1 < points.size() && (r -= d2[n]) > 0; ++n) {}
+      centers.push_back(points[n]);
+    }
+
+    std::vector<std::size_t> assign(points.size(), centers.size());
+    double sse = 0;
+    for(int iter = 0; iter < MaxIters; ++iter) {
+      bool changed = false;
+      sse = 0;
+      for(std::size_t n = 0; n < points.size(); ++n) {
+        std::size_t nearest = 0;
+        double nearest_d = std::numeric_limits<double>::max();
+        for(std::size_t c = 0; c < centers.size(); ++c)
+          if(double d = dist2(points[n], centers[c]); d < nearest_d) nearest = c, nearest_d = d;
+        if(assign[n] != nearest) assign[n] = nearest, changed = true;
+        sse += nearest_d;
+      }
+      if(!changed) break;
+      std::vector<Point> sums(centers.size());
+      std::vector<std::size_t> sizes(centers.size());
+      for(std::size_t n = 0; n < points.size(); ++n) {
+        for(std::size_t i = 0; i < Dims; ++i) sums[assign[n]][i] += points[n][i];
+        ++sizes[assign[n]];
+      }
+      for(std::size_t c = 0; c < centers.size(); ++c)
+        if(sizes[c])
+          for(std::size_t i = 0; i < Dims; ++i) centers[c][i] = sums[c][i] / sizes[c];
+    }
+    if(sse < best_sse) {
+      best_sse = sse;
+      best_assign = std::move(assign);
+      best_centers = std::move(centers);
+    }
+  }
+
+  std::vector<SimPointChoice> choices;
+  for(std::size_t c = 0; c < best_centers.size(); ++c) {
+    std::size_t nearest = points.size(), size = 0;
+    double nearest_d = std::numeric_limits<double>::max();
+    for(std::size_t n = 0; n < points.size(); ++n)
+      if(best_assign[n] == c) {
+        ++size;
+        if(double d = dist2(points[n], best_centers[c]); d < nearest_d) nearest = n, nearest_d = d;
+      }
+    if(size) choices.push_back({nearest, 1.0 * size / points.size(), 0});
+  }
+  std::sort(choices.begin(), choices.end(), [](auto &a, auto &b) { return a.index < b.index; });
+  return choices;
+}
+
+// bbv_out: where to write the basic-block vectors too, if not nullptr.
+template <class Detailed>
+SimPointResult run_simpoint(std::istream &program, const SimPoint &options, std::ostream *bbv_out = nullptr) {
+  if(options.interval == 0) throw std::runtime_error("SimPoint interval must not be empty");
+  SimPointResult res;
+  auto functional = std::make_unique<BCPU>();
+  functional->preload_program(program);
+  const ArchState initial = functional->arch_state();
+
+  BBVProfiler profiler(options.interval);
+  profiler.profile(*functional);
+  if(bbv_out) profiler.write(*bbv_out);
+  res.ret = profiler.ret();
+  res.instructions = profiler.instructions();
+  res.intervals = profiler.bbvs().size();
+  res.points = choose_simpoints(profiler.bbvs(), options.clusters);
+
+  // second pass: BCPU up to each chosen interval (keeping the predictor warm), the CPU through it.
+  Warming warming;
+  functional = std::make_unique<BCPU>();
+  functional->load_arch_state(initial);
+  functional->set_warming(&warming);
+#ifdef ISM_FORK_SUPPORTED
+  std::optional<ForkPool<WindowStats>> pool;
+  if(options.jobs > 1) pool.emplace(options.jobs);
+#endif
+  std::vector<std::pair<std::size_t, WindowStats>> windows; // by point
+  uint64_t done = 0; // instructions of the program run so far
+  for(std::size_t k = 0; k < res.points.size(); ++k) {
+    uint64_t beg = res.points[k].index * options.interval;
+    uint64_t warmup = std::min(options.warmup, beg - std::min(beg, done));
+    for(; done < beg - warmup; ++done) functional->tick();
+    auto start_window = [&] {
+      auto detailed = std::make_unique<Detailed>();
+      detailed->load_arch_state(functional->arch_state());
+      detailed->load_warming(warming);
+      detailed->stop_after(warmup + options.interval);
+      return detailed;
+    };
+#ifdef ISM_FORK_SUPPORTED
+    if(pool) { // the interval in a child; functional runs through it itself
+      pool->spawn(k, [&] { return run_window(*start_window(), warmup); });
+      for(uint64_t i = 0; i < warmup + options.interval; ++i, ++done) functional->tick();
+      continue;
+    }
+#endif
+    auto detailed = start_window();
+    windows.emplace_back(k, run_window(*detailed, warmup));
+    done += detailed->instructions();
+    detailed->save_warming(warming);
+    functional->load_arch_state(detailed->arch_state());
+  }
+#ifdef ISM_FORK_SUPPORTED
+  if(pool) windows = pool->finish();
+#endif
+  for(auto &[k, stats]: windows) {
+    res.points[k].cpi = stats.cpi;
+    res.detailed += stats.instructions;
+    res.cycles += stats.cycles;
+  }
+  for(auto &point: res.points) res.cpi += point.weight * point.cpi;
+  return res;
+}
+
+}
+
+#endif // ISM_SIMPOINT_H
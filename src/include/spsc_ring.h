@@ -0,0 +1,76 @@
+#ifndef ISM_SPSC_RING_H
+#define ISM_SPSC_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+
+namespace insomnia {
+
+// Lock-free ring for exactly one producer thread and one consumer thread.
+template <class T, std::size_t Cap>
+class spsc_ring {
+  static_assert(std::has_single_bit(Cap), "capacity must be a power of two");
+  static constexpr std::size_t CacheLine = 64;
+public:
+  spsc_ring() = default;
+  spsc_ring(const spsc_ring &) = delete;
+  spsc_ring &operator=(const spsc_ring &) = delete;
+
+  // producer side. false if full.
+  bool try_push(const T &t) {
+    std::size_t tail = _tail.load(std::memory_order_relaxed);
+    if(tail - _head_cache == Cap) {
+      _head_cache = _head.load(std::memory_order_acquire);
+      if(tail - _head_cache == Cap) return false;
+    }
+    _data[tail & (Cap - 1)] = t;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side. false if empty.
+  bool try_pop(T &t) {
+    std::size_t head = _head.load(std::memory_order_relaxed);
+    if(head == _tail_cache) {
+      _tail_cache = _tail.load(std::memory_order_acquire);
+      if(head == _tail_cache) return false;
+    }
+    t = _data[head & (Cap - 1)];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // producer side: as many of the cnt values as fit, published at once. Returns how many.
+  std::size_t try_push(const T *ts, std::size_t cnt) {
+    std::size_t tail = _tail.load(std::memory_order_relaxed);
+    if(Cap - (tail - _head_cache) < cnt) _head_cache = _head.load(std::memory_order_acquire);
+    cnt = std::min(cnt, Cap - (tail - _head_cache));
+    for(std::size_t i = 0; i < cnt; ++i) _data[(tail + i) & (Cap - 1)] = ts[i];
+    if(cnt) _tail.store(tail + cnt, std::memory_order_release);
+    return cnt;
+  }
+
+  // consumer side: at most cnt values, released at once. Returns how many.
+  std::size_t try_pop(T *ts, std::size_t cnt) {
+    std::size_t head = _head.load(std::memory_order_relaxed);
+    if(_tail_cache - head < cnt) _tail_cache = _tail.load(std::memory_order_acquire);
+    cnt = std::min(cnt, _tail_cache - head);
+    for(std::size_t i = 0; i < cnt; ++i) ts[i] = _data[(head + i) & (Cap - 1)];
+    if(cnt) _head.store(head + cnt, std::memory_order_release);
+    return cnt;
+  }
+
+private:
+  // indices only grow; the slot is index % Cap.
+  alignas(CacheLine) std::atomic<std::size_t> _head{0}; // written by the consumer
+  std::size_t _tail_cache = 0;                          // consumer's copy of _tail
+  alignas(CacheLine) std::atomic<std::size_t> _tail{0}; // written by the producer
+  std::size_t _head_cache = 0;                          // producer's copy of _head
+  alignas(CacheLine) T _data[Cap];
+};
+
+}
+
+#endif // ISM_SPSC_RING_H
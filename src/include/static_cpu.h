@@ -0,0 +1,350 @@
+#ifndef ISM_STATIC_CPU_H
+#define ISM_STATIC_CPU_H
+
+#include <iostream>
+#include <tuple>
+#include <utility>
+
+#include "alu.h"
+#include "cdb.h"
+#include "miu.h"
+#include "instruction_cache.h"
+#include "data_cache.h"
+#include "wiring.h"
+#include "utility.h"
+#include "predictor.h"
+#include "scheduler.h"
+#include "timing_wheel.h"
+#include "arch_state.h"
+#include "warming.h"
+#include "checkpoint.h"
+#include "dispatch_unit.h"
+#include "register_file.h"
+#include "reorder_buffer.h"
+#include "load_store_buffer.h"
+#include "reservation_station.h"
+#include "instruction_fetch_unit.h"
+
+namespace insomnia {
+
+// The same CPU as DynamicCPU, wired at compile time.
+// Modules are concrete (final) members of a tuple, so update()/sync() are called without virtual dispatch.
+// Harnesses live in one Wiring block. Modules still hold shared_ptrs, but these only alias the block.
+// A tick is an unrolled sweep over the tuple; the scheduler only provides the listener masks.
+class StaticCPU {
+  using MIU  = MemoryInterfaceUnit<MemoryBackend>;
+  using IC   = InstructionCache<ICacheSize, ICacheWays, ICacheLineSize, ICacheHitLatency>;
+  using DC   = DataCache<DCacheSize, DCacheWays, DCacheLineSize, DCacheHitLatency, DCacheMSHRs, DCacheTargets>;
+  using IFU  = InstructionFetchUnit<IFUSize>;
+  using DU   = DispatchUnit;
+  using ROB  = ReorderBuffer<ROBSize>;
+  using ALU  = CommonALU;
+  using LSB  = LoadStoreBuffer<LSBSize>;
+  using RS   = ReservationStation<RSSize>;
+  using PRED = Predictor;
+  using RF   = RegisterFile;
+  using CDB  = CommonDataBus;
+  using module_mask_t = EventScheduler::module_mask_t;
+
+  // must be the evaluation order derived by the scheduler. Checked at construction.
+  using Modules = std::tuple<RF, ROB, DU, ALU, IC, DC, LSB, CDB, RS, MIU, PRED, IFU>;
+  static constexpr std::size_t ModuleCnt = std::tuple_size_v<Modules>;
+
+private:
+  clock_t _clk;  // state machine update clock
+  clock_t _skipped = 0; // cycles fast-forwarded
+  std::shared_ptr<TimingWheel> _wheel;
+  std::shared_ptr<Wiring> _wiring;
+  Modules _modules;
+  EventScheduler _scheduler;
+  std::unique_ptr<WorkerPool> _pool; // for parallel evaluation, if set_threads() found it worthwhile
+
+  // harness shared_ptr without its own allocation or control block.
+  template <class WH>
+  std::shared_ptr<WH> wire(WH Wiring::*harness) const {
+    return std::shared_ptr<WH>(_wiring, &(_wiring.get()->*harness));
+  }
+
+  template <class Module>
+  Module &get() { return std::get<Module>(_modules); }
+  template <class Module>
+  const Module &get() const { return std::get<Module>(_modules); }
+
+  static constexpr module_mask_t bit(std::size_t i) { return module_mask_t{1} << i; }
+
+  // modules in checkpoint order, the same as DynamicCPU's: either CPU reads the other's checkpoints.
+  template <class Self>
+  static auto checkpoint_order(Self &self) {
+    return std::tie(self.template get<MIU>(), self.template get<IC>(), self.template get<DC>(),
+      self.template get<IFU>(), self.template get<DU>(), self.template get<ROB>(), self.template get<ALU>(),
+      self.template get<LSB>(), self.template get<RS>(), self.template get<PRED>(), self.template get<RF>(), self.template get<CDB>());
+  }
+
+  template <std::size_t ...I>
+  void evaluate(std::index_sequence<I...>) {
+    module_mask_t dirty = _scheduler.all(), settle = 0;
+    uint64_t evaluations = 0;
+    std::size_t last_changed_pass = 0;
+    std::size_t pass = 0;
+    while(dirty || settle) {
+      ++pass;
+      if(!dirty) std::swap(dirty, settle);
+      ([&] {
+        if(!(dirty & bit(I))) return;
+        dirty &= ~bit(I);
+        settle &= ~bit(I);
+        ++evaluations;
+        if(wire_mask_t changed = std::get<I>(_modules).update()) {
+          last_changed_pass = pass;
+          _scheduler.wake(I, changed, dirty, settle);
+        }
+      }(), ...);
+    }
+    _scheduler.account(evaluations, last_changed_pass, pass);
+  }
+
+public:
+  StaticCPU() : _clk(0), _wheel(std::make_shared<TimingWheel>()), _wiring(std::make_shared<Wiring>()),
+  _modules(
+    RF(
+      _wheel,
+      wire(&Wiring::du_rf),
+      wire(&Wiring::rob_rf),
+      wire(&Wiring::rf_du)
+    ),
+    ROB(
+      wire(&Wiring::du_rob),
+      wire(&Wiring::cdb_out),
+      wire(&Wiring::lsb_rob),
+      wire(&Wiring::rob_lsb),
+      wire(&Wiring::rob_du),
+      wire(&Wiring::rob_pred),
+      wire(&Wiring::rob_rf),
+      wire(&Wiring::flush)
+    ),
+    DU(
+      wire(&Wiring::ifu_du),
+      wire(&Wiring::rf_du),
+      wire(&Wiring::rob_du),
+      wire(&Wiring::cdb_out),
+      wire(&Wiring::flush),
+      wire(&Wiring::rs_du),
+      wire(&Wiring::du_ifu),
+      wire(&Wiring::du_rs),
+      wire(&Wiring::du_lsb),
+      wire(&Wiring::du_rf),
+      wire(&Wiring::du_rob)
+    ),
+    ALU(
+      wire(&Wiring::rs_alu),
+      wire(&Wiring::flush),
+      wire(&Wiring::alu_cdb),
+      wire(&Wiring::alu_rs)
+    ),
+    IC(
+      _wheel,
+      wire(&Wiring::ifu_ic),
+      wire(&Wiring::miu_ic),
+      wire(&Wiring::dc_ic),
+      wire(&Wiring::flush),
+      wire(&Wiring::ic_ifu),
+      wire(&Wiring::ic_miu)
+    ),
+    DC(
+      _wheel,
+      wire(&Wiring::lsb_dc),
+      wire(&Wiring::miu_dc),
+      wire(&Wiring::ic_miu),
+      wire(&Wiring::flush),
+      wire(&Wiring::dc_lsb),
+      wire(&Wiring::dc_miu),
+      wire(&Wiring::dc_ic)
+    ),
+    LSB(
+      wire(&Wiring::dc_lsb),
+      wire(&Wiring::du_lsb),
+      wire(&Wiring::rob_lsb),
+      wire(&Wiring::flush),
+      wire(&Wiring::cdb_out),
+      wire(&Wiring::lsb_rob),
+      wire(&Wiring::lsb_dc),
+      wire(&Wiring::lsb_cdb)
+    ),
+    CDB(
+      wire(&Wiring::lsb_cdb),
+      wire(&Wiring::alu_cdb),
+      wire(&Wiring::cdb_out)
+    ),
+    RS(
+      wire(&Wiring::du_rs),
+      wire(&Wiring::cdb_out),
+      wire(&Wiring::flush),
+      wire(&Wiring::alu_rs),
+      wire(&Wiring::rs_alu),
+      wire(&Wiring::rs_du)
+    ),
+    MIU(
+      _wheel,
+      wire(&Wiring::dc_miu),
+      wire(&Wiring::ic_miu),
+      wire(&Wiring::flush),
+      wire(&Wiring::miu_ic),
+      wire(&Wiring::miu_dc)
+    ),
+    PRED(
+      wire(&Wiring::ifu_pred),
+      wire(&Wiring::rob_pred),
+      wire(&Wiring::pred_ifu)
+    ),
+    IFU(
+      0, // start from instr addr 0x0
+      wire(&Wiring::ic_ifu),
+      wire(&Wiring::pred_ifu),
+      wire(&Wiring::flush),
+      wire(&Wiring::du_ifu),
+      wire(&Wiring::ifu_ic),
+      wire(&Wiring::ifu_pred),
+      wire(&Wiring::ifu_du)
+    )
+  ) {
+    auto modules = std::apply([](auto &...module) {
+      return std::array<CPUModule *, ModuleCnt>{&module...};
+    }, _modules);
+    _scheduler.build(modules);
+    if(!std::equal(modules.begin(), modules.end(), _scheduler.order().begin()))
+      throw std::runtime_error("StaticCPU: modules are not in evaluation order");
+  }
+
+  // via std::cin by default. Pre-assumed the input style.
+  void preload_program(std::istream &is = std::cin) {
+    load_hex_program(is, [this](mem_val_t raw_instr, mem_ptr_t addr) { get<MIU>().preload_program(raw_instr, addr); });
+  }
+
+  // Start from state instead of a preloaded program. Before the first tick only.
+  void load_arch_state(const ArchState &state) {
+    if(_clk) throw std::runtime_error("StaticCPU: state loaded into a running CPU");
+    get<MIU>().load_memory(state.mem);
+    for(std::size_t i = 0; i < RFSize; ++i) get<RF>().set_reg(i, state.regs[i]);
+    get<IFU>().reset(state.pc);
+    get<ROB>().reset(state.pc);
+  }
+  // Committed state: valid once tick() has returned false.
+  ArchState arch_state() const {
+    ArchState state;
+    state.pc = get<ROB>().next_pc();
+    for(std::size_t i = 0; i < RFSize; ++i) state.regs[i] = get<RF>().get_reg(i);
+    state.mem = get<MIU>().memory();
+    get<DC>().write_back(state.mem);
+    return state;
+  }
+  // start with trained predictor tables. Before the first tick only.
+  void load_warming(const Warming &warming) { get<PRED>().load_tables(warming.predictor); }
+  void save_warming(Warming &warming) const { warming.predictor = get<PRED>().tables(); }
+  // tick() returns false once cnt more instructions are committed and their stores are in memory.
+  void stop_after(uint64_t cnt) { get<ROB>().stop_after(cnt); }
+  // whether the program has ended (rather than stopped by stop_after()).
+  bool halted() const { return get<ROB>().to_terminate(); }
+
+  // whether a checkpoint can be taken now: no memory access or register read in flight
+  // (see CoModule::restart_point()). Between two ticks. Comes true within a few cycles.
+  bool checkpointable() const {
+    return get<MIU>().restartable() && get<IC>().restartable() && get<DC>().restartable() &&
+      get<RF>().restartable();
+  }
+  // The complete state, so that a CPU that load_checkpoint()s it goes on exactly as this one would.
+  // Between two ticks, once checkpointable(). See checkpoint.h for the format.
+  void save_checkpoint(std::ostream &os) const {
+    CheckpointWriter out(os);
+    out.section("CPU");
+    out.pod(_clk);
+    out.pod(_skipped);
+    out.pod(*_wheel);
+    _scheduler.save(out);
+    out.section("Wiring");
+    Wiring::for_each(*_wiring, [&](const auto &harness) { out.pod(harness); });
+    std::apply([&](const auto &...module) {
+      ((out.section(module.ports().name), module.save(out)), ...);
+    }, checkpoint_order(*this));
+  }
+  // Instead of a preloaded program. Before the first tick only.
+  void load_checkpoint(std::istream &is) {
+    if(_clk) throw std::runtime_error("StaticCPU: checkpoint loaded into a running CPU");
+    CheckpointReader in(is);
+    in.section("CPU");
+    _clk = in.pod<clock_t>();
+    _skipped = in.pod<clock_t>();
+    *_wheel = in.pod<TimingWheel>();
+    _scheduler.load(in);
+    in.section("Wiring");
+    Wiring::for_each(*_wiring, [&](auto &harness) { harness = in.pod<std::remove_cvref_t<decltype(harness)>>(); });
+    std::apply([&](auto &...module) {
+      ((in.section(module.ports().name), module.load(in)), ...);
+    }, checkpoint_order(*this));
+  }
+
+  // Evaluate independent modules on this many threads (including the calling one).
+  // Stays serial where that cannot pay off: too few cores, or no two modules to evaluate at once
+  // (see EventScheduler::worth_parallel). Returns whether it is parallel now. Results are the same either way.
+  bool set_threads(std::size_t threads) {
+    _pool.reset();
+    if(_scheduler.worth_parallel(threads))
+      _pool = std::make_unique<WorkerPool>(threads);
+    return _pool != nullptr;
+  }
+
+  bool tick() {
+    ++_clk;
+    _wheel->advance(_clk);
+
+    ISM_LOG(CPU, Trace, "clk {}", _clk);
+    // the pool calls update() through CPUModule; only the serial sweep is devirtualized.
+    if(_pool && !log_active()) _scheduler.evaluate(*_pool);
+    else evaluate(std::make_index_sequence<ModuleCnt>{});
+    if(get<ROB>().to_terminate()) return false;
+    if(get<ROB>().stopped() && !get<LSB>().stores_pending() && !get<DC>().stores_pending()) return false;
+    // If nothing changed in this cycle and nothing changes at this edge, the cycles up to
+    // the next wakeup are all the same as this one. Skip them.
+    bool quiescent = _scheduler.quiet() &&
+      std::apply([](const auto &...module) { return (module.stable() && ...); }, _modules);
+    std::apply([](auto &...module) { (module.sync(), ...); }, _modules);
+    if(quiescent)
+      if(auto wakeup = _wheel->next_event()) {
+        _skipped += *wakeup - 1 - _clk;
+        _clk = *wakeup - 1;
+      }
+    return true;
+  }
+
+  std::pair<uint32_t, uint32_t> pred_stat() const { return get<PRED>().pred_stat(); }
+
+  // {I-cache hits, misses}
+  std::pair<uint64_t, uint64_t> icache_stat() const { return get<IC>().stat(); }
+  const DataCacheStat &dcache_stat() const { return get<DC>().stat(); }
+  // of the L2 cache and DRAM behind the L1s
+  MemoryStat memory_stat() const { return get<MIU>().stat(); }
+
+  // {module evaluations done, module evaluations saved compared to updating everything}
+  std::pair<uint64_t, uint64_t> eval_stat() const {
+    return {_scheduler.evaluations(), _scheduler.saved_evaluations()};
+  }
+
+  // {convergence sweeps in total, most sweeps in one cycle}
+  std::pair<uint64_t, std::size_t> pass_stat() const {
+    return {_scheduler.passes(), _scheduler.max_passes()};
+  }
+
+  mem_val_t get_ret() const {
+    return get<RF>().get_reg(10) & 0xff;
+  }
+
+  clock_t cycles() const { return _clk; }
+
+  // cycles fast-forwarded instead of simulated. Included in cycles().
+  clock_t skipped_cycles() const { return _skipped; }
+
+  uint64_t instructions() const { return get<ROB>().instret(); }
+};
+
+}
+
+#endif // ISM_STATIC_CPU_H
@@ -0,0 +1,273 @@
+#ifndef ISM_THREADED_CPU_H
+#define ISM_THREADED_CPU_H
+
+#include <bitset>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "utility.h"
+#include "instruction.h"
+#include "decode_cache.h"
+
+namespace insomnia {
+
+// Functional model like BCPU, for speed: the program is cut into basic blocks of predecoded
+// instructions, run with direct-threaded dispatch (computed goto, a GCC/Clang extension).
+// Each block ends with a control transfer; the block it leads to is linked in (chained) the first
+// time, so loops run from block to block without leaving tick(). tick() only returns at the end
+// of the program, or at an exit that is not linked yet.
+// A store into translated code drops all blocks (self-modifying code).
+// Memory is the RAMSize bytes from address 0: an access or jump outside it throws.
+class ThreadedCPU {
+  static constexpr std::size_t MaxBlockLen = 64;
+
+  // handlers: the InstrType ones, then these.
+  enum Handler : uint8_t {
+    Nop = static_cast<uint8_t>(InstrType::AND) + 1, // writes x0
+    Li,   // rd = imm. LUI and AUIPC (the pc is known)
+    Goto, // the block is full: go on at target
+    Halt,
+    HandlerCnt
+  };
+
+  struct Op {
+    const void *handler;
+    uint8_t rd, rs1, rs2;
+    int32_t imm;
+    mem_ptr_t target; // branch / jump target
+    mem_ptr_t next;   // pc of the following instruction
+  };
+  struct Block {
+    std::vector<Op> ops;                            // the last one leaves the block
+    std::size_t instrs = 0;                         // how many of them are instructions
+    Block *taken = nullptr, *fallthrough = nullptr; // linked successors
+  };
+
+  std::array<uint8_t, RAMSize> _mem{};
+  std::array<mem_val_t, RFSize> _regs{};
+  clock_t _clk = 0;
+  uint64_t _instret = 0;
+  mem_ptr_t _pc = 0;
+
+  std::vector<std::unique_ptr<Block>> _blocks;
+  std::vector<Block *> _block_at = std::vector<Block *>(RAMSize / 4); // by pc / 4
+  std::bitset<RAMSize / 4> _code_words; // translated, by address / 4
+  Block **_unlinked = nullptr; // the exit taken last time tick() returned, to be linked
+  const void *const *_labels = nullptr;
+
+  static void check_range(mem_ptr_t addr, mptr_diff_t data_len) {
+    if(addr >= RAMSize || RAMSize - addr < data_len) [[unlikely]]
+      throw std::runtime_error("ThreadedCPU: memory access out of range at " + std::to_string(addr));
+  }
+  mem_val_t read_mem(mem_ptr_t addr, mptr_diff_t data_len) {
+    check_range(addr, data_len);
+    mem_val_t val = 0;
+    for(size_t i = 0; i < data_len; ++i)
+      val |= static_cast<mem_val_t>(_mem[addr + i]) << (i * 8);
+    return val;
+  }
+  // returns whether translated code was hit.
+  bool write_mem(mem_ptr_t addr, mptr_diff_t data_len, mem_val_t val) {
+    check_range(addr, data_len);
+    for(size_t i = 0; i < data_len; ++i)
+      _mem[addr + i] = static_cast<uint8_t>((val >> (i * 8)) & 0xff);
+    return _code_words[addr >> 2] || _code_words[(addr + data_len - 1) >> 2];
+  }
+
+  void flush() {
+    ISM_LOG(BCPU, Debug, "code written: dropping {} blocks", _blocks.size());
+    _blocks.clear();
+    std::fill(_block_at.begin(), _block_at.end(), nullptr);
+    _code_words.reset();
+    _unlinked = nullptr;
+  }
+
+  Block *translate(mem_ptr_t pc) {
+    if(pc & 0b11) throw std::runtime_error("ThreadedCPU: unaligned pc");
+    auto &block = _blocks.emplace_back(std::make_unique<Block>());
+    ISM_LOG(BCPU, Debug, "block at {}", pc);
+    for(bool end = false; !end; pc += 4) {
+      if(block->ops.size() + 1 == MaxBlockLen || pc >= RAMSize) {
+        block->ops.push_back({.handler = _labels[Goto], .target = pc});
+        break;
+      }
+      _code_words[pc >> 2] = true;
+      DecodedInstr instr(read_mem(pc, 4));
+      Op op{.rd = instr.rd, .rs1 = instr.rs1, .rs2 = instr.rs2, .imm = instr.imm, .target = pc + instr.imm, .next = pc + 4};
+      uint8_t handler = instr.op;
+      switch(instr.op) {
+      case static_cast<uint8_t>(InstrType::AUIPC):
+        op.imm = static_cast<int32_t>(pc + instr.imm);
+        [[fallthrough]];
+      case static_cast<uint8_t>(InstrType::LUI):
+        handler = op.rd ? Li : Nop;
+        break;
+      case static_cast<uint8_t>(InstrType::JAL): case static_cast<uint8_t>(InstrType::JALR):
+      case static_cast<uint8_t>(InstrType::BEQ): case static_cast<uint8_t>(InstrType::BNE):
+      case static_cast<uint8_t>(InstrType::BLT): case static_cast<uint8_t>(InstrType::BGE):
+      case static_cast<uint8_t>(InstrType::BLTU): case static_cast<uint8_t>(InstrType::BGEU):
+      case static_cast<uint8_t>(InstrType::INVALID):
+        end = true;
+        break;
+      case static_cast<uint8_t>(InstrType::SB): case static_cast<uint8_t>(InstrType::SH):
+      case static_cast<uint8_t>(InstrType::SW):
+        break;
+      case DecodedInstr::Halt:
+        handler = Halt;
+        end = true;
+        break;
+      default: // writes rd
+        if(op.rd == 0) handler = Nop;
+        break;
+      }
+      op.handler = _labels[handler];
+      block->ops.push_back(op);
+      if(handler != Halt) ++block->instrs;
+    }
+    return block.get();
+  }
+
+  Block *block_at(mem_ptr_t pc) {
+    check_range(pc, 4);
+    auto &block = _block_at[pc >> 2];
+    if(!block) block = translate(pc);
+    return block;
+  }
+
+  // runs blocks from block on. nullptr: only publishes the handler table.
+  bool execute(Block *block) {
+    static const void *const labels[HandlerCnt] = {
+      &&INVALID,
+      &&LI, &&LI,
+      &&JAL, &&JALR,
+      &&BEQ, &&BNE, &&BLT, &&BGE, &&BLTU, &&BGEU,
+      &&LB, &&LH, &&LW, &&LBU, &&LHU,
+      &&SB, &&SH, &&SW,
+      &&ADDI, &&SLTI, &&SLTIU, &&XORI, &&ORI, &&ANDI, &&SLLI, &&SRLI, &&SRAI,
+      &&ADD, &&SUB, &&SLL, &&SLT, &&SLTU, &&XOR, &&SRL, &&SRA, &&OR, &&AND,
+      &&NOP, &&LI, &&GOTO, &&HALT,
+    };
+    if(!block) {
+      _labels = labels;
+      return true;
+    }
+    auto &r = _regs;
+    const Op *op = block->ops.data();
+    mem_ptr_t pc;
+    Block **link;
+
+#define ISM_NEXT goto *(++op)->handler
+#define ISM_BRANCH(cond) \
+    if(cond) { pc = op->target; link = &block->taken; } \
+    else { pc = op->next; link = &block->fallthrough; } \
+    goto leave
+#define ISM_STORE(len) \
+    if(write_mem(r[op->rs1] + op->imm, len, r[op->rs2])) { \
+      _instret += op - block->ops.data() + 1; \
+      _pc = op->next; \
+      flush(); \
+      return true; \
+    } \
+    ISM_NEXT
+
+    goto *op->handler;
+
+  LI:    r[op->rd] = op->imm; ISM_NEXT;
+  NOP:   ISM_NEXT;
+  JAL:   r[op->rd] = op->next; r[0] = 0; pc = op->target; link = &block->taken; goto leave;
+  JALR:  pc = (r[op->rs1] + op->imm) & ~static_cast<mem_ptr_t>(1); r[op->rd] = op->next; r[0] = 0; link = nullptr; goto leave;
+  BEQ:   ISM_BRANCH(r[op->rs1] == r[op->rs2]);
+  BNE:   ISM_BRANCH(r[op->rs1] != r[op->rs2]);
+  BLT:   ISM_BRANCH(static_cast<int32_t>(r[op->rs1]) < static_cast<int32_t>(r[op->rs2]));
+  BGE:   ISM_BRANCH(static_cast<int32_t>(r[op->rs1]) >= static_cast<int32_t>(r[op->rs2]));
+  BLTU:  ISM_BRANCH(r[op->rs1] < r[op->rs2]);
+  BGEU:  ISM_BRANCH(r[op->rs1] >= r[op->rs2]);
+  GOTO:  pc = op->target; link = &block->fallthrough; goto leave;
+  LB:    r[op->rd] = sign_extend<mem_val_t, 8>(read_mem(r[op->rs1] + op->imm, 1)); ISM_NEXT;
+  LH:    r[op->rd] = sign_extend<mem_val_t, 16>(read_mem(r[op->rs1] + op->imm, 2)); ISM_NEXT;
+  LW:    r[op->rd] = read_mem(r[op->rs1] + op->imm, 4); ISM_NEXT;
+  LBU:   r[op->rd] = read_mem(r[op->rs1] + op->imm, 1); ISM_NEXT;
+  LHU:   r[op->rd] = read_mem(r[op->rs1] + op->imm, 2); ISM_NEXT;
+  SB:    ISM_STORE(1);
+  SH:    ISM_STORE(2);
+  SW:    ISM_STORE(4);
+  ADDI:  r[op->rd] = r[op->rs1] + op->imm; ISM_NEXT;
+  SLTI:  r[op->rd] = static_cast<int32_t>(r[op->rs1]) < op->imm; ISM_NEXT;
+  SLTIU: r[op->rd] = r[op->rs1] < static_cast<mem_val_t>(op->imm); ISM_NEXT;
+  XORI:  r[op->rd] = r[op->rs1] ^ op->imm; ISM_NEXT;
+  ORI:   r[op->rd] = r[op->rs1] | op->imm; ISM_NEXT;
+  ANDI:  r[op->rd] = r[op->rs1] & op->imm; ISM_NEXT;
+  SLLI:  r[op->rd] = r[op->rs1] << op->imm; ISM_NEXT;
+  SRLI:  r[op->rd] = r[op->rs1] >> op->imm; ISM_NEXT;
+  SRAI:  r[op->rd] = static_cast<mem_val_t>(static_cast<int32_t>(r[op->rs1]) >> op->imm); ISM_NEXT;
+  ADD:   r[op->rd] = r[op->rs1] + r[op->rs2]; ISM_NEXT;
+  SUB:   r[op->rd] = r[op->rs1] - r[op->rs2]; ISM_NEXT;
+  SLL:   r[op->rd] = r[op->rs1] << (r[op->rs2] & 0x1f); ISM_NEXT;
+  SLT:   r[op->rd] = static_cast<int32_t>(r[op->rs1]) < static_cast<int32_t>(r[op->rs2]); ISM_NEXT;
+  SLTU:  r[op->rd] = r[op->rs1] < r[op->rs2]; ISM_NEXT;
+  XOR:   r[op->rd] = r[op->rs1] ^ r[op->rs2]; ISM_NEXT;
+  SRL:   r[op->rd] = r[op->rs1] >> (r[op->rs2] & 0x1f); ISM_NEXT;
+  SRA:   r[op->rd] = static_cast<mem_val_t>(static_cast<int32_t>(r[op->rs1]) >> (r[op->rs2] & 0x1f)); ISM_NEXT;
+  OR:    r[op->rd] = r[op->rs1] | r[op->rs2]; ISM_NEXT;
+  AND:   r[op->rd] = r[op->rs1] & r[op->rs2]; ISM_NEXT;
+  INVALID:
+    throw std::runtime_error("Invalid operation");
+  HALT:
+    _instret += op - block->ops.data();
+    _pc = op->next - 4;
+    return false;
+
+  leave:
+    _instret += block->instrs;
+    if(link && *link) {
+      block = *link;
+    } else if(!link && !(pc & 0b11) && pc < RAMSize && _block_at[pc >> 2]) { // jalr: not linked, but looked up
+      block = _block_at[pc >> 2];
+    } else {
+      _pc = pc;
+      _unlinked = link;
+      return true;
+    }
+    op = block->ops.data();
+    goto *op->handler;
+
+#undef ISM_NEXT
+#undef ISM_BRANCH
+#undef ISM_STORE
+  }
+
+public:
+  ThreadedCPU() { execute(nullptr); }
+
+  // via std::cin by default. Pre-assumed the input style.
+  void preload_program(std::istream &is = std::cin) {
+    load_hex_program(is, [this](raw_instr_t raw_instr, mem_ptr_t addr) { write_mem(addr, 4, raw_instr); });
+  }
+
+  mem_val_t get_ret() const {
+    return _regs[10] & 0xff;
+  }
+  mem_val_t get_reg(int i) const { return _regs[i]; }
+
+  std::pair<uint32_t, uint32_t> pred_stat() const { return {-1, -1}; }
+
+  clock_t cycles() const { return _clk; }
+  uint64_t instructions() const { return _instret; }
+
+  bool tick() {
+    Block *block = block_at(_pc);
+    if(_unlinked) {
+      *_unlinked = block;
+      _unlinked = nullptr;
+    }
+    return execute(block);
+  }
+};
+
+}
+
+#endif // ISM_THREADED_CPU_H
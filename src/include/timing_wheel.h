@@ -0,0 +1,51 @@
+#ifndef ISM_TIMING_WHEEL_H
+#define ISM_TIMING_WHEEL_H
+
+#include <bit>
+#include <optional>
+#include <stdexcept>
+
+#include "common.h"
+
+namespace insomnia {
+
+// Wakeups modules ask for, up to Horizon cycles ahead. One bit per cycle.
+// Scheduling a cycle twice, or one that turns out not to be needed, is harmless:
+// the CPU only uses it to know how far nothing can happen (see CPU::tick()).
+class TimingWheel {
+public:
+  static constexpr clock_t Horizon = 64;
+
+  clock_t now() const { return _now; }
+
+  // called by the CPU at the start of every cycle. May jump over cycles.
+  void advance(clock_t to) {
+    clock_t passed = to - _now;
+    if(passed >= Horizon) _slots = 0;
+    else _slots &= ~std::rotl((uint64_t{1} << passed) - 1, static_cast<int>(_now % Horizon));
+    _now = to;
+  }
+
+  // wake up at cycle `at`, in the future.
+  void schedule(clock_t at) {
+    if(at <= _now || at - _now >= Horizon)
+      throw std::runtime_error("TimingWheel: wakeup out of horizon");
+    _slots |= uint64_t{1} << (at % Horizon);
+  }
+
+  // the earliest wakeup after now.
+  std::optional<clock_t> next_event() const {
+    uint64_t later = _slots & ~(uint64_t{1} << (_now % Horizon)); // the bit of now is not now + Horizon
+    uint64_t ahead = std::rotr(later, static_cast<int>((_now + 1) % Horizon));
+    if(!ahead) return std::nullopt;
+    return _now + 1 + std::countr_zero(ahead);
+  }
+
+private:
+  clock_t _now = 0;
+  uint64_t _slots = 0; // bit (t % Horizon) for a wakeup at cycle t
+};
+
+}
+
+#endif // ISM_TIMING_WHEEL_H
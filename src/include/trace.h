@@ -0,0 +1,20 @@
+#ifndef ISM_TRACE_H
+#define ISM_TRACE_H
+
+#include "common.h"
+#include "decode_cache.h"
+
+namespace insomnia {
+
+// One instruction as the functional model committed it (see BCPU::set_trace()).
+// A whole program's trace ends with the halt instruction, whose instr.op is DecodedInstr::Halt.
+struct TraceRecord {
+  mem_ptr_t pc;
+  mem_ptr_t next_pc;  // the branch/jump outcome
+  mem_ptr_t addr;     // effective address of a load/store, 0 otherwise
+  DecodedInstr instr; // operation and register operands
+};
+
+}
+
+#endif // ISM_TRACE_H
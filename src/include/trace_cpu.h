@@ -0,0 +1,748 @@
+#ifndef ISM_TRACE_CPU_H
+#define ISM_TRACE_CPU_H
+
+#include <array>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "cache_tags.h"
+#include "data_cache.h"
+#include "memory_hierarchy.h"
+#include "paged_memory.h"
+#include "ring_buffer.h"
+#include "predictor.h"
+#include "trace.h"
+#include "bcpu.h"
+
+namespace insomnia {
+
+// Timing of the CPU without its values: fed with the trace of the committed instructions (trace.h),
+// it steps the same occupancy, dependencies and latencies cycle by cycle, but computes no result.
+// What it keeps of each unit:
+//   MIU: one line request of each cache at a time, the D-cache's first, timed by the CPU's memory backend
+//        (memory_hierarchy.h). I-cache fills wait while the D-cache has a newer copy of the line.
+//        A reply lasts one cycle, the cache's next request is taken after it.
+//   IC:  the I-cache tags. A hit is answered ICacheHitLatency cycles after the fetch, a miss the cycle after
+//        its fill. A store drops the lines it writes, and a line being filled meanwhile is not kept.
+//   DC:  the D-cache tags, dirty lines and MSHRs: hits answered DCacheHitLatency cycles after, misses
+//        merged or told to retry, dirty lines written back when replaced or wanted by the I-cache.
+//   IFU: queues the fetch block as far as the pc goes through it, up to a jump or a br/jalr, for which
+//        it waits a cycle for the predictor. The next block is fetched once this one is used up.
+//   DU:  one instruction at a time: allocation (a load/store only if the LSB has room), operands
+//        (register file, ROB or broadcast), dispatch.
+//   ALU: executes the cycle after dispatch. LSB: loads (with forwarding) as their addresses are known,
+//        stores after commit and before loads.
+//   ROB: commits one instruction a cycle; a mispredicted br/jalr flushes everything the cycle after.
+// After a mispredicted br/jalr the IFU goes on fetching down the predicted path until the flush.
+// The trace cannot tell what is there, so those instructions are taken as plain ALU ones
+// that read and write no register: they are fetched and dispatched, but never load or store.
+// The D-cache and the L2 cache thus miss the lines the CPU's loads down such a path bring in (and evict).
+// Given the program (set_code()), the IFU follows their jumps and predicted branches as the CPU's does,
+// so that the I-cache sees the same lines.
+// Sized as the CPU's IFU, ROB and LSB; see TraceCPU.
+template <std::size_t IFUCap, std::size_t ROBCap, std::size_t LSBCap>
+class BasicTraceCPU {
+  using ICTags = CacheTags<ICacheSize, ICacheWays, ICacheLineSize>;
+  using DCTags = CacheTags<DCacheSize, DCacheWays, DCacheLineSize>;
+  static constexpr std::size_t FetchWords = FetchBlockSize / 4;
+  static constexpr std::size_t DCReplyCap =
+    DataCache<DCacheSize, DCacheWays, DCacheLineSize, DCacheHitLatency, DCacheMSHRs, DCacheTargets>::ReplyCap;
+
+  // an instruction in the pipeline.
+  struct Op {
+    mem_ptr_t pc = 0, next_pc = 0, addr = 0;
+    mem_ptr_t pred_pc = 0;    // br/jalr: as predicted at fetch
+    uint8_t dst_reg = 0;      // the rd field, as the ROB keeps it
+    uint8_t src[2] = {0, 0};  // registers read, 0 for none
+    mptr_diff_t data_len = 0;
+    bool is_br = false, is_jalr = false, is_load = false, is_store = false, write_rf = false;
+    bool is_halt = false;
+    bool wrong_path = false;  // not in the trace
+  };
+  struct FetchEntry {
+    Op op;
+    bool next_pc_ready = false;
+  };
+  enum class DUState { IDLE, DECODED, WAIT_OPERANDS, OPERANDS_READY, DISPATCHING };
+  struct Operand {
+    bool ready = true;
+    bool from_rf = false;  // read from the register file: arrives the cycle after allocation
+    rob_index_t index = 0; // otherwise waits for the broadcast of this ROB entry
+  };
+  struct ROBEntry {
+    Op op;
+    bool is_ready = false;
+  };
+  struct LSBEntry {
+    bool is_load = false, is_store = false;
+    mptr_diff_t data_len = 0;
+    mem_ptr_t addr = 0;
+    rob_index_t rob_index = 0;
+    bool addr_ready = false, data_ready = false;
+    bool is_sent = false; // a load waiting for the D-cache
+    bool is_executed = false, is_committed = false, is_finished = false;
+  };
+  struct MappingEntry {
+    bool is_ready = true;
+    rob_index_t rob_index = 0;
+  };
+  // what the D-cache asks the MIU for.
+  enum class Port { IDLE, DC_FILL, DC_WRITEBACK };
+  // ids of the caches' requests in the memory backend.
+  enum Requester : uint32_t { DC, IC };
+  struct DCRequest {
+    bool is_load = false, is_store = false;
+    std::size_t index = 0; // LSB entry
+    mem_ptr_t addr = 0;
+    mptr_diff_t data_len = 0;
+  };
+  struct DCAnswer {
+    bool is_load_reply = false, is_store_reply = false;
+    std::size_t index = 0;
+    bool is_retry = false, retry_store = false;
+    std::size_t retry_index = 0;
+  };
+  struct DCTarget {
+    bool is_store = false;
+    std::size_t index = 0;
+  };
+  struct DCMSHR {
+    mem_ptr_t line = 0;
+    bool is_sent = false;
+    std::array<DCTarget, DCacheTargets> targets{};
+    std::size_t target_cnt = 0;
+  };
+  struct DCReply {
+    clock_t at = 0;
+    bool is_store = false;
+    std::size_t index = 0;
+  };
+  struct Broadcast {
+    bool is_valid = false;
+    rob_index_t rob_index = 0;
+  };
+
+public:
+  // the memory image the program starts with, to fetch down mispredicted paths from.
+  void set_code(PagedMemory mem) { _code = std::move(mem); }
+
+  // more of the trace, in order. The halt record ends it.
+  void feed(const TraceRecord *records, std::size_t cnt) {
+    for(std::size_t i = 0; i < cnt && !_trace_ended; ++i) {
+      _trace.push_back(records[i]);
+      _trace_ended = records[i].instr.op == DecodedInstr::Halt;
+    }
+  }
+  void feed(const std::vector<TraceRecord> &records) { feed(records.data(), records.size()); }
+  // whether the next tick() needs more of the trace first: it may take in the next instruction
+  // and ask for the one after.
+  bool starving() const { return !_trace_ended && _fetch_seq + FetchWords - _trace_base >= _trace.size(); }
+
+  // false once the halt instruction is committed.
+  bool tick() {
+    const clock_t clk = ++_clk;
+    // the I-cache hears of a store the cycle after the D-cache takes it.
+    if(_ic_drop_at == clk)
+      for(mem_ptr_t line = ICTags::line_of(_ic_drop_addr); line < _ic_drop_addr + _ic_drop_len; line += ICacheLineSize) {
+        _ic_tags.invalidate(line);
+        if(_ic_filling && line == _ic_fill_line) _ic_fill_stale = true;
+      }
+
+    const bool fill_reply = _miu_ic_reply == clk;
+    const bool dc_fill = _miu_dc_reply == clk && _miu_dc_taken == Port::DC_FILL;
+    const bool dc_written = _miu_dc_reply == clk && _miu_dc_taken == Port::DC_WRITEBACK;
+    if(_flushing) {
+      flush(dc_fill, dc_written);
+      return true;
+    }
+
+    // IFU
+    bool predict_request = false;
+    if(_ic_reply_at == clk)
+      _block_pc = _ic_pc, _block_cnt = (FetchBlockSize - (_ic_pc & ~mem_ptr_t{3}) % FetchBlockSize) / 4;
+    if(_predicting && _predict_at == clk) {
+      auto &entry = _fetch_queue.back();
+      entry.op.pred_pc = _predicted_pc;
+      entry.next_pc_ready = true;
+      if(entry.op.wrong_path || _predicted_pc != entry.op.next_pc) _wrong_path = true, _wrong_pc = _predicted_pc;
+      _predicting = false;
+    }
+    while(!_predicting && in_block() && !_fetch_queue.full() &&
+      (_fetch_queue.empty() || _fetch_queue.front().op.pc != fetch_pc())) {
+      const Op op = fetch_op();
+      bool branch = op.is_br || op.is_jalr;
+      _fetch_queue.push(FetchEntry{op, !branch});
+      if(op.wrong_path) _wrong_pc = op.next_pc;
+      else ++_fetch_seq;
+      if(op.is_halt) _wrong_path = true, _wrong_pc = op.pc + 4; // what follows it is never committed
+      if(branch) _predicting = predict_request = true;
+      _block_pc += 4, --_block_cnt;
+    }
+    bool du_input = false;
+    Op du_op;
+    if(_du_state == DUState::IDLE && !_fetch_queue.empty() && _fetch_queue.front().next_pc_ready) {
+      du_op = _fetch_queue.front().op;
+      du_input = true;
+      _fetch_queue.pop();
+    }
+    // it asks for the next block once this one is used up, unless waiting for the predictor or full,
+    // as this cycle leaves it.
+    bool fetch_request = !_predicting && !in_block() && !_fetch_queue.full() &&
+      (_fetch_queue.empty() || _fetch_queue.front().op.pc != fetch_pc());
+
+    // DU, with the ROB as it is at the start of the cycle.
+    DUState du_next = _du_state;
+    bool allocated = false;
+    switch(_du_state) {
+    case DUState::IDLE:
+      if(du_input) _du_op = du_op, du_next = DUState::DECODED;
+      break;
+    case DUState::DECODED:
+      if(!_rob.full() && !((_du_op.is_load || _du_op.is_store) && _lsb.full())) {
+        _rob.push(ROBEntry{_du_op, false});
+        _du_rob_index = _rob.back_index();
+        allocated = true;
+        for(int i = 0; i < 2; ++i) {
+          auto reg = _du_op.src[i];
+          Operand &src = _du_src[i];
+          src = Operand{};
+          if(reg == 0) continue;
+          bool in_rob = false; // its youngest older writer is done
+          for(auto it = _rob.begin(); it != _rob.end(); ++it)
+            if(it.index() != _du_rob_index && it->op.write_rf && it->op.dst_reg == reg) in_rob = it->is_ready;
+          if(in_rob) continue;
+          src.ready = false;
+          if(_mapping[reg].is_ready) src.from_rf = true;
+          else src.index = _mapping[reg].rob_index;
+        }
+        _rf_reply_at = clk + 1;
+        du_next = DUState::WAIT_OPERANDS;
+      }
+      break;
+    case DUState::WAIT_OPERANDS:
+      if(_rf_reply_at == clk)
+        for(auto &src: _du_src)
+          if(src.from_rf) src.ready = true;
+      break;
+    case DUState::OPERANDS_READY:
+      _alu_at = clk + 1;
+      _alu_index = _du_rob_index;
+      _alu_load_store = _du_op.is_load || _du_op.is_store;
+      if(_alu_load_store)
+        _lsb.push(LSBEntry{
+          .is_load = _du_op.is_load, .is_store = _du_op.is_store, .data_len = _du_op.data_len,
+          .addr = _du_op.addr, .rob_index = _du_rob_index, .data_ready = _du_op.is_store
+        });
+      du_next = DUState::DISPATCHING;
+      break;
+    case DUState::DISPATCHING:
+      du_next = DUState::IDLE;
+      break;
+    }
+
+    // ALU: what was dispatched last cycle.
+    Broadcast alu_broadcast, lsb_broadcast;
+    bool alu_load_store = false;
+    if(_alu_at == clk) {
+      alu_broadcast = {true, _alu_index};
+      alu_load_store = _alu_load_store;
+    }
+
+    // LSB, up to what it tells the ROB.
+    const DCAnswer dc = _dc_answer;
+    if(dc.is_load_reply) {
+      auto &entry = _lsb.at(dc.index);
+      entry.is_sent = false;
+      if(!entry.data_ready) {
+        entry.data_ready = entry.is_executed = true;
+        lsb_broadcast = {true, entry.rob_index};
+      }
+    }
+    if(dc.is_retry && !dc.retry_store) _lsb.at(dc.retry_index).is_sent = false;
+    if(_accept_addr) _lsb.at(_addr_index).addr_ready = true;
+    _accept_addr = false;
+    if(alu_broadcast.is_valid)
+      for(auto it = _lsb.begin(); it != _lsb.end(); ++it)
+        if(!it->addr_ready && it->rob_index == alu_broadcast.rob_index)
+          _accept_addr = true, _addr_index = it.index();
+    // the oldest load not sent: forwarded to now, or sent below unless a store is.
+    bool load_ready = false;
+    std::size_t load_index = 0;
+    for(auto it = _lsb.begin(); it != _lsb.end(); ++it) {
+      if(!it->is_load || it->data_ready || it->is_sent) continue;
+      auto &entry = _lsb.at(it.index());
+      mem_ptr_t addr = entry.addr_ready ? entry.addr : 0;
+      bool has_reliance = false;
+      for(auto older = it; older != _lsb.begin(); ) {
+        const auto &store = *--older;
+        if(!store.is_store) continue;
+        if(!store.addr_ready || (store.addr < addr + entry.data_len && addr < store.addr + store.data_len)) {
+          has_reliance = true;
+          if(entry.addr_ready && store.addr_ready && store.addr == addr &&
+            store.data_ready && store.data_len == entry.data_len && !lsb_broadcast.is_valid) {
+            entry.data_ready = entry.is_executed = true;
+            lsb_broadcast = {true, entry.rob_index};
+          }
+          break;
+        }
+      }
+      load_ready = entry.addr_ready && !has_reliance;
+      load_index = it.index();
+      break;
+    }
+    Broadcast store_done;
+    for(auto it = _lsb.begin(); it != _lsb.end(); ++it)
+      if(it->is_store && !it->is_executed && it->addr_ready && it->data_ready) {
+        _lsb.at(it.index()).is_executed = true;
+        store_done = {true, it->rob_index};
+        break;
+      }
+
+    // ROB
+    auto set_ready = [this](const Broadcast &b) {
+      if(b.is_valid && _rob.index_valid(b.rob_index)) _rob.at(b.rob_index).is_ready = true;
+    };
+    if(!alu_load_store) set_ready(alu_broadcast);
+    set_ready(lsb_broadcast);
+    set_ready(store_done);
+    Broadcast committed;
+    if(!_rob.empty() && _rob.front().is_ready) {
+      const Op &op = _rob.front().op;
+      rob_index_t index = _rob.front_index();
+      if(op.is_halt) {
+        _halted = true;
+      } else if(op.is_br || op.is_jalr) {
+        bool right = op.pred_pc == op.next_pc;
+        _pred_total++, _pred_success += right;
+        _tables.learn(op.pc, op.is_br, right, op.next_pc);
+        if(!right) _flushing = true;
+        else if(op.write_rf) committed = {true, index};
+      } else {
+        if(op.is_load || op.is_store)
+          for(auto it = _lsb.begin(); it != _lsb.end(); ++it)
+            if(!it->is_committed && it->rob_index == index) {
+              auto &entry = _lsb.at(it.index());
+              entry.is_committed = true;
+              entry.is_finished = entry.is_load;
+              break;
+            }
+        if(op.write_rf) committed = {true, index};
+      }
+      if(!_halted) {
+        ++_instret;
+        _trace.pop_front();
+        ++_trace_base;
+      }
+      _rob.pop();
+    }
+
+    // LSB: stores go to memory once committed, loads when no store does.
+    if(dc.is_store_reply) _lsb.at(dc.index).is_finished = true, _store_sent = false;
+    if(dc.is_retry && dc.retry_store) _store_sent = false;
+    DCRequest request;
+    if(!_lsb.empty()) {
+      const auto &front = _lsb.front();
+      if(front.is_store && front.is_executed && front.is_committed && !front.is_finished && !_store_sent) {
+        request = {.is_store = true, .index = _lsb.front_index(), .addr = front.addr, .data_len = front.data_len};
+        _store_sent = true;
+      }
+    }
+    if(load_ready && !request.is_store) {
+      auto &entry = _lsb.at(load_index);
+      request = {.is_load = true, .index = load_index, .addr = entry.addr, .data_len = entry.data_len};
+      entry.is_sent = true;
+    }
+    while(!_lsb.empty() && _lsb.front().is_finished) _lsb.pop();
+
+    // what the DU learns at the edge: the mapping table and the operands broadcast this cycle.
+    if(allocated && _du_op.write_rf && _du_op.dst_reg != 0) _mapping[_du_op.dst_reg] = {false, _du_rob_index};
+    auto release = [this](const Broadcast &b) {
+      if(!b.is_valid) return;
+      for(std::size_t i = 1; i < RFSize; ++i)
+        if(!_mapping[i].is_ready && _mapping[i].rob_index == b.rob_index) _mapping[i].is_ready = true;
+    };
+    release(lsb_broadcast);
+    if(!alu_load_store) release(alu_broadcast);
+    release(committed);
+    if(du_next == DUState::WAIT_OPERANDS) {
+      for(auto &src: _du_src) {
+        if(src.ready || src.from_rf) continue;
+        if((lsb_broadcast.is_valid && src.index == lsb_broadcast.rob_index) ||
+          (alu_broadcast.is_valid && (!alu_load_store || _du_state == DUState::WAIT_OPERANDS) &&
+            src.index == alu_broadcast.rob_index))
+          src.ready = true;
+      }
+      if(_du_src[0].ready && _du_src[1].ready) du_next = DUState::OPERANDS_READY;
+    }
+    _du_state = du_next;
+
+    // the predictor answers next cycle, having learnt from this cycle's commit.
+    if(predict_request) {
+      const Op &op = _fetch_queue.back().op; // not ready, so still there
+      _predicted_pc = _tables.predict(op.pc, op.is_br);
+      _predict_at = clk + 1;
+    }
+
+    // what the MIU sees of the caches this cycle, as the last edge left them.
+    const bool ic_request = _ic_filling && clk >= _ic_fill_from;
+    const mem_ptr_t ic_line = _ic_fill_line;
+    const Port dc_request = _dc_request;
+    const mem_ptr_t dc_line = _dc_request_line;
+    const bool hold_ic = ic_request && dc_newer(ic_line);
+
+    // I-cache, at the edge: a fill comes in, or a fetch is taken.
+    if(fill_reply) {
+      if(!_ic_fill_stale) _ic_tags.allocate(_ic_fill_line);
+      _ic_filling = false;
+      _ic_reply_at = _ic_free = clk + 1;
+    } else if(!_ic_filling && clk >= _ic_free && fetch_request) {
+      mem_ptr_t pc = _ic_pc = fetch_pc();
+      typename ICTags::Slot slot;
+      if(_ic_tags.lookup(pc, slot)) {
+        _ic_reply_at = _ic_free = clk + ICacheHitLatency;
+      } else {
+        _ic_filling = true;
+        _ic_fill_stale = false;
+        _ic_fill_line = ICTags::line_of(pc);
+        _ic_fill_from = clk + 1;
+      }
+    }
+
+    dc_edge(clk, false, dc_fill, dc_written, request, ic_request, ic_line);
+
+    miu_edge(clk, false, dc_request, dc_line, ic_request && !hold_ic, ic_line);
+    return !_halted;
+  }
+
+  clock_t cycles() const { return _clk; }
+  uint64_t instructions() const { return _instret; }
+  std::pair<uint32_t, uint32_t> pred_stat() const { return {_pred_success, _pred_total}; }
+
+private:
+  clock_t _clk = 0;
+  uint64_t _instret = 0;
+  bool _halted = false;
+
+  PagedMemory _code;
+
+  // the trace from the oldest instruction not committed on.
+  std::deque<TraceRecord> _trace;
+  uint64_t _trace_base = 0;  // index in the trace of _trace.front()
+  bool _trace_ended = false;
+
+  // IFU
+  ring_buffer<FetchEntry, IFUCap> _fetch_queue;
+  uint64_t _fetch_seq = 0;   // index in the trace of the next instruction to fetch
+  bool _wrong_path = false;  // fetching from _wrong_pc instead
+  mem_ptr_t _wrong_pc = 0;
+  mem_ptr_t _block_pc = 0;   // the fetch block: the next word in it
+  std::size_t _block_cnt = 0; // and the words left
+  bool _predicting = false;
+  clock_t _predict_at = 0;
+  mem_ptr_t _predicted_pc = 0;
+  PredictorTables _tables;
+  uint32_t _pred_success = 0, _pred_total = 0;
+
+  // IC
+  ICTags _ic_tags;
+  mem_ptr_t _ic_pc = 0;       // being fetched
+  clock_t _ic_reply_at = 0;   // when the IFU gets it
+  clock_t _ic_free = 0;       // first cycle at whose end a fetch can be taken
+  bool _ic_filling = false;   // missed, waiting for the line
+  bool _ic_fill_stale = false; // a store has written it meanwhile
+  mem_ptr_t _ic_fill_line = 0;
+  clock_t _ic_fill_from = 0;  // first cycle at whose end the MIU can take the fill
+  clock_t _ic_drop_at = 0;    // when a store drops the lines it writes
+  mem_ptr_t _ic_drop_addr = 0;
+  mptr_diff_t _ic_drop_len = 0;
+
+  // MIU
+  MemoryBackend _memory;
+  bool _miu_dc_waiting = false, _miu_ic_waiting = false; // a request taken, not answered yet
+  clock_t _miu_dc_reply = 0, _miu_ic_reply = 0;          // the cycle its answer is on the wires in
+  Port _miu_dc_taken = Port::IDLE;                       // what the D-cache asked for
+  clock_t _miu_next = MemoryNever;                       // the next edge the backend has something to do at
+
+  // DC
+  DCTags _dc_tags;
+  std::array<std::array<bool, DCacheWays>, DCTags::Sets> _dc_dirty{};
+  ring_buffer<DCMSHR, DCacheMSHRs> _dc_mshrs;
+  ring_buffer<DCReply, DCReplyCap> _dc_replies;
+  std::size_t _dc_load_targets = 0;
+  bool _dc_writeback = false;     // a dirty line on its way to memory
+  mem_ptr_t _dc_writeback_line = 0;
+  Port _dc_request = Port::IDLE;  // to the MIU, from the next cycle on
+  mem_ptr_t _dc_request_line = 0;
+  DCAnswer _dc_answer;            // to the LSB, the next cycle
+
+  // DU
+  DUState _du_state = DUState::IDLE;
+  Op _du_op;
+  rob_index_t _du_rob_index = 0;
+  Operand _du_src[2];
+  clock_t _rf_reply_at = 0;
+  std::array<MappingEntry, RFSize> _mapping;
+
+  // ALU
+  clock_t _alu_at = 0;
+  rob_index_t _alu_index = 0;
+  bool _alu_load_store = false;
+
+  // ROB
+  ring_buffer<ROBEntry, ROBCap> _rob;
+  bool _flushing = false;
+
+  // LSB
+  ring_buffer<LSBEntry, LSBCap> _lsb;
+  bool _store_sent = false; // the front store, until the D-cache has it
+  bool _accept_addr = false;
+  std::size_t _addr_index = 0;
+
+  static Op decode(const TraceRecord &rec) {
+    Op op;
+    op.pc = rec.pc;
+    op.next_pc = rec.next_pc;
+    op.addr = rec.addr;
+    const auto &instr = rec.instr;
+    if(instr.op == DecodedInstr::Halt) { // li a0, 255
+      op.dst_reg = 10;
+      op.write_rf = op.is_halt = true;
+      return op;
+    }
+    auto type = static_cast<InstrType>(instr.op);
+    op.dst_reg = instr.rd;
+    op.is_br = InstrType::BEQ <= type && type <= InstrType::BGEU;
+    op.is_jalr = type == InstrType::JALR;
+    op.is_load = InstrType::LB <= type && type <= InstrType::LHU;
+    op.is_store = InstrType::SB <= type && type <= InstrType::SW;
+    op.write_rf = !op.is_br && !op.is_store;
+    if(type != InstrType::LUI && type != InstrType::AUIPC && type != InstrType::JAL) op.src[0] = instr.rs1;
+    if(op.is_br || op.is_store || type >= InstrType::ADD) op.src[1] = instr.rs2;
+    switch(type) {
+    case InstrType::LB: case InstrType::LBU: case InstrType::SB: op.data_len = 1; break;
+    case InstrType::LH: case InstrType::LHU: case InstrType::SH: op.data_len = 2; break;
+    case InstrType::LW: case InstrType::SW: op.data_len = 4; break;
+    default: break;
+    }
+    return op;
+  }
+
+  bool in_block() const { return _block_cnt && _block_pc == fetch_pc(); }
+  mem_ptr_t fetch_pc() const { return _wrong_path ? _wrong_pc : _trace[_fetch_seq - _trace_base].pc; }
+  Op fetch_op() const {
+    if(!_wrong_path) return decode(_trace[_fetch_seq - _trace_base]);
+    Op op;
+    op.pc = _wrong_pc;
+    op.next_pc = _wrong_pc + 4;
+    op.wrong_path = true;
+    Instruction instr{_code.read(_wrong_pc, 4)};
+    if(instr.is_jal()) op.next_pc = _wrong_pc + instr.imm();
+    op.is_br = instr.is_br();
+    op.is_jalr = instr.is_jalr();
+    return op;
+  }
+
+  // the D-cache at the edge, as DataCache::edge().
+  void dc_edge(clock_t clk, bool flush, bool fill, bool written, const DCRequest &req,
+    bool ic_request, mem_ptr_t ic_line) {
+    _dc_answer = {};
+    if(flush) {
+      for(std::size_t k = _dc_replies.size(); k--; ) {
+        DCReply reply = _dc_replies.front();
+        _dc_replies.pop();
+        if(reply.is_store) _dc_replies.push(reply);
+      }
+      for(auto it = _dc_mshrs.begin(); it != _dc_mshrs.end(); ++it) {
+        auto &mshr = _dc_mshrs.at(it.index());
+        std::size_t kept = 0;
+        for(std::size_t k = 0; k < mshr.target_cnt; ++k)
+          if(mshr.targets[k].is_store) mshr.targets[kept++] = mshr.targets[k];
+        mshr.target_cnt = kept;
+      }
+      _dc_load_targets = 0;
+    }
+    if(fill) {
+      auto &mshr = _dc_mshrs.front();
+      bool evicted;
+      mem_ptr_t victim;
+      auto slot = _dc_tags.allocate(mshr.line, evicted, victim);
+      if(evicted && _dc_dirty[slot.set][slot.way]) dc_write_back(victim, slot);
+      _dc_dirty[slot.set][slot.way] = false;
+      for(std::size_t k = 0; k < mshr.target_cnt; ++k) {
+        if(mshr.targets[k].is_store) {
+          _dc_dirty[slot.set][slot.way] = true;
+        } else {
+          dc_reply(clk, false, mshr.targets[k].index);
+          --_dc_load_targets;
+        }
+      }
+      _dc_mshrs.pop();
+      _dc_request = Port::IDLE;
+    }
+    if(written) _dc_writeback = false, _dc_request = Port::IDLE;
+    if(req.is_load || req.is_store) dc_take(clk, req);
+    if(!_dc_writeback && _dc_request == Port::IDLE && ic_request) {
+      typename DCTags::Slot slot;
+      for(mem_ptr_t line = DCTags::line_of(ic_line); line < ic_line + ICacheLineSize; line += DCacheLineSize)
+        if(_dc_tags.find(line, slot) && _dc_dirty[slot.set][slot.way]) {
+          dc_write_back(line, slot);
+          break;
+        }
+    }
+    if(_dc_request == Port::IDLE) {
+      if(_dc_writeback) {
+        _dc_request = Port::DC_WRITEBACK;
+        _dc_request_line = _dc_writeback_line;
+      } else if(!_dc_mshrs.empty() && !_dc_mshrs.front().is_sent) {
+        _dc_mshrs.front().is_sent = true;
+        _dc_request = Port::DC_FILL;
+        _dc_request_line = _dc_mshrs.front().line;
+      }
+    }
+    if(!_dc_replies.empty() && _dc_replies.front().at <= clk + 1) {
+      const auto &reply = _dc_replies.front();
+      (reply.is_store ? _dc_answer.is_store_reply : _dc_answer.is_load_reply) = true;
+      _dc_answer.index = reply.index;
+      _dc_replies.pop();
+    }
+  }
+
+  void dc_take(clock_t clk, const DCRequest &req) {
+    mem_ptr_t line = DCTags::line_of(req.addr);
+    typename DCTags::Slot slot;
+    DCMSHR *mshr = nullptr;
+    bool hit = false;
+    bool taken = _dc_replies.size() + _dc_load_targets < DCReplyCap;
+    if(taken) {
+      for(auto it = _dc_mshrs.begin(); it != _dc_mshrs.end(); ++it)
+        if(it->line == line) mshr = &_dc_mshrs.at(it.index());
+      hit = !mshr && _dc_tags.lookup(req.addr, slot);
+      taken = hit || (mshr ? mshr->target_cnt < DCacheTargets : !_dc_mshrs.full());
+    }
+    if(!taken) {
+      _dc_answer.is_retry = true;
+      _dc_answer.retry_store = req.is_store;
+      _dc_answer.retry_index = req.index;
+      return;
+    }
+    if(hit) {
+      if(req.is_store) _dc_dirty[slot.set][slot.way] = true;
+      else dc_reply(clk, false, req.index);
+    } else {
+      if(!mshr) {
+        _dc_mshrs.push(DCMSHR{.line = line});
+        mshr = &_dc_mshrs.back();
+      }
+      mshr->targets[mshr->target_cnt++] = {req.is_store, req.index};
+      if(!req.is_store) ++_dc_load_targets;
+    }
+    if(req.is_store) {
+      dc_reply(clk, true, req.index);
+      _ic_drop_at = clk + 1;
+      _ic_drop_addr = req.addr;
+      _ic_drop_len = req.data_len;
+    }
+  }
+
+  void dc_reply(clock_t clk, bool is_store, std::size_t index) {
+    _dc_replies.push(DCReply{static_cast<clock_t>(clk + DCacheHitLatency), is_store, index});
+  }
+  void dc_write_back(mem_ptr_t line, typename DCTags::Slot slot) {
+    _dc_writeback = true;
+    _dc_writeback_line = line;
+    _dc_dirty[slot.set][slot.way] = false;
+  }
+
+  // the MIU at the edge, as MemoryInterfaceUnit::edge().
+  void miu_edge(clock_t clk, bool flush, Port dc_request, mem_ptr_t dc_line, bool ic_request, mem_ptr_t ic_line) {
+    if(flush && _miu_ic_waiting) _memory.cancel(IC, clk), _miu_ic_waiting = false;
+    bool taken = false;
+    if(dc_request != Port::IDLE && !_miu_dc_waiting && _miu_dc_reply != clk &&
+      _memory.access(DC, dc_line, DCacheLineSize, dc_request == Port::DC_WRITEBACK, clk))
+      _miu_dc_waiting = taken = true, _miu_dc_taken = dc_request;
+    if(ic_request && !_miu_ic_waiting && _miu_ic_reply != clk && _memory.access(IC, ic_line, ICacheLineSize, false, clk))
+      _miu_ic_waiting = taken = true;
+    if(!taken && clk < _miu_next) return; // nothing for the backend to do
+    _memory.edge(clk, [this, clk](uint32_t id) {
+      if(id == DC) _miu_dc_waiting = false, _miu_dc_reply = clk + 1;
+      else _miu_ic_waiting = false, _miu_ic_reply = clk + 1;
+    });
+    _miu_next = _memory.next_event(clk);
+  }
+
+  // whether the D-cache has (or is to have) a newer copy of some of the I-cache line.
+  bool dc_newer(mem_ptr_t ic_line) const {
+    for(mem_ptr_t line = DCTags::line_of(ic_line); line < ic_line + ICacheLineSize; line += DCacheLineSize) {
+      if(typename DCTags::Slot slot; _dc_tags.find(line, slot) && _dc_dirty[slot.set][slot.way]) return true;
+      if(_dc_writeback && _dc_writeback_line == line) return true;
+      for(const auto &mshr: _dc_mshrs)
+        if(mshr.line == line) return true;
+    }
+    return false;
+  }
+
+  // the cycle after a mispredicted br/jalr is committed: everything in flight is dropped,
+  // stores already committed excepted. Fetching starts again right after the br/jalr.
+  // The D-cache and the MIU go on with what they do for those stores.
+  void flush(bool dc_fill, bool dc_written) {
+    const clock_t clk = _clk;
+    _flushing = false;
+    _rob.clear();
+    _fetch_queue.clear();
+    _block_cnt = 0;
+    _fetch_seq = _trace_base;
+    _wrong_path = _predicting = false;
+    _du_state = DUState::IDLE;
+    for(auto &entry: _mapping) entry.is_ready = true;
+    _alu_at = 0;
+    while(!_lsb.empty() && !_lsb.back().is_committed) _lsb.pop_back();
+    if(_dc_answer.is_store_reply) _lsb.at(_dc_answer.index).is_finished = true, _store_sent = false;
+    if(_dc_answer.is_retry && _dc_answer.retry_store) _store_sent = false;
+    while(!_lsb.empty() && _lsb.front().is_finished) _lsb.pop();
+    _accept_addr = false;
+    const Port dc_request = _dc_request;
+    const mem_ptr_t dc_line = _dc_request_line;
+    dc_edge(clk, true, dc_fill, dc_written, DCRequest{}, false, 0);
+    miu_edge(clk, true, dc_request, dc_line, false, 0);
+    _ic_filling = false;
+    _ic_reply_at = 0;
+    _ic_free = clk + 1;
+  }
+};
+
+using TraceCPU = BasicTraceCPU<IFUSize, ROBSize, LSBSize>;
+
+struct TraceResult {
+  mem_val_t ret = 0;
+  uint64_t instructions = 0;
+  clock_t cycles = 0;  // of the timing model
+  std::pair<uint32_t, uint32_t> pred_stat;
+};
+
+// The decoupled mode: BCPU runs ahead and hands its trace over in batches of `batch` records;
+// TraceCPU times it.
+inline TraceResult run_trace(std::istream &program, std::size_t batch = 4096) {
+  auto functional = std::make_unique<BCPU>();
+  functional->preload_program(program);
+  std::vector<TraceRecord> records;
+  records.reserve(batch);
+  functional->set_trace(&records);
+  auto timing = std::make_unique<TraceCPU>();
+  timing->set_code(functional->arch_state().mem);
+  bool running = true;
+  do {
+    while(running && timing->starving()) {
+      records.clear();
+      while(records.size() < batch && (running = functional->tick())) {}
+      timing->feed(records);
+    }
+  } while(timing->tick());
+  return {functional->get_ret(), timing->instructions(), timing->cycles(), timing->pred_stat()};
+}
+
+}
+
+#endif // ISM_TRACE_CPU_H
@@ -0,0 +1,134 @@
+#ifndef ISM_TRACE_PIPELINE_H
+#define ISM_TRACE_PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "bcpu.h"
+#include "spsc_ring.h"
+#include "trace.h"
+#include "trace_cpu.h"
+
+namespace insomnia {
+
+// How one side of the pipeline spent its time.
+struct StageStats {
+  uint64_t records = 0;
+  double seconds = 0;  // from its start to its end
+  double waiting = 0;  // of those, blocked on the queue: full for the producer, empty for the consumer
+
+  double busy() const { return seconds - waiting; }
+  // records a second when not waiting: what the stage could do on its own.
+  double throughput() const { return busy() > 0 ? records / busy() : 0; }
+};
+
+struct PipelineResult : TraceResult {
+  StageStats functional, timing;
+  double seconds = 0;  // host time of the whole run
+
+  // the stage that waited less is the one holding the other up.
+  bool functional_bound() const { return functional.waiting < timing.waiting; }
+};
+
+// run_trace() on two threads: BCPU produces the trace on its own thread while TraceCPU times it
+// on the calling one. Records go through a bounded lock-free queue, `batch` at a time each way;
+// BCPU waits while it is full (backpressure), TraceCPU while it is empty.
+// Host time is then about that of the slower stage rather than the sum of both.
+//
+// The consumer is TraceCPU, not the CPU. The CPU is execution-driven: each unit computes its own values,
+// and what gets fetched, issued and flushed follows from them, so there is nowhere to take an outcome
+// from a record. TraceCPU steps the same units cycle by cycle with the records as its oracle and takes
+// exactly the CPU's cycles (--timing compare, and the .timing tests in CMakeLists.txt).
+template <std::size_t QueueCap = 1 << 14>
+PipelineResult run_trace_threaded(std::istream &program, std::size_t batch = 256) {
+  using Clock = std::chrono::steady_clock;
+  auto seconds = [](Clock::duration d) { return std::chrono::duration<double>(d).count(); };
+  if(batch == 0 || batch > QueueCap) throw std::runtime_error("trace pipeline: batch must fit in the queue");
+  auto functional = std::make_unique<BCPU>();
+  functional->preload_program(program);
+  auto queue = std::make_unique<spsc_ring<TraceRecord, QueueCap>>();
+  auto timing = std::make_unique<TraceCPU>();
+  timing->set_code(functional->arch_state().mem);
+  PipelineResult res;
+  std::atomic<bool> produced{false}; // the producer has pushed its last record (or failed)
+  std::atomic<bool> abandoned{false}; // the consumer has failed: stop waiting for room
+  std::exception_ptr error;
+
+  const auto beg = Clock::now();
+  std::thread producer([&] {
+    auto &stats = res.functional;
+    std::vector<TraceRecord> records;
+    records.reserve(batch);
+    functional->set_trace(&records);
+    try {
+      for(bool running = true; running && !abandoned.load(std::memory_order_relaxed);) {
+        records.clear();
+        while(records.size() < batch && (running = functional->tick())) {}
+        std::size_t sent = queue->try_push(records.data(), records.size());
+        if(sent < records.size()) {
+          auto wait_beg = Clock::now();
+          while(sent < records.size() && !abandoned.load(std::memory_order_relaxed)) {
+            std::this_thread::yield();
+            sent += queue->try_push(records.data() + sent, records.size() - sent);
+          }
+          stats.waiting += seconds(Clock::now() - wait_beg);
+        }
+        stats.records += sent;
+      }
+    } catch(...) {
+      error = std::current_exception();
+    }
+    stats.seconds = seconds(Clock::now() - beg);
+    produced.store(true, std::memory_order_release);
+  });
+
+  auto &stats = res.timing;
+  std::vector<TraceRecord> records(batch);
+  try {
+    for(;;) {
+      while(timing->starving()) {
+        if(std::size_t cnt = queue->try_pop(records.data(), batch)) {
+          timing->feed(records.data(), cnt);
+          stats.records += cnt;
+          continue;
+        }
+        auto wait_beg = Clock::now();
+        std::size_t cnt = 0;
+        for(bool done = false; !cnt && !done;) {
+          done = produced.load(std::memory_order_acquire); // read first: nothing is pushed after it is set
+          if(!(cnt = queue->try_pop(records.data(), batch)) && !done) std::this_thread::yield();
+        }
+        stats.waiting += seconds(Clock::now() - wait_beg);
+        if(!cnt) break; // the producer is done (or failed) without a halt record
+        timing->feed(records.data(), cnt);
+        stats.records += cnt;
+      }
+      if(timing->starving() || !timing->tick()) break;
+    }
+  } catch(...) {
+    abandoned.store(true, std::memory_order_relaxed);
+    producer.join();
+    throw;
+  }
+  stats.seconds = seconds(Clock::now() - beg);
+  producer.join();
+  res.seconds = seconds(Clock::now() - beg);
+  if(error) std::rethrow_exception(error);
+  if(timing->starving()) throw std::runtime_error("trace pipeline: the trace ended without a halt");
+
+  res.ret = functional->get_ret();
+  res.instructions = timing->instructions();
+  res.cycles = timing->cycles();
+  res.pred_stat = timing->pred_stat();
+  return res;
+}
+
+}
+
+#endif // ISM_TRACE_PIPELINE_H
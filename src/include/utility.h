@@ -1,8 +1,10 @@
 #ifndef ISM_UTILITY_H
 #define ISM_UTILITY_H
 
+#include <istream>
+#include <limits>
+
 #include "common.h"
-#include "circular_queue.h"
 
 namespace insomnia {
 
@@ -54,6 +56,35 @@ inline uint32_t ToSmallEndian32_8(uint32_t bigEndian) {
   return (s31_24 << 24) | (s23_16 << 16) | (s15_8 << 8) | (s7_0 << 0);
 }
 
+// reads a program in hex dump style ("@address" then bytes), until EOF or '&'.
+// store(word, addr) is called for every 4 bytes.
+template <class Store>
+void load_hex_program(std::istream &is, Store &&store) {
+  mem_ptr_t cur_ptr = 0, diff_ptr = 0;
+  mem_val_t raw_instr = 0;
+  int hex_cnt = 0;
+  // the character & is designed for debug.
+  for(char ch = is.get(); ch != EOF && ch != '&'; ch = is.get()) {
+    if(is_delim(ch)) continue;
+    if(ch == '@') {
+      cur_ptr = 0;
+      for(int i = 0; i < 8; ++i) {
+        ch = is.get();
+        cur_ptr = (cur_ptr << 4) | hex2dec(ch);
+      }
+      diff_ptr = 0;
+      continue;
+    }
+    raw_instr = (raw_instr << 4) | hex2dec(ch);
+    if(++hex_cnt == 8) {
+      store(ToSmallEndian32_8(raw_instr), cur_ptr + diff_ptr);
+      hex_cnt = 0;
+      raw_instr = 0;
+      diff_ptr += 4;
+    }
+  }
+}
+
 /*
 // concatenate the lower digits of two values
 template <std::integral To, int Len1, int Len2, std::integral Left, std::integral Right>
@@ -0,0 +1,27 @@
+#ifndef ISM_WARMING_H
+#define ISM_WARMING_H
+
+#include "common.h"
+#include "predictor.h"
+#include "decode_cache.h"
+
+namespace insomnia {
+
+// Long-lived microarchitectural state, trained while the program runs functionally (BCPU::set_warming())
+// so that a detailed sample does not start cold. Handed to and from the CPU with load_warming()/save_warming().
+struct Warming {
+  PredictorTables predictor;
+
+  // instr at pc has been executed; the next one is at next_pc.
+  void retire(mem_ptr_t pc, const DecodedInstr &instr, mem_ptr_t next_pc) {
+    auto type = static_cast<InstrType>(instr.op);
+    bool is_br = InstrType::BEQ <= type && type <= InstrType::BGEU;
+    // as the ROB reports it at commit; the prediction is the one the tables give now.
+    if(is_br || type == InstrType::JALR)
+      predictor.learn(pc, is_br, predictor.predict(pc, is_br) == next_pc, next_pc);
+  }
+};
+
+}
+
+#endif // ISM_WARMING_H
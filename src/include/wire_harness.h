@@ -1,6 +1,8 @@
 #ifndef ISM_WIRE_HARNESS_H
 #define ISM_WIRE_HARNESS_H
 
+#include <compare>
+
 #include "common.h"
 #include "instruction.h"
 
@@ -17,40 +19,125 @@
 // output structs be in front of input structs
 
 namespace insomnia {
-// load raw instruction
-struct WH_MIU_IFU {
+
+// Base of every harness: bookkeeping that is not part of the value on the wires.
+// Comparisons ignore it, and drive() keeps it when the value is replaced.
+template <class WH>
+struct WireHarness {
+  // counts real value changes. A listener that remembers it can tell whether anything
+  // arrived since it last looked, without comparing values.
+  uint32_t generation = 0;
+
+  // The only way modules write their outputs. Returns whether the value really changed,
+  // which is what goes into the wire mask of update().
+  // A harness with an is_valid flag carries nothing while it is unset: such a value is stored
+  // as WH{}, and two of them are equal without looking at the rest.
+  bool drive(const WH &next) {
+    auto &self = static_cast<WH &>(*this);
+    if constexpr(requires { next.is_valid; }) {
+      if(!next.is_valid) {
+        if(!self.is_valid) return false;
+        return replace(WH{});
+      }
+    }
+    if(self == next) return false;
+    return replace(next);
+  }
+
+  bool operator==(const WireHarness &) const { return true; }
+  std::strong_ordering operator<=>(const WireHarness &) const { return std::strong_ordering::equal; }
+
+private:
+  bool replace(const WH &next) {
+    uint32_t gen = generation;
+    static_cast<WH &>(*this) = next;
+    generation = gen + 1;
+    return true;
+  }
+};
+
+// raw instructions, from instr_addr to the end of its fetch block (see FetchBlockSize).
+// From the I-cache, which answers fetches in the MIU's place.
+struct WH_MIU_IFU : WireHarness<WH_MIU_IFU> {
   bool is_valid = false;
-  raw_instr_t raw_instr{};
-  mem_ptr_t instr_addr;
+  uint8_t instr_cnt = 0;
+  mem_ptr_t instr_addr{}; // of the first one
+  std::array<raw_instr_t, FetchBlockSize / 4> raw_instrs{};
   auto operator<=>(const WH_MIU_IFU &) const = default;
 };
 
 // instruction load request
-struct WH_IFU_MIU {
+struct WH_IFU_MIU : WireHarness<WH_IFU_MIU> {
   bool is_valid = false;
   mem_ptr_t pc{};
   auto operator<=>(const WH_IFU_MIU &) const = default;
 };
 
-// load data
-struct WH_MIU_LSB {
+// I-cache line fill request
+struct WH_IC_MIU : WireHarness<WH_IC_MIU> {
+  bool is_valid = false;
+  mem_ptr_t addr{}; // of the line
+  auto operator<=>(const WH_IC_MIU &) const = default;
+};
+
+// I-cache line fill
+struct WH_MIU_IC : WireHarness<WH_MIU_IC> {
+  bool is_fill = false;
+  mem_ptr_t addr{}; // of the line
+  std::array<uint8_t, ICacheLineSize> line{};
+  auto operator<=>(const WH_MIU_IC &) const = default;
+};
+
+// the last store the D-cache has taken (for the I-cache to drop stale lines).
+struct WH_DC_IC : WireHarness<WH_DC_IC> {
+  uint32_t store_cnt = 0; // stores taken so far. Changes by one at each store.
+  mem_ptr_t store_addr{};
+  mptr_diff_t store_len{};
+  auto operator<=>(const WH_DC_IC &) const = default;
+};
+
+// D-cache line fill / write-back request
+struct WH_DC_MIU : WireHarness<WH_DC_MIU> {
+  bool is_fill = false;
+  bool is_writeback = false;
+  mem_ptr_t addr{}; // of the line
+  std::array<uint8_t, DCacheLineSize> line{}; // to write back
+  bool hold_ic = false; // the D-cache has a newer copy of the line the I-cache asks for: no fill for it yet
+  auto operator<=>(const WH_DC_MIU &) const = default;
+};
+
+// D-cache line fill / write-back done
+struct WH_MIU_DC : WireHarness<WH_MIU_DC> {
+  bool is_fill = false;
+  bool is_written = false;
+  std::array<uint8_t, DCacheLineSize> line{};
+  auto operator<=>(const WH_MIU_DC &) const = default;
+};
+
+// load data / store done, for LSB entry index. From the D-cache, which answers the LSB in the MIU's place.
+struct WH_MIU_LSB : WireHarness<WH_MIU_LSB> {
   bool is_load_reply = false;
   bool is_store_reply = false;
-  mem_val_t value;
+  uint32_t index{};
+  mem_val_t value{};
+  bool is_retry = false; // the request of entry retry_index was not taken: send it again
+  bool retry_store = false;
+  uint32_t retry_index{};
   auto operator<=>(const WH_MIU_LSB &) const = default;
 };
 
-// data load request / store data
-struct WH_LSB_MIU {
+// data load request / store data, of LSB entry index
+struct WH_LSB_MIU : WireHarness<WH_LSB_MIU> {
   bool is_load_request = false;
   bool is_store_request = false;
   mem_ptr_t addr;
   mem_val_t value;
   mptr_diff_t data_len;
+  uint32_t index{};
   auto operator<=>(const WH_LSB_MIU &) const = default;
 };
 
-struct WH_IFU_DU {
+struct WH_IFU_DU : WireHarness<WH_IFU_DU> {
   bool is_valid = false;
   raw_instr_t raw_instr;
   mem_ptr_t instr_addr;
@@ -58,7 +145,7 @@ struct WH_IFU_DU {
   auto operator<=>(const WH_IFU_DU &) const = default;
 };
 
-struct WH_IFU_PRED {
+struct WH_IFU_PRED : WireHarness<WH_IFU_PRED> {
   bool is_valid = false;
   mem_ptr_t instr_addr; // for predictor to locate the instruction and predict
   bool is_br = false;
@@ -67,20 +154,20 @@ struct WH_IFU_PRED {
   auto operator<=>(const WH_IFU_PRED &) const = default;
 };
 
-struct WH_DU_IFU {
+struct WH_DU_IFU : WireHarness<WH_DU_IFU> {
   bool can_accept_req = false;
 
   auto operator<=>(const WH_DU_IFU &) const = default;
 };
 
-struct WH_PRED_IFU {
+struct WH_PRED_IFU : WireHarness<WH_PRED_IFU> {
   bool is_valid = false;
   mem_ptr_t pred_pc;
 
   auto operator<=>(const WH_PRED_IFU &) const = default;
 };
 
-struct WH_ROB_PRED {
+struct WH_ROB_PRED : WireHarness<WH_ROB_PRED> {
   bool is_valid = false;
   mem_ptr_t instr_addr;
   bool is_pred_taken;  // false if prediction failed. For predictor learning.
@@ -90,7 +177,7 @@ struct WH_ROB_PRED {
   auto operator<=>(const WH_ROB_PRED &) const = default;
 };
 
-struct WH_ROB_DU {
+struct WH_ROB_DU : WireHarness<WH_ROB_DU> {
   bool is_alloc_valid = false;
   rob_index_t rob_index;
 
@@ -105,7 +192,7 @@ struct WH_ROB_DU {
   auto operator<=>(const WH_ROB_DU &) const = default;
 };
 
-struct WH_ROB_RF {
+struct WH_ROB_RF : WireHarness<WH_ROB_RF> {
   bool is_valid = false;
   rf_index_t dst_reg;
   mem_val_t value;
@@ -114,21 +201,25 @@ struct WH_ROB_RF {
   auto operator<=>(const WH_ROB_RF &) const = default;
 };
 
-struct WH_ROB_LSB {
+struct WH_ROB_LSB : WireHarness<WH_ROB_LSB> {
   bool is_valid = false;
   rob_index_t rob_index;
 
   auto operator<=>(const WH_ROB_LSB &) const = default;
 };
 
-struct WH_LSB_ROB {
-  bool is_valid;
-  rob_index_t rob_index; // the latest one to store
+// No is_valid flag: is_full is carried in every cycle.
+struct WH_LSB_ROB : WireHarness<WH_LSB_ROB> {
+  bool is_store_ready = false;
+  rob_index_t rob_index = 0; // the latest one to store
+  // no room for another load/store. Committed stores stay in the LSB until the D-cache has them,
+  // so it can be full while the ROB is not.
+  bool is_full = false;
 
   auto operator<=>(const WH_LSB_ROB &) const = default;
 };
 
-struct WH_DU_ROB {
+struct WH_DU_ROB : WireHarness<WH_DU_ROB> {
   bool is_valid = false;
   raw_instr_t raw_instr;
 
@@ -170,20 +261,20 @@ struct CDBEntry {
 
 // broadcaster: ALU, LSB
 // listener: ROB, RS, DU
-struct WH_CDB_OUT {
+struct WH_CDB_OUT : WireHarness<WH_CDB_OUT> {
   CDBEntry lsb_entry;
   CDBEntry alu_entry;
 
   auto operator<=>(const WH_CDB_OUT &) const = default;
 };
 
-struct WH_LSB_CDB {
+struct WH_LSB_CDB : WireHarness<WH_LSB_CDB> {
   CDBEntry entry;
 
   auto operator<=>(const WH_LSB_CDB &) const = default;
 };
 
-struct WH_ALU_CDB {
+struct WH_ALU_CDB : WireHarness<WH_ALU_CDB> {
   CDBEntry entry;
 
   auto operator<=>(const WH_ALU_CDB &) const = default;
@@ -191,14 +282,14 @@ struct WH_ALU_CDB {
 
 // broadcaster: ROB
 // listener: IFU, DU, LSB, RS
-struct WH_FLUSH_PIPELINE {
+struct WH_FLUSH_PIPELINE : WireHarness<WH_FLUSH_PIPELINE> {
   bool is_flush = false;
   mem_ptr_t pc; // ifu will need it.
 
   auto operator<=>(const WH_FLUSH_PIPELINE &) const = default;
 };
 
-struct WH_RF_DU {
+struct WH_RF_DU : WireHarness<WH_RF_DU> {
   bool is_valid = false;
 
   bool repRi = false, repRj = false;
@@ -208,7 +299,7 @@ struct WH_RF_DU {
   auto operator<=>(const WH_RF_DU &) const = default;
 };
 
-struct WH_DU_RF {
+struct WH_DU_RF : WireHarness<WH_DU_RF> {
   bool is_valid = false;
 
   bool reqRi = false, reqRj = false;
@@ -217,7 +308,7 @@ struct WH_DU_RF {
   auto operator<=>(const WH_DU_RF &) const = default;
 };
 
-struct WH_DU_LSB {
+struct WH_DU_LSB : WireHarness<WH_DU_LSB> {
   bool is_valid = false;
 
   mptr_diff_t data_len;
@@ -233,7 +324,7 @@ struct WH_DU_LSB {
   auto operator<=>(const WH_DU_LSB &) const = default;
 };
 
-struct WH_DU_RS {
+struct WH_DU_RS : WireHarness<WH_DU_RS> {
   bool is_valid = false;
   rob_index_t rob_index = 0;
   InstrType instr_type = InstrType::INVALID;
@@ -256,7 +347,7 @@ struct WH_DU_RS {
   auto operator<=>(const WH_DU_RS &) const = default;
 };
 
-struct WH_RS_ALU {
+struct WH_RS_ALU : WireHarness<WH_RS_ALU> {
   bool is_valid = false;
   rob_index_t rob_index = 0;
   InstrType instr_type = InstrType::INVALID;
@@ -272,12 +363,12 @@ struct WH_RS_ALU {
   auto operator<=>(const WH_RS_ALU &) const = default;
 };
 
-struct WH_ALU_RS {
+struct WH_ALU_RS : WireHarness<WH_ALU_RS> {
   bool can_accept_instr = false;
   auto operator<=>(const WH_ALU_RS &) const = default;
 };
 
-struct WH_RS_DU {
+struct WH_RS_DU : WireHarness<WH_RS_DU> {
   bool can_accept_instr = false;
   auto operator<=>(const WH_RS_DU &) const = default;
 };
@@ -0,0 +1,79 @@
+#ifndef ISM_WIRING_H
+#define ISM_WIRING_H
+
+#include "wire_harness.h"
+
+namespace insomnia {
+
+// All wire harnesses of the CPU, by value and side by side in memory.
+struct Wiring {
+  WH_MIU_IFU        ic_ifu;
+  WH_IFU_MIU        ifu_ic;
+  WH_IC_MIU         ic_miu;
+  WH_MIU_IC         miu_ic;
+  WH_DC_IC          dc_ic;
+  WH_DC_MIU         dc_miu;
+  WH_MIU_DC         miu_dc;
+  WH_MIU_LSB        dc_lsb;
+  WH_LSB_MIU        lsb_dc;
+  WH_IFU_DU         ifu_du;
+  WH_IFU_PRED       ifu_pred;
+  WH_DU_IFU         du_ifu;
+  WH_PRED_IFU       pred_ifu;
+  WH_ROB_PRED       rob_pred;
+  WH_ROB_DU         rob_du;
+  WH_ROB_RF         rob_rf;
+  WH_ROB_LSB        rob_lsb;
+  WH_LSB_ROB        lsb_rob;
+  WH_DU_ROB         du_rob;
+  WH_CDB_OUT        cdb_out;
+  WH_LSB_CDB        lsb_cdb;
+  WH_ALU_CDB        alu_cdb;
+  WH_FLUSH_PIPELINE flush;
+  WH_RF_DU          rf_du;
+  WH_DU_RF          du_rf;
+  WH_DU_LSB         du_lsb;
+  WH_DU_RS          du_rs;
+  WH_RS_ALU         rs_alu;
+  WH_ALU_RS         alu_rs;
+  WH_RS_DU          rs_du;
+
+  // f(harness) for every harness, in declaration order. Self: Wiring or const Wiring.
+  template <class Self, class F>
+  static void for_each(Self &wiring, F &&f) {
+    f(wiring.ic_ifu);
+    f(wiring.ifu_ic);
+    f(wiring.ic_miu);
+    f(wiring.miu_ic);
+    f(wiring.dc_ic);
+    f(wiring.dc_miu);
+    f(wiring.miu_dc);
+    f(wiring.dc_lsb);
+    f(wiring.lsb_dc);
+    f(wiring.ifu_du);
+    f(wiring.ifu_pred);
+    f(wiring.du_ifu);
+    f(wiring.pred_ifu);
+    f(wiring.rob_pred);
+    f(wiring.rob_du);
+    f(wiring.rob_rf);
+    f(wiring.rob_lsb);
+    f(wiring.lsb_rob);
+    f(wiring.du_rob);
+    f(wiring.cdb_out);
+    f(wiring.lsb_cdb);
+    f(wiring.alu_cdb);
+    f(wiring.flush);
+    f(wiring.rf_du);
+    f(wiring.du_rf);
+    f(wiring.du_lsb);
+    f(wiring.du_rs);
+    f(wiring.rs_alu);
+    f(wiring.alu_rs);
+    f(wiring.rs_du);
+  }
+};
+
+}
+
+#endif // ISM_WIRING_H
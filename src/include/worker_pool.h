@@ -0,0 +1,86 @@
+#ifndef ISM_WORKER_POOL_H
+#define ISM_WORKER_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace insomnia {
+
+// Persistent threads that run small batches of tasks together with the calling thread.
+// run() returns once every task of the batch is done, which is the barrier.
+// Batches come every few microseconds, so idle workers spin (then yield) instead of sleeping.
+class WorkerPool {
+public:
+  // threads: including the calling one.
+  explicit WorkerPool(std::size_t threads) {
+    for(std::size_t i = 1; i < threads; ++i)
+      _workers.emplace_back([this] { work(); });
+  }
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+  ~WorkerPool() {
+    _stop.store(true, std::memory_order_release);
+    for(auto &worker: _workers) worker.join();
+  }
+
+  std::size_t threads() const { return _workers.size() + 1; }
+
+  // task(i) for every i < cnt, in any order and on any thread.
+  template <class Task>
+  void run(std::size_t cnt, Task &&task) {
+    _task = [](void *ctx, std::size_t i) { (*static_cast<std::remove_reference_t<Task> *>(ctx))(i); };
+    _ctx = &task;
+    _pending.store(cnt, std::memory_order_relaxed);
+    uint64_t epoch = (_batch.load(std::memory_order_relaxed) >> 32) + 1;
+    _batch.store(epoch << 32 | cnt, std::memory_order_release);
+    _ticket.store(epoch << 32, std::memory_order_release); // publishes the batch
+    take();
+    while(_pending.load(std::memory_order_acquire)) std::this_thread::yield();
+  }
+
+private:
+  std::vector<std::thread> _workers;
+  std::atomic<bool> _stop{false};
+  // (epoch << 32) | task count of the current batch.
+  std::atomic<uint64_t> _batch{0};
+  // (epoch << 32) | next task index. A ticket of an older batch is always past its end:
+  // the batch is not over while one of its tasks is taken but not finished.
+  std::atomic<uint64_t> _ticket{0};
+  std::atomic<std::size_t> _pending{0}; // tasks of the batch not finished yet
+
+  // valid while a task of the current batch is pending.
+  void (*_task)(void *, std::size_t) = nullptr;
+  void *_ctx = nullptr;
+
+  void take() {
+    for(;;) {
+      uint64_t ticket = _ticket.fetch_add(1, std::memory_order_acq_rel);
+      uint64_t batch = _batch.load(std::memory_order_acquire);
+      std::size_t i = ticket & 0xffffffff;
+      if(ticket >> 32 != batch >> 32 || i >= (batch & 0xffffffff)) return;
+      _task(_ctx, i);
+      _pending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+  }
+
+  void work() {
+    uint64_t seen = 0;
+    for(std::size_t idle = 0; !_stop.load(std::memory_order_acquire); ) {
+      uint64_t epoch = _ticket.load(std::memory_order_acquire) >> 32;
+      if(epoch == seen) {
+        if(++idle > 1024) std::this_thread::yield();
+        continue;
+      }
+      idle = 0;
+      seen = epoch;
+      take();
+    }
+  }
+};
+
+}
+
+#endif // ISM_WORKER_POOL_H
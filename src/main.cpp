@@ -1,8 +1,175 @@
 #include "cpu.h"
 #include "bcpu.h"
+#include "fast_forward.h"
+#include "sampling.h"
+#include "simpoint.h"
+#include "trace_cpu.h"
+#include "trace_pipeline.h"
+#include <fstream>
+#include <sstream>
+#include <thread>
 #include <chrono>
+#include <cstdlib>
+#include <string>
 
-int main() {
+// usage: code [--skip N] [--until PC] [--detail N] < program
+//        code --sample N [--warmup W] [--measure M] [--jobs J] < program
+//        code --simpoint N [--clusters K] [--warmup W] [--bbv FILE] [--jobs J] < program
+//        code [--restore FILE] [--checkpoint FILE --at CYCLE] [< program]
+//        code --timing trace|threaded|compare < program
+// Without options the whole program runs on the CPU. Otherwise BCPU runs the first N instructions
+// (or up to PC), the CPU the next N, and BCPU the rest (see fast_forward.h).
+// With --sample, the CPU runs W + M instructions out of every N and CPI is estimated from the M (see sampling.h).
+// With --simpoint, it runs K intervals of N instructions picked by their basic-block vectors, which go to FILE (see simpoint.h).
+// --jobs runs J detailed windows at once in forked processes (0: one per core).
+// --checkpoint saves the CPU at the first cycle from CYCLE on at which it can be (see checkpoint.h) and runs on;
+// --restore runs on from a checkpoint instead of a program.
+// --timing trace times the program with the trace-driven model fed by BCPU (see trace_cpu.h) instead of the CPU;
+// threaded runs BCPU and the model on two threads and reports which one holds the other up (see trace_pipeline.h);
+// compare runs both and reports how far apart their cycle counts are.
+int main(int argc, char *argv[]) {
+  insomnia::configure_log(std::getenv("ISM_LOG")); // e.g. ISM_LOG=all=info,LSB=trace
+  insomnia::FastForward fast_forward;
+  insomnia::Sampling sampling;
+  insomnia::SimPoint simpoint;
+  std::string bbv_file, checkpoint_file, restore_file, timing = "cpu";
+  uint64_t checkpoint_at = 0;
+  bool skip_set = false, until_set = false, sample_set = false, simpoint_set = false;
+  for(int i = 1; i < argc; i += 2) {
+    std::string opt = argv[i];
+    if(i + 1 == argc || (opt != "--skip" && opt != "--until" && opt != "--detail"
+      && opt != "--sample" && opt != "--warmup" && opt != "--measure"
+      && opt != "--simpoint" && opt != "--clusters" && opt != "--bbv"
+      && opt != "--checkpoint" && opt != "--at" && opt != "--restore" && opt != "--jobs" && opt != "--timing")) {
+      std::cerr << "usage: " << argv[0] << " [--skip N] [--until PC] [--detail N] < program\n"
+        << "       " << argv[0] << " --sample N [--warmup W] [--measure M] [--jobs J] < program\n"
+        << "       " << argv[0] << " --simpoint N [--clusters K] [--warmup W] [--bbv FILE] [--jobs J] < program\n"
+        << "       " << argv[0] << " [--restore FILE] [--checkpoint FILE --at CYCLE] [< program]\n"
+        << "       " << argv[0] << " --timing trace|threaded|compare < program" << std::endl;
+      return 1;
+    }
+    if(opt == "--bbv" || opt == "--checkpoint" || opt == "--restore" || opt == "--timing") {
+      (opt == "--bbv" ? bbv_file : opt == "--checkpoint" ? checkpoint_file :
+        opt == "--restore" ? restore_file : timing) = argv[i + 1];
+      continue;
+    }
+    uint64_t val = std::stoull(argv[i + 1], nullptr, 0);
+    if(opt == "--skip") fast_forward.skip = val, skip_set = true;
+    else if(opt == "--until") fast_forward.until = val, until_set = true;
+    else if(opt == "--detail") fast_forward.detail = val;
+    else if(opt == "--sample") sampling.interval = val, sample_set = true;
+    else if(opt == "--warmup") sampling.warmup = simpoint.warmup = val;
+    else if(opt == "--measure") sampling.measure = val;
+    else if(opt == "--simpoint") simpoint.interval = val, simpoint_set = true;
+    else if(opt == "--clusters") simpoint.clusters = val;
+    else if(opt == "--jobs") sampling.jobs = simpoint.jobs = val ? val : std::max(1u, std::thread::hardware_concurrency());
+    else checkpoint_at = val;
+  }
+  if(timing == "trace" || timing == "compare") {
+    std::stringstream program;
+    program << std::cin.rdbuf();
+    auto beg = std::chrono::steady_clock::now();
+    auto res = insomnia::run_trace(program);
+    auto end = std::chrono::steady_clock::now();
+    auto [suc, tot] = res.pred_stat;
+    std::cerr << "trace-driven: " << res.instructions << " instructions in " << res.cycles << " cycles, predictor "
+      << suc << '/' << tot << std::endl;
+    if(timing == "compare") {
+      program.clear();
+      program.seekg(0);
+      insomnia::CPU cpu;
+      cpu.preload_program(program);
+      auto cpu_beg = std::chrono::steady_clock::now();
+      while(cpu.tick()) {}
+      auto cpu_end = std::chrono::steady_clock::now();
+      double error = 100.0 * (static_cast<double>(res.cycles) - cpu.cycles()) / cpu.cycles();
+      auto [hits, misses] = cpu.icache_stat();
+      const auto &dcache = cpu.dcache_stat();
+      std::cerr << "CPU: " << cpu.cycles() << " cycles, I-cache " << hits << " hits " << misses << " misses, D-cache "
+        << dcache.hits << " hits " << dcache.misses << " misses " << dcache.merges << " merged " << dcache.retries
+        << " retried " << dcache.writebacks << " written back. Trace-driven off by " << error << "%, "
+        << 1.0 * (cpu_end - cpu_beg).count() / std::max<std::int64_t>(1, (end - beg).count()) << "x as fast" << std::endl;
+      auto mem = cpu.memory_stat();
+      std::cerr << "L2 " << mem.l2.hits << " hits " << mem.l2.misses << " misses " << mem.l2.merges << " merged, "
+        << mem.l2.avg_latency() << " cycles a request, " << mem.l2.bandwidth(cpu.cycles()) << " B/cycle. DRAM "
+        << mem.dram.reads << " reads " << mem.dram.writes << " writes, rows " << mem.dram.row_hits << " hit "
+        << mem.dram.row_misses << " closed " << mem.dram.row_conflicts << " conflicting, " << mem.dram.avg_latency()
+        << " cycles a request, " << mem.dram.bandwidth(cpu.cycles()) << " B/cycle" << std::endl;
+    }
+    std::cout << res.ret << std::endl;
+    return 0;
+  }
+  if(timing == "threaded") {
+    auto res = insomnia::run_trace_threaded(std::cin);
+    auto [suc, tot] = res.pred_stat;
+    std::cerr << "trace-driven: " << res.instructions << " instructions in " << res.cycles << " cycles, predictor "
+      << suc << '/' << tot << '\n';
+    for(auto [name, stage]: {std::pair{"functional", &res.functional}, std::pair{"timing", &res.timing}})
+      std::cerr << name << ": " << stage->throughput() / 1e6 << "M records/s busy, waited "
+        << stage->waiting << " of " << stage->seconds << " s\n";
+    std::cerr << "host time " << res.seconds << " s, " << (res.functional_bound() ? "functional" : "timing")
+      << "-bound" << std::endl;
+    std::cout << res.ret << std::endl;
+    return 0;
+  }
+  if(timing != "cpu") {
+    std::cerr << "unknown timing model " << timing << std::endl;
+    return 1;
+  }
+  if(!checkpoint_file.empty() || !restore_file.empty()) {
+    insomnia::CPU cpu;
+    if(!restore_file.empty()) {
+      std::ifstream in(restore_file, std::ios::binary);
+      if(!in) throw std::runtime_error("cannot open " + restore_file);
+      cpu.load_checkpoint(in);
+    } else {
+      cpu.preload_program();
+    }
+    bool running = true;
+    if(!checkpoint_file.empty()) {
+      while(running && (cpu.cycles() < checkpoint_at || !cpu.checkpointable())) running = cpu.tick();
+      if(running) {
+        std::ofstream out(checkpoint_file, std::ios::binary);
+        cpu.save_checkpoint(out);
+        std::cerr << "checkpoint at cycle " << cpu.cycles() << ", " << cpu.instructions() << " instructions" << std::endl;
+      } else {
+        std::cerr << "program ended at cycle " << cpu.cycles() << ", no checkpoint" << std::endl;
+      }
+    }
+    while(running && cpu.tick()) {}
+    std::cout << cpu.get_ret() << std::endl;
+    return 0;
+  }
+  if(simpoint_set) {
+    std::ofstream bbv_out;
+    if(!bbv_file.empty()) bbv_out.open(bbv_file);
+    auto res = insomnia::run_simpoint<insomnia::CPU>(std::cin, simpoint, bbv_file.empty() ? nullptr : &bbv_out);
+    for(auto &point: res.points)
+      std::cerr << "interval " << point.index << ": weight " << point.weight << ", CPI " << point.cpi << '\n';
+    std::cerr << res.points.size() << " of " << res.intervals << " intervals, " << res.detailed << " of "
+      << res.instructions << " instructions detailed: CPI " << res.cpi << ", about "
+      << static_cast<uint64_t>(res.est_cycles()) << " cycles" << std::endl;
+    std::cout << res.ret << std::endl;
+    return 0;
+  }
+  if(sample_set) {
+    auto res = insomnia::run_sampling<insomnia::CPU>(std::cin, sampling);
+    std::cerr << res.samples << " samples, " << res.detailed << " of " << res.instructions
+      << " instructions detailed: CPI " << res.cpi << " +- " << res.cpi_error << " (95%), about "
+      << static_cast<uint64_t>(res.est_cycles()) << " +- " << static_cast<uint64_t>(res.cpi_error * res.instructions)
+      << " cycles" << std::endl;
+    std::cout << res.ret << std::endl;
+    return 0;
+  }
+  if(argc > 1) {
+    if(!skip_set && !until_set) fast_forward.skip = 0;
+    auto res = insomnia::run_fast_forward<insomnia::CPU>(std::cin, fast_forward);
+    std::cerr << "functional " << res.skipped << ", detailed " << res.detailed << " in " << res.cycles
+      << " cycles (IPC " << (res.cycles ? 1.0 * res.detailed / res.cycles : 0) << "), functional "
+      << res.rest << " instructions" << std::endl;
+    std::cout << res.ret << std::endl;
+    return 0;
+  }
   // freopen("cpu.log", "w", stdout);
   insomnia::CPU cpu;
   cpu.preload_program();
@@ -12,8 +179,12 @@ int main() {
   // auto dur = std::chrono::duration_cast<std::chrono::milliseconds>(end - beg).count();
   // auto [suc, tot] = cpu.pred_stat();
   // std::cout << "Dur: " << dur / 1000 << "'" << dur % 1000 << "s" << std::endl;
-  // std::cout << "Clk tot: " << cpu.cycles() << std::endl;
+  // std::cout << "Clk tot: " << cpu.cycles() << " (" << cpu.skipped_cycles() << " skipped)" << std::endl;
   // std::cout << "Pred suc/tot: " << suc << '/' << tot << std::endl;
+  // auto [evals, saved] = cpu.eval_stat();
+  // std::cout << "Evals/saved per clk: " << 1.0 * evals / cpu.cycles() << '/' << 1.0 * saved / cpu.cycles() << std::endl;
+  // auto [passes, max_passes] = cpu.pass_stat();
+  // std::cout << "Sweeps per clk: " << 1.0 * passes / cpu.cycles() << ", at most " << max_passes << std::endl;
   std::cout << cpu.get_ret() << std::endl;
   return 0;
-}
\ No newline at end of file
+}
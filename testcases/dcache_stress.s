@@ -0,0 +1,71 @@
+# D-cache stress at any memory latency. Strided loads and stores over more than the D-cache holds:
+# misses merge in the MSHRs, fill their targets and the MSHRs up and retry, dirty lines are written back.
+# Runs of stores to distinct lines leave the LSB full of committed stores waiting for the D-cache.
+  li s0, 0x10000
+  li s1, 3000
+  li t0, 0
+  li t1, 0
+fill:
+  add t2, s0, t1
+  sw t0, 0(t2)
+  sb t0, 5(t2)
+  addi t0, t0, 1
+  addi t1, t1, 12
+  blt t0, s1, fill
+  li s3, 0x30000
+  li s4, 400
+  li t0, 0
+  li t1, 0
+burst:
+  add t2, s3, t1
+  sw t0, 0(t2)
+  sh t1, 70(t2)
+  sb t0, 131(t2)
+  addi t0, t0, 1
+  addi t1, t1, 196
+  blt t0, s4, burst
+  li t0, 0
+  li t1, 0
+  li a0, 0
+  li s2, 0x20000
+scatter:
+  add t2, s0, t1
+  lw t3, 0(t2)
+  lbu t4, 5(t2)
+  add a0, a0, t3
+  add a0, a0, t4
+  slli t5, t0, 6
+  add t5, t5, s2
+  sw a0, 0(t5)
+  sh t3, 34(t5)
+  lw t6, 0(t5)
+  add a0, a0, t6
+  addi t0, t0, 1
+  addi t1, t1, 12
+  blt t0, s1, scatter
+  li t0, 0
+gather:
+  slli t5, t0, 6
+  add t5, t5, s2
+  lw t3, 0(t5)
+  lhu t4, 34(t5)
+  xor a0, a0, t3
+  add a0, a0, t4
+  addi t0, t0, 3
+  blt t0, s1, gather
+  li t0, 0
+  li t1, 0
+collect:
+  add t2, s3, t1
+  lw t3, 0(t2)
+  lhu t4, 70(t2)
+  lbu t5, 131(t2)
+  add a0, a0, t3
+  xor a0, a0, t4
+  add a0, a0, t5
+  addi t0, t0, 1
+  addi t1, t1, 196
+  blt t0, s4, collect
+  andi a0, a0, 255
+  mv s3, a0
+  li a0, 255